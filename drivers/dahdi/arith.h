@@ -20,6 +20,30 @@
 #ifndef _DAHDI_ARITH_H
 #define _DAHDI_ARITH_H
 
+/*
+ * Vector registers used by the asm below, for its clobber lists.  The kernel
+ * is built with -mno-sse and -mno-avx, so there the compiler keeps nothing in
+ * them (and gcc will not take them as clobbers).  Where the compiler may use
+ * them, as in the userspace harnesses under tools/, they are listed.
+ */
+#if defined(__SSE2__)
+#define DAHDI_XMM_CLOBBERS2	, "xmm0", "xmm1"
+#define DAHDI_XMM_CLOBBERS3	, "xmm0", "xmm1", "xmm2"
+#else
+#define DAHDI_XMM_CLOBBERS2
+#define DAHDI_XMM_CLOBBERS3
+#endif
+#if defined(__AVX__)
+#define DAHDI_YMM_CLOBBERS02	, "ymm0", "ymm2"
+#define DAHDI_YMM_CLOBBERS4	, "ymm0", "ymm1", "ymm2", "ymm3"
+#elif defined(__SSE2__)
+#define DAHDI_YMM_CLOBBERS02	, "xmm0", "xmm2"
+#define DAHDI_YMM_CLOBBERS4	, "xmm0", "xmm1", "xmm2", "xmm3"
+#else
+#define DAHDI_YMM_CLOBBERS02
+#define DAHDI_YMM_CLOBBERS4
+#endif
+
 #ifdef CONFIG_DAHDI_MMX
 #ifdef DAHDI_CHUNKSIZE
 static inline void __ACSS(volatile short *dst, const short *src)
@@ -273,7 +297,7 @@ static inline short MAX16(const short *y, int len, int *pos)
 #else
 
 #ifdef DAHDI_CHUNKSIZE
-static inline void ACSS(short *dst, short *src)
+static inline void __ACSS_C(short *dst, const short *src)
 {
 	int x;
 
@@ -296,7 +320,7 @@ static inline void ACSS(short *dst, short *src)
 #endif
 }
 
-static inline void SCSS(short *dst, short *src)
+static inline void __SCSS_C(short *dst, const short *src)
 {
 	int x;
 
@@ -318,6 +342,76 @@ static inline void SCSS(short *dst, short *src)
 #endif
 }
 
+#ifdef CONFIG_DAHDI_SSE2
+#include <linux/percpu.h>
+
+#if (DAHDI_CHUNKSIZE % 8)
+#error No SSE2 for DAHDI_CHUNKSIZE not a multiple of 8
+#endif
+
+/*
+ * Set while the CPU is between dahdi_sse2_begin() and dahdi_sse2_end(), i.e.
+ * while it is safe to touch the xmm registers.  Outside of such a section
+ * ACSS() and SCSS() quietly use the C versions.
+ */
+DECLARE_PER_CPU(int, dahdi_sse2_active);
+
+static inline void __ACSS_SSE2(short *dst, const short *src)
+{
+	int x;
+
+	/* One paddsw per 8 samples. Neither buffer is guaranteed to be 16
+	 * byte aligned, so both are loaded with movdqu. */
+	for (x = 0; x < DAHDI_CHUNKSIZE; x += 8) {
+		__asm__ __volatile__ (
+			"movdqu (%0), %%xmm0;\n"
+			"movdqu (%1), %%xmm1;\n"
+			"paddsw %%xmm1, %%xmm0;\n"
+			"movdqu %%xmm0, (%0);\n"
+			:
+			: "r" (dst + x), "r" (src + x)
+			: "memory" DAHDI_XMM_CLOBBERS2
+		);
+	}
+}
+
+static inline void __SCSS_SSE2(short *dst, const short *src)
+{
+	int x;
+
+	for (x = 0; x < DAHDI_CHUNKSIZE; x += 8) {
+		__asm__ __volatile__ (
+			"movdqu (%0), %%xmm0;\n"
+			"movdqu (%1), %%xmm1;\n"
+			"psubsw %%xmm1, %%xmm0;\n"
+			"movdqu %%xmm0, (%0);\n"
+			:
+			: "r" (dst + x), "r" (src + x)
+			: "memory" DAHDI_XMM_CLOBBERS2
+		);
+	}
+}
+
+static inline void ACSS(short *dst, const short *src)
+{
+	if (likely(this_cpu_read(dahdi_sse2_active)))
+		__ACSS_SSE2(dst, src);
+	else
+		__ACSS_C(dst, src);
+}
+
+static inline void SCSS(short *dst, const short *src)
+{
+	if (likely(this_cpu_read(dahdi_sse2_active)))
+		__SCSS_SSE2(dst, src);
+	else
+		__SCSS_C(dst, src);
+}
+#else
+#define ACSS(a, b) __ACSS_C(a, b)
+#define SCSS(a, b) __SCSS_C(a, b)
+#endif /* CONFIG_DAHDI_SSE2 */
+
 #endif	/* DAHDI_CHUNKSIZE */
 
 static inline int CONVOLVE(const int *coeffs, const short *hist, int len)
@@ -374,5 +468,200 @@ static inline short MAX16(const short *y, int len, int *pos)
 	return max;
 }
 
+#ifdef CONFIG_DAHDI_ECHOCAN_SIMD
+/*
+ * SIMD versions of CONVOLVE2() for the echo cancellers.
+ *
+ * All of them multiply 16 bit pairs into 32 bits and accumulate with
+ * wrap-around, so the sum is exactly what the C loop gives.  They may only be
+ * called between a successful dahdi_ec_simd_begin() and dahdi_ec_simd_end(),
+ * with the level that dahdi_ec_simd_level() returned.
+ */
+enum dahdi_ec_simd {
+	DAHDI_EC_SIMD_NONE = 0,
+	DAHDI_EC_SIMD_SSE2,
+	DAHDI_EC_SIMD_AVX2,
+};
+
+#include <linux/version.h>
+#include <asm/cpufeature.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 2, 0)
+#include <asm/fpu/api.h>
+#else
+#include <asm/i387.h>
+#endif
+
+static inline enum dahdi_ec_simd dahdi_ec_simd_level(void)
+{
+	if (boot_cpu_has(X86_FEATURE_AVX2) && boot_cpu_has(X86_FEATURE_OSXSAVE))
+		return DAHDI_EC_SIMD_AVX2;
+	return DAHDI_EC_SIMD_SSE2;
+}
+
+static inline int dahdi_ec_simd_begin(void)
+{
+	if (!irq_fpu_usable())
+		return 0;
+	kernel_fpu_begin();
+	return 1;
+}
+
+static inline void dahdi_ec_simd_end(void)
+{
+	kernel_fpu_end();
+}
+
+static inline int __CONVOLVE2_SSE2(const short *coeffs, const short *hist,
+				   int len)
+{
+	int blocks = len >> 3;
+	int sum = 0;
+	int x;
+
+	if (blocks) {
+		const short *c = coeffs;
+		const short *h = hist;
+
+		/* Eight pmaddwd products per pass, four lanes of sums */
+		__asm__ __volatile__ (
+			"pxor %%xmm2, %%xmm2;\n"
+			"1:\n"
+			"movdqu (%1), %%xmm0;\n"
+			"movdqu (%2), %%xmm1;\n"
+			"pmaddwd %%xmm1, %%xmm0;\n"
+			"paddd %%xmm0, %%xmm2;\n"
+			"add $16, %1;\n"
+			"add $16, %2;\n"
+			"dec %3;\n"
+			"jnz 1b;\n"
+			"pshufd $0x4e, %%xmm2, %%xmm0;\n"
+			"paddd %%xmm0, %%xmm2;\n"
+			"pshufd $0xb1, %%xmm2, %%xmm0;\n"
+			"paddd %%xmm0, %%xmm2;\n"
+			"movd %%xmm2, %0;\n"
+			: "=r" (sum), "+r" (c), "+r" (h), "+r" (blocks)
+			:
+			: "memory", "cc" DAHDI_XMM_CLOBBERS3
+		);
+	}
+	for (x = len & ~7; x < len; x++)
+		sum += coeffs[x] * hist[x];
+	return sum;
+}
+
+static inline int __CONVOLVE2_AVX2(const short *coeffs, const short *hist,
+				   int len)
+{
+	int blocks = len >> 4;
+	int sum = 0;
+	int x;
+
+	if (blocks) {
+		const short *c = coeffs;
+		const short *h = hist;
+
+		/* Sixteen products per pass, eight lanes of sums */
+		__asm__ __volatile__ (
+			"vpxor %%ymm2, %%ymm2, %%ymm2;\n"
+			"1:\n"
+			"vmovdqu (%1), %%ymm0;\n"
+			"vpmaddwd (%2), %%ymm0, %%ymm0;\n"
+			"vpaddd %%ymm0, %%ymm2, %%ymm2;\n"
+			"add $32, %1;\n"
+			"add $32, %2;\n"
+			"dec %3;\n"
+			"jnz 1b;\n"
+			"vextracti128 $1, %%ymm2, %%xmm0;\n"
+			"vpaddd %%xmm0, %%xmm2, %%xmm2;\n"
+			"vpshufd $0x4e, %%xmm2, %%xmm0;\n"
+			"vpaddd %%xmm0, %%xmm2, %%xmm2;\n"
+			"vpshufd $0xb1, %%xmm2, %%xmm0;\n"
+			"vpaddd %%xmm0, %%xmm2, %%xmm2;\n"
+			"vmovd %%xmm2, %0;\n"
+			"vzeroupper;\n"
+			: "=r" (sum), "+r" (c), "+r" (h), "+r" (blocks)
+			:
+			: "memory", "cc" DAHDI_YMM_CLOBBERS02
+		);
+	}
+	for (x = len & ~15; x < len; x++)
+		sum += coeffs[x] * hist[x];
+	return sum;
+}
+
+static inline int CONVOLVE2_SIMD(enum dahdi_ec_simd level,
+				 const short *coeffs, const short *hist,
+				 int len)
+{
+	switch (level) {
+	case DAHDI_EC_SIMD_AVX2:
+		return __CONVOLVE2_AVX2(coeffs, hist, len);
+	case DAHDI_EC_SIMD_SSE2:
+		return __CONVOLVE2_SSE2(coeffs, hist, len);
+	default:
+		return CONVOLVE2(coeffs, hist, len);
+	}
+}
+
+#endif /* CONFIG_DAHDI_ECHOCAN_SIMD */
+
 #endif	/* MMX */
+
+#ifndef CONFIG_DAHDI_ECHOCAN_SIMD
+enum dahdi_ec_simd {
+	DAHDI_EC_SIMD_NONE = 0,
+};
+
+static inline enum dahdi_ec_simd dahdi_ec_simd_level(void)
+{
+	return DAHDI_EC_SIMD_NONE;
+}
+
+static inline int dahdi_ec_simd_begin(void) { return 0; }
+static inline void dahdi_ec_simd_end(void) { }
+
+#define CONVOLVE2_SIMD(level, coeffs, hist, len) CONVOLVE2(coeffs, hist, len)
+#endif /* CONFIG_DAHDI_ECHOCAN_SIMD */
+
+/*
+ * Filter a whole block of n samples at once:
+ *
+ *	out[j] = CONVOLVE2(coeffs, hist + n - 1 - j, len)	for 0 <= j < n
+ *
+ * hist holds the n newest samples, newest first, followed by the
+ * (len - 1) samples that preceded them.  Without SIMD the outputs are
+ * computed four at a time, so each coefficient is loaded once per four
+ * outputs rather than once per output.  The sums are bit-identical to
+ * separate CONVOLVE2() calls.
+ */
+static inline void CONVOLVE2_BLOCK(enum dahdi_ec_simd level,
+				   const short *coeffs, const short *hist,
+				   int len, int *out, int n)
+{
+	int j = 0;
+	int k;
+
+	if (level == DAHDI_EC_SIMD_NONE) {
+		for (; j + 4 <= n; j += 4) {
+			const short *h = hist + n - 4 - j;
+			int s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+
+			for (k = 0; k < len; k++) {
+				const int c = coeffs[k];
+
+				s3 += c * h[k];
+				s2 += c * h[k + 1];
+				s1 += c * h[k + 2];
+				s0 += c * h[k + 3];
+			}
+			out[j] = s0;
+			out[j + 1] = s1;
+			out[j + 2] = s2;
+			out[j + 3] = s3;
+		}
+	}
+	for (; j < n; j++)
+		out[j] = CONVOLVE2_SIMD(level, coeffs, hist + n - 1 - j, len);
+}
+
 #endif	/* _DAHDI_ARITH_H */
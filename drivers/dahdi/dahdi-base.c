@@ -51,7 +51,16 @@
 #include <linux/delay.h>
 #include <linux/mutex.h>
 #include <linux/ktime.h>
+#include <linux/hrtimer.h>
 #include <linux/slab.h>
+#include <linux/rcupdate.h>
+#include <linux/file.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/kref.h>
+#include <linux/log2.h>
+#include <linux/eventfd.h>
+#include <linux/uaccess.h>
 
 #include <linux/ppp_defs.h>
 
@@ -80,6 +89,19 @@
 #include <linux/netdevice.h>
 #endif
 
+#ifdef CONFIG_DAHDI_SHARDED_MASTERSPAN
+#include <linux/irq_work.h>
+#endif
+
+#ifdef CONFIG_DAHDI_EC_OFFLOAD
+#include <linux/kthread.h>
+#include <linux/wait_bit.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 11, 0) && \
+    LINUX_VERSION_CODE < KERNEL_VERSION(5, 9, 0)
+#include <uapi/linux/sched/types.h>
+#endif
+#endif
+
 #include "hpec/hpec_user.h"
 
 /* Linux kernel 5.16 and greater has removed user-space headers from the kernel include path */
@@ -103,6 +125,13 @@
 #if defined(CONFIG_DAHDI_MMX) || defined(ECHO_CAN_FP)
 #include <asm/i387.h>
 #endif
+#ifdef CONFIG_DAHDI_SSE2
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 2, 0)
+#include <asm/fpu/api.h>
+#else
+#include <asm/i387.h>
+#endif
+#endif
 
 #define hdlc_to_chan(h) (((struct dahdi_hdlc *)(h))->chan)
 #define netdev_to_chan(h) (((struct dahdi_hdlc *)(dev_to_hdlc(h)->priv))->chan)
@@ -112,7 +141,6 @@
 #define	UNIT(file) MINOR(file->f_path.dentry->d_inode->i_rdev)
 
 EXPORT_SYMBOL(dahdi_transcode_fops);
-EXPORT_SYMBOL(dahdi_init_tone_state);
 EXPORT_SYMBOL(dahdi_mf_tone);
 EXPORT_SYMBOL(__dahdi_mulaw);
 EXPORT_SYMBOL(__dahdi_alaw);
@@ -175,13 +203,39 @@ enum dahdi_txstate {
 
 typedef short sumtype[DAHDI_MAX_CHUNKSIZE];
 
-static sumtype sums[(DAHDI_MAX_CONF + 1) * 3];
+#if DAHDI_MAX_CONF > 32767
+#error DAHDI_MAX_CONF must fit in confalias / confrev
+#endif
+
+/*
+ * The conference accumulators live in a pool indexed by conference alias
+ * (chan->_confn) rather than by conference number. Aliases are handed out
+ * lowest first, so the live accumulators are packed at the front of the pool
+ * and the pool only needs to be as big as the highest alias in use. It holds
+ * three segments of conf_pool_size entries each, one per rotating buffer, and
+ * grows (never shrinks) as more conferences are created.
+ */
+#define CONF_POOL_MIN	16
+
+struct conf_pool {
+	struct rcu_head rcu;
+	sumtype sums[] ____cacheline_aligned;
+};
+
+static struct conf_pool *conf_pool;
+static sumtype *sums;
+static int conf_pool_size;
+static int sums_pos;
 
 /* Translate conference aliases into actual conferences
    and vice-versa */
 static short confalias[DAHDI_MAX_CONF + 1];
 static short confrev[DAHDI_MAX_CONF + 1];
 
+/* The aliases currently in use, in no particular order */
+static short conf_live[DAHDI_MAX_CONF + 1];
+static int nr_live_confs;
+
 static sumtype *conf_sums_next;
 static sumtype *conf_sums;
 static sumtype *conf_sums_prev;
@@ -202,16 +256,31 @@ static int maxlinks;
 
 #ifdef CONFIG_DAHDI_CORE_TIMER
 
+#define CORE_TIMER_LATE_BUCKETS		8
+#define CORE_TIMER_BATCH_BUCKETS	6
+
 static struct core_timer {
-	struct timer_list timer;
-	ktime_t start_interval;
-	unsigned long interval;
+	struct hrtimer timer;
+	ktime_t start_interval;		/* Tick n is due n + 1 chunks later */
 	int dahdi_receive_used;
 	atomic_t count;
 	atomic_t shutdown;
 	atomic_t last_count;
+	/* Only written from coretimer_func() */
+	unsigned long late_hist[CORE_TIMER_LATE_BUCKETS];
+	unsigned long batch_hist[CORE_TIMER_BATCH_BUCKETS];
+	s64 max_late_ns;
+	unsigned long resets;
 } core_timer;
 
+/* Upper bounds, in microseconds, of all but the last late_hist bucket */
+static const unsigned int core_timer_late_us[CORE_TIMER_LATE_BUCKETS - 1] = {
+	10, 50, 100, 250, 500, 1000, 4000,
+};
+
+/* Most ticks the core timer runs back to back when it has fallen behind */
+static int core_timer_max_batch = 2;
+
 #endif /* CONFIG_DAHDI_CORE_TIMER */
 
 
@@ -306,6 +375,40 @@ static inline void dahdi_kernel_fpu_end(void)
 
 #endif
 
+#ifdef CONFIG_DAHDI_SSE2
+DEFINE_PER_CPU(int, dahdi_sse2_active);
+
+/**
+ * dahdi_sse2_begin() - Allow ACSS() / SCSS() to use the xmm registers
+ *
+ * Opens one kernel FPU section for all the conference mixing done by this
+ * CPU in a tick, rather than paying for a save / restore on every chunk. If
+ * the FPU cannot be used from the current context the section is not opened
+ * and the mixing falls back to the C versions.
+ *
+ * Must be paired with dahdi_sse2_end() on the same CPU, with preemption
+ * disabled in between (we are always under chan_lock here).
+ */
+static inline void dahdi_sse2_begin(void)
+{
+	if (!irq_fpu_usable())
+		return;
+	kernel_fpu_begin();
+	this_cpu_write(dahdi_sse2_active, 1);
+}
+
+static inline void dahdi_sse2_end(void)
+{
+	if (!this_cpu_read(dahdi_sse2_active))
+		return;
+	this_cpu_write(dahdi_sse2_active, 0);
+	kernel_fpu_end();
+}
+#else
+static inline void dahdi_sse2_begin(void) { }
+static inline void dahdi_sse2_end(void) { }
+#endif
+
 struct dahdi_timer {
 	spinlock_t lock;
 	int ms;			/* Countdown */
@@ -336,15 +439,41 @@ struct dahdi_zone {
 	struct dahdi_tone mfr2_rev[15];		/* MFR2 REV tones for this zone, with desired length */
 	struct dahdi_tone mfr2_fwd_continuous[16];	/* MFR2 FWD tones for this zone, continuous play */
 	struct dahdi_tone mfr2_rev_continuous[16];	/* MFR2 REV tones for this zone, continuous play */
+	int ntones;		/* Regular tones, stored right after the zone */
 	struct list_head node;
 	struct kref refcount;
 	const char *name;	/* Informational, only */
 	u8 num;
 };
 
+static void tone_zone_for_each_tone(struct dahdi_zone *z,
+				    void (*fn)(struct dahdi_tone *))
+{
+	struct {
+		struct dahdi_tone *tones;
+		int count;
+	} const sets[] = {
+		{ (struct dahdi_tone *)(z + 1), z->ntones },
+		{ z->dtmf, ARRAY_SIZE(z->dtmf) },
+		{ z->dtmf_continuous, ARRAY_SIZE(z->dtmf_continuous) },
+		{ z->mfr1, ARRAY_SIZE(z->mfr1) },
+		{ z->mfr2_fwd, ARRAY_SIZE(z->mfr2_fwd) },
+		{ z->mfr2_rev, ARRAY_SIZE(z->mfr2_rev) },
+		{ z->mfr2_fwd_continuous, ARRAY_SIZE(z->mfr2_fwd_continuous) },
+		{ z->mfr2_rev_continuous, ARRAY_SIZE(z->mfr2_rev_continuous) },
+	};
+	int i, x;
+
+	for (i = 0; i < ARRAY_SIZE(sets); i++) {
+		for (x = 0; x < sets[i].count; x++)
+			fn(&sets[i].tones[x]);
+	}
+}
+
 static void tone_zone_release(struct kref *kref)
 {
 	struct dahdi_zone *z = container_of(kref, struct dahdi_zone, refcount);
+	tone_zone_for_each_tone(z, dahdi_tone_free_wave);
 	kfree(z->name);
 	kfree(z);
 }
@@ -384,6 +513,10 @@ static DEFINE_SPINLOCK(chan_lock);
 struct pseudo_chan {
 	struct dahdi_chan chan;
 	struct list_head node;
+#ifdef CONFIG_DAHDI_SHARDED_MASTERSPAN
+	unsigned int claim_tick;	/* Last tick a shard claimed us */
+	int claim_shard;		/* Which shard that was */
+#endif
 };
 
 static inline struct pseudo_chan *chan_to_pseudo(struct dahdi_chan *chan)
@@ -548,8 +681,6 @@ static inline bool can_provide_timing(const struct dahdi_span *const s)
 	return !s->cannot_provide_timing;
 }
 
-static int maxconfs;
-
 short __dahdi_mulaw[256];
 short __dahdi_alaw[256];
 
@@ -627,15 +758,130 @@ int dahdi_is_sync_master(const struct dahdi_span *span)
 	return span == master_span;
 }
 
+static inline void set_sums_pointers(void)
+{
+	conf_sums_prev = sums + conf_pool_size * sums_pos;
+	conf_sums = sums + conf_pool_size * ((sums_pos + 1) % 3);
+	conf_sums_next = sums + conf_pool_size * ((sums_pos + 2) % 3);
+}
+
 static inline void rotate_sums(void)
 {
+	int x;
+
 	/* Rotate where we sum and so forth */
-	static int pos = 0;
-	conf_sums_prev = sums + (DAHDI_MAX_CONF + 1) * pos;
-	conf_sums = sums + (DAHDI_MAX_CONF + 1) * ((pos + 1) % 3);
-	conf_sums_next = sums + (DAHDI_MAX_CONF + 1) * ((pos + 2) % 3);
-	pos = (pos + 1) % 3;
-	memset(conf_sums_next, 0, maxconfs * sizeof(sumtype));
+	set_sums_pointers();
+	sums_pos = (sums_pos + 1) % 3;
+
+	/* Only the accumulators of live conferences need clearing. Alias 0
+	 * is never handed out, but is cleared anyway so that a channel
+	 * caught without an alias only ever sums into silence. */
+	memset(conf_sums_next[0], 0, sizeof(sumtype));
+	for (x = 0; x < nr_live_confs; x++)
+		memset(conf_sums_next[conf_live[x]], 0, sizeof(sumtype));
+}
+
+/**
+ * conf_pool_install() - Move the accumulators over to a bigger pool.
+ * @new_pool:	The pool to use from now on.
+ * @new_size:	Its size, bigger than the current one.
+ *
+ * Must be called with the chan_lock held, so that the master span is not
+ * summing into the pool while it is being replaced.
+ */
+static void conf_pool_install(struct conf_pool *new_pool, int new_size)
+{
+	struct conf_pool *old_pool = conf_pool;
+	int x;
+
+	if (old_pool) {
+		for (x = 0; x < 3; x++) {
+			memcpy(new_pool->sums + new_size * x,
+			       old_pool->sums + conf_pool_size * x,
+			       conf_pool_size * sizeof(sumtype));
+		}
+	}
+	conf_pool = new_pool;
+	sums = new_pool->sums;
+	conf_pool_size = new_size;
+
+	/* Keep the current rotation, just in the new pool */
+	set_sums_pointers();
+
+	/* Conferenced span channels sum from their own transmit and receive
+	 * paths, which do not take the chan_lock, so the old pool can only go
+	 * once they are all done with it. */
+	if (old_pool)
+		kfree_rcu(old_pool, rcu);
+}
+
+/**
+ * conf_pool_reserve() - Make sure the pool has room for one more alias.
+ *
+ * Aliases are handed out lowest first, so the next one can be no higher
+ * than the number of live conferences plus one.  The pool is allocated, and
+ * may be large, without the chan_lock held; it is then swapped in under the
+ * lock unless someone else has grown the pool in the meantime.  May sleep.
+ *
+ * Returns 0 on success, or -ENOMEM.
+ */
+static int conf_pool_reserve(void)
+{
+	struct conf_pool *new_pool;
+	unsigned long flags;
+	int size;
+	int new_size;
+	int alias;
+
+	for (;;) {
+		spin_lock_irqsave(&chan_lock, flags);
+		alias = nr_live_confs + 1;
+		size = conf_pool_size;
+		spin_unlock_irqrestore(&chan_lock, flags);
+
+		new_size = size ? size : CONF_POOL_MIN;
+		while (new_size <= alias)
+			new_size *= 2;
+		if (new_size == size)
+			return 0;
+
+		new_pool = kzalloc(sizeof(*new_pool) +
+				   new_size * 3 * sizeof(sumtype), GFP_KERNEL);
+		if (!new_pool)
+			return -ENOMEM;
+
+		spin_lock_irqsave(&chan_lock, flags);
+		if (new_size > conf_pool_size) {
+			conf_pool_install(new_pool, new_size);
+			new_pool = NULL;
+		}
+		spin_unlock_irqrestore(&chan_lock, flags);
+		kfree(new_pool);
+	}
+}
+
+/**
+ * conf_pool_has_room() - True if the pool has an accumulator for @alias.
+ *
+ * Must be called with the chan_lock held.
+ */
+static inline bool conf_pool_has_room(int alias)
+{
+	return alias < conf_pool_size;
+}
+
+static int conf_pool_init(void)
+{
+	return conf_pool_reserve();
+}
+
+static void conf_pool_cleanup(void)
+{
+	rcu_barrier();
+	kfree(conf_pool);
+	conf_pool = NULL;
+	sums = NULL;
+	conf_pool_size = 0;
 }
 
 /**
@@ -647,6 +893,341 @@ static inline bool is_chan_dacsed(const struct dahdi_chan *const chan)
 	return (NULL != chan->dacs_chan);
 }
 
+/*
+ * How long a span channel that has gone idle is still processed before it is
+ * dropped from its span's active_chans. This gives every buffer the driver
+ * cycles through a chance to be filled with idle data again. (100 ms)
+ */
+#define DAHDI_IDLE_DRAIN_CHUNKS	(800 / DAHDI_CHUNKSIZE)
+
+/**
+ * chan_needs_txrx() - True if _dahdi_receive() / _dahdi_transmit() have work.
+ *
+ * Closed clear channels (e.g. idle B-channels) and unconfigured channels
+ * have nothing to do but send idle. Everything else either carries data or
+ * has signalling timers to run. Must be called with chan->lock held.
+ */
+static bool chan_needs_txrx(const struct dahdi_chan *chan)
+{
+	if (unlikely(chan->flags & DAHDI_FLAG_NOSTDTXRX) ||
+	    (chan->master != chan))
+		return false;
+
+	if (test_bit(DAHDI_FLAGBIT_OPEN, &chan->flags) ||
+	    dahdi_have_netdev(chan) || chan->confmode ||
+	    is_chan_dacsed(chan))
+		return true;
+
+#ifdef CONFIG_DAHDI_MIRROR
+	if (chan->rxmirror || chan->txmirror)
+		return true;
+#endif
+
+	return chan->sig && (chan->sig != DAHDI_SIG_CLEAR);
+}
+
+/**
+ * dahdi_chan_set_active() - Make sure the per-chunk loops visit chan.
+ *
+ * Must be called, with chan->lock held, after anything which may give a span
+ * channel work to do in _dahdi_receive(), _dahdi_transmit() or
+ * _process_masterspan(). Channels are only dropped again by those loops
+ * themselves, once they find there is nothing left to do.
+ */
+static void dahdi_chan_set_active(struct dahdi_chan *chan)
+{
+	struct dahdi_span *const span = chan->span;
+
+	if (!span || !span->active_chans)
+		return;
+
+	chan->txrx_drain = DAHDI_IDLE_DRAIN_CHUNKS;
+	set_bit(chan->chanpos - 1, span->active_chans);
+	if (chan->confmode)
+		set_bit(chan->chanpos - 1, span->conf_chans);
+}
+
+/*
+ * Iterate over the channels of span which are set in bitmap, or over all of
+ * them if there is no bitmap.
+ */
+#define for_each_span_chan_in(x, span, bitmap)				\
+	for ((x) = (bitmap) ? find_first_bit((bitmap), (span)->channels) : 0; \
+	     (x) < (span)->channels;					\
+	     (x) = (bitmap) ?						\
+		find_next_bit((bitmap), (span)->channels, (x) + 1) : (x) + 1)
+
+/**
+ * span_alloc_active_chans() - Start tracking which channels need processing.
+ *
+ * Every channel starts out active. If the driver's chanpos numbering does not
+ * match chans[], nothing is tracked and every channel is always visited.
+ */
+static void span_alloc_active_chans(struct dahdi_span *span)
+{
+	const int longs = BITS_TO_LONGS(span->channels);
+	unsigned long *bitmaps;
+	int x;
+
+	for (x = 0; x < span->channels; x++) {
+		if (span->chans[x]->chanpos != x + 1)
+			return;
+	}
+
+	bitmaps = kcalloc(longs * 2, sizeof(unsigned long), GFP_KERNEL);
+	if (!bitmaps)
+		return;
+
+	for (x = 0; x < span->channels; x++) {
+		span->chans[x]->txrx_drain = DAHDI_IDLE_DRAIN_CHUNKS;
+		set_bit(x, bitmaps);
+		set_bit(x, bitmaps + longs);
+	}
+
+	span->conf_chans = bitmaps + longs;
+	smp_wmb();
+	span->active_chans = bitmaps;
+}
+
+static void span_free_active_chans(struct dahdi_span *span)
+{
+	unsigned long *bitmaps = span->active_chans;
+
+	if (!bitmaps)
+		return;
+
+	/* The board driver may still be calling _dahdi_receive() and
+	 * _dahdi_transmit(), which only look at the bitmaps from interrupt or
+	 * softirq context. */
+	span->active_chans = NULL;
+	synchronize_rcu();
+	span->conf_chans = NULL;
+	kfree(bitmaps);
+}
+
+#ifdef CONFIG_DAHDI_TICK_STATS
+
+enum dahdi_tick_phase {
+	DAHDI_TICK_RECEIVE,
+	DAHDI_TICK_TRANSMIT,
+	DAHDI_TICK_EC,
+	DAHDI_TICK_MASTERSPAN,
+	DAHDI_TICK_PHASES,
+};
+
+static const char *const dahdi_tick_phase_names[DAHDI_TICK_PHASES] = {
+	[DAHDI_TICK_RECEIVE] = "receive",
+	[DAHDI_TICK_TRANSMIT] = "transmit",
+	[DAHDI_TICK_EC] = "ec",
+	[DAHDI_TICK_MASTERSPAN] = "masterspan",
+};
+
+/* Bucket n counts times of up to 2^n ns; the last one everything longer */
+#define DAHDI_TICK_BUCKETS	32
+
+struct dahdi_phase_stats {
+	u64 hist[DAHDI_TICK_BUCKETS];
+	u64 total_ns;
+	u64 max_ns;
+};
+
+struct dahdi_tick_stats {
+	struct dahdi_phase_stats phase[DAHDI_TICK_PHASES];
+};
+
+/* _process_masterspan() is not tied to a span */
+static struct dahdi_tick_stats __percpu *master_tick_stats;
+
+static inline u64 dahdi_tick_start(void)
+{
+	return ktime_to_ns(ktime_get());
+}
+
+/**
+ * dahdi_tick_account() - Count the time since @start against @phase.
+ *
+ * Must be called with interrupts disabled, as the per chunk processing is.
+ */
+static void dahdi_tick_account(struct dahdi_tick_stats __percpu *stats,
+			       enum dahdi_tick_phase phase, u64 start)
+{
+	struct dahdi_phase_stats *ps;
+	u64 ns;
+
+	if (!stats)
+		return;
+	ns = dahdi_tick_start() - start;
+	ps = &this_cpu_ptr(stats)->phase[phase];
+	ps->hist[min_t(int, fls64(ns), DAHDI_TICK_BUCKETS - 1)]++;
+	ps->total_ns += ns;
+	if (ns > ps->max_ns)
+		ps->max_ns = ns;
+}
+
+static void span_alloc_tick_stats(struct dahdi_span *span)
+{
+	span->tick_stats = alloc_percpu(struct dahdi_tick_stats);
+}
+
+static void span_free_tick_stats(struct dahdi_span *span)
+{
+	struct dahdi_tick_stats __percpu *stats = span->tick_stats;
+
+	if (!stats)
+		return;
+	/* Readers of the sysfs attribute may still hold it */
+	RCU_INIT_POINTER(span->tick_stats, NULL);
+	synchronize_rcu();
+	free_percpu(stats);
+}
+
+/* Upper bound of the bucket which takes the count past per_mille of it */
+static u64 dahdi_tick_percentile(const u64 *hist, u64 count, int per_mille)
+{
+	const u64 want = div_u64(count * per_mille + 999, 1000);
+	u64 seen = 0;
+	int i;
+
+	for (i = 0; i < DAHDI_TICK_BUCKETS - 1; i++) {
+		seen += hist[i];
+		if (seen >= want)
+			return 1ULL << i;
+	}
+	return U64_MAX;
+}
+
+static ssize_t dahdi_tick_stats_print(struct dahdi_tick_stats __percpu *stats,
+				      int first, int last,
+				      char *buf, size_t size)
+{
+	struct dahdi_phase_stats sum;
+	ssize_t len = 0;
+	u64 count;
+	int phase, cpu, i;
+
+	if (!stats)
+		return scnprintf(buf, size, "unavailable\n");
+
+	len += scnprintf(buf + len, size - len,
+		"phase count avg_ns max_ns p50_ns p90_ns p99_ns p999_ns\n");
+	for (phase = first; phase <= last; phase++) {
+		memset(&sum, 0, sizeof(sum));
+		for_each_possible_cpu(cpu) {
+			const struct dahdi_phase_stats *const ps =
+				&per_cpu_ptr(stats, cpu)->phase[phase];
+			for (i = 0; i < DAHDI_TICK_BUCKETS; i++)
+				sum.hist[i] += ps->hist[i];
+			sum.total_ns += ps->total_ns;
+			sum.max_ns = max(sum.max_ns, ps->max_ns);
+		}
+		count = 0;
+		for (i = 0; i < DAHDI_TICK_BUCKETS; i++)
+			count += sum.hist[i];
+		if (!count) {
+			len += scnprintf(buf + len, size - len,
+					 "%s 0 0 0 0 0 0 0\n",
+					 dahdi_tick_phase_names[phase]);
+			continue;
+		}
+		len += scnprintf(buf + len, size - len,
+				 "%s %llu %llu %llu %llu %llu %llu %llu\n",
+				 dahdi_tick_phase_names[phase], count,
+				 div64_u64(sum.total_ns, count), sum.max_ns,
+				 dahdi_tick_percentile(sum.hist, count, 500),
+				 dahdi_tick_percentile(sum.hist, count, 900),
+				 dahdi_tick_percentile(sum.hist, count, 990),
+				 dahdi_tick_percentile(sum.hist, count, 999));
+	}
+	return len;
+}
+
+static void dahdi_tick_stats_clear(struct dahdi_tick_stats __percpu *stats)
+{
+	int cpu;
+
+	if (!stats)
+		return;
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(stats, cpu), 0, sizeof(*stats));
+}
+
+/**
+ * dahdi_span_tick_stats_show() - Print the per phase timing of a span.
+ *
+ * Used by the "tick_stats" attribute of the span.  Times are taken per call
+ * of _dahdi_receive() and _dahdi_transmit(), and per channel chunk for the
+ * echo canceller.  The percentiles are the upper bounds of the log2 buckets
+ * they fall in.
+ */
+ssize_t dahdi_span_tick_stats_show(struct dahdi_span *span, char *buf,
+				   size_t size)
+{
+	ssize_t len;
+
+	rcu_read_lock();
+	len = dahdi_tick_stats_print(rcu_dereference(span->tick_stats),
+				     DAHDI_TICK_RECEIVE, DAHDI_TICK_EC,
+				     buf, size);
+	rcu_read_unlock();
+	return len;
+}
+
+void dahdi_span_tick_stats_clear(struct dahdi_span *span)
+{
+	rcu_read_lock();
+	dahdi_tick_stats_clear(rcu_dereference(span->tick_stats));
+	rcu_read_unlock();
+}
+
+/**
+ * dahdi_tick_stats_show() - Print the timing of _process_masterspan().
+ *
+ * Used by the "masterspan_tick_stats" attribute of the dahdi_spans bus driver.
+ */
+ssize_t dahdi_tick_stats_show(char *buf, size_t size)
+{
+	return dahdi_tick_stats_print(master_tick_stats, DAHDI_TICK_MASTERSPAN,
+				      DAHDI_TICK_MASTERSPAN, buf, size);
+}
+
+void dahdi_tick_stats_clear_master(void)
+{
+	dahdi_tick_stats_clear(master_tick_stats);
+}
+
+static inline struct dahdi_tick_stats __percpu *
+span_tick_stats(const struct dahdi_span *span)
+{
+	return span->tick_stats;
+}
+
+#else
+
+enum dahdi_tick_phase {
+	DAHDI_TICK_RECEIVE,
+	DAHDI_TICK_TRANSMIT,
+	DAHDI_TICK_EC,
+	DAHDI_TICK_MASTERSPAN,
+};
+
+struct dahdi_tick_stats;
+#define master_tick_stats	NULL
+
+static inline u64 dahdi_tick_start(void) { return 0; }
+static inline void dahdi_tick_account(struct dahdi_tick_stats *stats,
+				      enum dahdi_tick_phase phase, u64 start)
+{
+}
+static inline struct dahdi_tick_stats *
+span_tick_stats(const struct dahdi_span *span)
+{
+	return NULL;
+}
+static inline void span_alloc_tick_stats(struct dahdi_span *span) { }
+static inline void span_free_tick_stats(struct dahdi_span *span) { }
+
+#endif /* CONFIG_DAHDI_TICK_STATS */
+
 /**
  * can_dacs_chans() - Returns true if it may be possible to dacs two channels.
  *
@@ -1056,20 +1637,6 @@ static int dahdi_first_empty_alias(void)
 	return -1;
 }
 
-static void recalc_maxconfs(void)
-{
-	int x;
-
-	for (x = DAHDI_MAX_CONF - 1; x > 0; x--) {
-		if (confrev[x]) {
-			maxconfs = x + 1;
-			return;
-		}
-	}
-
-	maxconfs = 0;
-}
-
 static int dahdi_first_empty_conference(void)
 {
 	/* Find the first conference which has no alias */
@@ -1083,6 +1650,11 @@ static int dahdi_first_empty_conference(void)
 	return -1;
 }
 
+/*
+ * Returns the alias of conference x, allocating one if needed, or a negative
+ * error code. Must be called with the chan_lock held, and the accumulator pool
+ * must already have room for one more alias (see conf_pool_reserve()).
+ */
 static int dahdi_get_conf_alias(int x)
 {
 	int a;
@@ -1092,15 +1664,41 @@ static int dahdi_get_conf_alias(int x)
 
 	/* Allocate an alias */
 	a = dahdi_first_empty_alias();
+	if (a < 0)
+		return -EBUSY;
+	if (!conf_pool_has_room(a))
+		return -ENOMEM;
+
+	/* Don't let the new conference hear what the last user of this
+	 * accumulator left behind */
+	memset(conf_sums_prev[a], 0, sizeof(sumtype));
+	memset(conf_sums[a], 0, sizeof(sumtype));
+	memset(conf_sums_next[a], 0, sizeof(sumtype));
+
 	confalias[x] = a;
 	confrev[a] = x;
-
-	/* Highest conference may have changed */
-	recalc_maxconfs();
+	conf_live[nr_live_confs++] = a;
 
 	return a;
 }
 
+/* Must be called with the chan_lock held. */
+static void dahdi_put_conf_alias(int x)
+{
+	const int a = confalias[x];
+	int i;
+
+	for (i = 0; i < nr_live_confs; i++) {
+		if (conf_live[i] == a) {
+			conf_live[i] = conf_live[--nr_live_confs];
+			break;
+		}
+	}
+
+	confrev[a] = 0;
+	confalias[x] = 0;
+}
+
 static unsigned long _chan_in_conf(struct dahdi_chan *chan, unsigned long x)
 {
 	const int confmode = chan->confmode & DAHDI_CONF_MODE_MASK;
@@ -1146,17 +1744,15 @@ static void dahdi_check_conf(int x)
 
 	spin_lock_irqsave(&chan_lock, flags);
 	res = __for_each_channel(_chan_in_conf, x);
-	spin_unlock_irqrestore(&chan_lock, flags);
-	if (res)
+	if (res || !confalias[x]) {
+		spin_unlock_irqrestore(&chan_lock, flags);
 		return;
+	}
 
 	/* If we get here, nobody is in the conference anymore.  Clear it out
 	   both forward and reverse */
-	confrev[confalias[x]] = 0;
-	confalias[x] = 0;
-
-	/* Highest conference may have changed */
-	recalc_maxconfs();
+	dahdi_put_conf_alias(x);
+	spin_unlock_irqrestore(&chan_lock, flags);
 
 #ifdef CONFIG_DAHDI_CONFLINK
 	/* And unlink it from any conflinks */
@@ -1170,6 +1766,92 @@ static void dahdi_check_conf(int x)
 #endif
 }
 
+/**
+ * struct dahdi_span_eventfd - Aggregated wakeup of a span (DAHDI_SPAN_NOTIFY).
+ * @ctx:	The eventfd signalled once per tick while @pending.
+ * @owner:	The ctl file that attached it; detached when that is closed.
+ * @node:	Used to collect them on that close.
+ * @pending:	Set by dahdi_chan_wake() since the last signal.
+ * @channels:	Number of bits in @ready.
+ * @ready:	Channels woken since the last DAHDI_SPAN_READY, by chanpos - 1.
+ *
+ * Updated under registration_mutex, read under RCU.
+ */
+struct dahdi_span_eventfd {
+	struct eventfd_ctx *ctx;
+	struct file *owner;
+	struct list_head node;
+	int pending;
+	int channels;
+	unsigned long ready[];
+};
+
+/**
+ * dahdi_chan_wake() - Wake anyone waiting on a channel.
+ *
+ * Besides the waitqueue of the channel this flags the channel as ready for
+ * an eventfd attached to its span with DAHDI_SPAN_NOTIFY. The eventfd itself
+ * is signalled from dahdi_span_notify_signal(), once per tick.
+ */
+static void dahdi_chan_wake(struct dahdi_chan *chan)
+{
+	struct dahdi_span_eventfd *notify;
+
+	wake_up_interruptible(&chan->waitq);
+	if (!chan->span)
+		return;
+
+	rcu_read_lock();
+	notify = rcu_dereference(chan->span->notify);
+	if (notify && (chan->chanpos > 0) &&
+	    (chan->chanpos <= notify->channels)) {
+		set_bit(chan->chanpos - 1, notify->ready);
+		WRITE_ONCE(notify->pending, 1);
+	}
+	rcu_read_unlock();
+}
+
+static void dahdi_span_notify_signal(struct dahdi_span *span)
+{
+	struct dahdi_span_eventfd *notify;
+
+	rcu_read_lock();
+	notify = rcu_dereference(span->notify);
+	if (notify && READ_ONCE(notify->pending) && xchg(&notify->pending, 0)) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 8, 0)
+		eventfd_signal(notify->ctx);
+#else
+		eventfd_signal(notify->ctx, 1);
+#endif
+	}
+	rcu_read_unlock();
+}
+
+static void dahdi_span_notify_free(struct dahdi_span_eventfd *notify)
+{
+	eventfd_ctx_put(notify->ctx);
+	kfree(notify);
+}
+
+/**
+ * _dahdi_span_set_notify() - Attach or detach the eventfd of a span.
+ *
+ * Must be called with registration_mutex held.
+ */
+static void _dahdi_span_set_notify(struct dahdi_span *span,
+				   struct dahdi_span_eventfd *notify)
+{
+	struct dahdi_span_eventfd *old;
+
+	old = rcu_dereference_protected(span->notify,
+				lockdep_is_held(&registration_mutex));
+	rcu_assign_pointer(span->notify, notify);
+	if (old) {
+		synchronize_rcu();
+		dahdi_span_notify_free(old);
+	}
+}
+
 /* enqueue an event on a channel */
 static void __qevent(struct dahdi_chan *chan, int event)
 {
@@ -1189,7 +1871,7 @@ static void __qevent(struct dahdi_chan *chan, int event)
 		chan->eventinidx = 0;
 
 	/* wake em all up */
-	wake_up_interruptible(&chan->waitq);
+	dahdi_chan_wake(chan);
 
 	return;
 }
@@ -1209,7 +1891,6 @@ void dahdi_qevent_lock(struct dahdi_chan *chan, int event)
 
 static inline void calc_fcs(struct dahdi_chan *ss, int inwritebuf)
 {
-	int x;
 	unsigned int fcs = PPP_INITFCS;
 	unsigned char *data = ss->writebuf[inwritebuf];
 	int len = ss->writen[inwritebuf];
@@ -1218,8 +1899,7 @@ static inline void calc_fcs(struct dahdi_chan *ss, int inwritebuf)
 	if (len < 2)
 		return;
 
-	for (x = 0; x < len - 2; x++)
-		fcs = PPP_FCS(fcs, data[x]);
+	fcs = fasthdlc_fcs(fcs, data, len - 2);
 
 	fcs ^= 0xffff;
 	/* Send out the FCS */
@@ -1227,12 +1907,26 @@ static inline void calc_fcs(struct dahdi_chan *ss, int inwritebuf)
 	data[len - 1] = (fcs >> 8) & 0xff;
 }
 
+/**
+ * dahdi_alloc_linbufs() - Allocate the signed linear buffers of a channel.
+ *
+ * One allocation holds a signed linear copy of each of the @numbufs read
+ * buffers.  The tick path fills it alongside readbuf[] so that linear reads
+ * are a single copy to user space.
+ */
+static short *dahdi_alloc_linbufs(int blocksize, int numbufs)
+{
+	return kcalloc(numbufs * blocksize, sizeof(short), GFP_KERNEL);
+}
+
 static int dahdi_reallocbufs(struct dahdi_chan *ss, int blocksize, int numbufs)
 {
 	unsigned char *newtxbuf = NULL;
 	unsigned char *newrxbuf = NULL;
 	unsigned char *oldtxbuf = NULL;
 	unsigned char *oldrxbuf = NULL;
+	short *newlinbuf = NULL;
+	short *oldlinbuf;
 	unsigned long flags;
 	int x;
 
@@ -1253,6 +1947,14 @@ static int dahdi_reallocbufs(struct dahdi_chan *ss, int blocksize, int numbufs)
 			kfree(newtxbuf);
 			return -ENOMEM;
 		}
+		if (ss->flags & DAHDI_FLAG_LINEAR) {
+			newlinbuf = dahdi_alloc_linbufs(blocksize, numbufs);
+			if (!newlinbuf) {
+				kfree(newrxbuf);
+				kfree(newtxbuf);
+				return -ENOMEM;
+			}
+		}
 	}
 
 	/* Now that we've allocated our new buffers, we can safely
@@ -1264,6 +1966,8 @@ static int dahdi_reallocbufs(struct dahdi_chan *ss, int blocksize, int numbufs)
 	oldrxbuf = ss->readbuf[0]; /* Keep track of the old buffer */
 	oldtxbuf = ss->writebuf[0];
 	ss->readbuf[0] = NULL;
+	oldlinbuf = ss->linreadbuf;
+	ss->linreadbuf = newlinbuf;
 
 	if (newrxbuf) {
 		BUG_ON(NULL == newtxbuf);
@@ -1309,6 +2013,7 @@ static int dahdi_reallocbufs(struct dahdi_chan *ss, int blocksize, int numbufs)
 
 	kfree(oldtxbuf);
 	kfree(oldrxbuf);
+	kfree(oldlinbuf);
 
 	return 0;
 }
@@ -1471,6 +2176,38 @@ static void release_echocan(const struct dahdi_echocan_factory *ec)
 		module_put(ec->owner);
 }
 
+#ifdef CONFIG_DAHDI_EC_OFFLOAD
+static void span_alloc_ec_offload(struct dahdi_span *span);
+static void span_free_ec_offload(struct dahdi_span *span);
+static void ec_offload_sync(struct dahdi_span *span);
+#else
+static inline void span_alloc_ec_offload(struct dahdi_span *span) { }
+static inline void span_free_ec_offload(struct dahdi_span *span) { }
+static inline void ec_offload_sync(struct dahdi_span *span) { }
+#endif
+
+/**
+ * free_echocan() - Free an echocan instance detached from its channel
+ * @chan:	the channel it was attached to
+ * @ec_state:	the instance
+ * @ec_current:	the factory it came from
+ *
+ * dahdi_ec_span() runs echocans that have a batch operation without
+ * holding the channel lock, and the EC offload threads run them on other
+ * CPUs, so wait for any pass still using @ec_state.
+ * Must be called from process context, without chan->lock held.
+ */
+static void free_echocan(struct dahdi_chan *chan,
+			 struct dahdi_echocan_state *ec_state,
+			 const struct dahdi_echocan_factory *ec_current)
+{
+	if (ec_state->ops->echocan_process_batch)
+		synchronize_rcu();
+	ec_offload_sync(chan->span);
+	ec_state->ops->echocan_free(chan, ec_state);
+	release_echocan(ec_current);
+}
+
 /**
  * is_gain_allocated() - True if gain tables were dynamically allocated.
  * @chan:  The channel to check.
@@ -1565,6 +2302,7 @@ static void close_channel(struct dahdi_chan *chan)
 	const struct dahdi_echocan_factory *ec_current;
 	int oldconf;
 	short *readchunkpreec;
+	struct dahdi_ring *ring;
 #ifdef CONFIG_DAHDI_PPP
 	struct ppp_channel *ppp;
 #endif
@@ -1602,6 +2340,8 @@ static void close_channel(struct dahdi_chan *chan)
 	chan->ec_current = NULL;
 	readchunkpreec = chan->readchunkpreec;
 	chan->readchunkpreec = NULL;
+	ring = chan->ring;
+	chan->ring = NULL;
 	chan->curtone = NULL;
 	if (chan->curzone) {
 		struct dahdi_zone *zone = chan->curzone;
@@ -1654,10 +2394,8 @@ static void close_channel(struct dahdi_chan *chan)
 
 	spin_unlock_irqrestore(&chan->lock, flags);
 
-	if (ec_state) {
-		ec_state->ops->echocan_free(chan, ec_state);
-		release_echocan(ec_current);
-	}
+	if (ec_state)
+		free_echocan(chan, ec_state, ec_current);
 
 	/* release conference resource, if any to release */
 	if (oldconf)
@@ -1671,6 +2409,9 @@ static void close_channel(struct dahdi_chan *chan)
 		kfree(readchunkpreec);
 	}
 
+	if (ring)
+		dahdi_ring_put(ring);
+
 #ifdef CONFIG_DAHDI_PPP
 	if (ppp) {
 		tasklet_kill(&chan->ppp_calls);
@@ -2025,6 +2766,9 @@ static int dahdi_net_open(struct net_device *dev)
 	fasthdlc_init(&ms->txhdlc, (ms->flags & DAHDI_FLAG_HDLC56) ? FASTHDLC_MODE_56 : FASTHDLC_MODE_64);
 	ms->infcs = PPP_INITFCS;
 
+#ifdef CONFIG_DAHDI_NET_NAPI
+	napi_enable(&ms->hdlcnetdev->napi);
+#endif
 	netif_start_queue(chan_to_netdev(ms));
 
 #ifdef CONFIG_DAHDI_DEBUG
@@ -2047,6 +2791,115 @@ static int dahdi_register_hdlc_device(struct net_device *dev, const char *dev_na
 	return 0;
 }
 
+/* Set up a received frame the way the HDLC protocol on dev expects it */
+static void dahdi_net_rx_protocol(struct net_device *dev, struct sk_buff *skb)
+{
+	skb_reset_mac_header(skb);
+	skb->dev = dev;
+#ifdef DAHDI_HDLC_TYPE_TRANS
+	skb->protocol = hdlc_type_trans(skb, dev);
+#else
+	skb->protocol = htons (ETH_P_HDLC);
+#endif
+}
+
+#ifdef CONFIG_DAHDI_NET_NAPI
+/* Received frames held for the NAPI poll before more are dropped */
+#define DAHDI_NET_RX_BACKLOG	(4 * NAPI_POLL_WEIGHT)
+
+/**
+ * __dahdi_net_rx_queue() - Queue a received frame for dahdi_net_poll().
+ *
+ * Called with ms->lock held.
+ */
+static void __dahdi_net_rx_queue(struct dahdi_chan *ms, struct sk_buff *skb)
+{
+	struct dahdi_hdlc *const h = ms->hdlcnetdev;
+
+	if (skb_queue_len(&h->rxq) >= DAHDI_NET_RX_BACKLOG) {
+		hdlc_stats(h->netdev)->rx_dropped++;
+		dev_kfree_skb_any(skb);
+		return;
+	}
+	__skb_queue_tail(&h->rxq, skb);
+	napi_schedule(&h->napi);
+}
+
+/**
+ * dahdi_net_poll() - Hand up to @budget queued frames to the stack.
+ *
+ * The frames are taken off the channel in one go, so the card interrupt is
+ * only held off for the dequeue and not for the protocol work.
+ */
+static int dahdi_net_poll(struct napi_struct *napi, int budget)
+{
+	struct dahdi_hdlc *const h = container_of(napi, struct dahdi_hdlc, napi);
+	struct dahdi_chan *const ms = h->chan;
+	struct sk_buff_head list;
+	struct sk_buff *skb;
+	unsigned long flags;
+	int done = 0;
+
+	__skb_queue_head_init(&list);
+	spin_lock_irqsave(&ms->lock, flags);
+	while (done < budget && (skb = __skb_dequeue(&h->rxq))) {
+		__skb_queue_tail(&list, skb);
+		done++;
+	}
+	spin_unlock_irqrestore(&ms->lock, flags);
+
+	while ((skb = __skb_dequeue(&list))) {
+		dahdi_net_rx_protocol(h->netdev, skb);
+		napi_gro_receive(napi, skb);
+	}
+
+	if (done < budget) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 19, 0)
+		napi_complete_done(napi, done);
+#else
+		napi_complete(napi);
+#endif
+		/* A frame queued since we looked may have found us still
+		 * scheduled. */
+		spin_lock_irqsave(&ms->lock, flags);
+		if (!skb_queue_empty(&h->rxq))
+			napi_schedule(napi);
+		spin_unlock_irqrestore(&ms->lock, flags);
+	}
+	return done;
+}
+#endif /* CONFIG_DAHDI_NET_NAPI */
+
+/**
+ * dahdi_net_flush() - Drop the frames a network channel still holds.
+ * @ms:	The channel, with its receive buffers already released.
+ *
+ * Frees the queued and half-sent transmit frames and the receive frame
+ * being deframed into.
+ */
+static void dahdi_net_flush(struct dahdi_chan *ms)
+{
+	struct dahdi_hdlc *const h = ms->hdlcnetdev;
+	struct sk_buff_head list;
+	unsigned long flags;
+
+	__skb_queue_head_init(&list);
+	spin_lock_irqsave(&ms->lock, flags);
+	skb_queue_splice_init(&h->txq, &list);
+	if (h->txskb)
+		__skb_queue_tail(&list, h->txskb);
+	if (h->rxskb)
+		__skb_queue_tail(&list, h->rxskb);
+#ifdef CONFIG_DAHDI_NET_NAPI
+	skb_queue_splice_init(&h->rxq, &list);
+#endif
+	h->txskb = NULL;
+	h->rxskb = NULL;
+	spin_unlock_irqrestore(&ms->lock, flags);
+
+	__skb_queue_purge(&list);
+}
+
 static int dahdi_net_stop(struct net_device *dev)
 {
 	hdlc_device *h = dev_to_hdlc(dev);
@@ -2064,6 +2917,10 @@ static int dahdi_net_stop(struct net_device *dev)
 	/* Not much to do here.  Just deallocate the buffers */
 	netif_stop_queue(chan_to_netdev(ms));
 	dahdi_reallocbufs(ms, 0, 0);
+#ifdef CONFIG_DAHDI_NET_NAPI
+	napi_disable(&ms->hdlcnetdev->napi);
+#endif
+	dahdi_net_flush(ms);
 	hdlc_close(dev);
 	return 0;
 }
@@ -2098,58 +2955,49 @@ static int dahdi_net_attach(struct net_device *dev, unsigned short encoding,
 
 static struct dahdi_hdlc *dahdi_hdlc_alloc(void)
 {
-	return kzalloc(sizeof(struct dahdi_hdlc), GFP_KERNEL);
+	struct dahdi_hdlc *h = kzalloc(sizeof(struct dahdi_hdlc), GFP_KERNEL);
+
+	if (h) {
+		__skb_queue_head_init(&h->txq);
+#ifdef CONFIG_DAHDI_NET_NAPI
+		__skb_queue_head_init(&h->rxq);
+#endif
+		h->rxheadroom = 2;
+	}
+	return h;
 }
 
+/* FCS of a frame queued by dahdi_xmit(), sent LSB first after its data */
+#define dahdi_net_txfcs(skb) ((u8 *)(skb)->cb)
+
 static int dahdi_xmit(struct sk_buff *skb, struct net_device *dev)
 {
-	/* FIXME: this construction seems to be not very optimal for me but I
-	 * could find nothing better at the moment (Friday, 10PM :( )  --byg
-	 * */
 	struct dahdi_chan *ss = netdev_to_chan(dev);
+	struct dahdi_hdlc *h = ss->hdlcnetdev;
 	struct net_device_stats *stats = hdlc_stats(dev);
 
 	int retval = 1;
-	int x,oldbuf;
 	unsigned int fcs;
-	unsigned char *data;
 	unsigned long flags;
-	/* See if we have any buffers */
+
+	/* The frame is sent straight out of the skb, so only its FCS needs
+	 * working out here. */
+	fcs = fasthdlc_fcs(PPP_INITFCS, skb->data, skb->len) ^ 0xffff;
+	dahdi_net_txfcs(skb)[0] = fcs & 0xff;
+	dahdi_net_txfcs(skb)[1] = (fcs >> 8) & 0xff;
+
+	/* See if we have any room */
 	spin_lock_irqsave(&ss->lock, flags);
 	if (skb->len > ss->blocksize - 2) {
 		module_printk(KERN_ERR, "dahdi_xmit(%s): skb is too large (%d > %d)\n", dev->name, skb->len, ss->blocksize -2);
 		stats->tx_dropped++;
 		retval = 0;
-	} else if (ss->inwritebuf >= 0) {
-		/* We have a place to put this packet */
-		/* XXX We should keep the SKB and avoid the memcpy XXX */
-		data = ss->writebuf[ss->inwritebuf];
-		memcpy(data, skb->data, skb->len);
-		ss->writen[ss->inwritebuf] = skb->len;
-		ss->writeidx[ss->inwritebuf] = 0;
-		/* Calculate the FCS */
-		fcs = PPP_INITFCS;
-		for (x=0;x<skb->len;x++)
-			fcs = PPP_FCS(fcs, data[x]);
-		/* Invert it */
-		fcs ^= 0xffff;
-		/* Send it out LSB first */
-		data[ss->writen[ss->inwritebuf]++] = (fcs & 0xff);
-		data[ss->writen[ss->inwritebuf]++] = (fcs >> 8) & 0xff;
-		/* Advance to next window */
-		oldbuf = ss->inwritebuf;
-		ss->inwritebuf = (ss->inwritebuf + 1) % ss->numbufs;
-
-		if (ss->inwritebuf == ss->outwritebuf) {
+		dev_kfree_skb_any(skb);
+	} else if (skb_queue_len(&h->txq) < ss->numbufs) {
+		__skb_queue_tail(&h->txq, skb);
+		if (skb_queue_len(&h->txq) >= ss->numbufs) {
 			/* Whoops, no more space.  */
-		    ss->inwritebuf = -1;
-
-		    netif_stop_queue(chan_to_netdev(ss));
-		}
-		if (ss->outwritebuf < 0) {
-			/* Let the interrupt handler know there's
-			   some space for us */
-			ss->outwritebuf = oldbuf;
+			netif_stop_queue(dev);
 		}
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 7, 0)
 		netif_trans_update(dev);
@@ -2157,16 +3005,113 @@ static int dahdi_xmit(struct sk_buff *skb, struct net_device *dev)
 		dev->trans_start = jiffies;
 #endif
 		stats->tx_packets++;
-		stats->tx_bytes += ss->writen[oldbuf];
-		print_debug_writebuf(ss, skb, oldbuf);
+		stats->tx_bytes += skb->len + 2;
 		retval = 0;
-		/* Free the SKB */
-		dev_kfree_skb_any(skb);
 	}
 	spin_unlock_irqrestore(&ss->lock, flags);
 	return retval;
 }
 
+/**
+ * __dahdi_net_tx() - HDLC encode frames queued by dahdi_xmit().
+ *
+ * Encodes straight from the skb data, then its FCS, and frees each skb
+ * once it is sent. Returns the number of bytes written to txb, which is
+ * less than asked for only when the queue runs dry. Called with ms->lock
+ * held.
+ */
+static int __dahdi_net_tx(struct dahdi_chan *ms, u8 *txb, int bytes)
+{
+	struct dahdi_hdlc *const h = ms->hdlcnetdev;
+	struct sk_buff *skb = h->txskb;
+	int done = 0;
+
+	while (done < bytes) {
+		const u8 *src;
+		int left;
+
+		if (!skb) {
+			skb = __skb_dequeue(&h->txq);
+			if (!skb)
+				break;
+			h->txskb = skb;
+			h->txidx = 0;
+		}
+		if (h->txidx < skb->len) {
+			src = skb->data + h->txidx;
+			left = skb->len - h->txidx;
+		} else {
+			src = dahdi_net_txfcs(skb) + (h->txidx - skb->len);
+			left = skb->len + 2 - h->txidx;
+		}
+		/* Never more than one byte of data per byte of line */
+		left = min(left, bytes - done);
+		h->txidx += fasthdlc_tx_run_buf(&ms->txhdlc, src, txb + done,
+						left);
+		done += left;
+
+		if (h->txidx >= skb->len + 2) {
+			fasthdlc_tx_frame_nocheck(&ms->txhdlc);
+			dev_kfree_skb_any(skb);
+			skb = h->txskb = NULL;
+			netif_wake_queue(chan_to_netdev(ms));
+		}
+	}
+	return done;
+}
+
+/**
+ * __dahdi_net_rx_buf() - Where to deframe the next received bytes to.
+ * @ms:		The channel.
+ * @buf:	The channel's read buffer, used if there is no skb.
+ *
+ * A frame is deframed straight into an skb when one could be allocated as
+ * it began; otherwise it goes to @buf and is dropped at its end. Called
+ * with ms->lock held.
+ */
+static u8 *__dahdi_net_rx_buf(struct dahdi_chan *ms, u8 *buf)
+{
+	struct dahdi_hdlc *const h = ms->hdlcnetdev;
+
+	if (!h->rxskb && !ms->readidx[ms->inreadbuf]) {
+		h->rxskb = dev_alloc_skb(ms->blocksize + 2);
+		if (h->rxskb)
+			skb_reserve(h->rxskb, h->rxheadroom);
+	}
+	if (!h->rxskb)
+		return buf;
+	return skb_tail_pointer(h->rxskb);
+}
+
+/**
+ * __dahdi_net_rx_skb() - Take the skb a frame was deframed into.
+ * @ms:		The channel.
+ * @len:	Length of the frame, without its FCS.
+ *
+ * Returns NULL if the frame had to go to the read buffer instead. Called
+ * with ms->lock held.
+ */
+static struct sk_buff *__dahdi_net_rx_skb(struct dahdi_chan *ms, int len)
+{
+	struct dahdi_hdlc *const h = ms->hdlcnetdev;
+	struct sk_buff *skb = h->rxskb;
+	u8 cisco_addr;
+
+	if (!skb)
+		return NULL;
+	h->rxskb = NULL;
+	skb_put(skb, len);
+
+	/* The headroom must be picked before the frame arrives, so guess
+	 * the next one will be like this one.  A wrong guess only costs the
+	 * alignment of its network header. */
+	if (len) {
+		cisco_addr = skb->data[0];
+		h->rxheadroom = (cisco_addr != 0x0f && cisco_addr != 0x8f) ? 2 : 0;
+	}
+	return skb;
+}
+
 static int dahdi_net_ioctl(struct net_device *dev, struct ifreq *ifr, int cmd)
 {
 	return hdlc_ioctl(dev, ifr, cmd);
@@ -2185,7 +3130,7 @@ static int dahdi_ppp_xmit(struct ppp_channel *ppp, struct sk_buff *skb)
 	 * 1 and never if we return 0
          */
 	struct dahdi_chan *ss = ppp->private;
-	int x,oldbuf;
+	int oldbuf;
 	unsigned int fcs;
 	unsigned char *data;
 	unsigned long flags;
@@ -2218,9 +3163,7 @@ static int dahdi_ppp_xmit(struct ppp_channel *ppp, struct sk_buff *skb)
 		ss->writeidx[ss->inwritebuf] = 0;
 
 		/* Calculate the FCS */
-		fcs = PPP_INITFCS;
-		for (x=0;x<skb->len + 2;x++)
-			fcs = PPP_FCS(fcs, data[x]);
+		fcs = fasthdlc_fcs(PPP_INITFCS, data, skb->len + 2);
 		/* Invert it */
 		fcs ^= 0xffff;
 
@@ -2407,79 +3350,360 @@ static void dahdi_chan_unreg(struct dahdi_chan *chan)
 	}
 }
 
-static ssize_t dahdi_chan_read(struct file *file, char __user *usrbuf,
-			       size_t count, loff_t *ppos)
+/**
+ * struct dahdi_ring - The mmap()able audio rings of a channel.
+ * @mem:	vmalloc_user() area holding the header and both data areas.
+ * @rx_head:	Our copy of hdr->rx_head. User space may scribble on the
+ *		header, so the indices the kernel owns are never read back.
+ * @tx_tail:	Our copy of hdr->tx_tail.
+ *
+ * Referenced by the channel and by every VMA mapping it, and freed when the
+ * last of those goes away.
+ */
+struct dahdi_ring {
+	struct kref ref;
+	void *mem;
+	size_t len;
+	struct dahdi_ring_hdr *hdr;
+	u8 *rx;
+	u8 *tx;
+	u32 size;
+	u32 rx_head;
+	u32 tx_tail;
+};
+
+static struct dahdi_ring *dahdi_ring_alloc(u32 size)
 {
-	struct dahdi_chan *chan = file->private_data;
-	int amnt;
-	int res, rv;
-	int oldbuf,x;
-	unsigned long flags;
+	struct dahdi_ring *ring;
 
-	/* Make sure count never exceeds 65k, and make sure it's unsigned */
-	count &= 0xffff;
+	ring = kzalloc(sizeof(*ring), GFP_KERNEL);
+	if (!ring)
+		return NULL;
 
-	if (unlikely(!chan)) {
-		/*
-		 * This should never happen. Surprise device removal
-		 * should lead us to the nodev_* file_operations
-		 */
-		msleep(5);
-		module_printk(KERN_ERR, "%s: NODEV\n", __func__);
-		return -ENODEV;
+	ring->len = PAGE_ALIGN(DAHDI_RING_MAPLEN(size));
+	ring->mem = vmalloc_user(ring->len);
+	if (!ring->mem) {
+		kfree(ring);
+		return NULL;
 	}
 
-	if (unlikely(count < 1))
-		return -EINVAL;
+	kref_init(&ring->ref);
+	ring->size = size;
+	ring->hdr = ring->mem;
+	ring->rx = (u8 *)ring->mem + DAHDI_RING_HDRLEN;
+	ring->tx = ring->rx + size;
+	ring->hdr->size = size;
+	ring->hdr->rx_offset = DAHDI_RING_HDRLEN;
+	ring->hdr->tx_offset = DAHDI_RING_HDRLEN + size;
+	return ring;
+}
 
-	if (unlikely(!test_bit(DAHDI_FLAGBIT_REGISTERED, &chan->flags)))
-		return -ENODEV;
+static void dahdi_ring_release(struct kref *kref)
+{
+	struct dahdi_ring *ring = container_of(kref, struct dahdi_ring, ref);
 
-	for (;;) {
-		spin_lock_irqsave(&chan->lock, flags);
-		if (chan->eventinidx != chan->eventoutidx) {
-			spin_unlock_irqrestore(&chan->lock, flags);
-			return -ELAST /* - chan->eventbuf[chan->eventoutidx]*/;
-		}
-		res = chan->outreadbuf;
-		spin_unlock_irqrestore(&chan->lock, flags);
-		if (res >= 0)
-			break;
-		if (file->f_flags & O_NONBLOCK)
-			return -EAGAIN;
+	vfree(ring->mem);
+	kfree(ring);
+}
 
-		/* Wake up when data is available or when the board driver
-		 * unregistered the channel. */
-		rv = wait_event_interruptible(chan->waitq,
-			(!chan->file->private_data || chan->outreadbuf > -1));
-		if (rv)
-			return rv;
-		if (unlikely(!chan->file->private_data))
-			return -ENODEV;
+static inline void dahdi_ring_put(struct dahdi_ring *ring)
+{
+	kref_put(&ring->ref, dahdi_ring_release);
+}
+
+/* The rings carry audio only; a channel switched to HDLC leaves them be. */
+static inline bool dahdi_ring_active(const struct dahdi_chan *ms)
+{
+	return ms->ring && !(ms->flags & DAHDI_FLAG_HDLC);
+}
+
+/* Bytes waiting in the rx ring, as far as user space has told us. */
+static inline u32 dahdi_ring_rx_used(const struct dahdi_ring *ring)
+{
+	u32 used = ring->rx_head - smp_load_acquire(&ring->hdr->rx_tail);
+
+	return min(used, ring->size);
+}
+
+/* Bytes user space has queued in the tx ring. */
+static inline u32 dahdi_ring_tx_avail(const struct dahdi_ring *ring)
+{
+	u32 avail = smp_load_acquire(&ring->hdr->tx_head) - ring->tx_tail;
+
+	return (avail > ring->size) ? 0 : avail;
+}
+
+/**
+ * __dahdi_ring_rx() - Queue received audio for user space.
+ *
+ * Whatever does not fit is dropped and counted in rx_overruns. Wakes up
+ * poll() once a whole block is waiting. Called with ms->lock held.
+ */
+static void __dahdi_ring_rx(struct dahdi_chan *ms, const u8 *rxb, int bytes)
+{
+	struct dahdi_ring *const ring = ms->ring;
+	const u32 used = dahdi_ring_rx_used(ring);
+	const u32 pos = ring->rx_head & (ring->size - 1);
+	u32 first;
+
+	if (bytes > ring->size - used) {
+		ring->hdr->rx_overruns += bytes - (ring->size - used);
+		bytes = ring->size - used;
 	}
-	amnt = count;
-	if (chan->flags & DAHDI_FLAG_LINEAR) {
-		if (amnt > (chan->readn[res] << 1))
-			amnt = chan->readn[res] << 1;
-		if (amnt) {
-			/* There seems to be a max stack size, so we have
-			   to do this in smaller pieces */
-			short lindata[128];
-			int left = amnt >> 1; /* amnt is in bytes */
-			int pos = 0;
-			int pass;
-			while (left) {
-				pass = left;
-				if (pass > 128)
-					pass = 128;
-				for (x = 0; x < pass; x++)
-					lindata[x] = DAHDI_XLAW(chan->readbuf[res][x + pos], chan);
-				if (copy_to_user(usrbuf + (pos << 1), lindata, pass << 1))
-					return -EFAULT;
-				left -= pass;
-				pos += pass;
-			}
-		}
+
+	first = min_t(u32, bytes, ring->size - pos);
+	memcpy(ring->rx + pos, rxb, first);
+	memcpy(ring->rx, rxb + first, bytes - first);
+
+	ring->rx_head += bytes;
+	smp_store_release(&ring->hdr->rx_head, ring->rx_head);
+
+	if ((used < ms->blocksize) && (used + bytes >= ms->blocksize))
+		dahdi_chan_wake(ms);
+}
+
+/**
+ * __dahdi_ring_tx() - Take audio queued by user space for transmission.
+ *
+ * Returns the number of bytes copied into txb, which may be less than asked
+ * for. The transmit buffer policy applies as it does to write(): with
+ * DAHDI_POLICY_WHEN_FULL or DAHDI_POLICY_HALF_FULL nothing is taken after
+ * the ring has run dry until it has filled up that far again. Wakes up
+ * poll() once there is room for a whole block. Called with ms->lock held.
+ */
+static int __dahdi_ring_tx(struct dahdi_chan *ms, u8 *txb, int bytes)
+{
+	struct dahdi_ring *const ring = ms->ring;
+	const u32 avail = dahdi_ring_tx_avail(ring);
+	const u32 pos = ring->tx_tail & (ring->size - 1);
+	u32 first;
+
+	if (ms->txdisable) {
+		if (avail < ((ms->txbufpolicy == DAHDI_POLICY_HALF_FULL) ?
+			     ring->size / 2 : ring->size))
+			return 0;
+		ms->txdisable = 0;
+	}
+
+	if (bytes >= avail) {
+		bytes = avail;
+		if ((ms->txbufpolicy == DAHDI_POLICY_WHEN_FULL) ||
+		    (ms->txbufpolicy == DAHDI_POLICY_HALF_FULL))
+			ms->txdisable = 1;
+	}
+	if (!bytes)
+		return 0;
+
+	first = min_t(u32, bytes, ring->size - pos);
+	memcpy(txb, ring->tx + pos, first);
+	memcpy(txb + first, ring->tx, bytes - first);
+
+	ring->tx_tail += bytes;
+	smp_store_release(&ring->hdr->tx_tail, ring->tx_tail);
+
+	if ((ring->size - avail < ms->blocksize) &&
+	    (ring->size - avail + bytes >= ms->blocksize))
+		dahdi_chan_wake(ms);
+	return bytes;
+}
+
+static void dahdi_ring_vm_open(struct vm_area_struct *vma)
+{
+	struct dahdi_ring *ring = vma->vm_private_data;
+
+	kref_get(&ring->ref);
+}
+
+static void dahdi_ring_vm_close(struct vm_area_struct *vma)
+{
+	dahdi_ring_put(vma->vm_private_data);
+}
+
+static const struct vm_operations_struct dahdi_ring_vm_ops = {
+	.open = dahdi_ring_vm_open,
+	.close = dahdi_ring_vm_close,
+};
+
+static int dahdi_chan_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct dahdi_chan *const chan = file->private_data;
+	struct dahdi_ring *ring;
+	unsigned long flags;
+	int res;
+
+	if (unlikely(!chan))
+		return -ENODEV;
+
+	spin_lock_irqsave(&chan->lock, flags);
+	ring = chan->ring;
+	if (ring)
+		kref_get(&ring->ref);
+	spin_unlock_irqrestore(&chan->lock, flags);
+	if (!ring)
+		return -EINVAL;
+
+	if (vma->vm_pgoff || (vma->vm_end - vma->vm_start > ring->len)) {
+		dahdi_ring_put(ring);
+		return -EINVAL;
+	}
+
+	res = remap_vmalloc_range(vma, ring->mem, 0);
+	if (res) {
+		dahdi_ring_put(ring);
+		return res;
+	}
+
+	vma->vm_private_data = ring;
+	vma->vm_ops = &dahdi_ring_vm_ops;
+	return 0;
+}
+
+/**
+ * dahdi_set_ring() - Set up, resize or tear down the rings of a channel.
+ * @size:	Size of each ring in bytes, or 0 to go back to read() / write().
+ *
+ * Existing mappings keep the old rings until they are unmapped.
+ */
+static int dahdi_set_ring(struct dahdi_chan *chan, int size)
+{
+	struct dahdi_ring *ring = NULL;
+	struct dahdi_ring *old;
+	unsigned long flags;
+
+	if (size) {
+		if ((size < DAHDI_RING_MIN) || (size > DAHDI_RING_MAX) ||
+		    !is_power_of_2(size))
+			return -EINVAL;
+		if (chan->flags & DAHDI_FLAG_HDLC)
+			return -EINVAL;
+		ring = dahdi_ring_alloc(size);
+		if (!ring)
+			return -ENOMEM;
+	}
+
+	spin_lock_irqsave(&chan->lock, flags);
+	old = chan->ring;
+	chan->ring = ring;
+	spin_unlock_irqrestore(&chan->lock, flags);
+
+	if (old)
+		dahdi_ring_put(old);
+	return 0;
+}
+
+/**
+ * dahdi_set_linear() - Switch a channel in or out of signed linear mode.
+ *
+ * Entering linear mode converts whatever is already queued for reading so
+ * that the linear shadow stays in step with readbuf[].
+ */
+static int dahdi_set_linear(struct dahdi_chan *chan, int linear)
+{
+	short *linbuf = NULL;
+	short *old;
+	unsigned long flags;
+	int blocksize, numbufs, x;
+
+	for (;;) {
+		blocksize = chan->blocksize;
+		numbufs = chan->numbufs;
+		if (linear && blocksize) {
+			linbuf = dahdi_alloc_linbufs(blocksize, numbufs);
+			if (!linbuf)
+				return -ENOMEM;
+		}
+		spin_lock_irqsave(&chan->lock, flags);
+		if ((blocksize == chan->blocksize) &&
+		    (numbufs == chan->numbufs))
+			break;
+		/* Buffers were reallocated under us */
+		spin_unlock_irqrestore(&chan->lock, flags);
+		kfree(linbuf);
+		linbuf = NULL;
+	}
+
+	old = chan->linreadbuf;
+	if (linear) {
+		if (linbuf) {
+			for (x = 0; x < numbufs * blocksize; x++)
+				linbuf[x] = DAHDI_XLAW(chan->readbuf[0][x], chan);
+		}
+		chan->linreadbuf = linbuf;
+		chan->flags |= DAHDI_FLAG_LINEAR;
+	} else {
+		chan->linreadbuf = NULL;
+		chan->flags &= ~DAHDI_FLAG_LINEAR;
+	}
+	spin_unlock_irqrestore(&chan->lock, flags);
+
+	kfree(old);
+	return 0;
+}
+
+/**
+ * dahdi_chan_read_ready() - Find the next read buffer of a channel.
+ *
+ * Returns the index of the buffer, -ELAST if there is an event pending for
+ * the channel, or -EAGAIN if there is nothing to read yet.
+ */
+static int dahdi_chan_read_ready(struct dahdi_chan *chan)
+{
+	unsigned long flags;
+	int res;
+
+	spin_lock_irqsave(&chan->lock, flags);
+	if (chan->eventinidx != chan->eventoutidx)
+		res = -ELAST /* - chan->eventbuf[chan->eventoutidx]*/;
+	else if (chan->outreadbuf < 0)
+		res = -EAGAIN;
+	else
+		res = chan->outreadbuf;
+	spin_unlock_irqrestore(&chan->lock, flags);
+	return res;
+}
+
+/**
+ * dahdi_chan_copy_readbuf() - Hand a full read buffer to user space.
+ * @res:	The buffer, as returned by dahdi_chan_read_ready().
+ *
+ * Returns the number of bytes copied, or -EFAULT.
+ */
+static ssize_t dahdi_chan_copy_readbuf(struct dahdi_chan *chan, int res,
+				       char __user *usrbuf, size_t count)
+{
+	int amnt;
+	int oldbuf, x;
+	unsigned long flags;
+
+	amnt = count;
+	if (chan->flags & DAHDI_FLAG_LINEAR) {
+		if (amnt > (chan->readn[res] << 1))
+			amnt = chan->readn[res] << 1;
+		if (amnt && chan->linreadbuf) {
+			/* Already converted by __putbuf_chunk() */
+			if (copy_to_user(usrbuf,
+					 chan->linreadbuf + res * chan->blocksize,
+					 amnt))
+				return -EFAULT;
+		} else if (amnt) {
+			/* No linear shadow (e.g. flags copied from a mirror
+			   source), so convert in smaller pieces */
+			short lindata[128];
+			int left = amnt >> 1; /* amnt is in bytes */
+			int pos = 0;
+			int pass;
+			while (left) {
+				pass = left;
+				if (pass > 128)
+					pass = 128;
+				for (x = 0; x < pass; x++)
+					lindata[x] = DAHDI_XLAW(chan->readbuf[res][x + pos], chan);
+				if (copy_to_user(usrbuf + (pos << 1), lindata, pass << 1))
+					return -EFAULT;
+				left -= pass;
+				pos += pass;
+			}
+		}
 	} else {
 		if (amnt > chan->readn[res])
 			amnt = chan->readn[res];
@@ -2506,35 +3730,11 @@ static ssize_t dahdi_chan_read(struct file *file, char __user *usrbuf,
 	return amnt;
 }
 
-static int num_filled_bufs(struct dahdi_chan *chan)
-{
-	int range1, range2;
-
-	if (chan->inwritebuf < 0) {
-		return chan->numbufs;
-	}
-
-	if (chan->outwritebuf < 0) {
-		return 0;
-	}
-
-	if (chan->outwritebuf <= chan->inwritebuf) {
-		return chan->inwritebuf - chan->outwritebuf;
-	}
-
-	/* This means (in > out) and we have wrap around */
-	range1 = chan->numbufs - chan->outwritebuf;
-	range2 = chan->inwritebuf;
-
-	return range1 + range2;
-}
-
-static ssize_t dahdi_chan_write(struct file *file, const char __user *usrbuf,
-				size_t count, loff_t *ppos)
+static ssize_t dahdi_chan_read(struct file *file, char __user *usrbuf,
+			       size_t count, loff_t *ppos)
 {
-	unsigned long flags;
 	struct dahdi_chan *chan = file->private_data;
-	int res, amnt, oldbuf, rv, x;
+	int res, rv;
 
 	/* Make sure count never exceeds 65k, and make sure it's unsigned */
 	count &= 0xffff;
@@ -2556,38 +3756,134 @@ static ssize_t dahdi_chan_write(struct file *file, const char __user *usrbuf,
 		return -ENODEV;
 
 	for (;;) {
-		spin_lock_irqsave(&chan->lock, flags);
-		if ((chan->curtone || chan->pdialcount) && !is_pseudo_chan(chan)) {
-			chan->curtone = NULL;
-			chan->tonep = 0;
-			chan->dialing = 0;
-			chan->txdialbuf[0] = '\0';
-			chan->pdialcount = 0;
-		}
-		if (chan->eventinidx != chan->eventoutidx) {
-			spin_unlock_irqrestore(&chan->lock, flags);
-			return -ELAST;
-		}
-		res = chan->inwritebuf;
-		spin_unlock_irqrestore(&chan->lock, flags);
-		if (res >= 0)
+		res = dahdi_chan_read_ready(chan);
+		if (res != -EAGAIN)
 			break;
-		if (file->f_flags & O_NONBLOCK) {
-#ifdef BUFFER_DEBUG
-			printk("Error: Nonblock\n");
-#endif
+		if (file->f_flags & O_NONBLOCK)
 			return -EAGAIN;
-		}
 
-		/* Wake up when room in the write queue is available or when
-		 * the board driver unregistered the channel. */
+		/* Wake up when data is available or when the board driver
+		 * unregistered the channel. */
 		rv = wait_event_interruptible(chan->waitq,
-			(!chan->file->private_data || chan->inwritebuf > -1));
+			(!chan->file->private_data || chan->outreadbuf > -1));
 		if (rv)
 			return rv;
 		if (unlikely(!chan->file->private_data))
 			return -ENODEV;
 	}
+	if (res < 0)
+		return res;
+
+	return dahdi_chan_copy_readbuf(chan, res, usrbuf, count);
+}
+
+static int num_filled_bufs(struct dahdi_chan *chan)
+{
+	int range1, range2;
+
+	if (chan->inwritebuf < 0) {
+		return chan->numbufs;
+	}
+
+	if (chan->outwritebuf < 0) {
+		return 0;
+	}
+
+	if (chan->outwritebuf <= chan->inwritebuf) {
+		return chan->inwritebuf - chan->outwritebuf;
+	}
+
+	/* This means (in > out) and we have wrap around */
+	range1 = chan->numbufs - chan->outwritebuf;
+	range2 = chan->inwritebuf;
+
+	return range1 + range2;
+}
+
+/**
+ * dahdi_chan_write_ready() - Find the next empty write buffer of a channel.
+ *
+ * Writing stops any tone or pulse dialing in progress. Returns the index of
+ * the buffer, -ELAST if there is an event pending for the channel, or -EAGAIN
+ * if all of the write buffers are full.
+ */
+static int dahdi_chan_write_ready(struct dahdi_chan *chan)
+{
+	unsigned long flags;
+	int res;
+
+	spin_lock_irqsave(&chan->lock, flags);
+	if ((chan->curtone || chan->pdialcount) && !is_pseudo_chan(chan)) {
+		chan->curtone = NULL;
+		chan->tonep = 0;
+		chan->dialing = 0;
+		chan->txdialbuf[0] = '\0';
+		chan->pdialcount = 0;
+	}
+	if (chan->eventinidx != chan->eventoutidx)
+		res = -ELAST;
+	else if (chan->inwritebuf < 0)
+		res = -EAGAIN;
+	else
+		res = chan->inwritebuf;
+	spin_unlock_irqrestore(&chan->lock, flags);
+	return res;
+}
+
+/**
+ * dahdi_lin2x_user() - Convert signed linear samples from user space to the
+ * law of a channel.
+ *
+ * The samples are read straight out of the user buffer, with no copy in
+ * between.  Where the conversion is a table, user access is opened once for
+ * the whole block.  lineartoxlaw() is a call, which may not be made with
+ * user access open, so CONFIG_CALC_XLAW fetches one sample at a time, as do
+ * kernels before 5.0, which cannot open user access for a range.
+ *
+ * Returns 0, or -EFAULT.
+ */
+static int dahdi_lin2x_user(const struct dahdi_chan *chan, u_char *xb,
+			    const short __user *lin, int samples)
+{
+	short s;
+	int x;
+#if !defined(CONFIG_CALC_XLAW) && \
+    LINUX_VERSION_CODE >= KERNEL_VERSION(5, 0, 0)
+	const u_char *const lin2x = chan->lin2x;
+
+	if (!user_access_begin(lin, samples * sizeof(*lin)))
+		return -EFAULT;
+	for (x = 0; x < samples; x++) {
+		unsafe_get_user(s, &lin[x], efault);
+		xb[x] = lin2x[((unsigned short)s) >> 2];
+	}
+	user_access_end();
+	return 0;
+efault:
+	user_access_end();
+	return -EFAULT;
+#else
+	for (x = 0; x < samples; x++) {
+		if (get_user(s, &lin[x]))
+			return -EFAULT;
+		xb[x] = DAHDI_LIN2X(s, chan);
+	}
+	return 0;
+#endif
+}
+
+/**
+ * dahdi_chan_copy_writebuf() - Fill an empty write buffer from user space.
+ * @res:	The buffer, as returned by dahdi_chan_write_ready().
+ *
+ * Returns the number of bytes taken, or -EFAULT.
+ */
+static ssize_t dahdi_chan_copy_writebuf(struct dahdi_chan *chan, int res,
+					const char __user *usrbuf,
+					size_t count)
+{
+	unsigned long flags;
+	int amnt, oldbuf, x;
 
 	amnt = count;
 	if (chan->flags & DAHDI_FLAG_LINEAR) {
@@ -2605,23 +3901,11 @@ static ssize_t dahdi_chan_write(struct file *file, const char __user *usrbuf,
 
 	if (amnt) {
 		if (chan->flags & DAHDI_FLAG_LINEAR) {
-			/* There seems to be a max stack size, so we have
-			   to do this in smaller pieces */
-			short lindata[128];
-			int left = amnt >> 1; /* amnt is in bytes */
-			int pos = 0;
-			int pass;
-			while (left) {
-				pass = left;
-				if (pass > 128)
-					pass = 128;
-				if (copy_from_user(lindata, usrbuf + (pos << 1), pass << 1)) {
-					return -EFAULT;
-				}
-				left -= pass;
-				for (x = 0; x < pass; x++)
-					chan->writebuf[res][x + pos] = DAHDI_LIN2X(lindata[x], chan);
-				pos += pass;
+			/* amnt is in bytes */
+			if (dahdi_lin2x_user(chan, chan->writebuf[res],
+					     (const short __user *)usrbuf,
+					     amnt >> 1)) {
+				return -EFAULT;
 			}
 			chan->writen[res] = amnt >> 1;
 		} else {
@@ -2674,19 +3958,71 @@ static ssize_t dahdi_chan_write(struct file *file, const char __user *usrbuf,
 		}
 
 #ifdef BUFFER_DEBUG
-		if ((chan->statcount <= 0) || (amnt != 128) || (num_filled_bufs(chan) != chan->lastnumbufs)) {
-			printk("amnt: %d Number of filled buffers: %d\n", amnt, num_filled_bufs(chan));
-			chan->statcount = 32000;
-			chan->lastnumbufs = num_filled_bufs(chan);
-		}
+		if ((chan->statcount <= 0) || (amnt != 128) || (num_filled_bufs(chan) != chan->lastnumbufs)) {
+			printk("amnt: %d Number of filled buffers: %d\n", amnt, num_filled_bufs(chan));
+			chan->statcount = 32000;
+			chan->lastnumbufs = num_filled_bufs(chan);
+		}
+#endif
+
+		spin_unlock_irqrestore(&chan->lock, flags);
+
+		if (chan->flags & DAHDI_FLAG_NOSTDTXRX && chan->span->ops->hdlc_hard_xmit)
+			chan->span->ops->hdlc_hard_xmit(chan);
+	}
+	return amnt;
+}
+
+static ssize_t dahdi_chan_write(struct file *file, const char __user *usrbuf,
+				size_t count, loff_t *ppos)
+{
+	struct dahdi_chan *chan = file->private_data;
+	int res, rv;
+
+	/* Make sure count never exceeds 65k, and make sure it's unsigned */
+	count &= 0xffff;
+
+	if (unlikely(!chan)) {
+		/*
+		 * This should never happen. Surprise device removal
+		 * should lead us to the nodev_* file_operations
+		 */
+		msleep(5);
+		module_printk(KERN_ERR, "%s: NODEV\n", __func__);
+		return -ENODEV;
+	}
+
+	if (unlikely(count < 1))
+		return -EINVAL;
+
+	if (unlikely(!test_bit(DAHDI_FLAGBIT_REGISTERED, &chan->flags)))
+		return -ENODEV;
+
+	for (;;) {
+		res = dahdi_chan_write_ready(chan);
+		if (res != -EAGAIN)
+			break;
+		if (file->f_flags & O_NONBLOCK) {
+#ifdef BUFFER_DEBUG
+			printk("Error: Nonblock\n");
 #endif
+			return -EAGAIN;
+		}
 
-		spin_unlock_irqrestore(&chan->lock, flags);
-
-		if (chan->flags & DAHDI_FLAG_NOSTDTXRX && chan->span->ops->hdlc_hard_xmit)
-			chan->span->ops->hdlc_hard_xmit(chan);
+		/* Wake up when room in the write queue is available or when
+		 * the board driver unregistered the channel. */
+		rv = wait_event_interruptible(chan->waitq,
+			(!chan->file->private_data || chan->inwritebuf > -1));
+		if (rv)
+			return rv;
+		if (unlikely(!chan->file->private_data))
+			return -ENODEV;
 	}
-	return amnt;
+
+	if (res < 0)
+		return res;
+
+	return dahdi_chan_copy_writebuf(chan, res, usrbuf, count);
 }
 
 static int dahdi_ctl_open(struct file *file)
@@ -2703,7 +4039,28 @@ static int dahdi_chan_open(struct file *file)
 
 static int dahdi_ctl_release(struct file *file)
 {
-	/* Nothing to do */
+	struct dahdi_span_eventfd *notify, *next;
+	struct dahdi_span *s;
+	LIST_HEAD(stale);
+
+	/* Detach any eventfds this file attached with DAHDI_SPAN_NOTIFY */
+	mutex_lock(&registration_mutex);
+	list_for_each_entry(s, &span_list, spans_node) {
+		notify = rcu_dereference_protected(s->notify,
+					lockdep_is_held(&registration_mutex));
+		if (!notify || (notify->owner != file))
+			continue;
+		RCU_INIT_POINTER(s->notify, NULL);
+		list_add(&notify->node, &stale);
+	}
+	mutex_unlock(&registration_mutex);
+
+	if (list_empty(&stale))
+		return 0;
+
+	synchronize_rcu();
+	list_for_each_entry_safe(notify, next, &stale, node)
+		dahdi_span_notify_free(notify);
 	return 0;
 }
 
@@ -3045,13 +4402,11 @@ static int initialize_channel(struct dahdi_chan *chan)
 		chan->ringcadence[1] = DAHDI_RINGOFFTIME;
 	}
 
-	if (ec_state) {
-		ec_state->ops->echocan_free(chan, ec_state);
-		release_echocan(ec_current);
-	}
-
 	spin_unlock_irqrestore(&chan->lock, flags);
 
+	if (ec_state)
+		free_echocan(chan, ec_state, ec_current);
+
 	set_tone_zone(chan, DEFAULT_TONE_ZONE);
 
 	if (rxgain)
@@ -3138,6 +4493,8 @@ static int dahdi_specchan_open(struct file *file)
 		spin_lock_irqsave(&chan->lock, flags);
 		if (is_pseudo_chan(chan))
 			chan->flags |= DAHDI_FLAG_AUDIO;
+		else
+			dahdi_chan_set_active(chan);
 		chan->file = file;
 		file->private_data = chan;
 		/* Since we know we're a channel now, we can
@@ -3496,6 +4853,7 @@ static int dahdi_ioctl_loadzone(unsigned long data)
 			tone_type = REGULAR_TONE;
 
 			t = work->samples[x] = ptr;
+			z->ntones++;
 
 			space -= sizeof(*t);
 			ptr = (char *) ptr + sizeof(*t);
@@ -3600,6 +4958,8 @@ static int dahdi_ioctl_loadzone(unsigned long data)
 			work->samples[x]->next = work->samples[work->next[x]];
 	}
 
+	tone_zone_for_each_tone(z, dahdi_tone_build_wave);
+
 	z->num = work->th.zone;
 
 	/* After we call dahdi_register_tone_zone, the only safe way to free
@@ -3621,17 +4981,6 @@ error_exit:
 	return res;
 }
 
-void dahdi_init_tone_state(struct dahdi_tone_state *ts, struct dahdi_tone *zt)
-{
-	ts->v1_1 = 0;
-	ts->v2_1 = zt->init_v2_1;
-	ts->v3_1 = zt->init_v3_1;
-	ts->v1_2 = 0;
-	ts->v2_2 = zt->init_v2_2;
-	ts->v3_2 = zt->init_v3_2;
-	ts->modulate = zt->modulate;
-}
-
 struct dahdi_tone *dahdi_mf_tone(const struct dahdi_chan *chan, char digit, int digitmode)
 {
 	unsigned int tone_index;
@@ -4709,6 +6058,102 @@ static int dahdi_ioctl_conflink(struct file *file, unsigned long data)
 #endif
 
 
+/**
+ * dahdi_iovec_rw() - Carry out one entry of a DAHDI_MULTI_IO request.
+ * @vec:	The entry. readres and writeres are filled in.
+ *
+ * Returns true if anything was read or written.
+ */
+static bool dahdi_iovec_rw(struct dahdi_iovec *vec)
+{
+	struct file *file;
+	struct dahdi_chan *chan;
+	int res;
+
+	vec->readres = 0;
+	vec->writeres = 0;
+
+	file = fget(vec->fd);
+	if (!file) {
+		vec->readres = vec->writeres = -EBADF;
+		return false;
+	}
+
+	chan = file->private_data;
+	if ((file->f_op != &dahdi_chan_fops) || !chan) {
+		res = -EBADF;
+	} else if (!test_bit(DAHDI_FLAGBIT_REGISTERED, &chan->flags)) {
+		res = -ENODEV;
+	} else {
+		res = 0;
+	}
+	if (res) {
+		vec->readres = vec->writeres = res;
+		fput(file);
+		return false;
+	}
+
+	if (vec->flags & DAHDI_IOVEC_READ) {
+		res = dahdi_chan_read_ready(chan);
+		if (res >= 0 && (vec->readlen & 0xffff)) {
+			res = dahdi_chan_copy_readbuf(chan, res,
+				(char __user *)(unsigned long)vec->readbuf,
+				vec->readlen & 0xffff);
+		} else if (res >= 0) {
+			res = -EINVAL;
+		}
+		vec->readres = res;
+	}
+
+	if (vec->flags & DAHDI_IOVEC_WRITE) {
+		res = dahdi_chan_write_ready(chan);
+		if (res >= 0 && (vec->writelen & 0xffff)) {
+			res = dahdi_chan_copy_writebuf(chan, res,
+				(const char __user *)(unsigned long)vec->writebuf,
+				vec->writelen & 0xffff);
+		} else if (res >= 0) {
+			res = -EINVAL;
+		}
+		vec->writeres = res;
+	}
+
+	fput(file);
+	return (vec->readres > 0) || (vec->writeres > 0);
+}
+
+/**
+ * dahdi_ioctl_multi_io() - Read and write a set of channels in one call.
+ *
+ * This saves a media thread servicing many channels a pair of system calls
+ * per channel every packetization interval. See DAHDI_MULTI_IO in user.h.
+ */
+static int dahdi_ioctl_multi_io(unsigned long data)
+{
+	struct dahdi_multi_io mio;
+	struct dahdi_iovec vec;
+	struct dahdi_iovec __user *uvec;
+	int done = 0;
+	u32 i;
+
+	if (copy_from_user(&mio, (void __user *)data, sizeof(mio)))
+		return -EFAULT;
+	if (mio.count > DAHDI_MAX_IOVECS)
+		return -EINVAL;
+
+	uvec = (struct dahdi_iovec __user *)(unsigned long)mio.iov;
+	for (i = 0; i < mio.count; i++) {
+		if (copy_from_user(&vec, &uvec[i], sizeof(vec)))
+			return -EFAULT;
+		if (dahdi_iovec_rw(&vec))
+			++done;
+		if (put_user(vec.readres, &uvec[i].readres) ||
+		    put_user(vec.writeres, &uvec[i].writeres))
+			return -EFAULT;
+	}
+
+	return done;
+}
+
 static int dahdi_common_ioctl(struct file *file, unsigned int cmd,
 			      unsigned long data)
 {
@@ -4741,6 +6186,9 @@ static int dahdi_common_ioctl(struct file *file, unsigned int cmd,
 	case DAHDI_CONFLINK:
 		return dahdi_ioctl_conflink(file, data);
 
+	case DAHDI_MULTI_IO:
+		return dahdi_ioctl_multi_io(data);
+
 	default:
 		return -ENOTTY;
 	}
@@ -4984,6 +6432,18 @@ static int dahdi_ioctl_chanconfig(struct file *file, unsigned long data)
 				dev_to_hdlc(chan->hdlcnetdev->netdev)->xmit = dahdi_xmit;
 				spin_unlock_irqrestore(&chan->lock, flags);
 				/* Briefly restore interrupts while we register the device */
+#ifdef CONFIG_DAHDI_NET_NAPI
+				/* free_netdev() deletes it again */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 1, 0)
+				netif_napi_add(chan->hdlcnetdev->netdev,
+					       &chan->hdlcnetdev->napi,
+					       dahdi_net_poll);
+#else
+				netif_napi_add(chan->hdlcnetdev->netdev,
+					       &chan->hdlcnetdev->napi,
+					       dahdi_net_poll, NAPI_POLL_WEIGHT);
+#endif
+#endif
 				res = dahdi_register_hdlc_device(chan->hdlcnetdev->netdev, ch.netdev_name);
 				spin_lock_irqsave(&chan->lock, flags);
 			} else {
@@ -5020,6 +6480,7 @@ static int dahdi_ioctl_chanconfig(struct file *file, unsigned long data)
 #ifdef CONFIG_DAHDI_DEBUG
 	module_printk(KERN_NOTICE, "Configured channel %s, flags %04lx, sig %04x\n", chan->name, chan->flags, chan->sig);
 #endif
+	dahdi_chan_set_active(chan);
 	spin_unlock_irqrestore(&chan->lock, flags);
 
 	return res;
@@ -5546,6 +7007,111 @@ retry_check:
 	return res;
 }
 
+static int dahdi_ioctl_span_notify(struct file *file, unsigned long data)
+{
+	struct dahdi_span_notify sn;
+	struct dahdi_span_eventfd *notify = NULL;
+	struct dahdi_span *s;
+	int res;
+
+	if (copy_from_user(&sn, (void __user *)data, sizeof(sn)))
+		return -EFAULT;
+
+	s = span_find_and_get(sn.spanno);
+	if (!s)
+		return -EINVAL;
+
+	if (sn.fd >= 0) {
+		notify = kzalloc(sizeof(*notify) +
+				 BITS_TO_LONGS(s->channels) * sizeof(long),
+				 GFP_KERNEL);
+		if (!notify) {
+			put_span(s);
+			return -ENOMEM;
+		}
+		notify->ctx = eventfd_ctx_fdget(sn.fd);
+		if (IS_ERR(notify->ctx)) {
+			res = PTR_ERR(notify->ctx);
+			kfree(notify);
+			put_span(s);
+			return res;
+		}
+		notify->owner = file;
+		notify->channels = s->channels;
+	}
+
+	mutex_lock(&registration_mutex);
+	if (test_bit(DAHDI_FLAGBIT_REGISTERED, &s->flags)) {
+		_dahdi_span_set_notify(s, notify);
+		res = 0;
+	} else {
+		res = -ENODEV;
+	}
+	mutex_unlock(&registration_mutex);
+
+	if (res && notify)
+		dahdi_span_notify_free(notify);
+	put_span(s);
+	return res;
+}
+
+static int dahdi_ioctl_span_ready(unsigned long data)
+{
+	struct dahdi_span_ready sr;
+	struct dahdi_span_eventfd *notify;
+	struct dahdi_span *s;
+	u32 *map;
+	unsigned int len;
+	int x, res = 0;
+
+	if (copy_from_user(&sr, (void __user *)data, sizeof(sr)))
+		return -EFAULT;
+
+	s = span_find_and_get(sr.spanno);
+	if (!s)
+		return -EINVAL;
+
+	len = DIV_ROUND_UP(s->channels, 32) * sizeof(u32);
+	if (sr.len < len) {
+		/* Fetching would clear bits that could not be handed back */
+		put_span(s);
+		sr.len = len;
+		if (copy_to_user((void __user *)data, &sr, sizeof(sr)))
+			return -EFAULT;
+		return -ENOSPC;
+	}
+	map = kzalloc(len, GFP_KERNEL);
+	if (!map) {
+		put_span(s);
+		return -ENOMEM;
+	}
+
+	rcu_read_lock();
+	notify = rcu_dereference(s->notify);
+	if (notify) {
+		for (x = 0; x < notify->channels; x++) {
+			if (test_and_clear_bit(x, notify->ready))
+				map[x / 32] |= 1U << (x % 32);
+		}
+	} else {
+		res = -EINVAL;
+	}
+	rcu_read_unlock();
+	put_span(s);
+
+	if (!res && copy_to_user((void __user *)(unsigned long)sr.map, map,
+				 len))
+		res = -EFAULT;
+	kfree(map);
+	if (res)
+		return res;
+
+	sr.len = len;
+	if (copy_to_user((void __user *)data, &sr, sizeof(sr)))
+		return -EFAULT;
+	return 0;
+}
+
 static int
 dahdi_ctl_ioctl(struct file *file, unsigned int cmd, unsigned long data)
 {
@@ -5581,6 +7147,10 @@ dahdi_ctl_ioctl(struct file *file, unsigned int cmd, unsigned long data)
 	case DAHDI_DYNAMIC_CREATE:
 	case DAHDI_DYNAMIC_DESTROY:
 		return dahdi_ioctl_dynamic(cmd, data);
+	case DAHDI_SPAN_NOTIFY:
+		return dahdi_ioctl_span_notify(file, data);
+	case DAHDI_SPAN_READY:
+		return dahdi_ioctl_span_ready(data);
 	case DAHDI_EC_LICENSE_CHALLENGE:
 	case DAHDI_EC_LICENSE_RESPONSE:
 		if (dahdi_hpec_ioctl) {
@@ -5663,6 +7233,7 @@ static int dahdi_ioctl_setconf(struct file *file, unsigned long data)
 	unsigned long flags;
 	unsigned int confmode;
 	int oldconf;
+	int res;
 	enum {NONE, ENABLE_HWPREEC, DISABLE_HWPREEC} preec = NONE;
 
 	if (copy_from_user(&conf, (void __user *)data, sizeof(conf)))
@@ -5697,6 +7268,10 @@ static int dahdi_ioctl_setconf(struct file *file, unsigned long data)
 		return -EINVAL;
 	dahdi_check_conf(conf.confno);
 	conf.chan = chan->channo;  /* return with real channel # */
+retry:
+	res = conf_pool_reserve();
+	if (res)
+		return res;
 	spin_lock_irqsave(&chan_lock, flags);
 	spin_lock(&chan->lock);
 	if (conf.confno == -1)
@@ -5706,6 +7281,12 @@ static int dahdi_ioctl_setconf(struct file *file, unsigned long data)
 		spin_unlock(&chan->lock);
 		spin_unlock_irqrestore(&chan_lock, flags);
 		return -EBUSY;
+	}
+	/* Someone else used up the room conf_pool_reserve() made */
+	if (!conf_pool_has_room(nr_live_confs + 1)) {
+		spin_unlock(&chan->lock);
+		spin_unlock_irqrestore(&chan_lock, flags);
+		goto retry;
 	}
 	  /* if changing confs, clear last added info */
 	if (conf.confno != chan->confna) {
@@ -5737,8 +7318,19 @@ static int dahdi_ioctl_setconf(struct file *file, unsigned long data)
 	     confmode == DAHDI_CONF_CONFANNMON ||
 	     confmode == DAHDI_CONF_REALANDPSEUDO)) {
 		/* Get alias */
-		chan->_confn = dahdi_get_conf_alias(conf.confno);
+		res = dahdi_get_conf_alias(conf.confno);
+		if (res < 0) {
+			chan->confna = 0;
+			chan->conf_chan = NULL;
+			chan->confmode = 0;
+			spin_unlock(&chan->lock);
+			spin_unlock_irqrestore(&chan_lock, flags);
+			dahdi_check_conf(oldconf);
+			return res;
+		}
+		chan->_confn = res;
 	}
+	dahdi_chan_set_active(chan);
 
 	spin_unlock(&chan->lock);
 
@@ -5770,7 +7362,7 @@ static int dahdi_ioctl_setconf(struct file *file, unsigned long data)
 	spin_unlock_irqrestore(&chan_lock, flags);
 
 	if (ENABLE_HWPREEC == preec) {
-		int res = dahdi_enable_hw_preechocan(conf_chan);
+		res = dahdi_enable_hw_preechocan(conf_chan);
 		if (res) {
 			spin_lock_irqsave(&chan_lock, flags);
 			spin_lock(&conf_chan->lock);
@@ -6003,7 +7595,7 @@ static int dahdi_ioctl_rxmirror(struct file *file, unsigned long data)
 	spin_lock_irqsave(&srcmirror->lock, flags);
 	if (srcmirror->rxmirror == NULL)
 		srcmirror->rxmirror = chan;
-
+	dahdi_chan_set_active(srcmirror);
 	spin_unlock_irqrestore(&srcmirror->lock, flags);
 	if (srcmirror->rxmirror != chan) {
 		module_printk(KERN_INFO, "Chan %d cannot be rxmirrored, " \
@@ -6047,6 +7639,7 @@ static int dahdi_ioctl_txmirror(struct file *file, unsigned long data)
 	srcmirror->txmirror = chan;
 	if (srcmirror->txmirror == NULL)
 		srcmirror->txmirror = chan;
+	dahdi_chan_set_active(srcmirror);
 	spin_unlock_irqrestore(&srcmirror->lock, flags);
 
 	if (srcmirror->txmirror != chan) {
@@ -6134,6 +7727,10 @@ dahdi_chanandpseudo_ioctl(struct file *file, unsigned int cmd,
 		/* return block size */
 		put_user(chan->blocksize, (int __user *)data);
 		break;
+	case DAHDI_SET_RING:
+		if (get_user(j, (int __user *)data))
+			return -EFAULT;
+		return dahdi_set_ring(chan, j);
 	case DAHDI_SET_BLOCKSIZE:  /* set blocksize */
 		get_user(j, (int __user *)data);
 		/* cannot be larger than max amount */
@@ -6272,11 +7869,7 @@ dahdi_chanandpseudo_ioctl(struct file *file, unsigned int cmd,
 		if (!(chan->flags & DAHDI_FLAG_AUDIO))
 			return -EINVAL;
 
-		if (j)
-			chan->flags |= DAHDI_FLAG_LINEAR;
-		else
-			chan->flags &= ~DAHDI_FLAG_LINEAR;
-		break;
+		return dahdi_set_linear(chan, j);
 	case DAHDI_SETCADENCE:
 		if (data) {
 			/* Use specific ring cadence */
@@ -6354,6 +7947,253 @@ static void do_ppp_calls(unsigned long data)
 }
 #endif
 
+#ifdef CONFIG_DAHDI_TONEDETECT
+
+/**
+ * struct dahdi_span_tones - Software tone detection of a span.
+ * @lock:	Protects the banks against dahdi_tone_span().
+ * @bank:	One tone bank per mode, created when first asked for.
+ * @chans:	The channel of each lane of the matching @bank.
+ * @events:	Room for the events of one bank.
+ */
+struct dahdi_span_tones {
+	spinlock_t lock;
+	struct dahdi_tone_bank *bank[DAHDI_TONE_MODES];
+	struct dahdi_chan **chans[DAHDI_TONE_MODES];
+	int *events;
+};
+
+/* Serializes the DAHDI_TONEDETECT calls and span->tones changes */
+static DEFINE_MUTEX(tonedetect_mutex);
+
+#define DAHDI_TONEDETECT_MF	(DAHDI_TONEDETECT_MFR1 | \
+				 DAHDI_TONEDETECT_MFR2_FWD | \
+				 DAHDI_TONEDETECT_MFR2_BACK)
+
+static enum dahdi_tone_mode tonedetect_mode(int flags)
+{
+	if (flags & DAHDI_TONEDETECT_MFR1)
+		return DAHDI_TONE_MFR1;
+	if (flags & DAHDI_TONEDETECT_MFR2_FWD)
+		return DAHDI_TONE_MFR2_FWD;
+	if (flags & DAHDI_TONEDETECT_MFR2_BACK)
+		return DAHDI_TONE_MFR2_BACK;
+	return DAHDI_TONE_DTMF;
+}
+
+static void span_free_tones(struct dahdi_span *span)
+{
+	struct dahdi_span_tones *t;
+	int x;
+
+	mutex_lock(&tonedetect_mutex);
+	t = rcu_dereference_protected(span->tones,
+				      lockdep_is_held(&tonedetect_mutex));
+	RCU_INIT_POINTER(span->tones, NULL);
+	for (x = 0; x < span->channels; x++)
+		span->chans[x]->tonedetect = 0;
+	mutex_unlock(&tonedetect_mutex);
+
+	if (!t)
+		return;
+	synchronize_rcu();
+	for (x = 0; x < DAHDI_TONE_MODES; x++) {
+		dahdi_tone_bank_destroy(t->bank[x]);
+		kfree(t->chans[x]);
+	}
+	kfree(t->events);
+	kfree(t);
+}
+
+/**
+ * dahdi_tonedetect_set() - Start or stop software tone detection.
+ * @chan:	A channel of a span.
+ * @flags:	DAHDI_TONEDETECT_* flags. Detection is stopped unless
+ *		DAHDI_TONEDETECT_ON is set.
+ */
+static int dahdi_tonedetect_set(struct dahdi_chan *chan, int flags)
+{
+	struct dahdi_span *const span = chan->span;
+	const enum dahdi_tone_mode mode = tonedetect_mode(flags);
+	struct dahdi_span_tones *t;
+	unsigned long irqflags;
+	int res = 0;
+
+	if (!(flags & DAHDI_TONEDETECT_ON))
+		flags = 0;
+
+	mutex_lock(&tonedetect_mutex);
+	if (chan->tonedetect == flags)
+		goto out;
+
+	t = rcu_dereference_protected(span->tones,
+				      lockdep_is_held(&tonedetect_mutex));
+	if (flags && !t) {
+		t = kzalloc(sizeof(*t), GFP_KERNEL);
+		if (t)
+			t->events = kcalloc(span->channels,
+					    sizeof(*t->events), GFP_KERNEL);
+		if (!t || !t->events) {
+			kfree(t);
+			res = -ENOMEM;
+			goto out;
+		}
+		spin_lock_init(&t->lock);
+		rcu_assign_pointer(span->tones, t);
+	}
+	if (flags && !t->bank[mode]) {
+		struct dahdi_tone_bank *bank;
+		struct dahdi_chan **chans;
+
+		bank = dahdi_tone_bank_create(mode, span->channels);
+		chans = kcalloc(span->channels, sizeof(*chans), GFP_KERNEL);
+		if (!bank || !chans) {
+			dahdi_tone_bank_destroy(bank);
+			kfree(chans);
+			res = -ENOMEM;
+			goto out;
+		}
+		spin_lock_irqsave(&t->lock, irqflags);
+		t->bank[mode] = bank;
+		t->chans[mode] = chans;
+		spin_unlock_irqrestore(&t->lock, irqflags);
+	}
+
+	spin_lock_irqsave(&t->lock, irqflags);
+	if (chan->tonedetect) {
+		const enum dahdi_tone_mode old = tonedetect_mode(chan->tonedetect);
+		struct dahdi_chan **const chans = t->chans[old];
+		const unsigned int last =
+			dahdi_tone_bank_lanes(t->bank[old]) - 1;
+		unsigned int l;
+
+		for (l = 0; chans[l] != chan; l++)
+			;
+		/* The bank moves its last lane into the hole as well */
+		dahdi_tone_bank_remove(t->bank[old], l);
+		chans[l] = chans[last];
+		chans[last] = NULL;
+	}
+	chan->tonedetect = 0;
+	if (flags) {
+		/* Can't fail, the bank has a lane for every channel */
+		const int l = dahdi_tone_bank_add(t->bank[mode]);
+
+		t->chans[mode][l] = chan;
+		chan->tonedetect = flags;
+	}
+	spin_unlock_irqrestore(&t->lock, irqflags);
+out:
+	mutex_unlock(&tonedetect_mutex);
+	return res;
+}
+
+/*
+ * Turn off the hardware DTMF detector of the span for @chan, if it has one
+ * that can be set from the kernel.
+ */
+static void dahdi_tonedetect_hw_off(struct dahdi_chan *chan)
+{
+	if (chan->span->ops->tonedetect)
+		chan->span->ops->tonedetect(chan, 0);
+}
+
+static int ioctl_tonedetect(struct dahdi_chan *chan, unsigned long data)
+{
+	int j;
+	int res;
+
+	if (get_user(j, (int __user *)data))
+		return -EFAULT;
+
+	/* Hardware detectors only know about DTMF. If the span has one it
+	 * is used, and the span gets -ENOSYS back when it doesn't. For MF it
+	 * must not keep reporting DTMF alongside the software detector. */
+	if (j & DAHDI_TONEDETECT_MF) {
+		dahdi_tonedetect_hw_off(chan);
+	} else if (chan->span->ops->ioctl) {
+		res = chan->span->ops->ioctl(chan, DAHDI_TONEDETECT, data);
+		if (res != -ENOSYS && res != -ENOTTY) {
+			if (!res)
+				dahdi_tonedetect_set(chan, 0);
+			return res;
+		}
+	}
+	return dahdi_tonedetect_set(chan, j);
+}
+
+/**
+ * dahdi_tone_span() - Look for digits in the received audio of a span.
+ * @span:	The span
+ *
+ * Runs each tone bank of the span over the chunk just received, queues
+ * DAHDI_EVENT_DTMFDOWN / DAHDI_EVENT_DTMFUP for the digits found and
+ * silences channels that asked for DAHDI_TONEDETECT_MUTE while a digit is
+ * present.
+ *
+ * Call with local interrupts disabled.
+ */
+static void dahdi_tone_span(struct dahdi_span *span)
+{
+	struct dahdi_span_tones *t;
+	short lin[DAHDI_CHUNKSIZE];
+	unsigned int l, n;
+	int m, k;
+
+	rcu_read_lock();
+	t = rcu_dereference(span->tones);
+	if (!t) {
+		rcu_read_unlock();
+		return;
+	}
+
+	spin_lock(&t->lock);
+	for (m = 0; m < DAHDI_TONE_MODES; m++) {
+		struct dahdi_tone_bank *const bank = t->bank[m];
+
+		if (!bank)
+			continue;
+		n = dahdi_tone_bank_lanes(bank);
+		if (!n)
+			continue;
+
+		for (l = 0; l < n; l++) {
+			const struct dahdi_chan *const chan = t->chans[m][l];
+
+			for (k = 0; k < DAHDI_CHUNKSIZE; k++)
+				lin[k] = DAHDI_XLAW(chan->readchunk[k], chan);
+			dahdi_tone_bank_put(bank, l, lin);
+		}
+		dahdi_tone_bank_process(bank, t->events);
+
+		for (l = 0; l < n; l++) {
+			struct dahdi_chan *const chan = t->chans[m][l];
+			const bool mute =
+				(chan->tonedetect & DAHDI_TONEDETECT_MUTE) &&
+				dahdi_tone_bank_present(bank, l);
+
+			if (!t->events[l] && !mute)
+				continue;
+			spin_lock(&chan->lock);
+			if (t->events[l])
+				__qevent(chan, t->events[l]);
+			if (mute)
+				memset(chan->readchunk, DAHDI_LIN2X(0, chan),
+				       DAHDI_CHUNKSIZE);
+			spin_unlock(&chan->lock);
+		}
+	}
+	spin_unlock(&t->lock);
+	rcu_read_unlock();
+}
+
+#else
+
+static inline void span_free_tones(struct dahdi_span *span) { }
+static inline void dahdi_tone_span(struct dahdi_span *span) { }
+
+#endif /* CONFIG_DAHDI_TONEDETECT */
+
 static int
 ioctl_echocancel(struct dahdi_chan *chan, struct dahdi_echocanparams *ecp,
 		 const void __user *data)
@@ -6376,10 +8216,8 @@ ioctl_echocancel(struct dahdi_chan *chan, struct dahdi_echocanparams *ecp,
 		ec_current = chan->ec_current;
 		chan->ec_current = NULL;
 		spin_unlock_irqrestore(&chan->lock, flags);
-		if (ec_state) {
-			ec_state->ops->echocan_free(chan, ec_state);
-			release_echocan(ec_current);
-		}
+		if (ec_state)
+			free_echocan(chan, ec_state, ec_current);
 		mutex_unlock(&chan->mutex);
 		return 0;
 	}
@@ -6405,10 +8243,8 @@ ioctl_echocancel(struct dahdi_chan *chan, struct dahdi_echocanparams *ecp,
 	ec_current = chan->ec_current;
 	chan->ec_current = NULL;
 	spin_unlock_irqrestore(&chan->lock, flags);
-	if (ec_state) {
-		ec_state->ops->echocan_free(chan, ec_state);
-		release_echocan(ec_current);
-	}
+	if (ec_state)
+		free_echocan(chan, ec_state, ec_current);
 
 	switch (ecp->tap_length) {
 	case 32:
@@ -6458,6 +8294,7 @@ ioctl_echocancel(struct dahdi_chan *chan, struct dahdi_echocanparams *ecp,
 		chan->ec_current = ec_current;
 		chan->ec_state = ec;
 		ec->status.mode = ECHO_MODE_ACTIVE;
+		ec->status.nlp_request = 0;
 		if (!ec->features.CED_tx_detect) {
 			echo_can_disable_detector_init(&chan->ec_state->txecdis);
 		}
@@ -6467,11 +8304,41 @@ ioctl_echocancel(struct dahdi_chan *chan, struct dahdi_echocanparams *ecp,
 		spin_unlock_irqrestore(&chan->lock, flags);
 	}
 
-exit_with_free:
-	mutex_unlock(&chan->mutex);
-	kfree(params);
+exit_with_free:
+	mutex_unlock(&chan->mutex);
+	kfree(params);
+
+	return ret;
+}
+
+/* dahdi_echocan_state.status.nlp_request */
+#define DAHDI_EC_NLP_DISABLE	1
+#define DAHDI_EC_NLP_ENABLE	2
+
+/*
+ * Turn the NLP of the echocan of @chan on or off. Software echocans may be
+ * running outside chan->lock, so the change is left for
+ * dahdi_ec_apply_nlp() to make before their next chunk.
+ *
+ * Call with chan->lock held.
+ */
+static void dahdi_ec_request_nlp(struct dahdi_chan *chan, unsigned int enable)
+{
+	struct dahdi_echocan_state *const ec = chan->ec_state;
+
+	if (ec->ops->echocan_process || ec->ops->echocan_process_batch)
+		ec->status.nlp_request = enable ? DAHDI_EC_NLP_ENABLE :
+						  DAHDI_EC_NLP_DISABLE;
+	else
+		ec->ops->echocan_NLP_toggle(ec, enable);
+}
 
-	return ret;
+/* Make an NLP change asked for of @ec, from where it is run */
+static inline void dahdi_ec_apply_nlp(struct dahdi_echocan_state *ec,
+				      u32 request)
+{
+	if (request)
+		ec->ops->echocan_NLP_toggle(ec, request == DAHDI_EC_NLP_ENABLE);
 }
 
 static void set_echocan_fax_mode(struct dahdi_chan *chan, unsigned int channo, const char *reason, unsigned int enable)
@@ -6492,7 +8359,7 @@ static void set_echocan_fax_mode(struct dahdi_chan *chan, unsigned int channo, c
 		} else if (chan->ec_state->features.NLP_toggle) {
 			module_printk(KERN_NOTICE, "Disabled echo canceller NLP because of %s on channel %d\n", reason, channo);
 			dahdi_qevent_nolock(chan, DAHDI_EVENT_EC_NLP_DISABLED);
-			chan->ec_state->ops->echocan_NLP_toggle(chan->ec_state, 0);
+			dahdi_ec_request_nlp(chan, 0);
 			chan->ec_state->status.mode = ECHO_MODE_FAX;
 		} else {
 			module_printk(KERN_NOTICE, "Idled echo canceller because of %s on channel %d\n", reason, channo);
@@ -6515,7 +8382,7 @@ static void set_echocan_fax_mode(struct dahdi_chan *chan, unsigned int channo, c
 		} else if (chan->ec_state->features.NLP_toggle) {
 			module_printk(KERN_NOTICE, "Enabled echo canceller NLP because of %s on channel %d\n", reason, channo);
 			dahdi_qevent_nolock(chan, DAHDI_EVENT_EC_NLP_ENABLED);
-			chan->ec_state->ops->echocan_NLP_toggle(chan->ec_state, 1);
+			dahdi_ec_request_nlp(chan, 1);
 			chan->ec_state->status.mode = ECHO_MODE_ACTIVE;
 		} else {
 			module_printk(KERN_NOTICE, "Activated echo canceller because of %s on channel %d\n", reason, channo);
@@ -6697,6 +8564,9 @@ static int dahdi_chan_ioctl(struct file *file, unsigned int cmd, unsigned long d
 	case DAHDI_HDLCRAWMODE:
 		if (chan->sig != DAHDI_SIG_CLEAR)	return (-EINVAL);
 		get_user(j, (int __user *)data);
+		/* The rings carry audio only */
+		if (j && chan->ring)
+			return -EBUSY;
 		chan->flags &= ~(DAHDI_FLAG_AUDIO | DAHDI_FLAG_HDLC | DAHDI_FLAG_FCS);
 		if (j) {
 			chan->flags |= DAHDI_FLAG_HDLC;
@@ -6707,6 +8577,8 @@ static int dahdi_chan_ioctl(struct file *file, unsigned int cmd, unsigned long d
 	case DAHDI_HDLCFCSMODE:
 		if (chan->sig != DAHDI_SIG_CLEAR)	return (-EINVAL);
 		get_user(j, (int __user *)data);
+		if (j && chan->ring)
+			return -EBUSY;
 		chan->flags &= ~(DAHDI_FLAG_AUDIO | DAHDI_FLAG_HDLC | DAHDI_FLAG_FCS);
 		if (j) {
 			chan->flags |= DAHDI_FLAG_HDLC | DAHDI_FLAG_FCS;
@@ -6755,6 +8627,12 @@ static int dahdi_chan_ioctl(struct file *file, unsigned int cmd, unsigned long d
 			return ret;
 		break;
 	}
+#ifdef CONFIG_DAHDI_TONEDETECT
+	case DAHDI_TONEDETECT:
+		if (!chan->span)
+			return -ENOSYS;
+		return ioctl_tonedetect(chan, data);
+#endif
 	case DAHDI_ECHOTRAIN:
 		/* get pre-training time from user */
 		get_user(j, (int __user *)data);
@@ -7325,6 +9203,10 @@ static int _dahdi_assign_span(struct dahdi_span *span, unsigned int spanno,
 	for (x = 0; x < span->channels; x++)
 		dahdi_chan_reg(span->chans[x]);
 
+	span_alloc_active_chans(span);
+	span_alloc_tick_stats(span);
+	span_alloc_ec_offload(span);
+
 #ifdef CONFIG_PROC_FS
 	{
 		char tempfile[17];
@@ -7374,6 +9256,9 @@ cleanup:
 		if (test_bit(DAHDI_FLAGBIT_REGISTERED, &chan->flags))
 			dahdi_chan_unreg(chan);
 	}
+	span_free_active_chans(span);
+	span_free_ec_offload(span);
+	span_free_tick_stats(span);
 	return res;
 }
 
@@ -7552,6 +9437,12 @@ static int _dahdi_unassign_span(struct dahdi_span *span)
 	for (x=0;x<span->channels;x++)
 		dahdi_chan_unreg(span->chans[x]);
 
+	span_free_active_chans(span);
+	span_free_ec_offload(span);
+	span_free_tones(span);
+	span_free_tick_stats(span);
+	_dahdi_span_set_notify(span, NULL);
+
 	new_master = master_span; /* FIXME: locking */
 	if (master_span == span)
 		new_master = NULL;
@@ -8050,6 +9941,57 @@ static inline void __dahdi_process_getaudio_chunk(struct dahdi_chan *ss, unsigne
 static void __putbuf_chunk(struct dahdi_chan *ss, unsigned char *rxb,
 			   int bytes);
 
+/* The precomputed table of the current tone in the channel's law, if any */
+static inline const u8 *dahdi_tone_wave(const struct dahdi_chan *ms)
+{
+	const struct dahdi_tone *const zt = ms->curtone;
+
+	if (!zt->wave)
+		return NULL;
+#ifdef CONFIG_CALC_XLAW
+	if (ms->lineartoxlaw == __dahdi_lineartoalaw)
+#else
+	if (ms->lin2x == __dahdi_lin2a)
+#endif
+		return zt->wave + zt->wavelen;
+	return zt->wave;
+}
+
+/**
+ * dahdi_tone_fill() - Write the next samples of the current tone.
+ * @ms:		Channel playing ms->curtone.  Called with ms->lock held.
+ * @txb:	Where to put the samples.
+ * @samples:	How many samples to write.
+ *
+ * Copies out of the tone's precomputed table while there is one to copy
+ * from, then carries on with the oscillator where a one-shot table ends
+ * (or for tones that have no table at all).
+ */
+static inline void dahdi_tone_fill(struct dahdi_chan *ms, u8 *txb,
+				   int samples)
+{
+	struct dahdi_tone *const zt = ms->curtone;
+	const u8 *const wave = dahdi_tone_wave(ms);
+	int x;
+
+	while (wave && samples > 0 && ms->ts.pos < zt->wavelen) {
+		x = min(samples, zt->wavelen - ms->ts.pos);
+		memcpy(txb, wave + ms->ts.pos, x);
+		txb += x;
+		samples -= x;
+		ms->ts.pos += x;
+		if (ms->ts.pos == zt->wavelen) {
+			if (zt->waveloop)
+				ms->ts.pos = 0;
+			else
+				ms->ts = zt->wave_end;
+		}
+	}
+
+	for (x = 0; x < samples; x++)
+		*(txb++) = DAHDI_LIN2X(dahdi_tone_nextsample(&ms->ts, zt), ms);
+}
+
 static inline void __dahdi_getbuf_chunk(struct dahdi_chan *ss, unsigned char *txb)
 {
 
@@ -8065,8 +10007,6 @@ static inline void __dahdi_getbuf_chunk(struct dahdi_chan *ss, unsigned char *tx
 	unsigned char *buf;
 	/* Old buffer number */
 	int oldbuf;
-	/* Linear representation */
-	int getlin;
 	/* How many bytes we need to process */
 	int bytes = DAHDI_CHUNKSIZE, left;
 	bool needtxunderrun = false;
@@ -8083,13 +10023,13 @@ static inline void __dahdi_getbuf_chunk(struct dahdi_chan *ss, unsigned char *tx
 				left = bytes;
 			if (ms->flags & DAHDI_FLAG_HDLC) {
 				/* If this is an HDLC channel we only send a byte of
-				   HDLC. */
-				for(x=0;x<left;x++) {
-					if (fasthdlc_tx_need_data(&ms->txhdlc))
-						/* Load a byte of data only if needed */
-						fasthdlc_tx_load_nocheck(&ms->txhdlc, buf[ms->writeidx[ms->outwritebuf]++]);
-					*(txb++) = fasthdlc_tx_run_nocheck(&ms->txhdlc);
-				}
+				   HDLC for each byte of line, loading data only as
+				   needed. */
+				ms->writeidx[ms->outwritebuf] +=
+					fasthdlc_tx_run_buf(&ms->txhdlc,
+						buf + ms->writeidx[ms->outwritebuf],
+						txb, left);
+				txb += left;
 				bytes -= left;
 			} else {
 				memcpy(txb, buf + ms->writeidx[ms->outwritebuf], left);
@@ -8113,7 +10053,7 @@ static inline void __dahdi_getbuf_chunk(struct dahdi_chan *ss, unsigned char *tx
 						there is something to write */
 						ms->outwritebuf = -1;
 						if (ms->iomask & (DAHDI_IOMUX_WRITE | DAHDI_IOMUX_WRITEEMPTY))
-							wake_up_interruptible(&ms->waitq);
+							dahdi_chan_wake(ms);
 						/* If we're only supposed to start when full, disable the transmitter */
 						if ((ms->txbufpolicy == DAHDI_POLICY_WHEN_FULL) ||
 							(ms->txbufpolicy == DAHDI_POLICY_HALF_FULL))
@@ -8123,7 +10063,7 @@ static inline void __dahdi_getbuf_chunk(struct dahdi_chan *ss, unsigned char *tx
 					if (ms->outwritebuf == ms->inwritebuf) {
 						ms->outwritebuf = oldbuf;
 						if (ms->iomask & (DAHDI_IOMUX_WRITE | DAHDI_IOMUX_WRITEEMPTY))
-							wake_up_interruptible(&ms->waitq);
+							dahdi_chan_wake(ms);
 						/* If we're only supposed to start when full, disable the transmitter */
 						if ((ms->txbufpolicy == DAHDI_POLICY_WHEN_FULL) ||
 							(ms->txbufpolicy == DAHDI_POLICY_HALF_FULL))
@@ -8147,7 +10087,7 @@ otherwise keeps sleeping and looking. The part in this code got "optimized"
 out in the later versions, and is put back now. */
 				if (!(ms->flags & DAHDI_FLAG_PPP) ||
 				    !dahdi_have_netdev(ms)) {
-					wake_up_interruptible(&ms->waitq);
+					dahdi_chan_wake(ms);
 				}
 				/* Transmit a flag if this is an HDLC channel */
 				if (ms->flags & DAHDI_FLAG_HDLC)
@@ -8163,15 +10103,24 @@ out in the later versions, and is put back now. */
 				}
 #endif
 			}
+#ifdef CONFIG_DAHDI_NET
+		} else if (dahdi_have_netdev(ms) &&
+			   (left = __dahdi_net_tx(ms, txb, bytes))) {
+			txb += left;
+			bytes -= left;
+#endif
+		} else if (dahdi_ring_active(ms) &&
+			   (left = __dahdi_ring_tx(ms, txb, bytes))) {
+			txb += left;
+			bytes -= left;
 		} else if (ms->curtone && !is_pseudo_chan(ms)) {
 			left = ms->curtone->tonesamples - ms->tonep;
 			if (left > bytes)
 				left = bytes;
-			for (x=0;x<left;x++) {
-				/* Pick our default value from the next sample of the current tone */
-				getlin = dahdi_tone_nextsample(&ms->ts, ms->curtone);
-				*(txb++) = DAHDI_LIN2X(getlin, ms);
-			}
+			/* Pick our default value from the next samples of the current tone */
+			dahdi_tone_fill(ms, txb, left);
+			if (left > 0)
+				txb += left;
 			ms->tonep+=left;
 			bytes -= left;
 			if (ms->tonep >= ms->curtone->tonesamples) {
@@ -8319,7 +10268,7 @@ static inline void __rbs_otimer_expire(struct dahdi_chan *chan)
 	case DAHDI_TXSTATE_START:
 		/* If we were starting, go off hook now ready to debounce */
 		dahdi_rbs_sethook(chan, DAHDI_TXSIG_OFFHOOK, DAHDI_TXSTATE_AFTERSTART, DAHDI_AFTERSTART_TIME);
-		wake_up_interruptible(&chan->waitq);
+		dahdi_chan_wake(chan);
 		break;
 
 	case DAHDI_TXSTATE_PREWINK:
@@ -8332,7 +10281,7 @@ static inline void __rbs_otimer_expire(struct dahdi_chan *chan)
 		dahdi_rbs_sethook(chan, DAHDI_TXSIG_ONHOOK, DAHDI_TXSTATE_ONHOOK, 0);
 		if (chan->file && (chan->file->f_flags & O_NONBLOCK))
 			__qevent(chan, DAHDI_EVENT_HOOKCOMPLETE);
-		wake_up_interruptible(&chan->waitq);
+		dahdi_chan_wake(chan);
 		break;
 
 	case DAHDI_TXSTATE_PREFLASH:
@@ -8344,7 +10293,7 @@ static inline void __rbs_otimer_expire(struct dahdi_chan *chan)
 		dahdi_rbs_sethook(chan, DAHDI_TXSIG_OFFHOOK, DAHDI_TXSTATE_OFFHOOK, 0);
 		if (chan->file && (chan->file->f_flags & O_NONBLOCK))
 			__qevent(chan, DAHDI_EVENT_HOOKCOMPLETE);
-		wake_up_interruptible(&chan->waitq);
+		dahdi_chan_wake(chan);
 		break;
 
 	case DAHDI_TXSTATE_DEBOUNCE:
@@ -8352,21 +10301,21 @@ static inline void __rbs_otimer_expire(struct dahdi_chan *chan)
 		/* See if we've gone back on hook */
 		if ((chan->rxhooksig == DAHDI_RXSIG_ONHOOK) && (chan->rxflashtime > 2))
 			chan->itimerset = chan->itimer = chan->rxflashtime * DAHDI_CHUNKSIZE;
-		wake_up_interruptible(&chan->waitq);
+		dahdi_chan_wake(chan);
 		break;
 
 	case DAHDI_TXSTATE_AFTERSTART:
 		dahdi_rbs_sethook(chan, DAHDI_TXSIG_OFFHOOK, DAHDI_TXSTATE_OFFHOOK, 0);
 		if (chan->file && (chan->file->f_flags & O_NONBLOCK))
 			__qevent(chan, DAHDI_EVENT_HOOKCOMPLETE);
-		wake_up_interruptible(&chan->waitq);
+		dahdi_chan_wake(chan);
 		break;
 
 	case DAHDI_TXSTATE_KEWL:
 		dahdi_rbs_sethook(chan, DAHDI_TXSIG_ONHOOK, DAHDI_TXSTATE_AFTERKEWL, DAHDI_AFTERKEWLTIME);
 		if (chan->file && (chan->file->f_flags & O_NONBLOCK))
 			__qevent(chan, DAHDI_EVENT_HOOKCOMPLETE);
-		wake_up_interruptible(&chan->waitq);
+		dahdi_chan_wake(chan);
 		break;
 
 	case DAHDI_TXSTATE_AFTERKEWL:
@@ -8380,7 +10329,7 @@ static inline void __rbs_otimer_expire(struct dahdi_chan *chan)
 	case DAHDI_TXSTATE_PULSEBREAK:
 		dahdi_rbs_sethook(chan, DAHDI_TXSIG_OFFHOOK, DAHDI_TXSTATE_PULSEMAKE,
 			chan->pulsemaketime);
-		wake_up_interruptible(&chan->waitq);
+		dahdi_chan_wake(chan);
 		break;
 
 	case DAHDI_TXSTATE_PULSEMAKE:
@@ -8394,13 +10343,13 @@ static inline void __rbs_otimer_expire(struct dahdi_chan *chan)
 		}
 		chan->txstate = DAHDI_TXSTATE_PULSEAFTER;
 		chan->otimer = chan->pulseaftertime * DAHDI_CHUNKSIZE;
-		wake_up_interruptible(&chan->waitq);
+		dahdi_chan_wake(chan);
 		break;
 
 	case DAHDI_TXSTATE_PULSEAFTER:
 		chan->txstate = DAHDI_TXSTATE_OFFHOOK;
 		__do_dtmf(chan);
-		wake_up_interruptible(&chan->waitq);
+		dahdi_chan_wake(chan);
 		break;
 
 	default:
@@ -8677,10 +10626,9 @@ void dahdi_rbsbits(struct dahdi_chan *chan, int cursig)
 	}
 }
 
-static void process_echocan_events(struct dahdi_chan *chan)
+static void __process_echocan_events(struct dahdi_chan *chan,
+				     union dahdi_echocan_events events)
 {
-	union dahdi_echocan_events events = chan->ec_state->events;
-
 	if (events.bit.CED_tx_detected) {
 		dahdi_qevent_nolock(chan, DAHDI_EVENT_TX_CED_DETECTED);
 		if (chan->ec_state) {
@@ -8718,6 +10666,11 @@ static void process_echocan_events(struct dahdi_chan *chan)
 	}
 }
 
+static void process_echocan_events(struct dahdi_chan *chan)
+{
+	__process_echocan_events(chan, chan->ec_state->events);
+}
+
 /**
  * __dahdi_ec_chunk() - process echo for a single channel
  * @ss:		DAHDI channel
@@ -8749,6 +10702,8 @@ void __dahdi_ec_chunk(struct dahdi_chan *ss, u8 *rxchunk,
 
 	/* Perform echo cancellation on a chunk if necessary */
 	if (ss->ec_state) {
+		const u64 start = dahdi_tick_start();
+
 #if defined(CONFIG_DAHDI_MMX) || defined(ECHO_CAN_FP)
 		dahdi_kernel_fpu_begin();
 #endif
@@ -8776,6 +10731,9 @@ void __dahdi_ec_chunk(struct dahdi_chan *ss, u8 *rxchunk,
 				rxchunk[x] = DAHDI_LIN2X((int)rxlin, ss);
 			}
 		} else if (ss->ec_state->status.mode != ECHO_MODE_IDLE) {
+			dahdi_ec_apply_nlp(ss->ec_state,
+					   ss->ec_state->status.nlp_request);
+			ss->ec_state->status.nlp_request = 0;
 			ss->ec_state->events.all = 0;
 
 			if (ss->ec_state->ops->echocan_process) {
@@ -8800,11 +10758,685 @@ void __dahdi_ec_chunk(struct dahdi_chan *ss, u8 *rxchunk,
 #if defined(CONFIG_DAHDI_MMX) || defined(ECHO_CAN_FP)
 		dahdi_kernel_fpu_end();
 #endif
+		if (ss->span)
+			dahdi_tick_account(span_tick_stats(ss->span),
+					   DAHDI_TICK_EC, start);
 	}
 
 	spin_unlock(&ss->lock);
 }
-EXPORT_SYMBOL(__dahdi_ec_chunk);
+EXPORT_SYMBOL(__dahdi_ec_chunk);
+
+/* Most channels handed to an echocan's batch operation at once */
+#define DAHDI_EC_BATCH		32
+
+/*
+ * Linear audio of the channels of a span whose echocan provides
+ * echocan_process_batch, gathered so they can be cancelled together.
+ */
+struct dahdi_ec_batch {
+	const struct dahdi_echocan_ops *ops;
+	unsigned int n;
+	struct dahdi_chan *chans[DAHDI_EC_BATCH];
+	struct dahdi_echocan_state *ec[DAHDI_EC_BATCH];
+	short rx[DAHDI_EC_BATCH * DAHDI_CHUNKSIZE];
+	short tx[DAHDI_EC_BATCH * DAHDI_CHUNKSIZE];
+};
+
+static DEFINE_PER_CPU(struct dahdi_ec_batch, dahdi_ec_batch);
+
+/* Cancel echo on every queued channel and scatter the results back */
+static void dahdi_ec_batch_flush(struct dahdi_ec_batch *b,
+				 struct dahdi_span *span)
+{
+	const u64 start = dahdi_tick_start();
+	unsigned int i;
+	int x;
+
+	/* No FPU section here: the echocan opens its own, and could not use
+	 * SIMD inside ours */
+	b->ops->echocan_process_batch(b->ec, b->rx, b->tx, b->n);
+	dahdi_tick_account(span_tick_stats(span), DAHDI_TICK_EC, start);
+
+	for (i = 0; i < b->n; i++) {
+		struct dahdi_chan *const chan = b->chans[i];
+		const short *rx = &b->rx[i * DAHDI_CHUNKSIZE];
+
+		spin_lock(&chan->lock);
+		for (x = 0; x < DAHDI_CHUNKSIZE; x++)
+			chan->readchunk[x] = DAHDI_LIN2X((int)rx[x], chan);
+		/* Unless the echocan was replaced meanwhile */
+		if (chan->ec_state == b->ec[i] && b->ec[i]->events.all)
+			process_echocan_events(chan);
+		spin_unlock(&chan->lock);
+	}
+	b->n = 0;
+}
+
+/*
+ * Queue a channel for batched echo cancellation. Returns false if its
+ * echocan can't be batched right now and __dahdi_ec_chunk() has to
+ * handle it.
+ */
+static bool dahdi_ec_batch_add(struct dahdi_ec_batch *b,
+			       struct dahdi_span *span, struct dahdi_chan *chan)
+{
+	struct dahdi_echocan_state *ec;
+	short rx[DAHDI_CHUNKSIZE];
+	short tx[DAHDI_CHUNKSIZE];
+	int x;
+
+	spin_lock(&chan->lock);
+	ec = chan->ec_state;
+	if (!ec || !ec->ops->echocan_process_batch ||
+	    (ec->status.mode & __ECHO_MODE_MUTE) ||
+	    ec->status.mode == ECHO_MODE_IDLE) {
+		spin_unlock(&chan->lock);
+		return false;
+	}
+
+	for (x = 0; x < DAHDI_CHUNKSIZE; x++) {
+		rx[x] = DAHDI_XLAW(chan->readchunk[x], chan);
+		tx[x] = DAHDI_XLAW(chan->writechunk[x], chan);
+	}
+	/* Save a copy of the audio before the echo can has its way with it */
+	if (chan->readchunkpreec)
+		memcpy(chan->readchunkpreec, rx, sizeof(rx));
+	/* Nothing else runs ec between two ticks of the span */
+	dahdi_ec_apply_nlp(ec, ec->status.nlp_request);
+	ec->status.nlp_request = 0;
+	ec->events.all = 0;
+	spin_unlock(&chan->lock);
+
+	/* Under rcu_read_lock(), ec stays valid until we are done: see
+	 * free_echocan() */
+	if (b->n == DAHDI_EC_BATCH || (b->n && b->ops != ec->ops))
+		dahdi_ec_batch_flush(b, span);
+
+	b->ops = ec->ops;
+	b->chans[b->n] = chan;
+	b->ec[b->n] = ec;
+	memcpy(&b->rx[b->n * DAHDI_CHUNKSIZE], rx, sizeof(rx));
+	memcpy(&b->tx[b->n * DAHDI_CHUNKSIZE], tx, sizeof(tx));
+	b->n++;
+	return true;
+}
+
+#ifdef CONFIG_DAHDI_EC_OFFLOAD
+
+static int ec_offload;
+
+/* Chunks a span may have queued for its EC thread */
+#define DAHDI_EC_OFFLOAD_FRAMES	4
+
+/*
+ * One chunk of a span queued for echo cancellation. A NULL @ec entry means
+ * the channel was not queued. The thread cancels @rx in place and leaves
+ * the events the echocan raised in @events. @raw keeps the received chunk
+ * as it was, for when the result is not back in time. @nlp carries the NLP
+ * change asked for since the echocan was last queued, for the thread to
+ * make before it processes the chunk.
+ */
+struct dahdi_ec_offload_frame {
+	struct dahdi_echocan_state **ec;
+	union dahdi_echocan_events *events;
+	u32 *nlp;
+	short *rx;
+	short *tx;
+	u8 *raw;
+};
+
+/**
+ * struct dahdi_ec_offload - Queue of echo cancellation work of a span.
+ * @span:	The span.
+ * @worker:	The thread that does the work.
+ * @node:	In the list of queues of @worker.
+ * @prod_seq:	Number of frames queued so far. Only written by
+ *		dahdi_ec_span().
+ * @done_seq:	Number of frames processed so far. Only written by @worker.
+ * @events_seq:	Frames whose echocan events were handed to the channels.
+ *		Those of a late frame are handed over with the next ones.
+ * @have_prev:	Whether a frame was queued on the previous chunk.
+ * @frames:	Number of frames queued.
+ * @late:	Number of frames whose result was not back one chunk later.
+ * @dropped:	Number of chunks a channel was left with echo because its
+ *		echocan was still queued.
+ * @syncers:	ec_offload_sync() callers waiting on @done_seq, under
+ *		ec_offload_mutex.
+ * @gone:	Set once @worker has let go of the queue; nothing queued is
+ *		done after that.
+ * @frame:	The ring of frames.
+ *
+ * The span interrupt fills frame @prod_seq and publishes it by bumping
+ * @prod_seq. One chunk later it picks the result up, so as long as the
+ * thread keeps up no lock is taken between the two.
+ */
+struct dahdi_ec_offload {
+	struct dahdi_span *span;
+	struct dahdi_ec_worker *worker;
+	struct list_head node;
+	unsigned int prod_seq ____cacheline_aligned_in_smp;
+	unsigned int events_seq;
+	bool have_prev;
+	atomic64_t frames;
+	atomic64_t late;
+	atomic64_t dropped;
+	unsigned int syncers;
+	bool gone;
+	unsigned int done_seq ____cacheline_aligned_in_smp;
+	struct dahdi_ec_offload_frame frame[DAHDI_EC_OFFLOAD_FRAMES];
+};
+
+/**
+ * struct dahdi_ec_worker - A thread running the echocans of some spans.
+ * @task:	The thread, bound to @cpu.
+ * @cpu:	The CPU it runs on.
+ * @channels:	Number of channels of the spans it serves.
+ * @queues:	The dahdi_ec_offload of the spans it serves.
+ */
+struct dahdi_ec_worker {
+	struct task_struct *task;
+	int cpu;
+	int channels;
+	struct list_head queues;
+};
+
+static struct dahdi_ec_worker *ec_workers;
+static int nr_ec_workers;
+/* Protects the queue lists of ec_workers and span->ec_offload */
+static DEFINE_MUTEX(ec_offload_mutex);
+
+static void ec_offload_run_frame(struct dahdi_ec_offload *o,
+				 struct dahdi_ec_offload_frame *f)
+{
+	const unsigned int channels = o->span->channels;
+	const u64 start = dahdi_tick_start();
+	unsigned long flags;
+	unsigned int i = 0;
+	unsigned int k;
+
+	/* The echocans expect the same context as in dahdi_ec_chunk() */
+	local_irq_save(flags);
+	while (i < channels) {
+		struct dahdi_echocan_state *const ec = f->ec[i];
+		unsigned int n = 1;
+
+		if (!ec) {
+			i++;
+			continue;
+		}
+		if (ec->ops->echocan_process_batch) {
+			while (i + n < channels && f->ec[i + n] &&
+			       f->ec[i + n]->ops == ec->ops)
+				n++;
+			for (k = i; k < i + n; k++) {
+				dahdi_ec_apply_nlp(f->ec[k], f->nlp[k]);
+				f->ec[k]->events.all = 0;
+			}
+			/* Opens its own FPU section, as in dahdi_ec_span() */
+			ec->ops->echocan_process_batch(&f->ec[i],
+					&f->rx[i * DAHDI_CHUNKSIZE],
+					&f->tx[i * DAHDI_CHUNKSIZE], n);
+		} else {
+			dahdi_ec_apply_nlp(ec, f->nlp[i]);
+			ec->events.all = 0;
+#if defined(CONFIG_DAHDI_MMX) || defined(ECHO_CAN_FP)
+			dahdi_kernel_fpu_begin();
+#endif
+			ec->ops->echocan_process(ec,
+					&f->rx[i * DAHDI_CHUNKSIZE],
+					&f->tx[i * DAHDI_CHUNKSIZE],
+					DAHDI_CHUNKSIZE);
+#if defined(CONFIG_DAHDI_MMX) || defined(ECHO_CAN_FP)
+			dahdi_kernel_fpu_end();
+#endif
+		}
+		for (k = i; k < i + n; k++)
+			f->events[k] = f->ec[k]->events;
+		i += n;
+	}
+	dahdi_tick_account(span_tick_stats(o->span), DAHDI_TICK_EC, start);
+	local_irq_restore(flags);
+}
+
+/* Process every frame queued to @w. Returns true if there was any. */
+static bool ec_worker_run(struct dahdi_ec_worker *w)
+{
+	struct dahdi_ec_offload *o;
+	bool busy = false;
+
+	rcu_read_lock();
+	list_for_each_entry_rcu(o, &w->queues, node) {
+		const unsigned int prod = smp_load_acquire(&o->prod_seq);
+		unsigned int seq = o->done_seq;
+
+		if (seq == prod)
+			continue;
+		while (seq != prod) {
+			ec_offload_run_frame(o,
+				&o->frame[seq % DAHDI_EC_OFFLOAD_FRAMES]);
+			smp_store_release(&o->done_seq, ++seq);
+		}
+		/* For ec_offload_sync() */
+		wake_up_var(&o->done_seq);
+		busy = true;
+	}
+	rcu_read_unlock();
+	return busy;
+}
+
+static int ec_worker_thread(void *data)
+{
+	struct dahdi_ec_worker *const w = data;
+
+	while (!kthread_should_stop()) {
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (ec_worker_run(w))
+			__set_current_state(TASK_RUNNING);
+		else
+			schedule();
+	}
+	__set_current_state(TASK_RUNNING);
+	return 0;
+}
+
+/* Is @ec still queued in one of the frames not processed yet? */
+static bool ec_offload_in_flight(const struct dahdi_ec_offload *o,
+				 unsigned int pos,
+				 const struct dahdi_echocan_state *ec,
+				 unsigned int seq, unsigned int done)
+{
+	for (; done != seq; done++) {
+		if (o->frame[done % DAHDI_EC_OFFLOAD_FRAMES].ec[pos] == ec)
+			return true;
+	}
+	return false;
+}
+
+/* The events @ec raised in the frames done since they were last handed over */
+static union dahdi_echocan_events
+ec_offload_events(const struct dahdi_ec_offload *o, unsigned int pos,
+		  const struct dahdi_echocan_state *ec, unsigned int done)
+{
+	union dahdi_echocan_events events = { .all = 0 };
+	unsigned int seq;
+
+	for (seq = o->events_seq; seq != done; seq++) {
+		const struct dahdi_ec_offload_frame *const f =
+			&o->frame[seq % DAHDI_EC_OFFLOAD_FRAMES];
+
+		if (f->ec[pos] == ec)
+			events.all |= f->events[pos].all;
+	}
+	return events;
+}
+
+/**
+ * ec_offload_span() - Hand the echo cancellation of a span to its thread.
+ * @span:	The span.
+ *
+ * Queues the chunk of every channel whose echocan is running and fills
+ * dahdi_chan.readchunk with the result for the previous chunk. Channels
+ * that can't be queued are handled inline by dahdi_ec_chunk(), unless
+ * their echocan is still busy with an earlier chunk.
+ *
+ * Returns false if the span doesn't offload its echo cancellation.
+ * Call with local interrupts disabled.
+ */
+static bool ec_offload_span(struct dahdi_span *span)
+{
+	struct dahdi_ec_offload *o;
+	struct dahdi_ec_offload_frame *f = NULL;
+	const struct dahdi_ec_offload_frame *prev = NULL;
+	unsigned int seq, done;
+	bool prev_done;
+	int x, k;
+
+	rcu_read_lock();
+	o = rcu_dereference(span->ec_offload);
+	if (!o) {
+		rcu_read_unlock();
+		return false;
+	}
+
+	seq = o->prod_seq;
+	done = smp_load_acquire(&o->done_seq);
+	if (seq - done < DAHDI_EC_OFFLOAD_FRAMES)
+		f = &o->frame[seq % DAHDI_EC_OFFLOAD_FRAMES];
+	if (o->have_prev)
+		prev = &o->frame[(seq - 1) % DAHDI_EC_OFFLOAD_FRAMES];
+	prev_done = (done == seq);
+
+	for (x = 0; x < span->channels; x++) {
+		struct dahdi_chan *const chan = span->chans[x];
+		struct dahdi_echocan_state *ec;
+		bool in_flight;
+
+		if (!chan->ec_current) {
+			if (f)
+				f->ec[x] = NULL;
+			continue;
+		}
+
+		spin_lock(&chan->lock);
+		ec = chan->ec_state;
+		/* Before f, which may be the oldest frame done, is refilled */
+		if (ec) {
+			const union dahdi_echocan_events events =
+				ec_offload_events(o, x, ec, done);
+
+			if (events.all)
+				__process_echocan_events(chan, events);
+		}
+		if (f && ec && ec->ops->echocan_process &&
+		    !(ec->status.mode & __ECHO_MODE_MUTE) &&
+		    ec->status.mode != ECHO_MODE_IDLE) {
+			u8 *const raw = &f->raw[x * DAHDI_CHUNKSIZE];
+			const u8 *src;
+			short *const rx = &f->rx[x * DAHDI_CHUNKSIZE];
+			short *const tx = &f->tx[x * DAHDI_CHUNKSIZE];
+
+			memcpy(raw, chan->readchunk, DAHDI_CHUNKSIZE);
+			for (k = 0; k < DAHDI_CHUNKSIZE; k++) {
+				rx[k] = DAHDI_XLAW(chan->readchunk[k], chan);
+				tx[k] = DAHDI_XLAW(chan->writechunk[k], chan);
+			}
+			f->ec[x] = ec;
+			/* The thread may be running ec: leave it the change */
+			f->nlp[x] = ec->status.nlp_request;
+			ec->status.nlp_request = 0;
+
+			/* Without a previous chunk the current one goes
+			 * through as it is, and once more next time with the
+			 * echo cancelled. */
+			if (prev && prev->ec[x] == ec)
+				src = &prev->raw[x * DAHDI_CHUNKSIZE];
+			else
+				src = raw;
+			/* Save a copy of the audio before the echo can has
+			 * its way with it */
+			if (chan->readchunkpreec) {
+				for (k = 0; k < DAHDI_CHUNKSIZE; k++)
+					chan->readchunkpreec[k] =
+						DAHDI_XLAW(src[k], chan);
+			}
+			if (src != raw && prev_done) {
+				const short *const prx =
+					&prev->rx[x * DAHDI_CHUNKSIZE];
+
+				for (k = 0; k < DAHDI_CHUNKSIZE; k++)
+					chan->readchunk[k] =
+						DAHDI_LIN2X((int)prx[k], chan);
+			} else {
+				memcpy(chan->readchunk, src, DAHDI_CHUNKSIZE);
+			}
+			spin_unlock(&chan->lock);
+			continue;
+		}
+		if (f)
+			f->ec[x] = NULL;
+		in_flight = ec && ec_offload_in_flight(o, x, ec, seq, done);
+		spin_unlock(&chan->lock);
+
+		if (in_flight)
+			atomic64_inc(&o->dropped);
+		else
+			_dahdi_ec_chunk(chan, chan->readchunk,
+					chan->writechunk);
+	}
+	o->events_seq = done;
+
+	if (f) {
+		if (o->have_prev && !prev_done)
+			atomic64_inc(&o->late);
+		atomic64_inc(&o->frames);
+		smp_store_release(&o->prod_seq, seq + 1);
+		wake_up_process(o->worker->task);
+	}
+	o->have_prev = (f != NULL);
+	rcu_read_unlock();
+	return true;
+}
+
+static void span_alloc_ec_offload(struct dahdi_span *span)
+{
+	const unsigned int n = DAHDI_EC_OFFLOAD_FRAMES * span->channels;
+	struct dahdi_ec_worker *w = NULL;
+	struct dahdi_ec_offload *o;
+	void *p;
+	int i;
+
+	if (!nr_ec_workers || !span->channels)
+		return;
+
+	o = kzalloc(sizeof(*o) + n * (sizeof(*o->frame[0].ec) +
+				      sizeof(*o->frame[0].events) +
+				      sizeof(*o->frame[0].nlp) +
+				      2 * DAHDI_CHUNKSIZE * sizeof(short) +
+				      DAHDI_CHUNKSIZE), GFP_KERNEL);
+	if (!o) {
+		span_notice(span, "Failed to allocate the EC offload queue. "
+			    "Cancelling echo in the interrupt.\n");
+		return;
+	}
+	o->span = span;
+
+	p = o + 1;
+	for (i = 0; i < DAHDI_EC_OFFLOAD_FRAMES; i++) {
+		o->frame[i].ec = p;
+		p += span->channels * sizeof(*o->frame[i].ec);
+	}
+	for (i = 0; i < DAHDI_EC_OFFLOAD_FRAMES; i++) {
+		o->frame[i].events = p;
+		p += span->channels * sizeof(*o->frame[i].events);
+	}
+	for (i = 0; i < DAHDI_EC_OFFLOAD_FRAMES; i++) {
+		o->frame[i].nlp = p;
+		p += span->channels * sizeof(*o->frame[i].nlp);
+	}
+	for (i = 0; i < DAHDI_EC_OFFLOAD_FRAMES; i++) {
+		o->frame[i].rx = p;
+		p += span->channels * DAHDI_CHUNKSIZE * sizeof(short);
+		o->frame[i].tx = p;
+		p += span->channels * DAHDI_CHUNKSIZE * sizeof(short);
+	}
+	for (i = 0; i < DAHDI_EC_OFFLOAD_FRAMES; i++) {
+		o->frame[i].raw = p;
+		p += span->channels * DAHDI_CHUNKSIZE;
+	}
+
+	mutex_lock(&ec_offload_mutex);
+	/* Keep all the channels of a span on one CPU, and spread the spans */
+	for (i = 0; i < nr_ec_workers; i++) {
+		if (!w || ec_workers[i].channels < w->channels)
+			w = &ec_workers[i];
+	}
+	o->worker = w;
+	w->channels += span->channels;
+	list_add_tail_rcu(&o->node, &w->queues);
+	rcu_assign_pointer(span->ec_offload, o);
+	mutex_unlock(&ec_offload_mutex);
+}
+
+static void span_free_ec_offload(struct dahdi_span *span)
+{
+	struct dahdi_ec_offload *o;
+
+	mutex_lock(&ec_offload_mutex);
+	o = rcu_dereference_protected(span->ec_offload,
+				      lockdep_is_held(&ec_offload_mutex));
+	if (!o) {
+		mutex_unlock(&ec_offload_mutex);
+		return;
+	}
+	RCU_INIT_POINTER(span->ec_offload, NULL);
+	list_del_rcu(&o->node);
+	o->worker->channels -= span->channels;
+	mutex_unlock(&ec_offload_mutex);
+
+	synchronize_rcu();
+	/* The thread has let go of it; release anyone still waiting on it */
+	WRITE_ONCE(o->gone, true);
+	wake_up_var(&o->done_seq);
+	mutex_lock(&ec_offload_mutex);
+	while (o->syncers) {
+		mutex_unlock(&ec_offload_mutex);
+		wait_var_event(&o->syncers, !READ_ONCE(o->syncers));
+		mutex_lock(&ec_offload_mutex);
+	}
+	mutex_unlock(&ec_offload_mutex);
+	kfree(o);
+}
+
+/*
+ * Wait for the EC thread of @span to be done with every frame queued so
+ * far. Echocans detached from their channel before this can't be in any
+ * of the frames queued afterwards.
+ */
+static void ec_offload_sync(struct dahdi_span *span)
+{
+	struct dahdi_ec_offload *o;
+	unsigned int seq;
+
+	if (!span)
+		return;
+
+	/* Until any interrupt that saw the echocan is over */
+	synchronize_rcu();
+
+	mutex_lock(&ec_offload_mutex);
+	o = rcu_dereference_protected(span->ec_offload,
+				      lockdep_is_held(&ec_offload_mutex));
+	if (!o) {
+		mutex_unlock(&ec_offload_mutex);
+		return;
+	}
+	/* Keeps span_free_ec_offload() from freeing it under us */
+	o->syncers++;
+	seq = READ_ONCE(o->prod_seq);
+	mutex_unlock(&ec_offload_mutex);
+
+	/* The thread may already be past seq by the time we look */
+	wait_var_event(&o->done_seq,
+		       (int)(smp_load_acquire(&o->done_seq) - seq) >= 0 ||
+		       READ_ONCE(o->gone));
+
+	mutex_lock(&ec_offload_mutex);
+	if (!--o->syncers)
+		wake_up_var(&o->syncers);
+	mutex_unlock(&ec_offload_mutex);
+}
+
+static void ec_offload_init(void)
+{
+	int cpu;
+	int i = 0;
+
+	nr_ec_workers = min(ec_offload, (int)num_online_cpus());
+	if (nr_ec_workers <= 0) {
+		nr_ec_workers = 0;
+		return;
+	}
+
+	ec_workers = kcalloc(nr_ec_workers, sizeof(*ec_workers), GFP_KERNEL);
+	if (!ec_workers) {
+		module_printk(KERN_NOTICE, "Failed to allocate %d EC offload "
+			      "threads. Cancelling echo in the interrupt.\n",
+			      nr_ec_workers);
+		nr_ec_workers = 0;
+		return;
+	}
+
+	for_each_online_cpu(cpu) {
+		struct dahdi_ec_worker *w;
+		struct task_struct *task;
+
+		if (i >= nr_ec_workers)
+			break;
+		w = &ec_workers[i];
+		INIT_LIST_HEAD(&w->queues);
+		w->cpu = cpu;
+		task = kthread_create(ec_worker_thread, w, "dahdi_ec/%d", cpu);
+		if (IS_ERR(task)) {
+			module_printk(KERN_NOTICE, "Failed to create the EC "
+				      "offload thread for CPU %d.\n", cpu);
+			continue;
+		}
+		kthread_bind(task, cpu);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 9, 0)
+		sched_set_fifo(task);
+#else
+		{
+			struct sched_param param = {
+				.sched_priority = MAX_RT_PRIO / 2,
+			};
+			sched_setscheduler(task, SCHED_FIFO, &param);
+		}
+#endif
+		w->task = task;
+		wake_up_process(task);
+		++i;
+	}
+	nr_ec_workers = i;
+	if (!nr_ec_workers) {
+		kfree(ec_workers);
+		ec_workers = NULL;
+		return;
+	}
+	module_printk(KERN_INFO, "Offloading echo cancellation to %d "
+		      "threads.\n", nr_ec_workers);
+}
+
+static void ec_offload_cleanup(void)
+{
+	int i;
+
+	if (!ec_workers)
+		return;
+	/* All the spans are gone by now, and their queues with them. */
+	for (i = 0; i < nr_ec_workers; ++i)
+		kthread_stop(ec_workers[i].task);
+	kfree(ec_workers);
+	ec_workers = NULL;
+	nr_ec_workers = 0;
+}
+
+/**
+ * dahdi_ec_offload_show() - Print the EC offload counters of every span.
+ *
+ * Used by the "ec_offload" attribute of the dahdi_spans bus driver.
+ */
+ssize_t dahdi_ec_offload_show(char *buf, size_t size)
+{
+	struct dahdi_ec_offload *o;
+	ssize_t len = 0;
+	int i;
+
+	len += scnprintf(buf + len, size - len,
+			 "span cpu channels frames late dropped\n");
+	mutex_lock(&ec_offload_mutex);
+	for (i = 0; i < nr_ec_workers; ++i) {
+		list_for_each_entry(o, &ec_workers[i].queues, node) {
+			len += scnprintf(buf + len, size - len,
+					 "%d %d %d %llu %llu %llu\n",
+					 o->span->spanno, ec_workers[i].cpu,
+					 o->span->channels,
+					 (u64)atomic64_read(&o->frames),
+					 (u64)atomic64_read(&o->late),
+					 (u64)atomic64_read(&o->dropped));
+		}
+	}
+	mutex_unlock(&ec_offload_mutex);
+	return len;
+}
+
+#else
+
+static inline bool ec_offload_span(struct dahdi_span *span) { return false; }
+static inline void ec_offload_init(void) { }
+static inline void ec_offload_cleanup(void) { }
+
+#endif /* CONFIG_DAHDI_EC_OFFLOAD */
 
 /**
  * dahdi_ec_span() - process echo for all channels in a span.
@@ -8813,16 +11445,37 @@ EXPORT_SYMBOL(__dahdi_ec_chunk);
  * Similar to calling dahdi_ec_chunk() for each of the channels in the
  * span. Uses dahdi_chunk.write_chunk for the rxchunk (the chunk to fix)
  * and dahdi_chan.readchunk as the txchunk (the reference chunk).
+ *
+ * Channels whose echocan has an echocan_process_batch operation are
+ * converted to linear up front and cancelled together, so that the
+ * echocan sets up its FPU section once rather than for every channel.
+ *
+ * With CONFIG_DAHDI_EC_OFFLOAD and the ec_offload module parameter the
+ * work is queued to a thread on another CPU instead, see
+ * ec_offload_span().
+ *
+ * Call with local interrupts disabled.
  */
 void _dahdi_ec_span(struct dahdi_span *span)
 {
+	struct dahdi_ec_batch *const b = this_cpu_ptr(&dahdi_ec_batch);
 	int x;
+
+	if (ec_offload_span(span))
+		return;
+
+	rcu_read_lock();
 	for (x = 0; x < span->channels; x++) {
 		struct dahdi_chan *const chan = span->chans[x];
 		if (!chan->ec_current)
 			continue;
-		_dahdi_ec_chunk(chan, chan->readchunk, chan->writechunk);
+		if (!dahdi_ec_batch_add(b, span, chan))
+			_dahdi_ec_chunk(chan, chan->readchunk,
+					chan->writechunk);
 	}
+	if (b->n)
+		dahdi_ec_batch_flush(b, span);
+	rcu_read_unlock();
 }
 EXPORT_SYMBOL(_dahdi_ec_span);
 
@@ -9143,6 +11796,11 @@ static void __putbuf_chunk(struct dahdi_chan *ss, unsigned char *rxb, int bytes)
 	int res;
 	int left, x;
 
+	if (dahdi_ring_active(ms)) {
+		__dahdi_ring_rx(ms, rxb, bytes);
+		return;
+	}
+
 	while(bytes) {
 #if defined(CONFIG_DAHDI_NET)  || defined(CONFIG_DAHDI_PPP)
 		skb = NULL;
@@ -9157,52 +11815,54 @@ static void __putbuf_chunk(struct dahdi_chan *ss, unsigned char *rxb, int bytes)
 			if (left > bytes)
 				left = bytes;
 			if (ms->flags & DAHDI_FLAG_HDLC) {
-				for (x=0;x<left;x++) {
-					/* Handle HDLC deframing */
-					fasthdlc_rx_load_nocheck(&ms->rxhdlc, *(rxb++));
-					bytes--;
-					res = fasthdlc_rx_run(&ms->rxhdlc);
-					/* If there is nothing there, continue */
-					if (res & RETURN_EMPTY_FLAG)
-						continue;
-					else if (res & RETURN_COMPLETE_FLAG) {
-						/* Only count this if it's a non-empty frame */
-						if (ms->readidx[ms->inreadbuf]) {
-							if ((ms->flags & DAHDI_FLAG_FCS) && (ms->infcs != PPP_GOODFCS)) {
-								abort = DAHDI_EVENT_BADFCS;
-							} else
-								eof=1;
-							break;
-						}
-						continue;
-					} else if (res & RETURN_DISCARD_FLAG) {
-						/* This could be someone idling with
-						  "idle" instead of "flag" */
-						if (!ms->readidx[ms->inreadbuf])
-							continue;
-						abort = DAHDI_EVENT_ABORT;
-						break;
-					} else {
-						unsigned char rxc;
-						rxc = res;
-						ms->infcs = PPP_FCS(ms->infcs, rxc);
-						buf[ms->readidx[ms->inreadbuf]++] = rxc;
-						/* Pay attention to the possibility of an overrun */
-						if (ms->readidx[ms->inreadbuf] >= ms->blocksize) {
-							if (!ss->span->alarms)
-								module_printk(KERN_WARNING, "HDLC Receiver overrun on channel %s (master=%s)\n", ss->name, ss->master->name);
-							abort=DAHDI_EVENT_OVERRUN;
-							/* Force the HDLC state back to frame-search mode */
-							ms->rxhdlc.state = 0;
-							ms->rxhdlc.bits = 0;
-							ms->readidx[ms->inreadbuf]=0;
-							break;
-						}
-					}
+				unsigned char *data = buf + ms->readidx[ms->inreadbuf];
+				int got;
+
+#ifdef CONFIG_DAHDI_NET
+				if (dahdi_have_netdev(ms))
+					data = __dahdi_net_rx_buf(ms, buf) +
+						ms->readidx[ms->inreadbuf];
+#endif
+
+				/* Handle HDLC deframing.  Empty frames, and
+				   someone idling with "idle" instead of "flag",
+				   are skipped over. */
+				x = fasthdlc_rx_run_buf(&ms->rxhdlc, rxb, left, data,
+							ms->readidx[ms->inreadbuf],
+							&got, &res);
+				rxb += x;
+				bytes -= x;
+				ms->infcs = fasthdlc_fcs(ms->infcs, data, got);
+				ms->readidx[ms->inreadbuf] += got;
+				if (res & RETURN_COMPLETE_FLAG) {
+					if ((ms->flags & DAHDI_FLAG_FCS) && (ms->infcs != PPP_GOODFCS)) {
+						abort = DAHDI_EVENT_BADFCS;
+					} else
+						eof=1;
+				} else if (res & RETURN_DISCARD_FLAG) {
+					abort = DAHDI_EVENT_ABORT;
+				} else if (got && ms->readidx[ms->inreadbuf] >= ms->blocksize) {
+					/* Pay attention to the possibility of an overrun */
+					if (!ss->span->alarms)
+						module_printk(KERN_WARNING, "HDLC Receiver overrun on channel %s (master=%s)\n", ss->name, ss->master->name);
+					abort=DAHDI_EVENT_OVERRUN;
+					/* Force the HDLC state back to frame-search mode */
+					ms->rxhdlc.state = 0;
+					ms->rxhdlc.bits = 0;
+					ms->readidx[ms->inreadbuf]=0;
 				}
 			} else {
 				/* Not HDLC */
 				memcpy(buf + ms->readidx[ms->inreadbuf], rxb, left);
+				if (ms->linreadbuf) {
+					short *lin = ms->linreadbuf +
+						ms->inreadbuf * ms->blocksize +
+						ms->readidx[ms->inreadbuf];
+					int i;
+
+					for (i = 0; i < left; i++)
+						lin[i] = DAHDI_XLAW(rxb[i], ms);
+				}
 				rxb += left;
 				ms->readidx[ms->inreadbuf] += left;
 				bytes -= left;
@@ -9232,18 +11892,27 @@ static void __putbuf_chunk(struct dahdi_chan *ss, unsigned char *rxb, int bytes)
 					if (ms->readn[ms->inreadbuf] > 1) {
 						/* Drop the FCS */
 						ms->readn[ms->inreadbuf] -= 2;
-						/* Allocate an SKB */
+#ifdef CONFIG_DAHDI_NET
+						if (dahdi_have_netdev(ms)) {
+							/* Already deframed into an SKB */
+							skb = __dahdi_net_rx_skb(ms, ms->readn[ms->inreadbuf]);
+						} else
+#endif
+						{
+							/* Allocate an SKB */
 #ifdef CONFIG_DAHDI_PPP
-						if (!ms->do_ppp_error)
+							if (!ms->do_ppp_error)
 #endif
-							skb = dev_alloc_skb(ms->readn[ms->inreadbuf] + 2);
+								skb = dev_alloc_skb(ms->readn[ms->inreadbuf] + 2);
+							if (skb) {
+								unsigned char cisco_addr = *(ms->readbuf[ms->inreadbuf]);
+								if (cisco_addr != 0x0f && cisco_addr != 0x8f)
+									skb_reserve(skb, 2);
+								memcpy(skb->data, ms->readbuf[ms->inreadbuf], ms->readn[ms->inreadbuf]);
+								skb_put(skb, ms->readn[ms->inreadbuf]);
+							}
+						}
 						if (skb) {
-							unsigned char cisco_addr = *(ms->readbuf[ms->inreadbuf]);
-							if (cisco_addr != 0x0f && cisco_addr != 0x8f)
-								skb_reserve(skb, 2);
-							/* XXX Get rid of this memcpy XXX */
-							memcpy(skb->data, ms->readbuf[ms->inreadbuf], ms->readn[ms->inreadbuf]);
-							skb_put(skb, ms->readn[ms->inreadbuf]);
 #ifdef CONFIG_DAHDI_NET
 							if (dahdi_have_netdev(ms)) {
 								struct net_device_stats *stats = hdlc_stats(ms->hdlcnetdev->netdev);
@@ -9314,7 +11983,7 @@ static void __putbuf_chunk(struct dahdi_chan *ss, unsigned char *rxb, int bytes)
 							ms->outreadbuf = oldbuf;
 							/* if there are processes waiting in poll() on this channel,
 							   wake them up */
-							wake_up_interruptible(&ms->waitq);
+							dahdi_chan_wake(ms);
 						}
 /* In the very orignal driver, it was quite well known to me (Jim) that there
 was a possibility that a channel sleeping on a receive block needed to
@@ -9334,7 +12003,7 @@ that the waitqueue is empty. */
 #ifdef CONFIG_DAHDI_DEBUG
 						module_printk(KERN_NOTICE, "Notifying reader data in block %d\n", oldbuf);
 #endif
-						wake_up_interruptible(&ms->waitq);
+						dahdi_chan_wake(ms);
 					}
 				}
 			}
@@ -9371,15 +12040,12 @@ that the waitqueue is empty. */
 #ifdef CONFIG_DAHDI_NET
 		if (skb && dahdi_have_netdev(ms))
 		{
-			skb_reset_mac_header(skb);
-			skb->dev = chan_to_netdev(ms);
-#ifdef DAHDI_HDLC_TYPE_TRANS
-			skb->protocol = hdlc_type_trans(skb,
-							chan_to_netdev(ms));
+#ifdef CONFIG_DAHDI_NET_NAPI
+			__dahdi_net_rx_queue(ms, skb);
 #else
-			skb->protocol = htons (ETH_P_HDLC);
-#endif
+			dahdi_net_rx_protocol(chan_to_netdev(ms), skb);
 			netif_rx(skb);
+#endif
 		}
 #endif
 #ifdef CONFIG_DAHDI_PPP
@@ -9509,7 +12175,7 @@ void dahdi_hdlc_finish(struct dahdi_chan *ss)
 		ss->outreadbuf = oldreadbuf;
 	}
 
-	wake_up_interruptible(&ss->waitq);
+	dahdi_chan_wake(ss);
 	spin_unlock_irqrestore(&ss->lock, flags);
 }
 
@@ -9546,7 +12212,7 @@ int dahdi_hdlc_getbuf(struct dahdi_chan *ss, unsigned char *bufptr, unsigned int
 			if (ss->outwritebuf == ss->inwritebuf) {
 				ss->outwritebuf = -1;
 				if (ss->iomask & (DAHDI_IOMUX_WRITE | DAHDI_IOMUX_WRITEEMPTY))
-					wake_up_interruptible(&ss->waitq);
+					dahdi_chan_wake(ss);
 				/* If we're only supposed to start when full, disable the transmitter */
 				if ((ss->txbufpolicy == DAHDI_POLICY_WHEN_FULL) || (ss->txbufpolicy == DAHDI_POLICY_HALF_FULL))
 					ss->txdisable = 1;
@@ -9558,7 +12224,7 @@ int dahdi_hdlc_getbuf(struct dahdi_chan *ss, unsigned char *bufptr, unsigned int
 
 			if (!(ss->flags & DAHDI_FLAG_PPP) ||
 			    !dahdi_have_netdev(ss)) {
-				wake_up_interruptible(&ss->waitq);
+				dahdi_chan_wake(ss);
 			}
 		}
 	} else {
@@ -9636,8 +12302,17 @@ dahdi_chan_poll(struct file *file, struct poll_table_struct *wait_table)
 	poll_wait(file, &c->waitq, wait_table);
 
 	spin_lock_irqsave(&c->lock, flags);
-	ret |= (c->inwritebuf > -1) ? POLLOUT|POLLWRNORM : 0;
-	ret |= (c->outreadbuf > -1) ?  POLLIN|POLLRDNORM : 0;
+	if (dahdi_ring_active(c)) {
+		const struct dahdi_ring *const ring = c->ring;
+
+		ret |= (ring->size - dahdi_ring_tx_avail(ring) >= c->blocksize) ?
+			POLLOUT|POLLWRNORM : 0;
+		ret |= (dahdi_ring_rx_used(ring) >= c->blocksize) ?
+			POLLIN|POLLRDNORM : 0;
+	} else {
+		ret |= (c->inwritebuf > -1) ? POLLOUT|POLLWRNORM : 0;
+		ret |= (c->outreadbuf > -1) ?  POLLIN|POLLRDNORM : 0;
+	}
 	ret |= (c->eventoutidx != c->eventinidx) ? POLLPRI : 0;
 	spin_unlock_irqrestore(&c->lock, flags);
 
@@ -9699,8 +12374,6 @@ static void __dahdi_getempty(struct dahdi_chan *ms, unsigned char *buf)
 	int bytes = DAHDI_CHUNKSIZE;
 	int left;
 	unsigned char *txb = buf;
-	int x;
-	short getlin;
 	/* Called with ms->lock held */
 
 	while(bytes) {
@@ -9709,11 +12382,10 @@ static void __dahdi_getempty(struct dahdi_chan *ms, unsigned char *buf)
 			left = ms->curtone->tonesamples - ms->tonep;
 			if (left > bytes)
 				left = bytes;
-			for (x=0;x<left;x++) {
-				/* Pick our default value from the next sample of the current tone */
-				getlin = dahdi_tone_nextsample(&ms->ts, ms->curtone);
-				*(txb++) = DAHDI_LIN2X(getlin, ms);
-			}
+			/* Pick our default value from the next samples of the current tone */
+			dahdi_tone_fill(ms, txb, left);
+			if (left > 0)
+				txb += left;
 			ms->tonep+=left;
 			bytes -= left;
 			if (ms->tonep >= ms->curtone->tonesamples) {
@@ -9757,135 +12429,561 @@ static void __dahdi_receive_chunk(struct dahdi_chan *chan, unsigned char *buf)
 #ifdef CONFIG_DAHDI_MMX
 		dahdi_kernel_fpu_begin();
 #endif
-		__dahdi_process_putaudio_chunk(chan, buf);
+		__dahdi_process_putaudio_chunk(chan, buf);
+#ifdef CONFIG_DAHDI_MMX
+		dahdi_kernel_fpu_end();
+#endif
+	}
+	__dahdi_putbuf_chunk(chan, buf);
+}
+
+static inline void __dahdi_real_receive(struct dahdi_chan *chan)
+{
+	/* Called with chan->lock held */
+#ifdef	OPTIMIZE_CHANMUTE
+	if(likely(chan->chanmute))
+		return;
+#endif
+	if (chan->confmode) {
+		/* Load into queue if we have space */
+		__buf_push(&chan->confin, chan->readchunk);
+	} else {
+		__dahdi_receive_chunk(chan, chan->readchunk);
+	}
+}
+
+/**
+ * __transmit_to_slaves() - Distribute the tx data to all the slave channels.
+ *
+ */
+static void __transmit_to_slaves(struct dahdi_chan *const chan)
+{
+	u_char data[DAHDI_CHUNKSIZE];
+	int i;
+	int pos = DAHDI_CHUNKSIZE;
+	struct dahdi_chan *slave;
+	for (i = 0; i < DAHDI_CHUNKSIZE; i++) {
+		for (slave = chan; (NULL != slave); slave = slave->nextslave) {
+			if (pos == DAHDI_CHUNKSIZE) {
+				__dahdi_transmit_chunk(chan, data);
+				pos = 0;
+			}
+			slave->writechunk[i] = data[pos++];
+		}
+	}
+}
+
+int _dahdi_transmit(struct dahdi_span *span)
+{
+	unsigned long *const active = span->active_chans;
+	const u64 start = dahdi_tick_start();
+	unsigned int x;
+
+	for_each_span_chan_in(x, span, active) {
+		struct dahdi_chan *const chan = span->chans[x];
+		spin_lock(&chan->lock);
+		if (active && !chan_needs_txrx(chan) &&
+		    (--chan->txrx_drain <= 0))
+			clear_bit(x, active);
+		if (unlikely(chan->flags & DAHDI_FLAG_NOSTDTXRX)) {
+			spin_unlock(&chan->lock);
+			continue;
+		}
+		if (chan == chan->master) {
+			if (is_chan_dacsed(chan)) {
+				struct dahdi_chan *const src = chan->dacs_chan;
+				memcpy(chan->writechunk, src->readchunk,
+				       DAHDI_CHUNKSIZE);
+				if (chan->sig == DAHDI_SIG_DACS_RBS) {
+					/* Just set bits for our destination */
+					if (chan->txsig != src->rxsig) {
+						chan->txsig = src->rxsig;
+						span->ops->rbsbits(chan, src->rxsig);
+					}
+				}
+				/* there is no further processing to do for
+				 * DACS channels, so jump to the next channel
+				 * in the span */
+				spin_unlock(&chan->lock);
+				continue;
+			} else if (chan->nextslave) {
+				__transmit_to_slaves(chan);
+			} else {
+				/* Process a normal channel */
+				__dahdi_real_transmit(chan);
+			}
+			if (chan->otimer) {
+				chan->otimer -= DAHDI_CHUNKSIZE;
+				if (chan->otimer <= 0)
+					__rbs_otimer_expire(chan);
+			}
+		}
+		spin_unlock(&chan->lock);
+	}
+
+	if (span->mainttimer) {
+		span->mainttimer -= DAHDI_CHUNKSIZE;
+		if (span->mainttimer <= 0) {
+			span->mainttimer = 0;
+			span->maintstat = 0;
+		}
+	}
+
+	dahdi_span_notify_signal(span);
+	dahdi_tick_account(span_tick_stats(span), DAHDI_TICK_TRANSMIT, start);
+	return 0;
+}
+EXPORT_SYMBOL(_dahdi_transmit);
+
+/* Called with chan->lock held */
+static inline void __pseudo_rx_audio(struct dahdi_chan *chan)
+{
+	unsigned char tmp[DAHDI_CHUNKSIZE];
+	__dahdi_getempty(chan, tmp);
+	__dahdi_receive_chunk(chan, tmp);
+}
+
+#ifdef CONFIG_DAHDI_MIRROR
+static inline bool pseudo_is_mirror(const struct dahdi_chan *chan)
+{
+	return NULL != chan->srcmirror;
+}
+#else
+static inline bool pseudo_is_mirror(const struct dahdi_chan *chan)
+{
+	return false;
+}
+#endif /* CONFIG_DAHDI_MIRROR */
+
+#ifdef DAHDI_SYNC_TICK
+static inline void dahdi_sync_tick(struct dahdi_span *const s)
+{
+	if (s->ops->sync_tick)
+		s->ops->sync_tick(s, dahdi_is_sync_master(s));
+}
+#else
+#define dahdi_sync_tick(x) do { ; } while (0)
+#endif
+
+enum masterspan_phase {
+	MASTERSPAN_PHASE_RECEIVE,
+	MASTERSPAN_PHASE_TRANSMIT,
+};
+
+#ifdef CONFIG_DAHDI_SHARDED_MASTERSPAN
+static unsigned int masterspan_tick;
+
+/* True if @chan reads the audio of the channel it is conferenced to */
+static inline bool chan_is_monitor(const struct dahdi_chan *chan)
+{
+	switch (chan->confmode & DAHDI_CONF_MODE_MASK) {
+	case DAHDI_CONF_MONITOR:
+	case DAHDI_CONF_MONITORTX:
+	case DAHDI_CONF_MONITORBOTH:
+	case DAHDI_CONF_MONITOR_RX_PREECHO:
+	case DAHDI_CONF_MONITOR_TX_PREECHO:
+	case DAHDI_CONF_MONITORBOTH_PREECHO:
+	case DAHDI_CONF_DIGITALMON:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/**
+ * chan_in_shard() - True if @chan is processed by @shard out of @count.
+ *
+ * Conferenced channels are keyed on their conference so that every
+ * accumulator in conf_sums is only ever written from a single shard. This
+ * means the shards never need to merge partial sums.
+ *
+ * Monitoring channels read the getlin/putlin of the channel they monitor,
+ * which any shard may be writing at the time, so they are left to the
+ * extra pass numbered @count that the master runs once all the shards are
+ * done.  Must be called with chan->lock held.
+ */
+static inline bool chan_in_shard(const struct dahdi_chan *chan,
+				 int shard, int count)
+{
+	const unsigned int key = (chan->_confn) ? chan->_confn : chan->channo;
+
+	if (count <= 1)
+		return true;
+	if (chan_is_monitor(chan))
+		return shard == count;
+	return (key % count) == shard;
+}
+
+/**
+ * pseudo_claim() - Claim a pseudo channel for @shard for this tick.
+ *
+ * Pseudo channels are processed whatever their conference mode, and may
+ * leave a conference with only their own lock held. Claiming them once per
+ * tick makes sure that a channel whose key changes while the shards are
+ * running is never processed twice. Must be called with chan->lock held.
+ */
+static inline bool pseudo_claim(struct pseudo_chan *pseudo,
+				int shard, int count)
+{
+	if (count <= 1)
+		return true;
+	if (pseudo->claim_tick == masterspan_tick)
+		return false;
+	if (!chan_in_shard(&pseudo->chan, shard, count))
+		return false;
+	pseudo->claim_tick = masterspan_tick;
+	pseudo->claim_shard = shard;
+	return true;
+}
+
+static inline bool pseudo_is_claimed(const struct pseudo_chan *pseudo,
+				     int shard, int count)
+{
+	return (count <= 1) || ((pseudo->claim_tick == masterspan_tick) &&
+				(pseudo->claim_shard == shard));
+}
+#else
+#define chan_in_shard(chan, shard, count) (true)
+#define pseudo_claim(pseudo, shard, count) (true)
+#define pseudo_is_claimed(pseudo, shard, count) (true)
+#endif /* CONFIG_DAHDI_SHARDED_MASTERSPAN */
+
+/* Step 1 of _process_masterspan(). */
+static void masterspan_receive(int shard, int count)
+{
+	struct dahdi_span *s;
+	u_char *data;
+	int x;
+
+	list_for_each_entry(s, &span_list, spans_node) {
+		unsigned long *const conf_chans = s->conf_chans;
+
+		for_each_span_chan_in(x, s, conf_chans) {
+			struct dahdi_chan *const chan = s->chans[x];
+			if (!conf_chans && !chan->confmode)
+				continue;
+			spin_lock(&chan->lock);
+			if (!chan->confmode) {
+				/* Out of conference, stop looking at it */
+				if (conf_chans)
+					clear_bit(x, conf_chans);
+			} else if (chan_in_shard(chan, shard, count)) {
+				data = __buf_peek(&chan->confin);
+				__dahdi_receive_chunk(chan, data);
+				if (data)
+					__buf_pull(&chan->confin, NULL, chan);
+			}
+			spin_unlock(&chan->lock);
+		}
+	}
+}
+
+/* Step 3 of _process_masterspan(). */
+static void masterspan_pseudo_transmit(int shard, int count)
+{
+	struct pseudo_chan *pseudo;
+
+	list_for_each_entry(pseudo, &pseudo_chans, node) {
+		spin_lock(&pseudo->chan.lock);
+		if (pseudo_claim(pseudo, shard, count))
+			__dahdi_transmit_chunk(&pseudo->chan, NULL);
+		spin_unlock(&pseudo->chan.lock);
+	}
+}
+
+/* Steps 5 and 6 of _process_masterspan(). */
+static void masterspan_transmit(int shard, int count)
+{
+	struct pseudo_chan *pseudo;
+	struct dahdi_span *s;
+	u_char *data;
+	int x;
+
+	/* do all the pseudo/conferenced channel transmits (putbuf's) */
+	list_for_each_entry(pseudo, &pseudo_chans, node) {
+		struct dahdi_chan *const chan = &pseudo->chan;
+		if (pseudo_is_mirror(chan) ||
+		    !pseudo_is_claimed(pseudo, shard, count))
+			continue;
+		spin_lock(&chan->lock);
+		__pseudo_rx_audio(chan);
+		spin_unlock(&chan->lock);
+	}
+
+	list_for_each_entry(s, &span_list, spans_node) {
+		for_each_span_chan_in(x, s, s->conf_chans) {
+			struct dahdi_chan *const chan = s->chans[x];
+			if (!chan->confmode)
+				continue;
+			spin_lock(&chan->lock);
+			if (chan->confmode &&
+			    chan_in_shard(chan, shard, count)) {
+				data = __buf_pushpeek(&chan->confout);
+				__dahdi_transmit_chunk(chan, data);
+				if (data)
+					__buf_push(&chan->confout, NULL);
+			}
+			spin_unlock(&chan->lock);
+		}
+	}
+}
+
+#ifdef CONFIG_DAHDI_CONFLINK
+/* Step 4 of _process_masterspan(). */
+static void masterspan_conflinks(void)
+{
+	int x;
+	int z;
+	int y;
+
+	if (!maxlinks)
+		return;
+#ifdef CONFIG_DAHDI_MMX
+	dahdi_kernel_fpu_begin();
+#endif
+	/* process all the conf links */
+	for (x = 1; x <= maxlinks; x++) {
+		/* if we have a destination conf */
+		z = confalias[conf_links[x].dst];
+		if (z) {
+			y = confalias[conf_links[x].src];
+			if (y)
+				ACSS(conf_sums[z], conf_sums[y]);
+		}
+	}
 #ifdef CONFIG_DAHDI_MMX
-		dahdi_kernel_fpu_end();
+	dahdi_kernel_fpu_end();
 #endif
+}
+#else
+static inline void masterspan_conflinks(void) { }
+#endif /* CONFIG_DAHDI_CONFLINK */
+
+#ifdef CONFIG_DAHDI_SHARDED_MASTERSPAN
+
+static int masterspan_shards = 1;
+
+enum {
+	SHARD_IDLE,
+	SHARD_PENDING,
+	SHARD_RUNNING,
+};
+
+/**
+ * struct masterspan_shard - One slice of the per-tick conferencing work.
+ * @work:	Used to kick the shard on its own CPU from the master tick.
+ * @state:	SHARD_IDLE, SHARD_PENDING or SHARD_RUNNING.
+ * @cpu:	The CPU the shard is normally run on.
+ * @tick_ns:	Time spent in the shard so far this tick.
+ * @ticks:	Number of ticks the shard has run.
+ * @stolen:	Number of phases the master ran itself because @cpu had not
+ *		picked the work up yet.
+ * @last_ns:	Time spent in the shard during the last tick.
+ * @max_ns:	Longest time spent in the shard during a single tick.
+ * @total_ns:	Total time spent in the shard.
+ *
+ */
+struct masterspan_shard {
+	struct irq_work work;
+	atomic_t state;
+	int cpu;
+	u64 tick_ns;
+	u64 ticks;
+	u64 stolen;
+	u64 last_ns;
+	u64 max_ns;
+	u64 total_ns;
+} ____cacheline_aligned_in_smp;
+
+static struct masterspan_shard *shards;
+static int nr_shards;
+static enum masterspan_phase shard_phase;
+
+static void masterspan_run_shard(struct masterspan_shard *shard)
+{
+	const int index = shard - shards;
+	ktime_t start = ktime_get();
+
+	dahdi_sse2_begin();
+	if (MASTERSPAN_PHASE_RECEIVE == shard_phase) {
+		masterspan_receive(index, nr_shards);
+	} else {
+		masterspan_pseudo_transmit(index, nr_shards);
+		masterspan_transmit(index, nr_shards);
 	}
-	__dahdi_putbuf_chunk(chan, buf);
+	dahdi_sse2_end();
+
+	shard->tick_ns += ktime_to_ns(ktime_sub(ktime_get(), start));
+	if (MASTERSPAN_PHASE_TRANSMIT == shard_phase) {
+		shard->last_ns = shard->tick_ns;
+		shard->total_ns += shard->tick_ns;
+		if (shard->tick_ns > shard->max_ns)
+			shard->max_ns = shard->tick_ns;
+		shard->tick_ns = 0;
+		++shard->ticks;
+	}
+
+	/* Publish everything done in the shard before the master sees it
+	 * as idle again. */
+	smp_mb();
+	atomic_set(&shard->state, SHARD_IDLE);
 }
 
-static inline void __dahdi_real_receive(struct dahdi_chan *chan)
+static void masterspan_shard_func(struct irq_work *work)
 {
-	/* Called with chan->lock held */
-#ifdef	OPTIMIZE_CHANMUTE
-	if(likely(chan->chanmute))
+	struct masterspan_shard *const shard =
+			container_of(work, struct masterspan_shard, work);
+
+	/* The master may have already run this shard itself. */
+	if (atomic_cmpxchg(&shard->state, SHARD_PENDING, SHARD_RUNNING) !=
+	    SHARD_PENDING)
 		return;
-#endif
-	if (chan->confmode) {
-		/* Load into queue if we have space */
-		__buf_push(&chan->confin, chan->readchunk);
-	} else {
-		__dahdi_receive_chunk(chan, chan->readchunk);
-	}
+	masterspan_run_shard(shard);
 }
 
 /**
- * __transmit_to_slaves() - Distribute the tx data to all the slave channels.
+ * masterspan_run_phase() - Run one phase of the tick on all the shards.
  *
+ * Called with chan_lock held, which the shards running on other CPUs rely
+ * on to keep the span and pseudo channel lists stable. Shard 0 is always
+ * run on the calling CPU. Any shard that another CPU has not started by the
+ * time shard 0 is done is run here as well, so a busy or offline CPU can only
+ * slow the tick down, never stall it. The monitoring channels are run last,
+ * here, after all the shards.
  */
-static void __transmit_to_slaves(struct dahdi_chan *const chan)
+static void masterspan_run_phase(enum masterspan_phase phase)
 {
-	u_char data[DAHDI_CHUNKSIZE];
+	const int this_cpu = smp_processor_id();
 	int i;
-	int pos = DAHDI_CHUNKSIZE;
-	struct dahdi_chan *slave;
-	for (i = 0; i < DAHDI_CHUNKSIZE; i++) {
-		for (slave = chan; (NULL != slave); slave = slave->nextslave) {
-			if (pos == DAHDI_CHUNKSIZE) {
-				__dahdi_transmit_chunk(chan, data);
-				pos = 0;
-			}
-			slave->writechunk[i] = data[pos++];
-		}
+
+	shard_phase = phase;
+	smp_wmb();
+
+	for (i = 1; i < nr_shards; ++i) {
+		struct masterspan_shard *const shard = &shards[i];
+		atomic_set(&shard->state, SHARD_PENDING);
+		if ((shard->cpu != this_cpu) && cpu_online(shard->cpu))
+			irq_work_queue_on(&shard->work, shard->cpu);
 	}
-}
 
-int _dahdi_transmit(struct dahdi_span *span)
-{
-	unsigned int x;
+	atomic_set(&shards[0].state, SHARD_RUNNING);
+	masterspan_run_shard(&shards[0]);
 
-	for (x=0;x<span->channels;x++) {
-		struct dahdi_chan *const chan = span->chans[x];
-		spin_lock(&chan->lock);
-		if (unlikely(chan->flags & DAHDI_FLAG_NOSTDTXRX)) {
-			spin_unlock(&chan->lock);
-			continue;
-		}
-		if (chan == chan->master) {
-			if (is_chan_dacsed(chan)) {
-				struct dahdi_chan *const src = chan->dacs_chan;
-				memcpy(chan->writechunk, src->readchunk,
-				       DAHDI_CHUNKSIZE);
-				if (chan->sig == DAHDI_SIG_DACS_RBS) {
-					/* Just set bits for our destination */
-					if (chan->txsig != src->rxsig) {
-						chan->txsig = src->rxsig;
-						span->ops->rbsbits(chan, src->rxsig);
-					}
-				}
-				/* there is no further processing to do for
-				 * DACS channels, so jump to the next channel
-				 * in the span */
-				spin_unlock(&chan->lock);
-				continue;
-			} else if (chan->nextslave) {
-				__transmit_to_slaves(chan);
-			} else {
-				/* Process a normal channel */
-				__dahdi_real_transmit(chan);
-			}
-			if (chan->otimer) {
-				chan->otimer -= DAHDI_CHUNKSIZE;
-				if (chan->otimer <= 0)
-					__rbs_otimer_expire(chan);
-			}
+	for (i = 1; i < nr_shards; ++i) {
+		struct masterspan_shard *const shard = &shards[i];
+		if (atomic_cmpxchg(&shard->state, SHARD_PENDING,
+				   SHARD_RUNNING) == SHARD_PENDING) {
+			++shard->stolen;
+			masterspan_run_shard(shard);
 		}
-		spin_unlock(&chan->lock);
 	}
 
-	if (span->mainttimer) {
-		span->mainttimer -= DAHDI_CHUNKSIZE;
-		if (span->mainttimer <= 0) {
-			span->mainttimer = 0;
-			span->maintstat = 0;
-		}
+	for (i = 1; i < nr_shards; ++i) {
+		while (atomic_read(&shards[i].state) != SHARD_IDLE)
+			cpu_relax();
 	}
-	return 0;
+	smp_rmb();
+
+	/* Now nothing else is running, the monitoring channels */
+	dahdi_sse2_begin();
+	if (MASTERSPAN_PHASE_RECEIVE == phase) {
+		masterspan_receive(nr_shards, nr_shards);
+	} else {
+		masterspan_pseudo_transmit(nr_shards, nr_shards);
+		masterspan_transmit(nr_shards, nr_shards);
+	}
+	dahdi_sse2_end();
 }
-EXPORT_SYMBOL(_dahdi_transmit);
 
-static inline void __pseudo_rx_audio(struct dahdi_chan *chan)
+static inline bool masterspan_is_sharded(void)
 {
-	unsigned char tmp[DAHDI_CHUNKSIZE];
-	spin_lock(&chan->lock);
-	__dahdi_getempty(chan, tmp);
-	__dahdi_receive_chunk(chan, tmp);
-	spin_unlock(&chan->lock);
+#ifdef CONFIG_DAHDI_CONFLINK
+	/* Conference links add one conference into another, which would
+	 * cross shards. */
+	if (maxlinks)
+		return false;
+#endif
+	return nr_shards > 1;
 }
 
-#ifdef CONFIG_DAHDI_MIRROR
-static inline void pseudo_rx_audio(struct dahdi_chan *chan)
+static void masterspan_shards_init(void)
 {
-	if (!chan->srcmirror)
-		__pseudo_rx_audio(chan);
+	int cpu;
+	int i = 0;
+
+	nr_shards = min(masterspan_shards, (int)num_online_cpus());
+	if (nr_shards <= 1) {
+		nr_shards = 0;
+		return;
+	}
+
+	shards = kcalloc(nr_shards, sizeof(*shards), GFP_KERNEL);
+	if (!shards) {
+		module_printk(KERN_NOTICE, "Failed to allocate %d masterspan "
+			      "shards. Processing on one CPU.\n", nr_shards);
+		nr_shards = 0;
+		return;
+	}
+
+	for_each_online_cpu(cpu) {
+		if (i >= nr_shards)
+			break;
+		init_irq_work(&shards[i].work, masterspan_shard_func);
+		atomic_set(&shards[i].state, SHARD_IDLE);
+		shards[i].cpu = cpu;
+		++i;
+	}
+	nr_shards = i;
+	module_printk(KERN_INFO, "Processing conferences in %d shards.\n",
+		      nr_shards);
 }
-#else
-static inline void pseudo_rx_audio(struct dahdi_chan *chan)
+
+static void masterspan_shards_cleanup(void)
 {
-	__pseudo_rx_audio(chan);
+	int i;
+
+	if (!shards)
+		return;
+	for (i = 0; i < nr_shards; ++i)
+		irq_work_sync(&shards[i].work);
+	kfree(shards);
+	shards = NULL;
+	nr_shards = 0;
 }
-#endif /* CONFIG_DAHDI_MIRROR */
 
-#ifdef DAHDI_SYNC_TICK
-static inline void dahdi_sync_tick(struct dahdi_span *const s)
+/**
+ * dahdi_masterspan_shards_show() - Print the per shard timing counters.
+ *
+ * Used by the "masterspan_shards" attribute of the dahdi_spans bus driver.
+ */
+ssize_t dahdi_masterspan_shards_show(char *buf, size_t size)
 {
-	if (s->ops->sync_tick)
-		s->ops->sync_tick(s, dahdi_is_sync_master(s));
+	int i;
+	ssize_t len = 0;
+
+	len += scnprintf(buf + len, size - len,
+			 "shard cpu ticks stolen last_ns max_ns avg_ns\n");
+	for (i = 0; i < nr_shards; ++i) {
+		const struct masterspan_shard *const shard = &shards[i];
+		const u64 ticks = shard->ticks;
+		len += scnprintf(buf + len, size - len,
+				 "%d %d %llu %llu %llu %llu %llu\n",
+				 i, shard->cpu, ticks, shard->stolen,
+				 shard->last_ns, shard->max_ns,
+				 (ticks) ? div64_u64(shard->total_ns, ticks) :
+					   0ULL);
+	}
+	return len;
 }
+
 #else
-#define dahdi_sync_tick(x) do { ; } while (0)
-#endif
+
+static inline bool masterspan_is_sharded(void) { return false; }
+static inline void masterspan_run_phase(enum masterspan_phase phase) { }
+static inline void masterspan_shards_init(void) { }
+static inline void masterspan_shards_cleanup(void) { }
+
+#endif /* CONFIG_DAHDI_SHARDED_MASTERSPAN */
 
 /**
  * _process_masterspan - Handle conferencing and timers.
@@ -9923,13 +13021,16 @@ static inline void dahdi_sync_tick(struct dahdi_span *const s)
  * the next sample chunk accumulators (conf_sums_next) to be processed as part
  * of the next sample chunk's data (next time around the world).
  *
+ * With CONFIG_DAHDI_SHARDED_MASTERSPAN and the masterspan_shards module
+ * parameter set, steps 1 and 3-6 are split between several CPUs. Channels are
+ * divided by conference, so each accumulator is still only touched by one CPU,
+ * and only step 2 and the conference links run on the master alone.
+ *
  */
 static void _process_masterspan(void)
 {
-	int x;
-	struct pseudo_chan *pseudo;
+	const u64 start = dahdi_tick_start();
 	struct dahdi_span *s;
-	u_char *data;
 
 #ifdef CONFIG_DAHDI_CORE_TIMER
 	/* We increment the calls since start here, so that if we switch over
@@ -9945,74 +13046,36 @@ static void _process_masterspan(void)
 	/* Process any timers */
 	process_timers();
 
-	list_for_each_entry(s, &span_list, spans_node) {
-		for (x = 0; x < s->channels; ++x) {
-			struct dahdi_chan *const chan = s->chans[x];
-			if (!chan->confmode)
-				continue;
-			spin_lock(&chan->lock);
-			data = __buf_peek(&chan->confin);
-			__dahdi_receive_chunk(chan, data);
-			if (data)
-				__buf_pull(&chan->confin, NULL, chan);
-			spin_unlock(&chan->lock);
-		}
-	}
+	if (masterspan_is_sharded()) {
+#ifdef CONFIG_DAHDI_SHARDED_MASTERSPAN
+		++masterspan_tick;
+#endif
+		masterspan_run_phase(MASTERSPAN_PHASE_RECEIVE);
+		rotate_sums();
+		masterspan_run_phase(MASTERSPAN_PHASE_TRANSMIT);
+	} else {
+		dahdi_sse2_begin();
+		masterspan_receive(0, 1);
 
-	/* This is the master channel, so make things switch over */
-	rotate_sums();
+		/* This is the master channel, so make things switch over */
+		rotate_sums();
 
-	/* do all the pseudo and/or conferenced channel receives (getbuf's) */
-	list_for_each_entry(pseudo, &pseudo_chans, node) {
-		spin_lock(&pseudo->chan.lock);
-		__dahdi_transmit_chunk(&pseudo->chan, NULL);
-		spin_unlock(&pseudo->chan.lock);
-	}
+		/* do all the pseudo and/or conferenced channel receives
+		 * (getbuf's) */
+		masterspan_pseudo_transmit(0, 1);
 
-#ifdef CONFIG_DAHDI_CONFLINK
-	if (maxlinks) {
-		int z;
-		int y;
-#ifdef CONFIG_DAHDI_MMX
-		dahdi_kernel_fpu_begin();
-#endif
-		/* process all the conf links */
-		for (x = 1; x <= maxlinks; x++) {
-			/* if we have a destination conf */
-			z = confalias[conf_links[x].dst];
-			if (z) {
-				y = confalias[conf_links[x].src];
-				if (y)
-					ACSS(conf_sums[z], conf_sums[y]);
-			}
-		}
-#ifdef CONFIG_DAHDI_MMX
-		dahdi_kernel_fpu_end();
-#endif
-	}
-#endif /* CONFIG_DAHDI_CONFLINK */
+		masterspan_conflinks();
 
-	/* do all the pseudo/conferenced channel transmits (putbuf's) */
-	list_for_each_entry(pseudo, &pseudo_chans, node) {
-		pseudo_rx_audio(&pseudo->chan);
+		masterspan_transmit(0, 1);
+		dahdi_sse2_end();
 	}
 
-	list_for_each_entry(s, &span_list, spans_node) {
-		for (x = 0; x < s->channels; x++) {
-			struct dahdi_chan *const chan = s->chans[x];
-			if (!chan->confmode)
-				continue;
-			spin_lock(&chan->lock);
-			data = __buf_pushpeek(&chan->confout);
-			__dahdi_transmit_chunk(chan, data);
-			if (data)
-				__buf_push(&chan->confout, NULL);
-			spin_unlock(&chan->lock);
-		}
-
+	list_for_each_entry(s, &span_list, spans_node)
 		dahdi_sync_tick(s);
-	}
+
 	spin_unlock(&chan_lock);
+
+	dahdi_tick_account(master_tick_stats, DAHDI_TICK_MASTERSPAN, start);
 }
 
 #ifndef CONFIG_DAHDI_CORE_TIMER
@@ -10029,76 +13092,53 @@ static void coretimer_cleanup(void)
 
 #else
 
-static inline unsigned long msecs_processed(const struct core_timer *const ct)
+static void coretimer_account(s64 late_ns, int batch)
 {
-	return atomic_read(&ct->count) * DAHDI_MSECS_PER_CHUNK;
+	int i;
+
+	for (i = 0; i < CORE_TIMER_LATE_BUCKETS - 1; i++) {
+		if (late_ns < core_timer_late_us[i] * NSEC_PER_USEC)
+			break;
+	}
+	core_timer.late_hist[i]++;
+	if (late_ns > core_timer.max_late_ns)
+		core_timer.max_late_ns = late_ns;
+
+	if (batch <= 4)
+		core_timer.batch_hist[batch - 1]++;
+	else if (batch <= 8)
+		core_timer.batch_hist[4]++;
+	else
+		core_timer.batch_hist[5]++;
 }
 
-static void coretimer_func(TIMER_DATA_TYPE unused)
+/**
+ * coretimer_func() - Provide timing when no span does.
+ *
+ * Tick n is due at start_interval + n + 1 chunks on CLOCK_MONOTONIC, and the
+ * timer is always armed for an absolute time, so the rate does not depend
+ * on HZ and neither timer slack nor rebasing accumulates into drift.  When
+ * it has fallen behind, up to core_timer_max_batch ticks are run in one go
+ * and the next expiry is brought forward to half a chunk, so a backlog is
+ * worked off at a bounded rate rather than in one long burst.
+ */
+static enum hrtimer_restart coretimer_func(struct hrtimer *timer)
 {
-	unsigned long flags;
-	long ms_since_start;
-	ktime_t now;
-	const unsigned long MAX_INTERVAL = 100000L;
-	const unsigned long ONESEC_INTERVAL = HZ;
-	const long MS_LIMIT = 3000;
-	long difference;
+	const s64 period_ns = DAHDI_MSECS_PER_CHUNK * NSEC_PER_MSEC;
+	const s64 MS_LIMIT_NS = 3000LL * NSEC_PER_MSEC;
+	const int MAX_COUNT = 100000;
+	ktime_t now, next;
+	s64 ns_since_start, late_ns;
+	int batch;
+
+	if (atomic_read(&core_timer.shutdown))
+		return HRTIMER_NORESTART;
 
 	now = ktime_get();
 
-	if (atomic_read(&core_timer.count) ==
+	if (atomic_read(&core_timer.count) !=
 	    atomic_read(&core_timer.last_count)) {
 
-		/* This is the code path if a board driver is not calling
-		 * dahdi_receive, and therefore the core of dahdi needs to
-		 * perform the master span processing itself. */
-		if (core_timer.dahdi_receive_used) {
-			core_timer.dahdi_receive_used = 0;
-			dahdi_dbg(GENERAL, "Master changed to core_timer\n");
-		}
-
-		if (!atomic_read(&core_timer.shutdown)) {
-			mod_timer(&core_timer.timer, jiffies +
-				  core_timer.interval);
-		}
-
-		ms_since_start = ktime_ms_delta(now, core_timer.start_interval);
-
-		/*
-		 * If the system time has changed, it is possible for us to be
-		 * far behind.  If we are more than MS_LIMIT milliseconds
-		 * behind (or ahead in time), just reset our time base and
-		 * continue so that we do not hang the system here.
-		 *
-		 */
-		difference = ms_since_start - msecs_processed(&core_timer);
-		if (unlikely((difference >  MS_LIMIT) || (difference < 0))) {
-			if (printk_ratelimit()) {
-				module_printk(KERN_INFO,
-					      "Detected time shift.\n");
-			}
-			atomic_set(&core_timer.count, 0);
-			atomic_set(&core_timer.last_count, 0);
-			core_timer.start_interval = now;
-			return;
-		}
-
-		local_irq_save(flags);
-		while (ms_since_start > msecs_processed(&core_timer))
-			_process_masterspan();
-		local_irq_restore(flags);
-
-		if (ms_since_start > MAX_INTERVAL) {
-			atomic_set(&core_timer.count, 0);
-			atomic_set(&core_timer.last_count, 0);
-			core_timer.start_interval = now;
-		} else {
-			atomic_set(&core_timer.last_count,
-				   atomic_read(&core_timer.count));
-		}
-
-	} else {
-
 		/* It looks like a board driver is calling dahdi_receive. We
 		 * will just check again in a second. */
 		if (!core_timer.dahdi_receive_used) {
@@ -10107,29 +13147,134 @@ static void coretimer_func(TIMER_DATA_TYPE unused)
 		}
 		atomic_set(&core_timer.count, 0);
 		atomic_set(&core_timer.last_count, 0);
+		core_timer.start_interval = ktime_add_ns(now, NSEC_PER_SEC);
+		hrtimer_set_expires(timer,
+				    ktime_add_ns(core_timer.start_interval,
+						 period_ns));
+		return HRTIMER_RESTART;
+	}
+
+	/* This is the code path if a board driver is not calling
+	 * dahdi_receive, and therefore the core of dahdi needs to
+	 * perform the master span processing itself. */
+	if (core_timer.dahdi_receive_used) {
+		core_timer.dahdi_receive_used = 0;
+		dahdi_dbg(GENERAL, "Master changed to core_timer\n");
+	}
+
+	/* How late the oldest tick we owe is */
+	ns_since_start = ktime_to_ns(ktime_sub(now, core_timer.start_interval));
+	late_ns = ns_since_start -
+		  (s64)(atomic_read(&core_timer.count) + 1) * period_ns;
+
+	/*
+	 * If we were held off for a long time, do not try to make all of it
+	 * up; just start over from here so that we do not hang the system.
+	 */
+	if (unlikely((late_ns > MS_LIMIT_NS) || (late_ns < 0))) {
+		if (printk_ratelimit()) {
+			module_printk(KERN_INFO,
+				      "Core timer fell %lld ms behind.\n",
+				      div_s64(late_ns, NSEC_PER_MSEC));
+		}
+		core_timer.resets++;
+		atomic_set(&core_timer.count, 0);
+		atomic_set(&core_timer.last_count, 0);
 		core_timer.start_interval = now;
-		if (!atomic_read(&core_timer.shutdown))
-			mod_timer(&core_timer.timer, jiffies + ONESEC_INTERVAL);
+		hrtimer_set_expires(timer, ktime_add_ns(now, period_ns));
+		return HRTIMER_RESTART;
+	}
+
+	batch = 0;
+	do {
+		_process_masterspan();
+		batch++;
+	} while ((batch < max(core_timer_max_batch, 1)) &&
+		 (late_ns - batch * period_ns >= 0));
+	coretimer_account(late_ns, batch);
+
+	/* Move the time base forward by whole ticks so that the count does
+	 * not overflow; this keeps the phase exactly. */
+	if (atomic_read(&core_timer.count) > MAX_COUNT) {
+		core_timer.start_interval =
+			ktime_add_ns(core_timer.start_interval,
+				     (s64)atomic_read(&core_timer.count) *
+				     period_ns);
+		atomic_set(&core_timer.count, 0);
 	}
+	atomic_set(&core_timer.last_count, atomic_read(&core_timer.count));
+
+	next = ktime_add_ns(core_timer.start_interval,
+			    (s64)(atomic_read(&core_timer.count) + 1) *
+			    period_ns);
+	if (ktime_before(next, now))
+		next = ktime_add_ns(now, period_ns / 2);
+	hrtimer_set_expires(timer, next);
+	return HRTIMER_RESTART;
+}
+
+/**
+ * dahdi_core_timer_show() - Print the core timer histograms.
+ *
+ * Used by the "core_timer" attribute of the dahdi_spans bus driver.  The
+ * lateness of each expiry is counted in buckets by upper bound in
+ * microseconds, and the number of ticks run by the expiry in buckets by
+ * size.
+ */
+ssize_t dahdi_core_timer_show(char *buf, size_t size)
+{
+	static const char *const batch_names[CORE_TIMER_BATCH_BUCKETS] = {
+		"1", "2", "3", "4", "8", "inf",
+	};
+	ssize_t len = 0;
+	int i;
+
+	len += scnprintf(buf + len, size - len, "active %d\n",
+			 !core_timer.dahdi_receive_used);
+	len += scnprintf(buf + len, size - len, "late_us");
+	for (i = 0; i < CORE_TIMER_LATE_BUCKETS; i++) {
+		if (i < CORE_TIMER_LATE_BUCKETS - 1)
+			len += scnprintf(buf + len, size - len, " %u:%lu",
+					 core_timer_late_us[i],
+					 core_timer.late_hist[i]);
+		else
+			len += scnprintf(buf + len, size - len, " inf:%lu",
+					 core_timer.late_hist[i]);
+	}
+	len += scnprintf(buf + len, size - len, "\nbatch");
+	for (i = 0; i < CORE_TIMER_BATCH_BUCKETS; i++)
+		len += scnprintf(buf + len, size - len, " %s:%lu",
+				 batch_names[i], core_timer.batch_hist[i]);
+	len += scnprintf(buf + len, size - len,
+			 "\nmax_late_ns %lld\nresets %lu\n",
+			 core_timer.max_late_ns, core_timer.resets);
+	return len;
 }
 
 static void coretimer_init(void)
 {
-	timer_setup(&core_timer.timer, coretimer_func, 0);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 15, 0)
+	hrtimer_setup(&core_timer.timer, coretimer_func, CLOCK_MONOTONIC,
+		      HRTIMER_MODE_ABS);
+#else
+	hrtimer_init(&core_timer.timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	core_timer.timer.function = coretimer_func;
+#endif
 
 	core_timer.start_interval = ktime_get();
 	atomic_set(&core_timer.count, 0);
+	atomic_set(&core_timer.last_count, 0);
 	atomic_set(&core_timer.shutdown, 0);
-	core_timer.interval = max(msecs_to_jiffies(DAHDI_MSECS_PER_CHUNK), 1UL);
-	if (core_timer.interval < (HZ/250))
-		core_timer.interval = (HZ/250);
-	mod_timer(&core_timer.timer, jiffies + core_timer.interval);
+	hrtimer_start(&core_timer.timer,
+		      ktime_add_ns(core_timer.start_interval,
+				   DAHDI_MSECS_PER_CHUNK * NSEC_PER_MSEC),
+		      HRTIMER_MODE_ABS);
 }
 
 static void coretimer_cleanup(void)
 {
 	atomic_set(&core_timer.shutdown, 1);
-	del_timer_sync(&core_timer.timer);
+	hrtimer_cancel(&core_timer.timer);
 }
 
 #endif /* CONFIG_DAHDI_CORE_TIMER */
@@ -10165,12 +13310,16 @@ static inline bool should_skip_receive(const struct dahdi_chan *const chan)
 
 int _dahdi_receive(struct dahdi_span *span)
 {
+	unsigned long *const active = span->active_chans;
+	const u64 start = dahdi_tick_start();
 	unsigned int x;
 
 #ifdef CONFIG_DAHDI_WATCHDOG
 	span->watchcounter--;
 #endif
-	for (x = 0; x < span->channels; x++) {
+	dahdi_tone_span(span);
+
+	for_each_span_chan_in(x, span, active) {
 		struct dahdi_chan *const chan = span->chans[x];
 		spin_lock(&chan->lock);
 		if (should_skip_receive(chan)) {
@@ -10230,9 +13379,13 @@ int _dahdi_receive(struct dahdi_span *span)
 		spin_unlock(&chan->lock);
 	}
 
+	dahdi_tick_account(span_tick_stats(span), DAHDI_TICK_RECEIVE, start);
+
 	if (dahdi_is_sync_master(span))
 		_process_masterspan();
 
+	dahdi_span_notify_signal(span);
+
 	return 0;
 }
 EXPORT_SYMBOL(_dahdi_receive);
@@ -10263,6 +13416,30 @@ MODULE_PARM_DESC(auto_assign_spans,
 		 "channel numbers assigned by the driver. If 0, user space "
 		 "will need to assign them via /sys/bus/dahdi_devices.");
 
+#ifdef CONFIG_DAHDI_CORE_TIMER
+module_param(core_timer_max_batch, int, 0644);
+MODULE_PARM_DESC(core_timer_max_batch,
+		 "Most ticks the core timer runs in one go while catching up "
+		 "after it was held off (default 2).");
+#endif
+
+#ifdef CONFIG_DAHDI_SHARDED_MASTERSPAN
+module_param(masterspan_shards, int, 0444);
+MODULE_PARM_DESC(masterspan_shards,
+		 "Number of CPUs to split the per-tick conference processing "
+		 "between. 1 (the default) keeps it all on the CPU providing "
+		 "timing.");
+#endif
+
+#ifdef CONFIG_DAHDI_EC_OFFLOAD
+module_param(ec_offload, int, 0444);
+MODULE_PARM_DESC(ec_offload,
+		 "Number of CPUs to run software echo cancellation on, in "
+		 "threads outside of the card interrupts. Each span is kept "
+		 "on one of them. 0 (the default) cancels echo in the "
+		 "interrupt.");
+#endif
+
 
 static ssize_t dahdi_no_read(struct file *file, char __user *usrbuf,
 			     size_t count, loff_t *ppos)
@@ -10367,6 +13544,7 @@ static const struct file_operations dahdi_chan_fops = {
 	.read    = dahdi_chan_read,
 	.write   = dahdi_chan_write,
 	.poll    = dahdi_chan_poll,
+	.mmap    = dahdi_chan_mmap,
 };
 
 #ifdef CONFIG_DAHDI_WATCHDOG
@@ -10444,9 +13622,17 @@ static int __init dahdi_init(void)
 
 	dahdi_conv_init();
 	fasthdlc_precalc();
+	res = conf_pool_init();
+	if (res)
+		goto failed_conf_pool;
 	rotate_sums();
+	masterspan_shards_init();
+	ec_offload_init();
 #ifdef CONFIG_DAHDI_WATCHDOG
 	watchdog_init();
+#endif
+#ifdef CONFIG_DAHDI_TICK_STATS
+	master_tick_stats = alloc_percpu(struct dahdi_tick_stats);
 #endif
 	coretimer_init();
 
@@ -10460,6 +13646,14 @@ static int __init dahdi_init(void)
 
 failed_register_ec_factory:
 	coretimer_cleanup();
+#ifdef CONFIG_DAHDI_TICK_STATS
+	free_percpu(master_tick_stats);
+	master_tick_stats = NULL;
+#endif
+	ec_offload_cleanup();
+	masterspan_shards_cleanup();
+	conf_pool_cleanup();
+failed_conf_pool:
 	dahdi_sysfs_exit();
 failed_driver_init:
 	if (root_proc_entry) {
@@ -10480,7 +13674,14 @@ static void __exit dahdi_cleanup(void)
 
 	dahdi_unregister_echocan_factory(&hwec_factory);
 	coretimer_cleanup();
+	ec_offload_cleanup();
+	masterspan_shards_cleanup();
+	conf_pool_cleanup();
 	dahdi_sysfs_exit();
+#ifdef CONFIG_DAHDI_TICK_STATS
+	free_percpu(master_tick_stats);
+	master_tick_stats = NULL;
+#endif
 
 #ifdef CONFIG_PROC_FS
 	if (root_proc_entry) {
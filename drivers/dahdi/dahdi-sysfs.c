@@ -196,6 +196,26 @@ static BUS_ATTR_READER(linecompat_show, dev, buf)
 	return len;
 }
 
+#ifdef CONFIG_DAHDI_TICK_STATS
+static BUS_ATTR_READER(tick_stats_show, dev, buf)
+{
+	struct dahdi_span *span;
+
+	span = dev_to_span(dev);
+	return dahdi_span_tick_stats_show(span, buf, PAGE_SIZE);
+}
+
+/* Writing anything clears the counters */
+static BUS_ATTR_WRITER(tick_stats_store, dev, buf, count)
+{
+	struct dahdi_span *span;
+
+	span = dev_to_span(dev);
+	dahdi_span_tick_stats_clear(span);
+	return count;
+}
+#endif
+
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4, 13, 0)
 static struct device_attribute span_dev_attrs[] = {
 	__ATTR_RO(name),
@@ -211,6 +231,10 @@ static struct device_attribute span_dev_attrs[] = {
 	__ATTR_RO(channels),
 	__ATTR_RO(lineconfig),
 	__ATTR_RO(linecompat),
+#ifdef CONFIG_DAHDI_TICK_STATS
+	__ATTR(tick_stats, S_IRUGO | S_IWUSR, tick_stats_show,
+			tick_stats_store),
+#endif
 	__ATTR_NULL,
 };
 #else
@@ -227,6 +251,9 @@ static DEVICE_ATTR_RO(basechan);
 static DEVICE_ATTR_RO(channels);
 static DEVICE_ATTR_RO(lineconfig);
 static DEVICE_ATTR_RO(linecompat);
+#ifdef CONFIG_DAHDI_TICK_STATS
+static DEVICE_ATTR_RW(tick_stats);
+#endif
 
 static struct attribute *span_dev_attrs[] = {
 	&dev_attr_name.attr,
@@ -242,6 +269,9 @@ static struct attribute *span_dev_attrs[] = {
 	&dev_attr_channels.attr,
 	&dev_attr_lineconfig.attr,
 	&dev_attr_linecompat.attr,
+#ifdef CONFIG_DAHDI_TICK_STATS
+	&dev_attr_tick_stats.attr,
+#endif
 	NULL,
 };
 ATTRIBUTE_GROUPS(span_dev);
@@ -267,16 +297,89 @@ static ssize_t master_span_store(struct device_driver *driver, const char *buf,
 	return count;
 }
 
+#ifdef CONFIG_DAHDI_SHARDED_MASTERSPAN
+static ssize_t masterspan_shards_show(struct device_driver *driver, char *buf)
+{
+	return dahdi_masterspan_shards_show(buf, PAGE_SIZE);
+}
+#endif
+
+#ifdef CONFIG_DAHDI_EC_OFFLOAD
+static ssize_t ec_offload_show(struct device_driver *driver, char *buf)
+{
+	return dahdi_ec_offload_show(buf, PAGE_SIZE);
+}
+#endif
+
+#ifdef CONFIG_DAHDI_CORE_TIMER
+static ssize_t core_timer_show(struct device_driver *driver, char *buf)
+{
+	return dahdi_core_timer_show(buf, PAGE_SIZE);
+}
+#endif
+
+#ifdef CONFIG_DAHDI_TICK_STATS
+static ssize_t masterspan_tick_stats_show(struct device_driver *driver,
+					  char *buf)
+{
+	return dahdi_tick_stats_show(buf, PAGE_SIZE);
+}
+
+static ssize_t masterspan_tick_stats_store(struct device_driver *driver,
+					   const char *buf, size_t count)
+{
+	dahdi_tick_stats_clear_master();
+	return count;
+}
+#endif
+
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3, 13, 0)
 static struct driver_attribute dahdi_attrs[] = {
 	__ATTR(master_span, S_IRUGO | S_IWUSR, master_span_show,
 			master_span_store),
+#ifdef CONFIG_DAHDI_SHARDED_MASTERSPAN
+	__ATTR_RO(masterspan_shards),
+#endif
+#ifdef CONFIG_DAHDI_EC_OFFLOAD
+	__ATTR_RO(ec_offload),
+#endif
+#ifdef CONFIG_DAHDI_CORE_TIMER
+	__ATTR_RO(core_timer),
+#endif
+#ifdef CONFIG_DAHDI_TICK_STATS
+	__ATTR(masterspan_tick_stats, S_IRUGO | S_IWUSR,
+			masterspan_tick_stats_show, masterspan_tick_stats_store),
+#endif
 	__ATTR_NULL,
 };
 #else
 static DRIVER_ATTR_RW(master_span);
+#ifdef CONFIG_DAHDI_SHARDED_MASTERSPAN
+static DRIVER_ATTR_RO(masterspan_shards);
+#endif
+#ifdef CONFIG_DAHDI_EC_OFFLOAD
+static DRIVER_ATTR_RO(ec_offload);
+#endif
+#ifdef CONFIG_DAHDI_CORE_TIMER
+static DRIVER_ATTR_RO(core_timer);
+#endif
+#ifdef CONFIG_DAHDI_TICK_STATS
+static DRIVER_ATTR_RW(masterspan_tick_stats);
+#endif
 static struct attribute *dahdi_attrs[] = {
 	&driver_attr_master_span.attr,
+#ifdef CONFIG_DAHDI_SHARDED_MASTERSPAN
+	&driver_attr_masterspan_shards.attr,
+#endif
+#ifdef CONFIG_DAHDI_EC_OFFLOAD
+	&driver_attr_ec_offload.attr,
+#endif
+#ifdef CONFIG_DAHDI_CORE_TIMER
+	&driver_attr_core_timer.attr,
+#endif
+#ifdef CONFIG_DAHDI_TICK_STATS
+	&driver_attr_masterspan_tick_stats.attr,
+#endif
 	NULL,
 };
 ATTRIBUTE_GROUPS(dahdi);
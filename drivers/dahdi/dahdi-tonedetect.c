@@ -0,0 +1,559 @@
+/* dahdi-tonedetect.c
+ *
+ * Software DTMF, MF R1 and MF R2 detection for DAHDI_TONEDETECT
+ *
+ * Copyright (C) 2013 Digium, Inc.
+ *
+ * All rights reserved.
+ *
+ */
+
+/*
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2 as published by the
+ * Free Software Foundation. See the LICENSE file included with
+ * this program for more details.
+ */
+
+/*
+ * A tone bank runs the Goertzel filters of one tone set over many channels
+ * (lanes) at once. The filter state is kept frequency major, lane minor, so
+ * a single coefficient is applied to eight lanes per AVX2 instruction. All
+ * the lanes of a bank share the block boundaries, which costs a channel at
+ * most one partial block when it starts detecting.
+ *
+ * The arithmetic is fixed point: samples are scaled down by
+ * TONE_INPUT_SHIFT and the coefficients 2 * cos(w) are in Q12, which keeps
+ * the filter state of the longest block and the lowest frequency below
+ * 2^31 after the multiplication. The SIMD and C versions give the same
+ * results.
+ */
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <dahdi/kernel.h>
+#include "dahdi.h"
+
+#ifdef CONFIG_DAHDI_TONEDETECT
+
+#include "arith.h"
+
+#define TONE_INPUT_SHIFT	5
+#define TONE_COEF_SHIFT		12
+#define TONE_MAX_FREQS		8
+/* Lanes are allocated in groups of the widest SIMD vector */
+#define TONE_LANE_ALIGN		8
+
+/**
+ * struct dahdi_tone_set - The tones of one signalling system.
+ * @block:	Samples per Goertzel block.
+ * @nfreqs:	Number of frequencies. DTMF has the four rows first.
+ * @coefs:	2 * cos(2 * pi * f / 8000) in Q12 for each frequency.
+ * @digits:	For DTMF, row major. For MF, indexed by the pair of
+ *		frequencies, see mf_pair().
+ * @min_amp:	Smallest amplitude of each tone accepted, in the 16 bit
+ *		linear scale.
+ * @hits:	Blocks a digit must be seen in before it is reported.
+ * @misses:	Blocks a digit must be missing from before it is released.
+ */
+struct dahdi_tone_set {
+	unsigned int block;
+	unsigned int nfreqs;
+	int coefs[TONE_MAX_FREQS];
+	const char *digits;
+	int min_amp;
+	u8 hits;
+	u8 misses;
+};
+
+static const struct dahdi_tone_set tone_sets[DAHDI_TONE_MODES] = {
+	[DAHDI_TONE_DTMF] = {
+		/* 697, 770, 852, 941, 1209, 1336, 1477, 1633 Hz */
+		.block = 102,
+		.nfreqs = 8,
+		.coefs = { 6995, 6739, 6425, 6055, 4768, 4081, 3271, 2329 },
+		.digits = "123A456B789C*0#D",
+		.min_amp = 175,
+		.hits = 2,
+		.misses = 3,
+	},
+	[DAHDI_TONE_MFR1] = {
+		/* 700, 900, 1100, 1300, 1500, 1700 Hz */
+		.block = 120,
+		.nfreqs = 6,
+		.coefs = { 6985, 6229, 5320, 4280, 3135, 1912 },
+		/* KP is '*', ST '#', ST' 'A', ST'' 'B' and ST''' 'C' */
+		.digits = "1234567890CA*B#",
+		.min_amp = 175,
+		.hits = 2,
+		.misses = 3,
+	},
+	[DAHDI_TONE_MFR2_FWD] = {
+		/* 1380, 1500, 1620, 1740, 1860, 1980 Hz */
+		.block = 133,
+		.nfreqs = 6,
+		.coefs = { 3833, 3135, 2409, 1661, 899, 129 },
+		.digits = "1234567890BCDEF",
+		.min_amp = 175,
+		.hits = 2,
+		.misses = 3,
+	},
+	[DAHDI_TONE_MFR2_BACK] = {
+		/* 1140, 1020, 900, 780, 660, 540 Hz */
+		.block = 133,
+		.nfreqs = 6,
+		.coefs = { 5122, 5701, 6229, 6702, 7116, 7466 },
+		.digits = "1234567890BCDEF",
+		.min_amp = 175,
+		.hits = 2,
+		.misses = 3,
+	},
+};
+
+/* Debouncing of one lane */
+struct tone_lane {
+	char digit;	/* Reported as down, or 0 */
+	char cand;	/* Seen in the last block, or 0 */
+	u8 hits;
+	u8 misses;
+};
+
+/**
+ * struct dahdi_tone_bank - Goertzel filters of one tone set for many lanes.
+ * @set:	The tones.
+ * @stride:	Allocated lanes, a multiple of TONE_LANE_ALIGN.
+ * @nr:		Lanes in use. They are always 0 to @nr - 1.
+ * @pos:	Samples of the current block seen so far.
+ * @threshold:	Smallest Goertzel energy of a tone accepted.
+ * @simd:	SIMD level picked when the bank was created, AVX2 or none.
+ * @s1:		Last filter output, @stride entries per frequency.
+ * @s2:		The one before, laid out as @s1.
+ * @x:		The scaled input of the current chunk, @stride entries per
+ *		sample.
+ * @energy:	Sum of the squared input of each lane over the block.
+ * @lane:	Debouncing state of each lane.
+ */
+struct dahdi_tone_bank {
+	const struct dahdi_tone_set *set;
+	unsigned int stride;
+	unsigned int nr;
+	unsigned int pos;
+	u64 threshold;
+	enum dahdi_ec_simd simd;
+	s32 *s1;
+	s32 *s2;
+	s32 *x;
+	u32 *energy;
+	struct tone_lane *lane;
+};
+
+static void goertzel_c(s32 *s1, s32 *s2, const s32 *x, unsigned int stride,
+		       unsigned int lanes, int coef, unsigned int samples)
+{
+	unsigned int l, k;
+
+	for (l = 0; l < lanes; l++) {
+		const s32 *in = x + l;
+		s32 a = s1[l];
+		s32 b = s2[l];
+
+		for (k = 0; k < samples; k++, in += stride) {
+			const s32 s0 = ((coef * a) >> TONE_COEF_SHIFT) - b + *in;
+			b = a;
+			a = s0;
+		}
+		s1[l] = a;
+		s2[l] = b;
+	}
+}
+
+#ifdef CONFIG_DAHDI_ECHOCAN_SIMD
+/* SSE2 has no 32 bit multiply, so only AVX2 gets a version of its own */
+static void goertzel_avx2(s32 *s1, s32 *s2, const s32 *x, unsigned int stride,
+			  unsigned int lanes, int coef, unsigned int samples)
+{
+	const unsigned long step = stride * sizeof(s32);
+	unsigned int l;
+
+	for (l = 0; l < lanes; l += 8) {
+		const s32 *in = x + l;
+		unsigned int k = samples;
+
+		/* Eight lanes per pass, one sample per iteration */
+		__asm__ __volatile__ (
+			"vmovd %[c], %%xmm0;\n"
+			"vpbroadcastd %%xmm0, %%ymm0;\n"
+			"vmovdqu (%[s1]), %%ymm1;\n"
+			"vmovdqu (%[s2]), %%ymm2;\n"
+			"1:\n"
+			"vpmulld %%ymm1, %%ymm0, %%ymm3;\n"
+			"vpsrad $12, %%ymm3, %%ymm3;\n"
+			"vpsubd %%ymm2, %%ymm3, %%ymm3;\n"
+			"vpaddd (%[in]), %%ymm3, %%ymm3;\n"
+			"vmovdqa %%ymm1, %%ymm2;\n"
+			"vmovdqa %%ymm3, %%ymm1;\n"
+			"add %[step], %[in];\n"
+			"dec %[k];\n"
+			"jnz 1b;\n"
+			"vmovdqu %%ymm1, (%[s1]);\n"
+			"vmovdqu %%ymm2, (%[s2]);\n"
+			"vzeroupper;\n"
+			: [in] "+r" (in), [k] "+r" (k)
+			: [c] "r" (coef), [s1] "r" (s1 + l), [s2] "r" (s2 + l),
+			  [step] "r" (step)
+			: "memory", "cc" DAHDI_YMM_CLOBBERS4
+		);
+	}
+}
+
+static void goertzel_simd(enum dahdi_ec_simd level, s32 *s1, s32 *s2,
+			  const s32 *x, unsigned int stride,
+			  unsigned int lanes, int coef, unsigned int samples)
+{
+	if (level == DAHDI_EC_SIMD_AVX2)
+		goertzel_avx2(s1, s2, x, stride, ALIGN(lanes, 8), coef,
+			      samples);
+	else
+		goertzel_c(s1, s2, x, stride, lanes, coef, samples);
+}
+
+/* Without AVX2 the filters run in C, so no FPU section is worth opening */
+static enum dahdi_ec_simd goertzel_simd_level(void)
+{
+	if (dahdi_ec_simd_level() == DAHDI_EC_SIMD_AVX2)
+		return DAHDI_EC_SIMD_AVX2;
+	return DAHDI_EC_SIMD_NONE;
+}
+#else
+#define goertzel_simd_level()	DAHDI_EC_SIMD_NONE
+#define goertzel_simd(level, s1, s2, x, stride, lanes, coef, samples) \
+	goertzel_c(s1, s2, x, stride, lanes, coef, samples)
+#endif /* CONFIG_DAHDI_ECHOCAN_SIMD */
+
+/* Energy of the Goertzel filter of one lane at the end of a block */
+static inline u64 goertzel_energy(s32 a, s32 b, int coef)
+{
+	return (s64)a * a + (s64)b * b -
+	       (s64)((coef * a) >> TONE_COEF_SHIFT) * b;
+}
+
+/*
+ * Index into dahdi_tone_set.digits of the pair of MF frequencies i < j:
+ * (0,1) (0,2) (1,2) (0,3) (1,3) (2,3) (0,4) ...
+ */
+static inline unsigned int mf_pair(unsigned int i, unsigned int j)
+{
+	return j * (j - 1) / 2 + i;
+}
+
+/*
+ * Enough of the signal must be in the detected tones. For a pure pair of
+ * tones the Goertzel energies add up to block / 2 times the sum of the
+ * squared samples. Ask for half of that, which still lets through tones
+ * that are off by the 1.5% the MF specifications allow.
+ */
+static inline bool tone_pure_enough(const struct dahdi_tone_bank *bank,
+				    u64 tones, u32 energy)
+{
+	return tones * 4 >= (u64)energy * bank->set->block;
+}
+
+static char dtmf_decide(const struct dahdi_tone_bank *bank, const u64 *e,
+			u32 energy)
+{
+	unsigned int row = 0;
+	unsigned int col = 4;
+	unsigned int i;
+
+	for (i = 1; i < 4; i++) {
+		if (e[i] > e[row])
+			row = i;
+		if (e[4 + i] > e[col])
+			col = 4 + i;
+	}
+	if (e[row] < bank->threshold || e[col] < bank->threshold)
+		return 0;
+	/* Twist: the row may be 8 dB louder, the column 4 dB */
+	if (e[row] * 100 > e[col] * 631 || e[col] * 100 > e[row] * 251)
+		return 0;
+	/* The other rows and columns must be 8 dB down */
+	for (i = 0; i < 4; i++) {
+		if (i != row && e[i] * 63 > e[row] * 10)
+			return 0;
+		if (4 + i != col && e[4 + i] * 63 > e[col] * 10)
+			return 0;
+	}
+	if (!tone_pure_enough(bank, e[row] + e[col], energy))
+		return 0;
+	return bank->set->digits[row * 4 + (col - 4)];
+}
+
+static char mf_decide(const struct dahdi_tone_bank *bank, const u64 *e,
+		      u32 energy)
+{
+	const unsigned int nfreqs = bank->set->nfreqs;
+	unsigned int best = 0;
+	unsigned int second = 1;
+	unsigned int i;
+
+	if (e[1] > e[0]) {
+		best = 1;
+		second = 0;
+	}
+	for (i = 2; i < nfreqs; i++) {
+		if (e[i] > e[best]) {
+			second = best;
+			best = i;
+		} else if (e[i] > e[second]) {
+			second = i;
+		}
+	}
+	if (e[second] < bank->threshold)
+		return 0;
+	/* Up to 6 dB of twist between the two */
+	if (e[best] > e[second] * 4)
+		return 0;
+	/* Anything else must be 10 dB down */
+	for (i = 0; i < nfreqs; i++) {
+		if (i != best && i != second && e[i] * 10 > e[second])
+			return 0;
+	}
+	if (!tone_pure_enough(bank, e[best] + e[second], energy))
+		return 0;
+	return bank->set->digits[mf_pair(min(best, second),
+					 max(best, second))];
+}
+
+/* Debounce what was seen in the block. Returns an event or 0. */
+static int tone_lane_update(const struct dahdi_tone_set *set,
+			    struct tone_lane *t, char digit)
+{
+	if (digit && digit == t->cand) {
+		if (t->hits < 255)
+			t->hits++;
+	} else {
+		t->cand = digit;
+		t->hits = digit ? 1 : 0;
+	}
+
+	if (t->digit) {
+		if (digit == t->digit) {
+			t->misses = 0;
+			return 0;
+		}
+		if (++t->misses < set->misses)
+			return 0;
+		digit = t->digit;
+		t->digit = 0;
+		t->misses = 0;
+		return DAHDI_EVENT_DTMFUP | digit;
+	}
+
+	if (t->cand && t->hits >= set->hits) {
+		t->digit = t->cand;
+		t->misses = 0;
+		return DAHDI_EVENT_DTMFDOWN | t->digit;
+	}
+	return 0;
+}
+
+static void tone_bank_end_block(struct dahdi_tone_bank *bank, int *events)
+{
+	const struct dahdi_tone_set *const set = bank->set;
+	unsigned int l, f;
+	u64 e[TONE_MAX_FREQS];
+
+	for (l = 0; l < bank->nr; l++) {
+		char digit;
+
+		for (f = 0; f < set->nfreqs; f++) {
+			const unsigned int i = f * bank->stride + l;
+			e[f] = goertzel_energy(bank->s1[i], bank->s2[i],
+					       set->coefs[f]);
+		}
+		if (set == &tone_sets[DAHDI_TONE_DTMF])
+			digit = dtmf_decide(bank, e, bank->energy[l]);
+		else
+			digit = mf_decide(bank, e, bank->energy[l]);
+		events[l] = tone_lane_update(set, &bank->lane[l], digit);
+	}
+
+	memset(bank->s1, 0, set->nfreqs * bank->stride * sizeof(s32));
+	memset(bank->s2, 0, set->nfreqs * bank->stride * sizeof(s32));
+	memset(bank->energy, 0, bank->stride * sizeof(u32));
+	bank->pos = 0;
+}
+
+/**
+ * dahdi_tone_bank_create() - Allocate a tone bank.
+ * @mode:	Which tones to detect.
+ * @lanes:	Most lanes it will be used for.
+ *
+ * Returns NULL on failure.
+ */
+struct dahdi_tone_bank *dahdi_tone_bank_create(enum dahdi_tone_mode mode,
+					       unsigned int lanes)
+{
+	const struct dahdi_tone_set *const set = &tone_sets[mode];
+	const unsigned int stride = ALIGN(max(lanes, 1U), TONE_LANE_ALIGN);
+	struct dahdi_tone_bank *bank;
+	u64 amp;
+
+	bank = kzalloc(sizeof(*bank), GFP_KERNEL);
+	if (!bank)
+		return NULL;
+	bank->set = set;
+	bank->stride = stride;
+	bank->simd = goertzel_simd_level();
+	/* A tone of amplitude A gives an energy of (A * block / 2)^2 */
+	amp = ((u64)set->min_amp * set->block / 2) >> TONE_INPUT_SHIFT;
+	bank->threshold = amp * amp;
+
+	bank->s1 = kcalloc(set->nfreqs * stride, sizeof(s32), GFP_KERNEL);
+	bank->s2 = kcalloc(set->nfreqs * stride, sizeof(s32), GFP_KERNEL);
+	bank->x = kcalloc(DAHDI_CHUNKSIZE * stride, sizeof(s32), GFP_KERNEL);
+	bank->energy = kcalloc(stride, sizeof(u32), GFP_KERNEL);
+	bank->lane = kcalloc(stride, sizeof(*bank->lane), GFP_KERNEL);
+	if (!bank->s1 || !bank->s2 || !bank->x || !bank->energy ||
+	    !bank->lane) {
+		dahdi_tone_bank_destroy(bank);
+		return NULL;
+	}
+	return bank;
+}
+
+void dahdi_tone_bank_destroy(struct dahdi_tone_bank *bank)
+{
+	if (!bank)
+		return;
+	kfree(bank->s1);
+	kfree(bank->s2);
+	kfree(bank->x);
+	kfree(bank->energy);
+	kfree(bank->lane);
+	kfree(bank);
+}
+
+unsigned int dahdi_tone_bank_lanes(const struct dahdi_tone_bank *bank)
+{
+	return bank->nr;
+}
+
+/**
+ * dahdi_tone_bank_add() - Start detecting on one more lane.
+ *
+ * Returns the new lane, which is always the last one, or -ENOSPC.
+ */
+int dahdi_tone_bank_add(struct dahdi_tone_bank *bank)
+{
+	const unsigned int l = bank->nr;
+	unsigned int f;
+
+	if (l >= bank->stride)
+		return -ENOSPC;
+	for (f = 0; f < bank->set->nfreqs; f++) {
+		bank->s1[f * bank->stride + l] = 0;
+		bank->s2[f * bank->stride + l] = 0;
+	}
+	bank->energy[l] = 0;
+	memset(&bank->lane[l], 0, sizeof(bank->lane[l]));
+	bank->nr++;
+	return l;
+}
+
+/**
+ * dahdi_tone_bank_remove() - Stop detecting on a lane.
+ *
+ * The last lane is moved into its place, so that the lanes in use stay
+ * contiguous.
+ */
+void dahdi_tone_bank_remove(struct dahdi_tone_bank *bank, unsigned int lane)
+{
+	const unsigned int last = --bank->nr;
+	unsigned int f;
+
+	if (lane == last)
+		return;
+	for (f = 0; f < bank->set->nfreqs; f++) {
+		bank->s1[f * bank->stride + lane] =
+			bank->s1[f * bank->stride + last];
+		bank->s2[f * bank->stride + lane] =
+			bank->s2[f * bank->stride + last];
+	}
+	bank->energy[lane] = bank->energy[last];
+	bank->lane[lane] = bank->lane[last];
+}
+
+/* Load the next chunk of a lane, as signed linear */
+void dahdi_tone_bank_put(struct dahdi_tone_bank *bank, unsigned int lane,
+			 const short *lin)
+{
+	unsigned int k;
+
+	for (k = 0; k < DAHDI_CHUNKSIZE; k++)
+		bank->x[k * bank->stride + lane] = lin[k] >> TONE_INPUT_SHIFT;
+}
+
+/* Whether the lane has a digit down, or one on the way */
+bool dahdi_tone_bank_present(const struct dahdi_tone_bank *bank,
+			     unsigned int lane)
+{
+	return bank->lane[lane].digit || bank->lane[lane].cand;
+}
+
+/**
+ * dahdi_tone_bank_process() - Run the filters over the loaded chunk.
+ * @bank:	The bank.
+ * @events:	One per lane: DAHDI_EVENT_DTMFDOWN or DAHDI_EVENT_DTMFUP or'ed
+ *		with the digit, or 0.
+ *
+ * Call with local interrupts disabled.
+ */
+void dahdi_tone_bank_process(struct dahdi_tone_bank *bank, int *events)
+{
+	const struct dahdi_tone_set *const set = bank->set;
+	const unsigned int stride = bank->stride;
+	const unsigned int nr = bank->nr;
+	enum dahdi_ec_simd simd = bank->simd;
+	unsigned int k = 0;
+	unsigned int l, f, j;
+
+	memset(events, 0, nr * sizeof(*events));
+
+	if (simd != DAHDI_EC_SIMD_NONE && !dahdi_ec_simd_begin())
+		simd = DAHDI_EC_SIMD_NONE;
+
+	while (k < DAHDI_CHUNKSIZE) {
+		const unsigned int n = min(DAHDI_CHUNKSIZE - k,
+					   set->block - bank->pos);
+		const s32 *const x = &bank->x[k * stride];
+
+		for (f = 0; f < set->nfreqs; f++) {
+			goertzel_simd(simd, &bank->s1[f * stride],
+				      &bank->s2[f * stride], x, stride, nr,
+				      set->coefs[f], n);
+		}
+		for (j = 0; j < n; j++) {
+			for (l = 0; l < nr; l++) {
+				const s32 v = x[j * stride + l];
+				bank->energy[l] += v * v;
+			}
+		}
+
+		k += n;
+		bank->pos += n;
+		if (bank->pos == set->block)
+			tone_bank_end_block(bank, events);
+	}
+
+	if (simd != DAHDI_EC_SIMD_NONE)
+		dahdi_ec_simd_end();
+}
+
+#endif /* CONFIG_DAHDI_TONEDETECT */
@@ -0,0 +1,211 @@
+/* dahdi-tonegen.c
+ *
+ * Precomputed tables of the tones of a tone zone
+ *
+ * Copyright (C) 2013 Digium, Inc.
+ *
+ * All rights reserved.
+ *
+ */
+
+/*
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2 as published by the
+ * Free Software Foundation. See the LICENSE file included with
+ * this program for more details.
+ */
+
+/*
+ * dahdi_ioctl_loadzone() builds a table for every tone of a zone, and the
+ * channels playing a tone copy out of it rather than run the oscillator of
+ * dahdi_tone_nextsample() themselves.  See dahdi_tone_build_wave().
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/gcd.h>
+#include <linux/math64.h>
+#include <dahdi/kernel.h>
+#include "dahdi.h"
+
+/* Longest tone table, looping or one-shot, in samples */
+#define DAHDI_TONE_WAVE_MAX DAHDI_MS_TO_SAMPLES(250)
+/* Short periods are repeated to at least this many samples */
+#define DAHDI_TONE_WAVE_MIN DAHDI_MS_TO_SAMPLES(20)
+
+void dahdi_init_tone_state(struct dahdi_tone_state *ts, struct dahdi_tone *zt)
+{
+	ts->v1_1 = 0;
+	ts->v2_1 = zt->init_v2_1;
+	ts->v3_1 = zt->init_v3_1;
+	ts->v1_2 = 0;
+	ts->v2_2 = zt->init_v2_2;
+	ts->v3_2 = zt->init_v3_2;
+	ts->modulate = zt->modulate;
+	ts->pos = 0;
+}
+EXPORT_SYMBOL(dahdi_init_tone_state);
+
+/* cos(2 * pi * freq / 8000) in Q30, for 0 <= freq <= 4000 Hz */
+static s64 tone_cos_q30(int freq)
+{
+	const s64 one = 1LL << 30;
+	s64 x, x2, term, sum;
+	bool negate = false;
+	int n;
+
+	if (freq > 2000) {
+		freq = 4000 - freq;
+		negate = true;
+	}
+	x = div_s64((s64)freq * 6746518852LL, 8000);	/* 2 * pi in Q30 */
+	x2 = (x * x) >> 30;
+
+	term = sum = one;
+	for (n = 1; n <= 7; n++) {
+		term = -div_s64((term * x2) >> 30, (2 * n - 1) * (2 * n));
+		sum += term;
+	}
+	return negate ? -sum : sum;
+}
+
+/* The whole number of Hz an oscillator with this fac runs closest to */
+static int tone_freq(int fac)
+{
+	const s64 target = (s64)fac << 14;
+	int lo = 0, hi = 4000;
+
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+
+		if (tone_cos_q30(mid) > target)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo && tone_cos_q30(lo - 1) - target < target - tone_cos_q30(lo))
+		lo--;
+	return lo;
+}
+
+/**
+ * dahdi_tone_build_wave() - Precompute the samples of a tone.
+ * @zt:	The tone, fully set up apart from the table.
+ *
+ * The tones a zone is loaded with are whole numbers of Hz, so most of
+ * them repeat within a few hundred samples (350+440Hz every 800, 425Hz
+ * every 320).  Those get a table of whole periods that is played in a
+ * loop.  The recursive oscillator never quite comes back to where it
+ * started because fac has been rounded to 16 bits, so the table is
+ * instead generated at the whole number of Hz nearest to what the
+ * oscillator plays, with a 64 bit copy of the same recurrence starting
+ * from the same two samples.
+ *
+ * Tones that do not repeat soon enough (most DTMF pairs only repeat once
+ * a second) instead get a one-shot table of exactly what the oscillator
+ * would produce for the length of the tone, along with the oscillator
+ * state at the end of it in case the tone is later played for longer.
+ *
+ * Failing to allocate a table is not an error; the tone is then
+ * generated sample by sample as before.
+ */
+void dahdi_tone_build_wave(struct dahdi_tone *zt)
+{
+	struct dahdi_tone_state ts;
+	unsigned long period = 8000;
+	int freq1, freq2;
+	s64 fac1, fac2;
+	s64 v1_1, v2_1, v3_1, v1_2, v2_2, v3_2;
+	int len;
+	int x;
+	u8 *wave;
+
+	if (zt->tonesamples <= 0)
+		return;
+
+	freq1 = tone_freq(zt->fac1);
+	freq2 = tone_freq(zt->fac2);
+	if (zt->init_v2_1 || zt->init_v3_1)
+		period = gcd(period, freq1);
+	if (zt->init_v2_2 || zt->init_v3_2)
+		period = gcd(period, freq2);
+	period = 8000 / period;
+
+	if (period <= DAHDI_TONE_WAVE_MAX) {
+		len = roundup(DAHDI_TONE_WAVE_MIN, period);
+	} else {
+		/* A tone that loops onto itself needs a table that loops */
+		if (zt->next == zt)
+			return;
+		period = 0;
+		len = min(zt->tonesamples, DAHDI_TONE_WAVE_MAX);
+	}
+
+	wave = kmalloc(2 * len, GFP_KERNEL);
+	if (!wave)
+		return;
+
+	if (!period) {
+		dahdi_init_tone_state(&ts, zt);
+		for (x = 0; x < len; x++) {
+			short sample = dahdi_tone_nextsample(&ts, zt);
+
+			wave[x] = DAHDI_LIN2MU(sample);
+			wave[len + x] = DAHDI_LIN2A(sample);
+		}
+		zt->wave_end = ts;
+		zt->wave_end.pos = len + 1;
+		goto done;
+	}
+
+	fac1 = 2 * tone_cos_q30(freq1);
+	fac2 = 2 * tone_cos_q30(freq2);
+	v2_1 = (s64)zt->init_v2_1 << 15;
+	v3_1 = (s64)zt->init_v3_1 << 15;
+	v2_2 = (s64)zt->init_v2_2 << 15;
+	v3_2 = (s64)zt->init_v3_2 << 15;
+	for (x = 0; x < period; x++) {
+		short sample;
+		int p;
+
+		v1_1 = v2_1;
+		v2_1 = v3_1;
+		v3_1 = ((fac1 * v2_1) >> 30) - v1_1;
+		v1_2 = v2_2;
+		v2_2 = v3_2;
+		v3_2 = ((fac2 * v2_2) >> 30) - v1_2;
+
+		/* The same sum or modulation as dahdi_tone_nextsample() */
+		if (!zt->modulate) {
+			sample = (v3_1 >> 15) + (v3_2 >> 15);
+		} else {
+			p = abs((int)(v3_2 >> 15) - 32768);
+			p = ((p * 9) / 10) + 1;
+			sample = ((int)(v3_1 >> 15) * p) >> 15;
+		}
+		wave[x] = DAHDI_LIN2MU(sample);
+		wave[len + x] = DAHDI_LIN2A(sample);
+	}
+	for (x = period; x < len; x += period) {
+		memcpy(wave + x, wave, period);
+		memcpy(wave + len + x, wave + len, period);
+	}
+
+done:
+	zt->wavelen = len;
+	zt->waveloop = !!period;
+	zt->wave = wave;
+}
+
+void dahdi_tone_free_wave(struct dahdi_tone *zt)
+{
+	kfree(zt->wave);
+	zt->wave = NULL;
+}
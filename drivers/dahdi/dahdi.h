@@ -39,6 +39,54 @@ void dahdi_sysfs_init_device(struct dahdi_device *ddev);
 int dahdi_sysfs_add_device(struct dahdi_device *ddev, struct device *parent);
 void dahdi_sysfs_unregister_device(struct dahdi_device *ddev);
 
+#ifdef CONFIG_DAHDI_SHARDED_MASTERSPAN
+ssize_t dahdi_masterspan_shards_show(char *buf, size_t size);
+#endif
+
+#ifdef CONFIG_DAHDI_EC_OFFLOAD
+ssize_t dahdi_ec_offload_show(char *buf, size_t size);
+#endif
+
+/* dahdi-tonegen.c */
+void dahdi_tone_build_wave(struct dahdi_tone *zt);
+void dahdi_tone_free_wave(struct dahdi_tone *zt);
+
+#ifdef CONFIG_DAHDI_TONEDETECT
+/* dahdi-tonedetect.c */
+enum dahdi_tone_mode {
+	DAHDI_TONE_DTMF,
+	DAHDI_TONE_MFR1,
+	DAHDI_TONE_MFR2_FWD,
+	DAHDI_TONE_MFR2_BACK,
+	DAHDI_TONE_MODES,
+};
+
+struct dahdi_tone_bank;
+struct dahdi_tone_bank *dahdi_tone_bank_create(enum dahdi_tone_mode mode,
+					       unsigned int lanes);
+void dahdi_tone_bank_destroy(struct dahdi_tone_bank *bank);
+unsigned int dahdi_tone_bank_lanes(const struct dahdi_tone_bank *bank);
+int dahdi_tone_bank_add(struct dahdi_tone_bank *bank);
+void dahdi_tone_bank_remove(struct dahdi_tone_bank *bank, unsigned int lane);
+void dahdi_tone_bank_put(struct dahdi_tone_bank *bank, unsigned int lane,
+			 const short *lin);
+bool dahdi_tone_bank_present(const struct dahdi_tone_bank *bank,
+			     unsigned int lane);
+void dahdi_tone_bank_process(struct dahdi_tone_bank *bank, int *events);
+#endif
+
+#ifdef CONFIG_DAHDI_CORE_TIMER
+ssize_t dahdi_core_timer_show(char *buf, size_t size);
+#endif
+
+#ifdef CONFIG_DAHDI_TICK_STATS
+ssize_t dahdi_span_tick_stats_show(struct dahdi_span *span, char *buf,
+				   size_t size);
+void dahdi_span_tick_stats_clear(struct dahdi_span *span);
+ssize_t dahdi_tick_stats_show(char *buf, size_t size);
+void dahdi_tick_stats_clear_master(void);
+#endif
+
 int dahdi_assign_span(struct dahdi_span *span, unsigned int spanno,
 			unsigned int basechan, int prefmaster);
 int dahdi_unassign_span(struct dahdi_span *span);
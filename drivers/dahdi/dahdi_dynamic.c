@@ -32,6 +32,12 @@
 #include <linux/sched.h>
 #include <linux/interrupt.h>
 #include <linux/moduleparam.h>
+#include <linux/vmalloc.h>
+#include <linux/irq_work.h>
+#include <linux/percpu.h>
+#include <linux/cpumask.h>
+#include <linux/cpuhotplug.h>
+#include <linux/wait_bit.h>
 
 #include <dahdi/kernel.h>
 
@@ -58,7 +64,10 @@
  *         1                Current flags on span
  *				Bit    0: Yellow Alarm
  *	                        Bit    1: Sig bits present
- *				Bits 2-7: reserved for future use
+ *				Bits 2-3: reserved for future use
+ *				Bit    4: Sender takes TDMoE bundles, set by
+ *					  dahdi_dynamic_eth while bundling
+ *				Bits 5-7: reserved for future use
  *         2-3		    16-bit counter value for detecting drops, network byte order.
  *         4-5		    Number of channels in the message, network byte order
  *         6...		    16-bit words, containing sig bits for each
@@ -88,9 +97,8 @@ static int txerrors;
 static struct tasklet_struct dahdi_dynamic_tlet;
 
 static void dahdi_dynamic_tasklet(unsigned long data);
-#else
-static struct tasklet_struct dahdi_dynamic_flush_tlet;
 #endif
+static struct tasklet_struct dahdi_dynamic_flush_tlet;
 
 static DEFINE_MUTEX(dspan_mutex);
 static DEFINE_SPINLOCK(dspan_lock);
@@ -101,8 +109,333 @@ static LIST_HEAD(driver_list);
 
 static int debug = 0;
 
+/* Least number of ms of received audio held back to ride out network
+ * jitter, or 0 to hand each message to DAHDI as soon as it arrives.  Off
+ * unless asked for, as it adds that much latency. */
+static int jitterbuffer;
+
 static int hasmaster = 0;
 
+/* Run the tick of each span on a CPU of its own rather than all of them
+ * on the CPU of the DAHDI master. */
+static bool rxsteering;
+
+/* Spans waiting for their tick on each CPU, and what kicks that CPU */
+static DEFINE_PER_CPU(struct llist_head, dahdi_dynamic_steer_list);
+static DEFINE_PER_CPU(struct irq_work, dahdi_dynamic_steer_work);
+
+/* CPUs, the master's included, still running ticks steered to them.  The
+ * last one to finish flushes the drivers, so that the messages of a tick
+ * are sent together, however the spans were spread. */
+static atomic_t dahdi_dynamic_steer_busy = ATOMIC_INIT(0);
+
+/* Last CPU a span was given, under dspan_mutex */
+static int dahdi_dynamic_steer_cpu = -1;
+
+/* Our CPU hotplug state, to re-home the spans of a CPU that goes away */
+static enum cpuhp_state dahdi_dynamic_cpuhp;
+
+/* Frames a jitter buffer can hold; a power of two */
+#define DAHDI_DYNAMIC_JB_SLOTS		32
+/* Most the target depth grows to after underruns */
+#define DAHDI_DYNAMIC_JB_MAX		(DAHDI_DYNAMIC_JB_SLOTS - 8)
+/* Ticks over which the depth is watched before adjusting it */
+#define DAHDI_DYNAMIC_JB_WINDOW		1000
+/* Quiet windows before the target depth is lowered again */
+#define DAHDI_DYNAMIC_JB_QUIET		10
+/* Concealed ticks over which audio is faded out */
+#define DAHDI_DYNAMIC_JB_FADE		6
+
+/**
+ * struct dahdi_dynamic_jb - Received messages waiting for their tick.
+ *
+ * Messages are kept by their transmit counter and handed to DAHDI one per
+ * tick of the DAHDI master, in order, from __dahdi_dynamic_run(). Holes are
+ * concealed when their turn comes. The target depth grows when the buffer
+ * runs dry or a message misses its tick and slowly shrinks back while
+ * neither happens, and audio that has sat in the buffer for a whole window
+ * beyond the target is dropped.
+ */
+struct dahdi_dynamic_jb {
+	spinlock_t lock;
+	/* Sig bits and audio of each slot */
+	u8 *frames;
+	int framelen;
+	/* Audio of the last message played, as received, to conceal from */
+	u8 *last;
+	u8 sflags[DAHDI_DYNAMIC_JB_SLOTS];
+	DECLARE_BITMAP(valid, DAHDI_DYNAMIC_JB_SLOTS);
+	/* Counter of the next message to play and one past the newest */
+	u16 next;
+	u16 head;
+	bool started;
+	bool primed;
+	/* Ran dry while playing and is filling back up */
+	bool refill;
+	/* Something arrived too late to play since the last tick */
+	bool stretch;
+	/* Least depth, from the jitterbuffer parameter at creation */
+	int min;
+	int target;
+	int ticks;
+	int mindepth;
+	bool underran;
+	int quiet;
+	int conceal_run;
+	/* Arrived after their tick had passed */
+	unsigned int late;
+	/* Never arrived */
+	unsigned int lost;
+	/* Ticks filled in by concealment for a lost message or after running
+	 * dry; not those before the first message is played */
+	unsigned int concealed;
+	/* Dropped to bring the depth back down */
+	unsigned int dropped;
+};
+
+static struct dahdi_dynamic_jb *dahdi_dynamic_jb_alloc(int nchans, int min)
+{
+	struct dahdi_dynamic_jb *jb;
+
+	jb = kzalloc(sizeof(*jb), GFP_KERNEL);
+	if (!jb)
+		return NULL;
+	jb->framelen = ((nchans + 3) / 4) * 2 + nchans * DAHDI_CHUNKSIZE;
+	jb->frames = vzalloc(DAHDI_DYNAMIC_JB_SLOTS * jb->framelen +
+			     nchans * DAHDI_CHUNKSIZE);
+	if (!jb->frames) {
+		kfree(jb);
+		return NULL;
+	}
+	jb->last = jb->frames + DAHDI_DYNAMIC_JB_SLOTS * jb->framelen;
+	spin_lock_init(&jb->lock);
+	jb->min = min;
+	jb->target = min;
+	jb->mindepth = INT_MAX;
+	/* Nothing to fade out from yet */
+	jb->conceal_run = DAHDI_DYNAMIC_JB_FADE + 1;
+	return jb;
+}
+
+static void dahdi_dynamic_jb_free(struct dahdi_dynamic_jb *jb)
+{
+	if (!jb)
+		return;
+	vfree(jb->frames);
+	kfree(jb);
+}
+
+/**
+ * dahdi_dynamic_jb_put() - File a received message by its counter.
+ * @jb:		The span's jitter buffer.
+ * @seq:	The message's transmit counter.
+ * @sflags:	The message's flags.
+ * @data:	Sig bits (if present) and audio, as validated by the caller.
+ * @len:	Length of @data.
+ */
+static void dahdi_dynamic_jb_put(struct dahdi_dynamic_jb *jb, u16 seq,
+				 int sflags, const u8 *data, int len)
+{
+	unsigned long flags;
+	unsigned int slot;
+	s16 delta;
+
+	spin_lock_irqsave(&jb->lock, flags);
+	if (!jb->started) {
+		jb->next = jb->head = seq;
+		jb->started = true;
+	}
+
+	delta = (s16)(seq - jb->next);
+	if (delta < -DAHDI_DYNAMIC_JB_SLOTS || delta >= DAHDI_DYNAMIC_JB_SLOTS) {
+		/* Far from where we are; the far end restarted, or we fell
+		 * a long way behind.  Start over from here. */
+		bitmap_zero(jb->valid, DAHDI_DYNAMIC_JB_SLOTS);
+		jb->next = jb->head = seq;
+		jb->primed = false;
+		jb->refill = false;
+	} else if (delta < 0) {
+		jb->late++;
+		jb->stretch = true;
+		goto out;
+	}
+
+	slot = seq & (DAHDI_DYNAMIC_JB_SLOTS - 1);
+	if (test_bit(slot, jb->valid)) {
+		/* A duplicate */
+		jb->late++;
+		goto out;
+	}
+	memcpy(jb->frames + slot * jb->framelen, data, len);
+	jb->sflags[slot] = sflags;
+	set_bit(slot, jb->valid);
+	if ((s16)(seq + 1 - jb->head) > 0)
+		jb->head = seq + 1;
+out:
+	spin_unlock_irqrestore(&jb->lock, flags);
+}
+
+/*
+ * Fill the span's readchunks in for a message that isn't there.  This
+ * works from jb->last rather than the readchunks, which dahdi_receive()
+ * has since put through the gain tables and the echo canceller.
+ */
+static void dahdi_dynamic_conceal(struct dahdi_dynamic *d)
+{
+	struct dahdi_dynamic_jb *const jb = d->jb;
+	struct dahdi_span *const span = &d->span;
+	int x, i;
+
+	jb->conceal_run++;
+	for (x = 0; x < span->channels; x++) {
+		struct dahdi_chan *const chan = span->chans[x];
+		u8 *const last = jb->last + x * DAHDI_CHUNKSIZE;
+		u8 *const rc = chan->readchunk;
+
+		if (!(chan->flags & DAHDI_FLAG_AUDIO)) {
+			/* Idle, rather than repeat, anything that isn't audio */
+			memset(rc, 0xff, DAHDI_CHUNKSIZE);
+		} else if (jb->conceal_run > DAHDI_DYNAMIC_JB_FADE) {
+			memset(rc, DAHDI_LIN2X(0, chan), DAHDI_CHUNKSIZE);
+		} else {
+			/* Repeat the last chunk, 6dB further down each time */
+			for (i = 0; i < DAHDI_CHUNKSIZE; i++) {
+				const int s = DAHDI_XLAW(last[i], chan) / 2;
+
+				last[i] = DAHDI_LIN2X(s, chan);
+			}
+			memcpy(rc, last, DAHDI_CHUNKSIZE);
+		}
+	}
+}
+
+/**
+ * dahdi_dynamic_playout() - Hand DAHDI this tick's message for a span.
+ *
+ * Called once per tick from __dahdi_dynamic_run().  Does nothing until the
+ * first message has arrived.
+ */
+static void dahdi_dynamic_playout(struct dahdi_dynamic *d)
+{
+	struct dahdi_dynamic_jb *const jb = d->jb;
+	struct dahdi_span *const span = &d->span;
+	unsigned long flags;
+	const u8 *frame = NULL;
+	unsigned int slot;
+	int sflags = 0;
+	int depth;
+	int x, bits, sig;
+
+	spin_lock_irqsave(&jb->lock, flags);
+	if (!jb->started) {
+		spin_unlock_irqrestore(&jb->lock, flags);
+		return;
+	}
+
+	depth = (u16)(jb->head - jb->next);
+	if (jb->primed && (!depth || jb->stretch)) {
+		/* Ran dry, or something came too late to be played; build
+		 * up some more before going on */
+		jb->primed = false;
+		jb->refill = true;
+		jb->underran = true;
+		if (jb->target < DAHDI_DYNAMIC_JB_MAX)
+			jb->target++;
+	}
+	jb->stretch = false;
+	if (!jb->primed && depth >= jb->target) {
+		jb->primed = true;
+		jb->refill = false;
+	}
+
+	if (!jb->primed) {
+		/* Filling up for the first time is not an underrun */
+		if (jb->refill)
+			jb->concealed++;
+		dahdi_dynamic_conceal(d);
+		if (jb->conceal_run >= DAHDI_DYNAMIC_JB_WINDOW) {
+			/* Nothing for a long while; wait for it to come back
+			 * (the alarm timer will have noticed) */
+			bitmap_zero(jb->valid, DAHDI_DYNAMIC_JB_SLOTS);
+			jb->started = false;
+			jb->primed = false;
+			jb->refill = false;
+		}
+	} else {
+		slot = jb->next & (DAHDI_DYNAMIC_JB_SLOTS - 1);
+		if (test_and_clear_bit(slot, jb->valid)) {
+			frame = jb->frames + slot * jb->framelen;
+			sflags = jb->sflags[slot];
+		} else {
+			jb->lost++;
+			jb->concealed++;
+			dahdi_dynamic_conceal(d);
+		}
+		jb->next++;
+		depth--;
+		if (depth < jb->mindepth)
+			jb->mindepth = depth;
+	}
+
+	if (++jb->ticks >= DAHDI_DYNAMIC_JB_WINDOW) {
+		if (jb->mindepth != INT_MAX && jb->mindepth > jb->target) {
+			/* Always more than we need; catch up */
+			for (x = jb->mindepth - jb->target; x > 0; x--) {
+				slot = jb->next & (DAHDI_DYNAMIC_JB_SLOTS - 1);
+				if (test_and_clear_bit(slot, jb->valid))
+					jb->dropped++;
+				jb->next++;
+			}
+		}
+		if (jb->underran) {
+			jb->quiet = 0;
+		} else if (++jb->quiet >= DAHDI_DYNAMIC_JB_QUIET) {
+			jb->quiet = 0;
+			if (jb->target > jb->min)
+				jb->target--;
+		}
+		jb->ticks = 0;
+		jb->mindepth = INT_MAX;
+		jb->underran = false;
+	}
+
+	if (frame) {
+		const u8 *msg = frame;
+
+		jb->conceal_run = 0;
+
+		/* Record sigbits if present */
+		if (sflags & DAHDI_DYNAMIC_FLAG_SIGBITS_PRESENT) {
+			bits = 0;
+			for (x = 0; x < span->channels; x++) {
+				if (!(x%4)) {
+					/* Get new bits */
+					bits = ntohs(*((unsigned short *)msg));
+					msg += 2;
+				}
+				/* Pick the right bits */
+				sig = (bits >> ((x % 4) << 2)) & 0xff;
+				/* Update signalling if appropriate */
+				if (sig != span->chans[x]->rxsig)
+					dahdi_rbsbits(span->chans[x], sig);
+			}
+		}
+
+		/* Record data for channels */
+		for (x = 0; x < span->channels; x++) {
+			memcpy(span->chans[x]->readchunk, msg, DAHDI_CHUNKSIZE);
+			msg += DAHDI_CHUNKSIZE;
+		}
+		/* And keep it as it came, in case the next one is missing */
+		memcpy(jb->last, msg - span->channels * DAHDI_CHUNKSIZE,
+		       span->channels * DAHDI_CHUNKSIZE);
+	}
+	spin_unlock_irqrestore(&jb->lock, flags);
+
+	dahdi_ec_span(span);
+	dahdi_receive(span);
+}
+
 static void checkmaster(void)
 {
 	int newhasmaster=0;
@@ -198,6 +531,122 @@ static void dahdi_dynamic_sendmessage(struct dahdi_dynamic *d)
 	
 }
 
+/* Everything a span does on a tick of the master */
+static void dahdi_dynamic_tick(struct dahdi_dynamic *d)
+{
+	if (d->jb)
+		dahdi_dynamic_playout(d);
+	dahdi_transmit(&d->span);
+	/* Handle all transmissions now */
+	dahdi_dynamic_sendmessage(d);
+}
+
+/*
+ * Run the ticks waiting on a CPU's list.  A span is on at most one list at
+ * a time, however many of its ticks are waiting, so its ticks are never run
+ * on two CPUs at once and always run in order.
+ */
+static void dahdi_dynamic_steer_run(struct llist_head *list)
+{
+	struct llist_node *first;
+	struct dahdi_dynamic *d, *n;
+
+	first = llist_reverse_order(llist_del_all(list));
+	llist_for_each_entry_safe(d, n, first, steer_node) {
+		/* The span may be queued again, or go away, as soon as the
+		 * last of its ticks is done */
+		do {
+			dahdi_dynamic_tick(d);
+		} while (!atomic_dec_and_test(&d->steer_ticks));
+		/* Only the address is used, so this is fine if it has gone */
+		wake_up_var(&d->steer_ticks);
+	}
+}
+
+/*
+ * A CPU is through with the ticks it was given.  If it was the last one
+ * still busy, flush what the drivers have bundled up.  A CPU that is slow
+ * holds everyone's messages back with it, and if it is still busy when the
+ * next tick comes, one flush covers both.
+ */
+static void dahdi_dynamic_steer_done(void)
+{
+	if (atomic_dec_and_test(&dahdi_dynamic_steer_busy))
+		tasklet_hi_schedule(&dahdi_dynamic_flush_tlet);
+}
+
+static void dahdi_dynamic_steer_work_fn(struct irq_work *work)
+{
+	dahdi_dynamic_steer_run(this_cpu_ptr(&dahdi_dynamic_steer_list));
+	dahdi_dynamic_steer_done();
+}
+
+/*
+ * Hand a span's tick to its CPU.  If one of its ticks is still waiting, this
+ * one is run right after it by the same CPU.
+ */
+static void dahdi_dynamic_steer(struct dahdi_dynamic *d)
+{
+	int cpu = READ_ONCE(d->rxcpu);
+
+	if (atomic_inc_return(&d->steer_ticks) > 1)
+		return;
+	if (!cpu_online(cpu))
+		cpu = smp_processor_id();
+	if (llist_add(&d->steer_node, per_cpu_ptr(&dahdi_dynamic_steer_list,
+						   cpu)) &&
+	    cpu != smp_processor_id()) {
+		atomic_inc(&dahdi_dynamic_steer_busy);
+		if (!irq_work_queue_on(per_cpu_ptr(&dahdi_dynamic_steer_work,
+						   cpu), cpu))
+			atomic_dec(&dahdi_dynamic_steer_busy);
+	}
+}
+
+/* Wait for a span that can no longer be steered to finish its last tick */
+static void dahdi_dynamic_steer_sync(struct dahdi_dynamic *d)
+{
+	wait_var_event(&d->steer_ticks, !atomic_read(&d->steer_ticks));
+}
+
+/* The next CPU to give a span to, taking turns over those online.  Called
+ * with dspan_mutex held. */
+static int dahdi_dynamic_steer_next(void)
+{
+	dahdi_dynamic_steer_cpu = cpumask_next(dahdi_dynamic_steer_cpu,
+					       cpu_online_mask);
+	if (dahdi_dynamic_steer_cpu >= nr_cpu_ids)
+		dahdi_dynamic_steer_cpu = cpumask_first(cpu_online_mask);
+	return dahdi_dynamic_steer_cpu;
+}
+
+/*
+ * A CPU is gone.  Rather than leave its spans to fall back to the master's
+ * CPU, give them CPUs that are still there, and run any tick that was left
+ * on its list, which nobody else would, so that dahdi_dynamic_steer_sync()
+ * does not wait for it forever.
+ */
+static int dahdi_dynamic_cpu_dead(unsigned int cpu)
+{
+	struct dahdi_dynamic *d;
+	unsigned long flags;
+
+	mutex_lock(&dspan_mutex);
+	rcu_read_lock();
+	list_for_each_entry_rcu(d, &dspan_list, list) {
+		if (READ_ONCE(d->rxcpu) == cpu)
+			WRITE_ONCE(d->rxcpu, dahdi_dynamic_steer_next());
+	}
+	rcu_read_unlock();
+	mutex_unlock(&dspan_mutex);
+
+	/* As from the irq_work it missed */
+	local_irq_save(flags);
+	dahdi_dynamic_steer_run(per_cpu_ptr(&dahdi_dynamic_steer_list, cpu));
+	local_irq_restore(flags);
+	return 0;
+}
+
 static void __dahdi_dynamic_run(void)
 {
 	struct dahdi_dynamic *d;
@@ -206,10 +655,23 @@ static void __dahdi_dynamic_run(void)
 #endif
 
 	rcu_read_lock();
+	/* Until our own share is done, nobody flushes */
+	if (rxsteering)
+		atomic_inc(&dahdi_dynamic_steer_busy);
 	list_for_each_entry_rcu(d, &dspan_list, list) {
-		dahdi_transmit(&d->span);
-		/* Handle all transmissions now */
-		dahdi_dynamic_sendmessage(d);
+		if (rxsteering)
+			dahdi_dynamic_steer(d);
+		else
+			dahdi_dynamic_tick(d);
+	}
+	if (rxsteering) {
+		/* Our own share, while the other CPUs do theirs; the flush
+		 * waits for the last of us */
+		dahdi_dynamic_steer_run(
+			this_cpu_ptr(&dahdi_dynamic_steer_list));
+		dahdi_dynamic_steer_done();
+		rcu_read_unlock();
+		return;
 	}
 
 #ifdef ENABLE_TASKLETS
@@ -329,30 +791,34 @@ void dahdi_dynamic_receive(struct dahdi_span *span, unsigned char *msg, int msgl
 
 	bits = 0;
 
-	/* Record sigbits if present */
-	if (sflags & DAHDI_DYNAMIC_FLAG_SIGBITS_PRESENT) {
-		for (x=0;x<nchans;x++) {
-			if (!(x%4)) {
-				/* Get new bits */
-				bits = ntohs(*((unsigned short *)msg));
-				msg++;
-				msg++;
+	if (dtd->jb) {
+		/* Played out on the master's tick by __dahdi_dynamic_run() */
+		dahdi_dynamic_jb_put(dtd->jb, rxpos, sflags, msg, msglen - 6);
+	} else {
+		/* Record sigbits if present */
+		if (sflags & DAHDI_DYNAMIC_FLAG_SIGBITS_PRESENT) {
+			for (x=0;x<nchans;x++) {
+				if (!(x%4)) {
+					/* Get new bits */
+					bits = ntohs(*((unsigned short *)msg));
+					msg++;
+					msg++;
+				}
+
+				/* Pick the right bits */
+				sig = (bits >> ((x % 4) << 2)) & 0xff;
+
+				/* Update signalling if appropriate */
+				if (sig != span->chans[x]->rxsig)
+					dahdi_rbsbits(span->chans[x], sig);
 			}
-			
-			/* Pick the right bits */
-			sig = (bits >> ((x % 4) << 2)) & 0xff;
-			
-			/* Update signalling if appropriate */
-			if (sig != span->chans[x]->rxsig)
-				dahdi_rbsbits(span->chans[x], sig);
-				
 		}
-	}
-	
-	/* Record data for channels */
-	for (x=0;x<nchans;x++) {
-		memcpy(span->chans[x]->readchunk, msg, DAHDI_CHUNKSIZE);
-		msg += DAHDI_CHUNKSIZE;
+
+		/* Record data for channels */
+		for (x=0;x<nchans;x++) {
+			memcpy(span->chans[x]->readchunk, msg, DAHDI_CHUNKSIZE);
+			msg += DAHDI_CHUNKSIZE;
+		}
 	}
 
 	master = dtd->master;
@@ -376,12 +842,14 @@ void dahdi_dynamic_receive(struct dahdi_span *span, unsigned char *msg, int msgl
 		checkmaster();
 	}
 
-	/* note if we had a missing packet */
-	if (unlikely(rxpos != rxcnt))
-		printk(KERN_NOTICE "Span %s: Expected seq no %d, but received %d instead\n", span->name, rxcnt, rxpos);
+	if (!dtd->jb) {
+		/* note if we had a missing packet */
+		if (unlikely(rxpos != rxcnt))
+			printk(KERN_NOTICE "Span %s: Expected seq no %d, but received %d instead\n", span->name, rxcnt, rxpos);
 
-	dahdi_ec_span(span);
-	dahdi_receive(span);
+		dahdi_ec_span(span);
+		dahdi_receive(span);
+	}
 
 	/* If this is our master span, then run everything */
 	if (master)
@@ -403,6 +871,7 @@ static void dahdi_dynamic_release(struct kref *kref)
 	WARN_ON(test_bit(DAHDI_FLAGBIT_REGISTERED, &d->span.flags));
 
 	kfree(d->msgbuf);
+	dahdi_dynamic_jb_free(d->jb);
 
 	for (x = 0; x < d->span.channels; x++)
 		kfree(d->chans[x]);
@@ -456,6 +925,23 @@ static struct dahdi_dynamic_driver *find_driver(const char *name)
 	return found;
 }
 
+static ssize_t jitter_buffer_show(struct device *dev,
+				  struct device_attribute *attr, char *buf)
+{
+	struct dahdi_device *ddev = container_of(dev, struct dahdi_device, dev);
+	struct dahdi_span *span = list_first_entry(&ddev->spans,
+						   struct dahdi_span,
+						   device_node);
+	struct dahdi_dynamic_jb *jb = dynamic_from_span(span)->jb;
+
+	if (!jb)
+		return sprintf(buf, "off\n");
+	return sprintf(buf, "depth=%d target=%d late=%u lost=%u concealed=%u dropped=%u\n",
+		       (u16)(jb->head - jb->next), jb->target, jb->late,
+		       jb->lost, jb->concealed, jb->dropped);
+}
+static DEVICE_ATTR_RO(jitter_buffer);
+
 static int _destroy_dynamic(struct dahdi_dynamic_span *dds)
 {
 	unsigned long flags;
@@ -490,12 +976,14 @@ static int _destroy_dynamic(struct dahdi_dynamic_span *dds)
 		d->pvt = NULL;
 	}
 
+	device_remove_file(&d->ddev->dev, &dev_attr_jitter_buffer);
 	dahdi_unregister_device(d->ddev);
 
 	spin_lock_irqsave(&dspan_lock, flags);
 	list_del_rcu(&d->list);
 	spin_unlock_irqrestore(&dspan_lock, flags);
 	synchronize_rcu();
+	dahdi_dynamic_steer_sync(d);
 
 	/* One since we've removed the item from the list... */
 	dynamic_put(d);
@@ -577,6 +1065,7 @@ static int _create_dynamic(struct dahdi_dynamic_span *dds)
 	unsigned long flags;
 	int x;
 	int bufsize;
+	int depth;
 
 	if (dds->numchans < 1) {
 		printk(KERN_NOTICE "Can't be less than 1 channel (%d)!\n",
@@ -620,7 +1109,20 @@ static int _create_dynamic(struct dahdi_dynamic_span *dds)
 		dynamic_put(d);
 		return -ENOMEM;
 	}
+
+	/* The parameter can change under us; read it once */
+	depth = min(READ_ONCE(jitterbuffer), DAHDI_DYNAMIC_JB_MAX);
+	if (depth > 0) {
+		d->jb = dahdi_dynamic_jb_alloc(dds->numchans, depth);
+		if (!d->jb) {
+			dynamic_put(d);
+			return -ENOMEM;
+		}
+	}
 	
+	/* A fixed CPU for the span's tick */
+	d->rxcpu = dahdi_dynamic_steer_next();
+
 	/* Setup parameters properly assuming we're going to be okay. */
 	strscpy(d->dname, dds->driver, sizeof(d->dname));
 	strscpy(d->addr, dds->addr, sizeof(d->addr));
@@ -698,6 +1200,10 @@ static int _create_dynamic(struct dahdi_dynamic_span *dds)
 
 	x = d->span.spanno;
 
+	if (device_create_file(&d->ddev->dev, &dev_attr_jitter_buffer))
+		printk(KERN_NOTICE "Unable to add jitter_buffer to '%s'\n",
+			d->span.name);
+
 	/* Transfer our reference to the dspan_list.  Do not touch d after
 	 * this point. It also must remain on the list while registered. */
 	spin_lock_irqsave(&dspan_lock, flags);
@@ -729,7 +1235,8 @@ static void dahdi_dynamic_tasklet(unsigned long data)
 	}
 	taskletpending = 0;
 }
-#else
+#endif
+
 static void dahdi_dynamic_flush_tasklet(unsigned long data)
 {
 	struct dahdi_dynamic_driver *drv;
@@ -743,7 +1250,6 @@ static void dahdi_dynamic_flush_tasklet(unsigned long data)
 	}
 	rcu_read_unlock();
 }
-#endif
 
 static int dahdi_dynamic_ioctl(unsigned int cmd, unsigned long data)
 {
@@ -810,11 +1316,14 @@ void dahdi_dynamic_unregister_driver(struct dahdi_dynamic_driver *dri)
 				else
 					WARN_ON(1);
 			}
+			device_remove_file(&d->ddev->dev,
+					   &dev_attr_jitter_buffer);
 			dahdi_unregister_device(d->ddev);
 			spin_lock_irqsave(&dspan_lock, flags);
 			list_del_rcu(&d->list);
 			spin_unlock_irqrestore(&dspan_lock, flags);
 			synchronize_rcu();
+			dahdi_dynamic_steer_sync(d);
 			d->driver = NULL;
 			dynamic_put(d);
 		}
@@ -866,15 +1375,28 @@ static const struct dahdi_dynamic_ops dahdi_dynamic_ops = {
 
 static int dahdi_dynamic_init(void)
 {
+	int cpu, res;
+
+	for_each_possible_cpu(cpu) {
+		init_llist_head(per_cpu_ptr(&dahdi_dynamic_steer_list, cpu));
+		init_irq_work(per_cpu_ptr(&dahdi_dynamic_steer_work, cpu),
+			      dahdi_dynamic_steer_work_fn);
+	}
+	/* The teardown runs once the CPU is dead, from another one */
+	res = cpuhp_setup_state_nocalls(CPUHP_BP_PREPARE_DYN, "dahdi/dynamic:dead",
+					NULL, dahdi_dynamic_cpu_dead);
+	if (res < 0)
+		return res;
+	dahdi_dynamic_cpuhp = res;
+
 	/* Start process to check for RED ALARM */
 	timer_setup(&alarmcheck, check_for_red_alarm, 0);
 	/* Check once per second */
 	mod_timer(&alarmcheck, jiffies + 1 * HZ);
 #ifdef ENABLE_TASKLETS
 	tasklet_init(&dahdi_dynamic_tlet, dahdi_dynamic_tasklet, 0);
-#else
-	tasklet_init(&dahdi_dynamic_flush_tlet, dahdi_dynamic_flush_tasklet, 0);
 #endif
+	tasklet_init(&dahdi_dynamic_flush_tlet, dahdi_dynamic_flush_tasklet, 0);
 	dahdi_set_dynamic_ops(&dahdi_dynamic_ops);
 
 	printk(KERN_INFO "DAHDI Dynamic Span support LOADED\n");
@@ -883,17 +1405,22 @@ static int dahdi_dynamic_init(void)
 
 static void dahdi_dynamic_cleanup(void)
 {
+	int cpu;
+
 	dahdi_set_dynamic_ops(NULL);
 
+	cpuhp_remove_state_nocalls(dahdi_dynamic_cpuhp);
+	for_each_possible_cpu(cpu)
+		irq_work_sync(per_cpu_ptr(&dahdi_dynamic_steer_work, cpu));
+
 #ifdef ENABLE_TASKLETS
 	if (taskletpending) {
 		tasklet_disable(&dahdi_dynamic_tlet);
 		tasklet_kill(&dahdi_dynamic_tlet);
 	}
-#else
+#endif
 	tasklet_disable(&dahdi_dynamic_flush_tlet);
 	tasklet_kill(&dahdi_dynamic_flush_tlet);
-#endif
 	del_timer_sync(&alarmcheck);
 	/* Must call again in case it was running before and rescheduled
 	 * itself. */
@@ -902,6 +1429,10 @@ static void dahdi_dynamic_cleanup(void)
 }
 
 module_param(debug, int, 0600);
+module_param(jitterbuffer, int, 0644);
+MODULE_PARM_DESC(jitterbuffer, "Least ms of received audio to hold back on dynamic spans created from now on (0 for none)");
+module_param(rxsteering, bool, 0444);
+MODULE_PARM_DESC(rxsteering, "Spread the receive, echo cancellation and transmit work of the dynamic spans over the CPUs, a fixed CPU for each span");
 
 MODULE_DESCRIPTION("DAHDI Dynamic Span Support");
 MODULE_AUTHOR("Mark Spencer <markster@digium.com>");
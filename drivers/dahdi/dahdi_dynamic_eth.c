@@ -36,26 +36,67 @@
 
 #define ETH_P_DAHDI_DETH	0xd00d
 
+/* Set in the flags byte of each message we send while bundling, so the
+   peer knows it may send us bundles */
+#define ZTDETH_FLAG_BUNDLE	(1 << 4)
+
+/* A subaddr of 01vvvvvv nnnnnnnn marks a bundle of n messages in format
+   version v, each preceded by a ztdeth_bundle_header.  (1xxxxxxx xxxxxxxx
+   is a dahdi_dynamic_ethmf frame.) */
+#define ZTDETH_BUNDLE		0x4000
+#define ZTDETH_BUNDLE_MASK	0xc000
+#define ZTDETH_BUNDLE_VERSION	1
+#define ZTDETH_BUNDLE_MAX	0xff
+
+/* Spare skbs kept for the bundles to each peer */
+#define ZTDETH_POOL_SIZE	4
+
 struct ztdeth_header {
 	unsigned short subaddr;
 };
 
+struct ztdeth_bundle_header {
+	unsigned short subaddr;	/* Network byte order */
+	unsigned short len;	/* Network byte order */
+};
+
+static bool bundle = true;
+module_param(bundle, bool, 0644);
+MODULE_PARM_DESC(bundle, "Send the spans for one peer in one frame per tick, if the peer takes bundles");
+
 /* We take the raw message, put it in an ethernet frame, and add a
    two byte addressing header at the top for future use */
 static DEFINE_SPINLOCK(zlock);
 
 static struct sk_buff_head skbs;
 
+/* The spans to one MAC address over one interface */
+static struct ztdeth_peer {
+	unsigned char addr[ETH_ALEN];
+	char ethdev[IFNAMSIZ];
+	struct net_device *dev;		/* Last used to send a bundle, held */
+	int version;			/* Bundle version it takes, or 0 */
+	struct sk_buff *bundle;		/* Bundle being filled this tick */
+	struct sk_buff_head pool;	/* Spare skbs for bundles */
+	int refs;
+	struct ztdeth_peer *next;
+} *zpeers = NULL;
+
 static struct ztdeth {
 	unsigned char addr[ETH_ALEN];
 	unsigned short subaddr; /* Network byte order */
 	struct dahdi_span *span;
 	char ethdev[IFNAMSIZ];
 	struct net_device *dev;
+	struct ztdeth_peer *peer;
 	struct ztdeth *next;
 } *zdevs = NULL;
 
-static struct dahdi_span *ztdeth_getspan(unsigned char *addr, unsigned short subaddr)
+/*
+ * Find the span a message from addr/subaddr is for, and note the bundle
+ * version its sender takes.
+ */
+static struct dahdi_span *ztdeth_getspan(unsigned char *addr, unsigned short subaddr, int version)
 {
 	unsigned long flags;
 	struct ztdeth *z;
@@ -68,43 +109,99 @@ static struct dahdi_span *ztdeth_getspan(unsigned char *addr, unsigned short sub
 			break;
 		z = z->next;
 	}
-	if (z)
+	if (z) {
 		span = z->span;
+		z->peer->version = version;
+	}
 	spin_unlock_irqrestore(&zlock, flags);
 	if (!span || !test_bit(DAHDI_FLAGBIT_REGISTERED, &span->flags))
 		return NULL;
 	return span;
 }
 
+static void ztdeth_rcv_bundle(struct sk_buff *skb, unsigned short hdr)
+{
+	const struct ztdeth_bundle_header *bh;
+	struct dahdi_span *span;
+	unsigned char *data;
+	int count = hdr & ZTDETH_BUNDLE_MAX;
+	int left, len;
+
+	if (((hdr & ~ZTDETH_BUNDLE_MASK) >> 8) != ZTDETH_BUNDLE_VERSION)
+		return;
+
+	data = skb->data;
+	left = skb->len;
+	while (count-- && left >= sizeof(*bh)) {
+		bh = (const struct ztdeth_bundle_header *)data;
+		len = ntohs(bh->len);
+		data += sizeof(*bh);
+		left -= sizeof(*bh);
+		if (len > left)
+			break;
+		span = ztdeth_getspan(eth_hdr(skb)->h_source, bh->subaddr,
+				      ZTDETH_BUNDLE_VERSION);
+		if (span)
+			dahdi_dynamic_receive(span, data, len);
+		data += len;
+		left -= len;
+	}
+}
+
 static int ztdeth_rcv(struct sk_buff *skb, struct net_device *dev, struct packet_type *pt, struct net_device *orig_dev)
 {
 	struct dahdi_span *span;
 	struct ztdeth_header *zh;
+	unsigned short subaddr;
+	int version;
+
 	zh = (struct ztdeth_header *)skb_network_header(skb);
-	span = ztdeth_getspan(eth_hdr(skb)->h_source, zh->subaddr);
-	if (span) {
-		skb_pull(skb, sizeof(struct ztdeth_header));
+	subaddr = zh->subaddr;
+	skb_pull(skb, sizeof(struct ztdeth_header));
 #ifdef NEW_SKB_LINEARIZE
-		if (skb_is_nonlinear(skb))
-			skb_linearize(skb);
+	if (skb_is_nonlinear(skb))
+		skb_linearize(skb);
 #else
-		if (skb_is_nonlinear(skb))
-			skb_linearize(skb, GFP_KERNEL);
+	if (skb_is_nonlinear(skb))
+		skb_linearize(skb, GFP_KERNEL);
 #endif
-		dahdi_dynamic_receive(span, (unsigned char *)skb->data, skb->len);
+	if ((ntohs(subaddr) & ZTDETH_BUNDLE_MASK) == ZTDETH_BUNDLE) {
+		ztdeth_rcv_bundle(skb, ntohs(subaddr));
+	} else {
+		version = (skb->len > 1 && (skb->data[1] & ZTDETH_FLAG_BUNDLE)) ?
+			  ZTDETH_BUNDLE_VERSION : 0;
+		span = ztdeth_getspan(eth_hdr(skb)->h_source, subaddr, version);
+		if (span)
+			dahdi_dynamic_receive(span, (unsigned char *)skb->data, skb->len);
 	}
 	kfree_skb(skb);
 	return 0;
 }
 
+/* Point a peer at the device its bundles go out on, holding on to it until
+   it goes down.  Called with zlock held. */
+static void __ztdeth_peer_set_dev(struct ztdeth_peer *p, struct net_device *dev)
+{
+	if (p->dev == dev)
+		return;
+	if (dev)
+		dev_hold(dev);
+	if (p->dev)
+		dev_put(p->dev);
+	p->dev = dev;
+}
+
 static int ztdeth_notifier(struct notifier_block *block, unsigned long event, void *ptr)
 {
 	struct net_device *dev = ptr;
 	struct ztdeth *z;
+	struct ztdeth_peer *p;
+	struct sk_buff_head list;
 	unsigned long flags;
 	switch(event) {
 	case NETDEV_GOING_DOWN:
 	case NETDEV_DOWN:
+		__skb_queue_head_init(&list);
 		spin_lock_irqsave(&zlock, flags);
 		z = zdevs;
 		while(z) {
@@ -113,7 +210,16 @@ static int ztdeth_notifier(struct notifier_block *block, unsigned long event, vo
 				z->dev = NULL;
 			z = z->next;
 		}
+		for (p = zpeers; p; p = p->next) {
+			if (p->dev != dev)
+				continue;
+			__ztdeth_peer_set_dev(p, NULL);
+			if (p->bundle)
+				__skb_queue_tail(&list, p->bundle);
+			p->bundle = NULL;
+		}
 		spin_unlock_irqrestore(&zlock, flags);
+		__skb_queue_purge(&list);
 		break;
 	case NETDEV_UP:
 		spin_lock_irqsave(&zlock, flags);
@@ -130,6 +236,75 @@ static int ztdeth_notifier(struct notifier_block *block, unsigned long event, vo
 	return 0;
 }
 
+/**
+ * __ztdeth_bundle - Add a span's message to the bundle for its peer.
+ *
+ * The bundle is sent by ztdeth_flush(), or earlier if the next message
+ * would take it past the MTU.  Returns nonzero if the message can't be
+ * bundled at all.  Called with zlock held.
+ */
+static int __ztdeth_bundle(struct ztdeth *z, u8 *msg, size_t msglen)
+{
+	struct ztdeth_peer *const p = z->peer;
+	struct net_device *const dev = z->dev;
+	const int need = sizeof(struct ztdeth_bundle_header) + msglen;
+	struct ztdeth_bundle_header *bh;
+	struct ztdeth_header *zh;
+	struct sk_buff *skb = p->bundle;
+	u8 *data;
+
+	if (skb) {
+		zh = (struct ztdeth_header *)skb_network_header(skb);
+		if (skb->dev != dev ||
+		    (ntohs(zh->subaddr) & ZTDETH_BUNDLE_MAX) == ZTDETH_BUNDLE_MAX ||
+		    skb_tail_pointer(skb) - (u8 *)zh + need > dev->mtu ||
+		    skb_tailroom(skb) < need) {
+			/* Full, send it now */
+			skb_queue_tail(&skbs, skb);
+			skb = p->bundle = NULL;
+		}
+	}
+
+	if (!skb) {
+		if (sizeof(*zh) + need > dev->mtu)
+			return -EMSGSIZE;
+		__ztdeth_peer_set_dev(p, dev);
+		skb = __skb_dequeue(&p->pool);
+		if (skb && (skb_headroom(skb) < LL_RESERVED_SPACE(dev) ||
+			    skb_tailroom(skb) < sizeof(*zh) + need)) {
+			/* Sized for another device */
+			dev_kfree_skb_any(skb);
+			skb = NULL;
+		}
+		if (!skb) {
+			skb = dev_alloc_skb(LL_RESERVED_SPACE(dev) + dev->mtu);
+			if (!skb)
+				return -ENOMEM;
+			skb_reserve(skb, LL_RESERVED_SPACE(dev));
+		}
+
+		skb_reset_network_header(skb);
+		zh = (struct ztdeth_header *)skb_put(skb, sizeof(*zh));
+		zh->subaddr = htons(ZTDETH_BUNDLE | (ZTDETH_BUNDLE_VERSION << 8));
+		skb->protocol = __constant_htons(ETH_P_DAHDI_DETH);
+		skb->dev = dev;
+		dev_hard_header(skb, dev, ETH_P_DAHDI_DETH, p->addr, dev->dev_addr, 0);
+		p->bundle = skb;
+	}
+
+	bh = (struct ztdeth_bundle_header *)skb_put(skb, sizeof(*bh));
+	bh->subaddr = z->subaddr;
+	bh->len = htons(msglen);
+	data = skb_put(skb, msglen);
+	memcpy(data, msg, msglen);
+	if (msglen > 1)
+		data[1] |= ZTDETH_FLAG_BUNDLE;
+
+	zh = (struct ztdeth_header *)skb_network_header(skb);
+	zh->subaddr = htons(ntohs(zh->subaddr) + 1);
+	return 0;
+}
+
 static void ztdeth_transmit(struct dahdi_dynamic *dyn, u8 *msg, size_t msglen)
 {
 	struct ztdeth *z;
@@ -139,10 +314,16 @@ static void ztdeth_transmit(struct dahdi_dynamic *dyn, u8 *msg, size_t msglen)
 	struct net_device *dev;
 	unsigned char addr[ETH_ALEN];
 	unsigned short subaddr; /* Network byte order */
+	/* The parameter can change under us; read it once */
+	const bool bundling = READ_ONCE(bundle);
 
 	spin_lock_irqsave(&zlock, flags);
 	z = dyn->pvt;
-	if (z && z->dev) {
+	if (z && z->dev && bundling &&
+	    z->peer->version == ZTDETH_BUNDLE_VERSION &&
+	    !__ztdeth_bundle(z, msg, msglen)) {
+		spin_unlock_irqrestore(&zlock, flags);
+	} else if (z && z->dev) {
 		/* Copy fields to local variables to remove spinlock ASAP */
 		dev = z->dev;
 		memcpy(addr, z->addr, sizeof(z->addr));
@@ -155,6 +336,8 @@ static void ztdeth_transmit(struct dahdi_dynamic *dyn, u8 *msg, size_t msglen)
 
 			/* Copy message body */
 			memcpy(skb_put(skb, msglen), msg, msglen);
+			if (bundling && msglen > 1)
+				skb->data[1] |= ZTDETH_FLAG_BUNDLE;
 
 			/* Throw on header */
 			zh = (struct ztdeth_header *)skb_push(skb, sizeof(struct ztdeth_header));
@@ -179,9 +362,47 @@ static void ztdeth_transmit(struct dahdi_dynamic *dyn, u8 *msg, size_t msglen)
  */
 static int ztdeth_flush(void)
 {
+	struct ztdeth_peer *p;
+	struct sk_buff_head list;
 	struct sk_buff *skb;
-	while ((skb = skb_dequeue(&skbs)))
+	unsigned long flags;
+
+	__skb_queue_head_init(&list);
+
+	spin_lock_irqsave(&zlock, flags);
+	for (p = zpeers; p; p = p->next) {
+		if (p->bundle) {
+			/* Nothing more for it this tick */
+			skb_queue_tail(&skbs, p->bundle);
+			p->bundle = NULL;
+		}
+	}
+	spin_unlock_irqrestore(&zlock, flags);
+
+	/* Take the whole tick's frames in one go */
+	spin_lock_irqsave(&skbs.lock, flags);
+	skb_queue_splice_init(&skbs, &list);
+	spin_unlock_irqrestore(&skbs.lock, flags);
+
+	while ((skb = __skb_dequeue(&list)))
 		dev_queue_xmit(skb);
+
+	/* Top up the pools here, so the tick doesn't have to allocate */
+	spin_lock_irqsave(&zlock, flags);
+	for (p = zpeers; p; p = p->next) {
+		struct net_device *const dev = p->dev;
+
+		if (!dev || p->version != ZTDETH_BUNDLE_VERSION)
+			continue;
+		while (skb_queue_len(&p->pool) < ZTDETH_POOL_SIZE) {
+			skb = dev_alloc_skb(LL_RESERVED_SPACE(dev) + dev->mtu);
+			if (!skb)
+				break;
+			skb_reserve(skb, LL_RESERVED_SPACE(dev));
+			__skb_queue_tail(&p->pool, skb);
+		}
+	}
+	spin_unlock_irqrestore(&zlock, flags);
 	return 0;
 }
 
@@ -248,11 +469,40 @@ static int hex2int(char *s)
 	return tmp;
 }
 
+/* Drop a span's reference to its peer.  Called with zlock held; returns
+   the peer if it is no longer used and should be freed. */
+static struct ztdeth_peer *__ztdeth_peer_put(struct ztdeth_peer *peer)
+{
+	struct ztdeth_peer **pp;
+
+	if (--peer->refs)
+		return NULL;
+	for (pp = &zpeers; *pp; pp = &(*pp)->next) {
+		if (*pp == peer) {
+			*pp = peer->next;
+			break;
+		}
+	}
+	return peer;
+}
+
+static void ztdeth_peer_free(struct ztdeth_peer *peer)
+{
+	if (!peer)
+		return;
+	kfree_skb(peer->bundle);
+	skb_queue_purge(&peer->pool);
+	if (peer->dev)
+		dev_put(peer->dev);
+	kfree(peer);
+}
+
 static void ztdeth_destroy(struct dahdi_dynamic *dyn)
 {
 	struct ztdeth *z = dyn->pvt;
 	unsigned long flags;
 	struct ztdeth *prev=NULL, *cur;
+	struct ztdeth_peer *peer = NULL;
 
 	spin_lock_irqsave(&zlock, flags);
 	cur = zdevs;
@@ -262,6 +512,7 @@ static void ztdeth_destroy(struct dahdi_dynamic *dyn)
 				prev->next = cur->next;
 			else
 				zdevs = cur->next;
+			peer = __ztdeth_peer_put(z->peer);
 			break;
 		}
 		prev = cur;
@@ -272,6 +523,7 @@ static void ztdeth_destroy(struct dahdi_dynamic *dyn)
 	if (cur == z) {	/* Successfully removed */
 		dyn->pvt = NULL;
 		dev_put(z->dev);
+		ztdeth_peer_free(peer);
 		printk(KERN_INFO "TDMoE: Removed interface for %s\n", z->span->name);
 		kfree(z);
 	}
@@ -280,6 +532,7 @@ static void ztdeth_destroy(struct dahdi_dynamic *dyn)
 static int ztdeth_create(struct dahdi_dynamic *dyn, const char *addr)
 {
 	struct ztdeth *z;
+	struct ztdeth_peer *peer, *newpeer;
 	char src[256];
 	char tmp[256], *tmp2, *tmp3, *tmp4 = NULL;
 	int res,x;
@@ -353,11 +606,25 @@ static int ztdeth_create(struct dahdi_dynamic *dyn, const char *addr)
 				mul *= 10;
 				tmp3--;
 			}
+			if ((sub & ZTDETH_BUNDLE_MASK) == ZTDETH_BUNDLE) {
+				printk(KERN_NOTICE "TDMoE: Subaddress %d is reserved\n", sub);
+				kfree(z);
+				return -EINVAL;
+			}
 			z->subaddr = htons(sub);
 		}
+		newpeer = kzalloc(sizeof(*newpeer), GFP_KERNEL);
+		if (!newpeer) {
+			kfree(z);
+			return -ENOMEM;
+		}
+		memcpy(newpeer->addr, z->addr, ETH_ALEN);
+		strscpy(newpeer->ethdev, z->ethdev, sizeof(newpeer->ethdev));
+		skb_queue_head_init(&newpeer->pool);
 		z->dev = dev_get_by_name(&init_net, z->ethdev);
 		if (!z->dev) {
 			printk(KERN_NOTICE "TDMoE: Invalid device '%s'\n", z->ethdev);
+			kfree(newpeer);
 			kfree(z);
 			return -EINVAL;
 		}
@@ -369,10 +636,24 @@ static int ztdeth_create(struct dahdi_dynamic *dyn, const char *addr)
 		printk(KERN_INFO "TDMoE: Added new interface for %s at %s (addr=%s, src=%s, subaddr=%d)\n", span->name, z->dev->name, addr, src, ntohs(z->subaddr));
 
 		spin_lock_irqsave(&zlock, flags);
+		for (peer = zpeers; peer; peer = peer->next) {
+			if (!memcmp(peer->addr, z->addr, ETH_ALEN) &&
+			    !strcmp(peer->ethdev, z->ethdev))
+				break;
+		}
+		if (!peer) {
+			peer = newpeer;
+			newpeer = NULL;
+			peer->next = zpeers;
+			zpeers = peer;
+		}
+		peer->refs++;
+		z->peer = peer;
 		z->next = zdevs;
 		zdevs = z;
 		dyn->pvt = z;
 		spin_unlock_irqrestore(&zlock, flags);
+		kfree(newpeer);
 	}
 	return (z) ? 0 : -ENOMEM;
 }
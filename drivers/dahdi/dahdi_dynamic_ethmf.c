@@ -37,6 +37,8 @@
 #include <linux/notifier.h>
 #include <linux/crc32.h>
 #include <linux/seq_file.h>
+#include <linux/llist.h>
+#include <linux/percpu.h>
 
 /**
  * Undefine USE_PROC_FS, if you do not want the /proc/dahdi/dynamic-ethmf
@@ -62,10 +64,19 @@
 #define ETHMF_FLAG_IGNORE_CHAN0	(1 << 3)
 #define ETHMF_MAX_SPANS			4
 
+/* Each span takes a 6 byte header, 16 bytes of RBS and 32 channels of
+ * voice in a frame */
+#define ETHMF_SPAN_SIZE			(6 + 16 + 32 * DAHDI_CHUNKSIZE)
+#define ETHMF_FRAME_SIZE		(ETHMF_MAX_SPANS * ETHMF_SPAN_SIZE)
+/* Spare frames kept per group */
+#define ETHMF_POOL_SIZE			2
+
 struct ztdeth_header {
 	unsigned short subaddr;
 };
 
+#define ETHMF_SKB_HEADROOM	(LL_MAX_HEADER + sizeof(struct ztdeth_header))
+
 /* Timer for enabling spans - used to combat a lock problem */
 static struct timer_list timer;
 
@@ -78,27 +89,45 @@ static atomic_t errcount = ATOMIC_INIT(0);
 /* Whether or not we are in shutdown */
 static atomic_t shutdown = ATOMIC_INIT(0);
 
-static struct sk_buff_head skbs;
+/* Frames waiting for ztdethmf_flush(), queued on the CPU that built them */
+static DEFINE_PER_CPU(struct llist_head, ethmf_txq);
+
+struct ethmf_skb_cb {
+	struct llist_node node;
+};
+#define ETHMF_SKB_CB(skb) ((struct ethmf_skb_cb *)(skb)->cb)
 
-#ifdef USE_PROC_FS
 struct ethmf_group {
 	unsigned int hash_addr;
 	atomic_t spans;
+	/* Protects the frame being built */
+	spinlock_t lock;
+	/* Frame being built this tick, if any */
+	struct sk_buff *skb;
+	/* Number of spans the frame is laid out for */
+	int num_spans;
+	/* One bit for each span already in the frame */
+	unsigned int filled;
+	/* Spare frames, refilled by ztdethmf_flush() */
+	struct sk_buff_head pool;
+#ifdef USE_PROC_FS
 	atomic_t rxframecount;
 	atomic_t txframecount;
 	atomic_t rxbytecount;
 	atomic_t txbytecount;
 	atomic_t devupcount;
 	atomic_t devdowncount;
+#endif
 };
 static struct ethmf_group ethmf_groups[ETHMF_MAX_GROUPS];
-#endif
 
 struct ztdeth {
 	/* Destination MAC address */
 	unsigned char addr[ETH_ALEN];
 	/* Destination MAC address hash value */
 	unsigned int addr_hash;
+	/* Index of the ethmf_groups[] entry for addr_hash */
+	int group;
 	/* span sub-address, in network byte order */
 	unsigned short subaddr;
 	/* DAHDI span associated with this TDMoE-mf span */
@@ -107,11 +136,7 @@ struct ztdeth {
 	char ethdev[IFNAMSIZ];
 	/* Ethernet device reference */
 	struct net_device *dev;
-	/* trx buffer */
-	unsigned char *msgbuf;
-	/* trx buffer length */
-	int msgbuf_len;
-	/* wether or not this frame is ready for trx */
+	/* wether or not this span is in the frame being built */
 	atomic_t ready;
 	/* delay counter, to ensure all spans are added, prior to usage */
 	atomic_t delay;
@@ -144,8 +169,13 @@ static inline void ethmf_errors_inc(void)
 #endif
 }
 
-#ifdef USE_PROC_FS
-static inline int hashaddr_to_index(unsigned int hash_addr)
+/**
+ * Find the group for hash_addr, claiming a free one if there is none yet.
+ *
+ * NOTE: ethmf_lock must already be held.  Only ztdethmf_create() claims
+ * groups; everything else uses the index it saved in the span.
+ */
+static int hashaddr_to_index(unsigned int hash_addr)
 {
 	int i, z = -1;
 	for (i = 0; i < ETHMF_MAX_GROUPS; ++i) {
@@ -159,7 +189,6 @@ static inline int hashaddr_to_index(unsigned int hash_addr)
 	}
 	return z;
 }
-#endif
 
 /**
  * Find the Ztdeth Struct and DAHDI span for a given MAC address and subaddr.
@@ -189,37 +218,23 @@ static inline void find_ethmf(const unsigned char *addr,
 }
 
 /**
- * Determines if all spans are ready for transmit. If all spans are ready,
- * we return the number of spans which indeed are ready and populate the
- * array of pointers to those spans..
+ * Returns the number of running spans in a group, and marks them as not yet
+ * in the frame being built.
  *
  * NOTE: RCU read lock must already be held.
  */
-static inline int ethmf_trx_spans_ready(unsigned int addr_hash, struct ztdeth *(*ready_spans)[ETHMF_MAX_PER_SPAN_GROUP])
+static int ethmf_group_start(unsigned int addr_hash)
 {
 	struct ztdeth *t;
-	int span_count = 0, spans_ready = 0;
+	int span_count = 0;
 
 	list_for_each_entry_rcu(t, &ethmf_list, list) {
 		if (!atomic_read(&t->delay) && t->addr_hash == addr_hash) {
+			atomic_set(&t->ready, 0);
 			++span_count;
-			if (atomic_read(&t->ready)) {
-				short subaddr = ntohs(t->subaddr);
-				if (subaddr < ETHMF_MAX_PER_SPAN_GROUP) {
-					(*ready_spans)[subaddr] = t;
-					++spans_ready;
-				} else {
-					printk(KERN_ERR "More than %d spans per multi-frame group are not currently supported.",
-						ETHMF_MAX_PER_SPAN_GROUP);
-				}
-			}
 		}
 	}
-
-	if (span_count && spans_ready && span_count == spans_ready) {
-		return spans_ready;
-	}
-	return 0;
+	return span_count;
 }
 
 /**
@@ -322,10 +337,10 @@ static int ztdethmf_rcv(struct sk_buff *skb, struct net_device *dev,
 
 #ifdef USE_PROC_FS
 			if (span_index == 0) {
-				atomic_inc(&(ethmf_groups[hashaddr_to_index(z->addr_hash)].rxframecount));
+				atomic_inc(&(ethmf_groups[z->group].rxframecount));
 				atomic_add(skb->len + z->dev->hard_header_len +
 					sizeof(struct ztdeth_header),
-					&(ethmf_groups[hashaddr_to_index(z->addr_hash)].rxbytecount));
+					&(ethmf_groups[z->group].rxbytecount));
 			}
 #endif
 			++span_index;
@@ -352,7 +367,7 @@ static int ztdethmf_notifier(struct notifier_block *block, unsigned long event,
 			if (z->dev == dev) {
 				z->dev = NULL;
 #ifdef USE_PROC_FS
-				atomic_inc(&(ethmf_groups[hashaddr_to_index(z->addr_hash)].devdowncount));
+				atomic_inc(&(ethmf_groups[z->group].devdowncount));
 #endif
 			}
 		}
@@ -365,7 +380,7 @@ static int ztdethmf_notifier(struct notifier_block *block, unsigned long event,
 			if (!strcmp(z->ethdev, dev->name)) {
 				z->dev = dev;
 #ifdef USE_PROC_FS
-				atomic_inc(&(ethmf_groups[hashaddr_to_index(z->addr_hash)].devupcount));
+				atomic_inc(&(ethmf_groups[z->group].devupcount));
 #endif
 			}
 		}
@@ -375,121 +390,161 @@ static int ztdethmf_notifier(struct notifier_block *block, unsigned long event,
 	return 0;
 }
 
+/**
+ * Writes a span's message into its place in a frame laid out for num_spans
+ * spans: the TDM header, then the RBS padded to 16 bytes, then the voice
+ * padded to 32 channels.
+ */
+static void ethmf_put_span(u8 *frame, int num_spans, int index,
+	struct ztdeth *z, const u8 *msg)
+{
+	const int chan = z->real_channels;
+	const int front = !atomic_read(&z->no_front_padding);
+	int rbs, pad;
+	u8 *p;
+
+	if (chan == 24)
+		rbs = 12;
+	else if (chan == 31)
+		rbs = 16;
+	else
+		rbs = ((chan + 3) / 4) * 2;
+
+	/* TDM Header */
+	p = frame + 6 * index;
+	memcpy(p, msg, 6);
+	if (front)
+		p[1] |= ETHMF_FLAG_IGNORE_CHAN0;
+
+	/* RBS Header */
+	p = frame + 6 * num_spans + 16 * index;
+	memcpy(p, msg + 6, rbs);
+	memset(p + rbs, 0, 16 - rbs);
+
+	/* Payload */
+	p = frame + 22 * num_spans + 32 * DAHDI_CHUNKSIZE * index;
+	if (front) {
+		/* This adds an additional (padded) channel to our total */
+		memset(p, 0xA5, 8); /* ETHMF_IGNORE_CHAN0 */
+		p += 8;
+	}
+	memcpy(p, msg + 6 + rbs, chan * 8);
+	pad = ((front ? 31 : 32) - chan) * 8;
+	if (pad > 0)
+		memset(p + chan * 8, 0xDD, pad);
+}
+
+/**
+ * Takes a frame for num_spans spans from the group's pool, or allocates one
+ * if the pool has run dry.
+ */
+static struct sk_buff *ethmf_frame_get(struct ethmf_group *g, int num_spans)
+{
+	struct sk_buff *skb = skb_dequeue(&g->pool);
+
+	if (!skb) {
+		skb = dev_alloc_skb(ETHMF_SKB_HEADROOM + ETHMF_FRAME_SIZE);
+		if (unlikely(!skb))
+			return NULL;
+		skb_reserve(skb, ETHMF_SKB_HEADROOM);
+	}
+	skb_put(skb, num_spans * ETHMF_SPAN_SIZE);
+	return skb;
+}
+
 static void ztdethmf_transmit(struct dahdi_dynamic *dyn, u8 *msg, size_t msglen)
 {
-	struct ztdeth *z = dyn->pvt, *ready_spans[ETHMF_MAX_PER_SPAN_GROUP];
-	struct sk_buff *skb;
+	struct ztdeth *z = dyn->pvt;
+	struct ethmf_group *g;
+	struct sk_buff *skb = NULL;
 	struct ztdeth_header *zh;
 	struct net_device *dev;
-	unsigned char addr[ETH_ALEN];
-	int spans_ready = 0, index = 0;
+	unsigned long flags;
+	int index, group, num_spans;
 
 	if (atomic_read(&shutdown))
 		return;
 
 	rcu_read_lock();
 
-	if (unlikely(!z || !z->dev)) {
+	if (unlikely(!z || !z->dev || atomic_read(&z->delay))) {
 		rcu_read_unlock();
 		return;
 	}
 
-	if (!atomic_read(&z->ready)) {
-		if (atomic_inc_return(&z->ready) == 1) {
-			memcpy(z->msgbuf, msg, msglen);
-			z->msgbuf_len = msglen;
-		}
+	index = ntohs(z->subaddr);
+	group = z->group;
+	if (unlikely(index >= ETHMF_MAX_SPANS)) {
+		rcu_read_unlock();
+		ethmf_errors_inc();
+		if (printk_ratelimit())
+			printk(KERN_ERR "More than %d spans per multi-frame group are not currently supported.",
+				ETHMF_MAX_SPANS);
+		return;
 	}
-
-	spans_ready = ethmf_trx_spans_ready(z->addr_hash, &ready_spans);
-	if (spans_ready) {
-		int pad[ETHMF_MAX_SPANS], rbs[ETHMF_MAX_SPANS];
-
-		dev = z->dev;
-		memcpy(addr, z->addr, sizeof(z->addr));
-
-		for (index = 0; index < spans_ready; index++) {
-			int chan = ready_spans[index]->real_channels;
-			/* By default we pad to 32 channels, but if
-			 * no_front_padding is false then we have a pad
-			 * in the front of 8 bytes, so this implies one
-			 * less channel
-			 */
-			if (atomic_read(&(ready_spans[index]->no_front_padding)))
-				pad[index] = (32 - chan)*8;
-			else
-				pad[index] = (31 - chan)*8;
-
-			if (chan == 24)
-				rbs[index] = 12;
-			else if (chan == 31)
-				rbs[index] = 16;
-			else
-				/* Shouldn't this be index, not spans_ready? */
-				rbs[spans_ready] = ((chan + 3) / 4) * 2;
-		}
-
-		/* Allocate the standard size for a 32-chan frame */
-		skb = dev_alloc_skb(1112 + dev->hard_header_len
-			+ sizeof(struct ztdeth_header) + 32);
-		if (unlikely(!skb)) {
+	if (unlikely(z->real_channels > 31)) {
+		rcu_read_unlock();
+		ethmf_errors_inc();
+		return;
+	}
+	g = &ethmf_groups[group];
+
+	spin_lock_irqsave(&g->lock, flags);
+	if (g->skb && (g->filled & (1 << index))) {
+		/* Not every span made it into the last tick's frame, so
+		 * start again in case the group has changed. */
+		skb_trim(g->skb, 0);
+		skb_queue_head(&g->pool, g->skb);
+		g->skb = NULL;
+	}
+	if (!g->skb) {
+		num_spans = ethmf_group_start(z->addr_hash);
+		if (index >= num_spans) {
+			spin_unlock_irqrestore(&g->lock, flags);
 			rcu_read_unlock();
 			ethmf_errors_inc();
 			return;
 		}
-
-		/* Reserve header space */
-		skb_reserve(skb, dev->hard_header_len
-				+ sizeof(struct ztdeth_header));
-		/* copy each spans header */
-		for (index = 0; index < spans_ready; index++) {
-			if (!atomic_read(&(ready_spans[index]->no_front_padding)))
-				ready_spans[index]->msgbuf[1]
-					|= ETHMF_FLAG_IGNORE_CHAN0;
-
-			memcpy(skb_put(skb, 6), ready_spans[index]->msgbuf, 6);
-		}
-
-		/* copy each spans RBS payload */
-		for (index = 0; index < spans_ready; index++) {
-			memcpy(skb_put(skb, 16), ready_spans[index]->msgbuf + 6,
-				rbs[index]);
+		g->skb = ethmf_frame_get(g, num_spans);
+		if (unlikely(!g->skb)) {
+			spin_unlock_irqrestore(&g->lock, flags);
+			rcu_read_unlock();
+			ethmf_errors_inc();
+			return;
 		}
+		g->num_spans = num_spans;
+		g->filled = 0;
+	}
 
-		/* copy each spans data/voice payload */
-		for (index = 0; index < spans_ready; index++) {
-			int chan = ready_spans[index]->real_channels;
-			if (!atomic_read(&(ready_spans[index]->no_front_padding))) {
-				/* This adds an additional (padded) channel to our total */
-				memset(skb_put(skb, 8), 0xA5, 8); /* ETHMF_IGNORE_CHAN0 */
-			}
-			memcpy(skb_put(skb, chan*8), ready_spans[index]->msgbuf
-					+ (6 + rbs[index]), chan*8);
-			if (pad[index] > 0) {
-				memset(skb_put(skb, pad[index]), 0xDD, pad[index]);
-			}
+	/* Straight from the span's message into its place in the frame */
+	ethmf_put_span(g->skb->data, g->num_spans, index, z, msg);
+	atomic_set(&z->ready, 1);
+	g->filled |= 1 << index;
+	if (g->filled == (1 << g->num_spans) - 1) {
+		skb = g->skb;
+		num_spans = g->num_spans;
+		g->skb = NULL;
+	}
+	spin_unlock_irqrestore(&g->lock, flags);
 
-			/* mark span as ready for new data/voice */
-			atomic_set(&(ready_spans[index]->ready), 0);
-		}
+	if (skb) {
+		dev = z->dev;
 
 		/* Throw on header */
 		zh = (struct ztdeth_header *)skb_push(skb,
 				sizeof(struct ztdeth_header));
-		zh->subaddr = htons((unsigned short)(0x8000 | (unsigned char)(spans_ready & 0xFF)));
+		zh->subaddr = htons((unsigned short)(0x8000 | (unsigned char)(num_spans & 0xFF)));
 
 		/* Setup protocol type */
 		skb->protocol = __constant_htons(ETH_P_ZTDETH);
 		skb_set_network_header(skb, 0);
 		skb->dev = dev;
-		dev_hard_header(skb, dev, ETH_P_ZTDETH, addr, dev->dev_addr, skb->len);
+		dev_hard_header(skb, dev, ETH_P_ZTDETH, z->addr, dev->dev_addr, skb->len);
 		/* queue frame for delivery */
-		if (dev) {
-			skb_queue_tail(&skbs, skb);
-		}
+		llist_add(&ETHMF_SKB_CB(skb)->node, this_cpu_ptr(&ethmf_txq));
 #ifdef USE_PROC_FS
-		atomic_inc(&(ethmf_groups[hashaddr_to_index(z->addr_hash)].txframecount));
-		atomic_add(skb->len, &(ethmf_groups[hashaddr_to_index(z->addr_hash)].txbytecount));
+		atomic_inc(&(g->txframecount));
+		atomic_add(skb->len, &(g->txbytecount));
 #endif
 	}
 
@@ -498,13 +553,45 @@ static void ztdethmf_transmit(struct dahdi_dynamic *dyn, u8 *msg, size_t msglen)
 	return;
 }
 
+/**
+ * Unlinks every queued frame, oldest first.
+ */
+static struct llist_node *ethmf_txq_take(int cpu)
+{
+	return llist_reverse_order(llist_del_all(per_cpu_ptr(&ethmf_txq, cpu)));
+}
+
+#define ethmf_txq_skb(node) container_of((void *)(node), struct sk_buff, cb)
+
 static int ztdethmf_flush(void)
 {
+	struct llist_node *node;
 	struct sk_buff *skb;
+	int cpu, group;
 
 	/* Handle all transmissions now */
-	while ((skb = skb_dequeue(&skbs))) {
-		dev_queue_xmit(skb);
+	for_each_possible_cpu(cpu) {
+		node = ethmf_txq_take(cpu);
+		while (node) {
+			skb = ethmf_txq_skb(node);
+			node = node->next;
+			dev_queue_xmit(skb);
+		}
+	}
+
+	/* Top up the pools here, so the tick doesn't have to allocate */
+	for (group = 0; group < ETHMF_MAX_GROUPS; ++group) {
+		struct ethmf_group *const g = &ethmf_groups[group];
+
+		if (!atomic_read(&g->spans))
+			continue;
+		while (skb_queue_len(&g->pool) < ETHMF_POOL_SIZE) {
+			skb = dev_alloc_skb(ETHMF_SKB_HEADROOM + ETHMF_FRAME_SIZE);
+			if (!skb)
+				break;
+			skb_reserve(skb, ETHMF_SKB_HEADROOM);
+			skb_queue_tail(&g->pool, skb);
+		}
 	}
 	return 0;
 }
@@ -527,12 +614,12 @@ static void ztdethmf_destroy(struct dahdi_dynamic *dyn)
 	list_del_rcu(&z->list);
 	spin_unlock_irqrestore(&ethmf_lock, flags);
 	synchronize_rcu();
-	atomic_dec(&(ethmf_groups[hashaddr_to_index(z->addr_hash)].spans));
+	atomic_dec(&(ethmf_groups[z->group].spans));
 
 	if (z) { /* Successfully removed */
 		printk(KERN_INFO "Removed interface for %s\n",
 			z->span->name);
-		kfree(z->msgbuf);
+		kfree(z->rcvbuf);
 		kfree(z);
 	} else {
 		if (z && z->span) {
@@ -569,7 +656,6 @@ static int ztdethmf_create(struct dahdi_dynamic *dyn, const char *addr)
 
 	/* create a msg buffer. MAX OF 31 CHANNELS!!!! */
 	bufsize = 31 * DAHDI_CHUNKSIZE + 31 / 4 + 48;
-	z->msgbuf = kmalloc(bufsize, GFP_KERNEL);
 	z->rcvbuf = kmalloc(bufsize, GFP_KERNEL);
 
 	/* Address should be <dev>/<macaddr>/subaddr */
@@ -616,9 +702,19 @@ static int ztdethmf_create(struct dahdi_dynamic *dyn, const char *addr)
 	atomic_set(&z->refcnt, 0);
 
 	spin_lock_irqsave(&ethmf_lock, flags);
+	z->group = hashaddr_to_index(z->addr_hash);
+	if (z->group < 0) {
+		spin_unlock_irqrestore(&ethmf_lock, flags);
+		printk(KERN_ERR "TDMoE Multiframe: More than %d groups are not supported.\n",
+			ETHMF_MAX_GROUPS);
+		dev_put(z->dev);
+		kfree(z->rcvbuf);
+		kfree(z);
+		return -ENOSPC;
+	}
+	atomic_inc(&(ethmf_groups[z->group].spans));
 	list_add_rcu(&z->list, &ethmf_list);
 	spin_unlock_irqrestore(&ethmf_lock, flags);
-	atomic_inc(&(ethmf_groups[hashaddr_to_index(z->addr_hash)].spans));
 
 	/* enable the timer for enabling the spans */
 	mod_timer(&timer, jiffies + HZ);
@@ -756,6 +852,13 @@ static const struct file_operations ztdethmf_proc_fops = {
 
 static int __init ztdethmf_init(void)
 {
+	int group;
+
+	for (group = 0; group < ETHMF_MAX_GROUPS; ++group) {
+		spin_lock_init(&ethmf_groups[group].lock);
+		skb_queue_head_init(&ethmf_groups[group].pool);
+	}
+
 	timer_setup(&timer, timer_callback, 0);
 	mod_timer(&timer, jiffies + HZ);
 
@@ -763,8 +866,6 @@ static int __init ztdethmf_init(void)
 	register_netdevice_notifier(&ztdethmf_nblock);
 	dahdi_dynamic_register_driver(&ztd_ethmf);
 
-	skb_queue_head_init(&skbs);
-
 #ifdef USE_PROC_FS
 	proc_entry = proc_create_data(ztdethmf_procname, 0444, NULL,
 				      &ztdethmf_proc_fops, NULL);
@@ -778,6 +879,10 @@ static int __init ztdethmf_init(void)
 
 static void __exit ztdethmf_exit(void)
 {
+	struct llist_node *node;
+	struct sk_buff *skb;
+	int cpu, group;
+
 	atomic_set(&timer_deleted, 1);
 	del_timer_sync(&timer);
 
@@ -785,6 +890,19 @@ static void __exit ztdethmf_exit(void)
 	unregister_netdevice_notifier(&ztdethmf_nblock);
 	dahdi_dynamic_unregister_driver(&ztd_ethmf);
 
+	for_each_possible_cpu(cpu) {
+		node = ethmf_txq_take(cpu);
+		while (node) {
+			skb = ethmf_txq_skb(node);
+			node = node->next;
+			kfree_skb(skb);
+		}
+	}
+	for (group = 0; group < ETHMF_MAX_GROUPS; ++group) {
+		kfree_skb(ethmf_groups[group].skb);
+		skb_queue_purge(&ethmf_groups[group].pool);
+	}
+
 #ifdef USE_PROC_FS
 	if (proc_entry)
 		remove_proc_entry(ztdethmf_procname, NULL);
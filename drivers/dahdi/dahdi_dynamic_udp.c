@@ -0,0 +1,408 @@
+/*
+ * Dynamic Span Interface for DAHDI (UDP/IP Interface)
+ *
+ * Carries the same messages as TDMoE, one per UDP datagram, so that
+ * dynamic spans can be routed between sites.
+ *
+ * Address syntax :
+ * <remote ip>:<remote port>[/<local port>]
+ *
+ * An IPv6 remote address is written in brackets, e.g. [fd00::2]:5000.  The
+ * local port defaults to the remote port.
+ *
+ * Every span has a socket of its own, bound to the local port and
+ * connected to the remote end, so every span is a flow of its own as far
+ * as RSS, RPS and the transmit hash are concerned.  The socket is opened
+ * in the network namespace of the process creating the span, so the two
+ * ends of a link can be set up from two namespaces on one host.
+ *
+ * Example :
+ *
+ * Two spans looped over the loopback interface:
+ *
+ *   dynamic=udp,127.0.0.1:5000/5001,24,0
+ *   dynamic=udp,127.0.0.1:5001/5000,24,1
+ *
+ */
+
+/*
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2 as published by the
+ * Free Software Foundation. See the LICENSE file included with
+ * this program for more details.
+ */
+
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/module.h>
+#include <linux/init.h>
+#include <linux/spinlock.h>
+#include <linux/slab.h>
+#include <linux/kmod.h>
+#include <linux/rculist.h>
+#include <linux/skbuff.h>
+#include <linux/inet.h>
+#include <linux/udp.h>
+#include <linux/nsproxy.h>
+#include <linux/sched.h>
+#include <net/net_namespace.h>
+#include <net/sock.h>
+#include <net/dst.h>
+#include <net/ip.h>
+#include <net/ipv6.h>
+#include <net/udp_tunnel.h>
+
+#include <dahdi/kernel.h>
+
+/* Messages a span may have waiting for the next flush */
+#define DAHDI_UDP_TXQ_MAX	8
+
+/* Room left in front of a message for the headers it is sent with */
+#define DAHDI_UDP_HEADROOM	(LL_MAX_HEADER + sizeof(struct ipv6hdr) + \
+				 sizeof(struct udphdr))
+
+/**
+ * struct dahdi_udp - A span carried over UDP.
+ * @sock:	Bound to the local port and connected to the remote end.
+ * @net:	The namespace @sock lives in, held for as long as it does.
+ * @txq:	Messages waiting for dahdi_udp_flush().
+ * @txerrs:	Messages dropped for want of queue space, memory or a route.
+ *
+ */
+struct dahdi_udp {
+	struct socket *sock;
+	struct net *net;
+	struct dahdi_span *span;
+	struct sk_buff_head txq;
+	atomic_t txerrs;
+	struct list_head node;
+};
+
+static DEFINE_SPINLOCK(udp_lock);
+static LIST_HEAD(dynamic_udp_list);
+
+static void
+dahdi_dynamic_udp_transmit(struct dahdi_dynamic *dyn, u8 *msg, size_t msglen)
+{
+	struct dahdi_udp *z;
+	struct sk_buff *skb;
+	unsigned long flags;
+
+	/* May be in interrupt context; the message is only sent from
+	 * dahdi_dynamic_udp_flush(), as it is here */
+	skb = alloc_skb(DAHDI_UDP_HEADROOM + msglen, GFP_ATOMIC);
+	if (skb) {
+		skb_reserve(skb, DAHDI_UDP_HEADROOM);
+		memcpy(skb_put(skb, msglen), msg, msglen);
+	}
+
+	spin_lock_irqsave(&udp_lock, flags);
+	z = dyn->pvt;
+	if (z && skb && skb_queue_len(&z->txq) < DAHDI_UDP_TXQ_MAX) {
+		skb_queue_tail(&z->txq, skb);
+		skb = NULL;
+	} else if (z) {
+		atomic_inc(&z->txerrs);
+	}
+	spin_unlock_irqrestore(&udp_lock, flags);
+
+	if (skb)
+		dev_kfree_skb_any(skb);
+}
+
+/*
+ * The route the socket was connected over, with a reference.  Should it
+ * have gone stale, it is looked up again the way UDP does when the socket
+ * is released.
+ */
+static struct dst_entry *dahdi_dynamic_udp_dst(struct sock *sk)
+{
+	struct dst_entry *dst;
+	u32 cookie = 0;
+
+#if IS_ENABLED(CONFIG_IPV6)
+	if (sk->sk_family == AF_INET6)
+		cookie = inet6_sk(sk)->dst_cookie;
+#endif
+	dst = sk_dst_get(sk);
+	if (dst && dst_check(dst, cookie))
+		return dst;
+	dst_release(dst);
+
+	/* Nothing else uses our socket, but just in case */
+	bh_lock_sock(sk);
+	if (!sock_owned_by_user(sk)) {
+#if IS_ENABLED(CONFIG_IPV6)
+		if (sk->sk_family == AF_INET6)
+			ip6_datagram_release_cb(sk);
+		else
+#endif
+			ip4_datagram_release_cb(sk);
+	}
+	bh_unlock_sock(sk);
+	return sk_dst_get(sk);
+}
+
+/* Put UDP and IP headers in front of a message and send it */
+static void dahdi_dynamic_udp_xmit(struct dahdi_udp *z, struct sk_buff *skb)
+{
+	struct sock *const sk = z->sock->sk;
+	struct inet_sock *const inet = inet_sk(sk);
+	struct dst_entry *dst;
+
+	dst = dahdi_dynamic_udp_dst(sk);
+	if (!dst)
+		goto drop;
+	if (skb_cow_head(skb, LL_RESERVED_SPACE(dst->dev) + dst->header_len +
+			      sizeof(struct ipv6hdr) + sizeof(struct udphdr))) {
+		dst_release(dst);
+		goto drop;
+	}
+
+	/* Both take over the reference to dst */
+#if IS_ENABLED(CONFIG_IPV6)
+	if (sk->sk_family == AF_INET6) {
+		udp_tunnel6_xmit_skb(dst, sk, skb, NULL, &inet6_sk(sk)->saddr,
+				     &sk->sk_v6_daddr, 0,
+				     ip6_dst_hoplimit(dst), 0,
+				     inet->inet_sport, inet->inet_dport,
+				     false);
+		return;
+	}
+#endif
+	udp_tunnel_xmit_skb((struct rtable *)dst, sk, skb, inet->inet_saddr,
+			    inet->inet_daddr, inet->tos, ip4_dst_hoplimit(dst),
+			    0, inet->inet_sport, inet->inet_dport, false,
+			    false);
+	return;
+
+drop:
+	atomic_inc(&z->txerrs);
+	kfree_skb(skb);
+}
+
+/**
+ * dahdi_dynamic_udp_flush - Send the messages queued this tick.
+ *
+ * Always called in softirq context.  The whole tick goes out here in one
+ * pass over the spans.  Each message is sent in the skb it was queued in,
+ * over the cached route of the span's connected socket, rather than being
+ * copied once more through kernel_sendmsg().
+ */
+static int dahdi_dynamic_udp_flush(void)
+{
+	struct dahdi_udp *z;
+	struct sk_buff_head list;
+	struct sk_buff *skb;
+	unsigned long flags;
+
+	__skb_queue_head_init(&list);
+
+	rcu_read_lock();
+	list_for_each_entry_rcu(z, &dynamic_udp_list, node) {
+		spin_lock_irqsave(&z->txq.lock, flags);
+		skb_queue_splice_init(&z->txq, &list);
+		spin_unlock_irqrestore(&z->txq.lock, flags);
+
+		while ((skb = __skb_dequeue(&list)))
+			dahdi_dynamic_udp_xmit(z, skb);
+	}
+	rcu_read_unlock();
+	return 0;
+}
+
+/*
+ * Called by UDP for each datagram to a span's socket, in softirq context,
+ * with the checksum already verified and skb->data at the UDP header.
+ * Datagrams are taken straight from the socket lookup rather than queued
+ * on the socket, and anything GRO has merged is split up again by UDP
+ * before it gets here.
+ */
+static int dahdi_dynamic_udp_rcv(struct sock *sk, struct sk_buff *skb)
+{
+	struct dahdi_udp *z = rcu_dereference_sk_user_data(sk);
+	struct dahdi_span *span;
+
+	if (!z)
+		goto drop;
+
+	__skb_pull(skb, sizeof(struct udphdr));
+	/* Messages are small; get them in one piece */
+	if (skb_linearize(skb))
+		goto drop;
+
+	span = z->span;
+	if (test_bit(DAHDI_FLAGBIT_REGISTERED, &span->flags))
+		dahdi_dynamic_receive(span, skb->data, skb->len);
+	consume_skb(skb);
+	return 0;
+
+drop:
+	kfree_skb(skb);
+	return 0;
+}
+
+static void dahdi_dynamic_udp_destroy(struct dahdi_dynamic *dyn)
+{
+	struct dahdi_udp *z;
+	unsigned long flags;
+
+	spin_lock_irqsave(&udp_lock, flags);
+	z = dyn->pvt;
+	list_del_rcu(&z->node);
+	dyn->pvt = NULL;
+	spin_unlock_irqrestore(&udp_lock, flags);
+
+	rcu_assign_sk_user_data(z->sock->sk, NULL);
+	/* Wait out any flush or receive still using it */
+	synchronize_rcu();
+
+	udp_tunnel_sock_release(z->sock);
+	put_net(z->net);
+	skb_queue_purge(&z->txq);
+
+	if (atomic_read(&z->txerrs)) {
+		printk(KERN_INFO "TDMoUDP: Removed interface for %s "
+		       "(%u messages could not be sent)\n", z->span->name,
+		       atomic_read(&z->txerrs));
+	} else {
+		printk(KERN_INFO "TDMoUDP: Removed interface for %s\n",
+		       z->span->name);
+	}
+	kfree(z);
+}
+
+static int dahdi_dynamic_udp_port(const char *s, __be16 *port)
+{
+	u16 res;
+
+	if (kstrtou16(s, 10, &res) || !res)
+		return -EINVAL;
+	*port = htons(res);
+	return 0;
+}
+
+/* Fill in the remote end and the ports of a socket from an address */
+static int dahdi_dynamic_udp_parse(const char *address,
+				   struct udp_port_cfg *cfg)
+{
+	char tmp[40];
+	const char *end;
+	char *local;
+
+	if (address[0] == '[') {
+#if IS_ENABLED(CONFIG_IPV6)
+		if (!in6_pton(address + 1, -1, cfg->peer_ip6.s6_addr, ']',
+			      &end))
+			return -EINVAL;
+		end++;
+		cfg->family = AF_INET6;
+		cfg->ipv6_v6only = 1;
+		cfg->use_udp6_tx_checksums = 1;
+		cfg->use_udp6_rx_checksums = 1;
+#else
+		return -EAFNOSUPPORT;
+#endif
+	} else {
+		if (!in4_pton(address, -1, (u8 *)&cfg->peer_ip, ':', &end))
+			return -EINVAL;
+		cfg->family = AF_INET;
+		cfg->use_udp_checksums = 1;
+	}
+	if (*end != ':')
+		return -EINVAL;
+
+	strscpy(tmp, end + 1, sizeof(tmp));
+	local = strchr(tmp, '/');
+	if (local)
+		*local++ = '\0';
+	if (dahdi_dynamic_udp_port(tmp, &cfg->peer_udp_port))
+		return -EINVAL;
+	if (!local) {
+		cfg->local_udp_port = cfg->peer_udp_port;
+		return 0;
+	}
+	return dahdi_dynamic_udp_port(local, &cfg->local_udp_port);
+}
+
+static int dahdi_dynamic_udp_create(struct dahdi_dynamic *dyn,
+				    const char *address)
+{
+	struct dahdi_udp *z;
+	struct udp_port_cfg cfg;
+	struct udp_tunnel_sock_cfg tunnel_cfg;
+	unsigned long flags;
+	int res;
+	struct dahdi_span *const span = &dyn->span;
+
+	memset(&cfg, 0, sizeof(cfg));
+	res = dahdi_dynamic_udp_parse(address, &cfg);
+	if (res) {
+		printk(KERN_NOTICE "TDMoUDP: Invalid address %s\n", address);
+		return res;
+	}
+
+	z = kzalloc(sizeof(*z), GFP_KERNEL);
+	if (!z)
+		return -ENOMEM;
+	skb_queue_head_init(&z->txq);
+	z->span = span;
+	z->net = get_net(current->nsproxy->net_ns);
+
+	res = udp_sock_create(z->net, &cfg, &z->sock);
+	if (res) {
+		printk(KERN_NOTICE "TDMoUDP: Unable to open a socket for %s "
+		       "(%d)\n", address, res);
+		put_net(z->net);
+		kfree(z);
+		return res;
+	}
+	memset(&tunnel_cfg, 0, sizeof(tunnel_cfg));
+	tunnel_cfg.sk_user_data = z;
+	tunnel_cfg.encap_type = 1;
+	tunnel_cfg.encap_rcv = dahdi_dynamic_udp_rcv;
+	setup_udp_tunnel_sock(z->net, z->sock, &tunnel_cfg);
+
+	spin_lock_irqsave(&udp_lock, flags);
+	list_add_tail_rcu(&z->node, &dynamic_udp_list);
+	dyn->pvt = z;
+	spin_unlock_irqrestore(&udp_lock, flags);
+
+	printk(KERN_INFO "TDMoUDP: Added new interface for %s, "
+	       "remote %s local port %d\n", span->name, address,
+	       ntohs(cfg.local_udp_port));
+	return 0;
+}
+
+static struct dahdi_dynamic_driver dahdi_dynamic_udp = {
+	.owner = THIS_MODULE,
+	.name = "udp",
+	.desc = "UDP/IP",
+	.create = dahdi_dynamic_udp_create,
+	.destroy = dahdi_dynamic_udp_destroy,
+	.transmit = dahdi_dynamic_udp_transmit,
+	.flush = dahdi_dynamic_udp_flush,
+};
+
+static int __init dahdi_dynamic_udp_init(void)
+{
+	dahdi_dynamic_register_driver(&dahdi_dynamic_udp);
+	return 0;
+}
+
+static void __exit dahdi_dynamic_udp_exit(void)
+{
+	dahdi_dynamic_unregister_driver(&dahdi_dynamic_udp);
+}
+
+module_init(dahdi_dynamic_udp_init);
+module_exit(dahdi_dynamic_udp_exit);
+
+MODULE_DESCRIPTION("DAHDI Dynamic TDM over UDP Support");
+MODULE_LICENSE("GPL v2");
@@ -0,0 +1,567 @@
+/*
+ * DAHDI Telephony Interface
+ *
+ * MDF: a partitioned-block frequency-domain adaptive echo canceler
+ * (multi-delay block filter), in fixed point.
+ *
+ * The echo path is split into partitions of MDF_B taps.  The first
+ * partition is applied in the time domain so that no latency is added,
+ * all the others are applied once per block in the frequency domain
+ * with overlap-save, and every partition is adapted once per block
+ * with a per-bin normalised LMS step.  For a 1024 tap (128 ms) tail
+ * that is a handful of 128 point FFTs and 16 complex multiplies per bin
+ * every 64 samples, instead of two 1024 tap dot products per sample.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2 as published by the
+ * Free Software Foundation. See the LICENSE file included with
+ * this program for more details.
+ */
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/errno.h>
+#include <linux/module.h>
+#include <linux/init.h>
+#include <linux/ctype.h>
+#include <linux/moduleparam.h>
+#include <linux/math64.h>
+
+#include <dahdi/kernel.h>
+
+static int debug;
+
+/* Partition (block) length in samples, and the FFT size it implies */
+#define MDF_B		64
+#define MDF_M		(2 * MDF_B)
+/* Bins of the spectrum of a real signal we actually keep */
+#define MDF_BINS	(MDF_M / 2 + 1)
+
+/* Filter weights (time and frequency domain) are Q23 */
+#define MDF_W_SHIFT	23
+/* Largest weight component, keeps the FFTs of the weights in range */
+#define MDF_W_MAX	((1 << 29) - 1)
+/* A time-domain tap may never reach 1.0 (G.168 ERL is at least 6 dB) */
+#define MDF_H_MAX	((1 << MDF_W_SHIFT) - 1)
+/* Fractional bits kept in the echo estimate */
+#define MDF_Y_FRAC	4
+
+/* Adaptation step, Q15: 0.75.  The step is shared out over the partitions,
+ * so a long tail converges the slower; at 0.5 a 1024 tap one took over a
+ * second to reach 20 dB of ERLE. */
+#define MDF_MU		24576
+/* Far-end power per bin is smoothed over 2^MDF_POW_SHIFT blocks */
+#define MDF_POW_SHIFT	2
+/* Per-bin power floor (per partition), slows adaptation in silence */
+#define MDF_EPS		(1ULL << 24)
+
+/* Don't bother adapting if the far end peaked below this in a block */
+#define MDF_MIN_FAR	64
+/* Near-end speech (Geigel) hangover, in samples: 30 ms */
+#define MDF_DT_HANG	240
+/* Reset the filter after this many blocks of making the echo worse */
+#define MDF_DIVERGE	8
+
+/* Center clipper: residuals this far below the far end are zapped */
+#define MDF_NLP_SHIFT	5
+
+struct mdf_cplx {
+	s32 re;
+	s32 im;
+};
+
+static int echo_can_create(struct dahdi_chan *chan, struct dahdi_echocanparams *ecp,
+			   struct dahdi_echocanparam *p, struct dahdi_echocan_state **ec);
+static void echo_can_free(struct dahdi_chan *chan, struct dahdi_echocan_state *ec);
+static void echo_can_process(struct dahdi_echocan_state *ec, short *isig, const short *iref, u32 size);
+static void echocan_NLP_toggle(struct dahdi_echocan_state *ec, unsigned int enable);
+static const char *name = "MDF";
+static const char *ec_name(const struct dahdi_chan *chan) { return name; }
+
+static const struct dahdi_echocan_factory my_factory = {
+	.get_name = ec_name,
+	.owner = THIS_MODULE,
+	.echocan_create = echo_can_create,
+};
+
+static const struct dahdi_echocan_features my_features = {
+	.NLP_toggle = 1,
+};
+
+static const struct dahdi_echocan_ops my_ops = {
+	.echocan_free = echo_can_free,
+	.echocan_process = echo_can_process,
+	.echocan_NLP_toggle = echocan_NLP_toggle,
+};
+
+struct ec_pvt {
+	struct dahdi_echocan_state dahdi;
+
+	/* Filter length, taps applied in the time domain, partitions (the
+	 * last of which may be only partly used) */
+	int taps;
+	int head_len;
+	int parts;
+
+	/* Position of the next sample within the current block */
+	int pos;
+	/* Next tail partition to get its gradient constraint applied */
+	int constrain;
+	/* Slot of the newest far-end spectrum in xf */
+	int xf_idx;
+	/* Near-end speech hangover, in samples */
+	int dt_hang;
+	/* Consecutive blocks where the output was louder than the input */
+	int diverge;
+	int use_nlp;
+
+	/* Far-end peak: current block, per block ring, over the tail */
+	int xmax_cur;
+	int xmax_idx;
+	int xmax_tail;
+	/* Smoothed far-end level, for the center clipper */
+	int ly;
+	/* Near-end and output energy of the current block */
+	u64 d_energy;
+	u64 e_energy;
+
+	/* Far-end samples: previous block, then the current one */
+	short x[2 * MDF_B];
+	/* Error (output before NLP) of the current block */
+	short e[MDF_B];
+	/* Echo estimate of the tail partitions for the current block (Q4) */
+	s32 tail[MDF_B];
+	/* Time-domain taps of the first partition (Q23) */
+	s32 head[MDF_B];
+	/* Smoothed far-end power per bin */
+	u64 pxx[MDF_BINS];
+	/* FFT scratch */
+	struct mdf_cplx buf[MDF_M];
+
+	/* parts + 1 far-end block peaks */
+	int *xmax;
+	/* parts far-end spectra, newest at xf_idx */
+	struct mdf_cplx *xf;
+	/* parts weight spectra, partition 0 first */
+	struct mdf_cplx *wf;
+};
+
+#define dahdi_to_pvt(a) container_of(a, struct ec_pvt, dahdi)
+
+/* cos(2 * pi * k / MDF_M) for k = 0 .. MDF_M / 4, Q30 */
+static const s32 mdf_cos_q[MDF_M / 4 + 1] = {
+	1073741824, 1072448455, 1068571464, 1062120190,
+	1053110176, 1041563127, 1027506862, 1010975242,
+	992008094, 970651112, 946955747, 920979082,
+	892783698, 862437520, 830013654, 795590213,
+	759250125, 721080937, 681174602, 639627258,
+	596538995, 552013618, 506158392, 459083786,
+	410903207, 361732726, 311690799, 260897982,
+	209476638, 157550647, 105245103, 52686014,
+	0,
+};
+
+/* Twiddles for k = 0 .. MDF_M / 2 - 1 and the bit reversal permutation */
+static s32 mdf_cos[MDF_M / 2];
+static s32 mdf_sin[MDF_M / 2];
+static u8 mdf_bitrev[MDF_M];
+
+static void mdf_init_tables(void)
+{
+	int k;
+	int bits;
+
+	for (k = 0; k < MDF_M / 2; k++) {
+		if (k <= MDF_M / 4) {
+			mdf_cos[k] = mdf_cos_q[k];
+			mdf_sin[k] = mdf_cos_q[MDF_M / 4 - k];
+		} else {
+			mdf_cos[k] = -mdf_cos_q[MDF_M / 2 - k];
+			mdf_sin[k] = mdf_cos_q[k - MDF_M / 4];
+		}
+	}
+
+	for (k = 0; k < MDF_M; k++) {
+		int r = 0;
+
+		for (bits = 1; bits < MDF_M; bits <<= 1)
+			r = (r << 1) | !!(k & bits);
+		mdf_bitrev[k] = r;
+	}
+}
+
+/*
+ * In-place radix-2 complex FFT of MDF_M points.  The forward transform
+ * is unscaled; the inverse halves every stage, i.e. includes the 1/MDF_M.
+ * Callers keep magnitudes below 2^30 so the butterflies can't overflow.
+ */
+static void mdf_fft(struct mdf_cplx *x, int inverse)
+{
+	int i, j, k;
+	int len, half, step;
+
+	for (i = 0; i < MDF_M; i++) {
+		j = mdf_bitrev[i];
+		if (j > i) {
+			struct mdf_cplx t = x[i];
+
+			x[i] = x[j];
+			x[j] = t;
+		}
+	}
+
+	for (len = 2, step = MDF_M / 2; len <= MDF_M; len <<= 1, step >>= 1) {
+		half = len >> 1;
+		for (i = 0; i < MDF_M; i += len) {
+			for (k = 0; k < half; k++) {
+				struct mdf_cplx *a = &x[i + k];
+				struct mdf_cplx *b = &x[i + k + half];
+				const s64 c = mdf_cos[k * step];
+				const s64 s = inverse ? mdf_sin[k * step] :
+							-mdf_sin[k * step];
+				s32 tr, ti;
+
+				tr = (s32)((b->re * c - b->im * s + (1 << 29)) >> 30);
+				ti = (s32)((b->re * s + b->im * c + (1 << 29)) >> 30);
+				if (inverse) {
+					b->re = (a->re - tr + 1) >> 1;
+					b->im = (a->im - ti + 1) >> 1;
+					a->re = (a->re + tr + 1) >> 1;
+					a->im = (a->im + ti + 1) >> 1;
+				} else {
+					b->re = a->re - tr;
+					b->im = a->im - ti;
+					a->re += tr;
+					a->im += ti;
+				}
+			}
+		}
+	}
+}
+
+/* Expand the kept bins of a real signal's spectrum into buf */
+static void mdf_expand(struct mdf_cplx *buf, const struct mdf_cplx *bins)
+{
+	int k;
+
+	for (k = 0; k < MDF_BINS; k++)
+		buf[k] = bins[k];
+	for (k = 1; k < MDF_M / 2; k++) {
+		buf[MDF_M - k].re = bins[k].re;
+		buf[MDF_M - k].im = -bins[k].im;
+	}
+}
+
+static inline s32 mdf_clamp(s64 v, s32 max)
+{
+	if (v > max)
+		return max;
+	if (v < -max)
+		return -max;
+	return v;
+}
+
+/*
+ * Apply the gradient constraint to partition q: back to the time domain,
+ * drop the wrapped-around second half, and forward again.  The taps of
+ * partition 0 are also what the time-domain head uses.
+ */
+static void mdf_constrain(struct ec_pvt *pvt, int q)
+{
+	struct mdf_cplx *w = pvt->wf + q * MDF_BINS;
+	/* Taps of the partition within the filter length */
+	int len = clamp_t(int, pvt->taps - q * MDF_B, 0, MDF_B);
+	int k;
+
+	mdf_expand(pvt->buf, w);
+	mdf_fft(pvt->buf, 1);
+	for (k = 0; k < MDF_M; k++) {
+		pvt->buf[k].re = (k < len) ?
+			mdf_clamp(pvt->buf[k].re, MDF_H_MAX) : 0;
+		pvt->buf[k].im = 0;
+		if (!q && k < MDF_B)
+			pvt->head[k] = pvt->buf[k].re;
+	}
+	mdf_fft(pvt->buf, 0);
+	memcpy(w, pvt->buf, MDF_BINS * sizeof(*w));
+}
+
+static void mdf_reset(struct ec_pvt *pvt)
+{
+	memset(pvt->wf, 0, pvt->parts * MDF_BINS * sizeof(*pvt->wf));
+	memset(pvt->head, 0, sizeof(pvt->head));
+	pvt->diverge = 0;
+}
+
+static void mdf_adapt(struct ec_pvt *pvt)
+{
+	int k, p;
+
+	/* Error spectrum, overlap-save: the block in the second half */
+	for (k = 0; k < MDF_B; k++) {
+		pvt->buf[k].re = pvt->buf[k].im = 0;
+		pvt->buf[MDF_B + k].re = pvt->e[k];
+		pvt->buf[MDF_B + k].im = 0;
+	}
+	mdf_fft(pvt->buf, 0);
+
+	for (k = 0; k < MDF_BINS; k++) {
+		u64 den = (pvt->pxx[k] + MDF_EPS) * pvt->parts;
+		/* 2^60 / den is at most 2^36; times |E| <= 2^21 still fits */
+		s64 r = div64_u64(1ULL << 60, den);
+		/* mu * E / den, Q40 */
+		s64 er = (((s64)pvt->buf[k].re * r) >> 20) * MDF_MU >> 15;
+		s64 ei = (((s64)pvt->buf[k].im * r) >> 20) * MDF_MU >> 15;
+
+		for (p = 0; p < pvt->parts; p++) {
+			const struct mdf_cplx *x =
+				&pvt->xf[((pvt->xf_idx + p) % pvt->parts) * MDF_BINS + k];
+			struct mdf_cplx *w = &pvt->wf[p * MDF_BINS + k];
+
+			/* w += conj(x) * mu * E / den */
+			w->re = mdf_clamp(w->re + ((x->re * er + x->im * ei) >>
+					  (40 - MDF_W_SHIFT)), MDF_W_MAX);
+			w->im = mdf_clamp(w->im + ((x->re * ei - x->im * er) >>
+					  (40 - MDF_W_SHIFT)), MDF_W_MAX);
+		}
+	}
+
+	mdf_constrain(pvt, 0);
+	if (pvt->parts > 1) {
+		mdf_constrain(pvt, pvt->constrain);
+		if (++pvt->constrain >= pvt->parts)
+			pvt->constrain = 1;
+	}
+}
+
+/* Echo estimate of partitions 1 .. parts - 1 for the next block */
+static void mdf_predict_tail(struct ec_pvt *pvt)
+{
+	int k, p;
+
+	for (k = 0; k < MDF_BINS; k++) {
+		s64 yr = 0;
+		s64 yi = 0;
+
+		for (p = 1; p < pvt->parts; p++) {
+			const struct mdf_cplx *x =
+				&pvt->xf[((pvt->xf_idx + p - 1) % pvt->parts) * MDF_BINS + k];
+			const struct mdf_cplx *w = &pvt->wf[p * MDF_BINS + k];
+
+			yr += (s64)w->re * x->re - (s64)w->im * x->im;
+			yi += (s64)w->re * x->im + (s64)w->im * x->re;
+		}
+		pvt->buf[k].re = mdf_clamp(yr >> (MDF_W_SHIFT - MDF_Y_FRAC),
+					   1 << 30);
+		pvt->buf[k].im = mdf_clamp(yi >> (MDF_W_SHIFT - MDF_Y_FRAC),
+					   1 << 30);
+	}
+	mdf_expand(pvt->buf, pvt->buf);
+	mdf_fft(pvt->buf, 1);
+	for (k = 0; k < MDF_B; k++)
+		pvt->tail[k] = pvt->buf[MDF_B + k].re;
+}
+
+/* Called after the last sample of every block */
+static void mdf_block(struct ec_pvt *pvt)
+{
+	struct mdf_cplx *xf;
+	int adapt;
+	int k;
+
+	/* Far-end peak over the whole tail, for near-end speech detection */
+	pvt->xmax[pvt->xmax_idx] = pvt->xmax_cur;
+	if (++pvt->xmax_idx > pvt->parts)
+		pvt->xmax_idx = 0;
+	pvt->xmax_tail = 0;
+	for (k = 0; k <= pvt->parts; k++)
+		pvt->xmax_tail = max(pvt->xmax_tail, pvt->xmax[k]);
+
+	/* Spectrum of the last two far-end blocks, replacing the oldest */
+	for (k = 0; k < MDF_M; k++) {
+		pvt->buf[k].re = pvt->x[k];
+		pvt->buf[k].im = 0;
+	}
+	mdf_fft(pvt->buf, 0);
+	pvt->xf_idx = pvt->xf_idx ? pvt->xf_idx - 1 : pvt->parts - 1;
+	xf = pvt->xf + pvt->xf_idx * MDF_BINS;
+	memcpy(xf, pvt->buf, MDF_BINS * sizeof(*xf));
+	for (k = 0; k < MDF_BINS; k++) {
+		u64 pw = (u64)((s64)xf[k].re * xf[k].re) +
+			 (u64)((s64)xf[k].im * xf[k].im);
+
+		if (pw > pvt->pxx[k])
+			pvt->pxx[k] += (pw - pvt->pxx[k]) >> MDF_POW_SHIFT;
+		else
+			pvt->pxx[k] -= (pvt->pxx[k] - pw) >> MDF_POW_SHIFT;
+	}
+
+	adapt = !pvt->dt_hang && pvt->xmax_cur >= MDF_MIN_FAR;
+
+	/* An estimate that keeps adding echo is worse than none at all */
+	if (adapt && pvt->e_energy > 4 * pvt->d_energy) {
+		if (++pvt->diverge >= MDF_DIVERGE) {
+			if (debug)
+				printk(KERN_DEBUG "MDF: filter diverged, resetting\n");
+			mdf_reset(pvt);
+			adapt = 0;
+		}
+	} else {
+		pvt->diverge = 0;
+	}
+
+	if (adapt)
+		mdf_adapt(pvt);
+
+	if (pvt->parts > 1)
+		mdf_predict_tail(pvt);
+
+	memcpy(pvt->x, pvt->x + MDF_B, MDF_B * sizeof(pvt->x[0]));
+	pvt->xmax_cur = 0;
+	pvt->d_energy = pvt->e_energy = 0;
+	pvt->pos = 0;
+}
+
+static inline short sample_update(struct ec_pvt *pvt, short iref, short isig)
+{
+	const short *x = pvt->x + MDF_B + pvt->pos;
+	s64 acc = 0;
+	int y;
+	int u;
+	int j;
+
+	pvt->x[MDF_B + pvt->pos] = iref;
+	pvt->xmax_cur = max(pvt->xmax_cur, abs(iref));
+	pvt->ly += (abs(iref) - pvt->ly) >> 7;
+
+	/* First partition in the time domain, the rest was precomputed */
+	for (j = 0; j < pvt->head_len; j++)
+		acc += (s64)pvt->head[j] * x[-j];
+	y = (int)(acc >> (MDF_W_SHIFT - MDF_Y_FRAC)) + pvt->tail[pvt->pos];
+	y = (y + (1 << (MDF_Y_FRAC - 1))) >> MDF_Y_FRAC;
+
+	u = isig - y;
+	if (u > 32767)
+		u = 32767;
+	else if (u < -32768)
+		u = -32768;
+	pvt->e[pvt->pos] = u;
+	pvt->d_energy += isig * isig;
+	pvt->e_energy += u * u;
+
+	/* Geigel near-end speech detector */
+	if (abs(isig) > (max(pvt->xmax_tail, pvt->xmax_cur) >> 1))
+		pvt->dt_hang = MDF_DT_HANG;
+	else if (pvt->dt_hang)
+		pvt->dt_hang--;
+
+	if (pvt->use_nlp && !pvt->dt_hang &&
+	    abs(u) < (pvt->ly >> MDF_NLP_SHIFT))
+		u = 0;
+
+	if (++pvt->pos == MDF_B)
+		mdf_block(pvt);
+
+	return u;
+}
+
+static void echo_can_process(struct dahdi_echocan_state *ec, short *isig, const short *iref, u32 size)
+{
+	struct ec_pvt *pvt = dahdi_to_pvt(ec);
+	u32 x;
+
+	for (x = 0; x < size; x++) {
+		*isig = sample_update(pvt, *iref, *isig);
+		isig++;
+		iref++;
+	}
+}
+
+static int echo_can_create(struct dahdi_chan *chan, struct dahdi_echocanparams *ecp,
+			   struct dahdi_echocanparam *p, struct dahdi_echocan_state **ec)
+{
+	struct ec_pvt *pvt;
+	int parts;
+
+	if (ecp->param_count > 0) {
+		printk(KERN_WARNING "MDF does not support parameters; failing request\n");
+		return -EINVAL;
+	}
+
+	parts = max_t(int, DIV_ROUND_UP(ecp->tap_length, MDF_B), 1);
+
+	pvt = kzalloc(sizeof(*pvt), GFP_KERNEL);
+	if (!pvt)
+		return -ENOMEM;
+
+	pvt->xmax = kcalloc(parts + 1, sizeof(*pvt->xmax), GFP_KERNEL);
+	pvt->xf = kcalloc(parts * MDF_BINS, sizeof(*pvt->xf), GFP_KERNEL);
+	pvt->wf = kcalloc(parts * MDF_BINS, sizeof(*pvt->wf), GFP_KERNEL);
+	if (!pvt->xmax || !pvt->xf || !pvt->wf) {
+		kfree(pvt->xmax);
+		kfree(pvt->xf);
+		kfree(pvt->wf);
+		kfree(pvt);
+		return -ENOMEM;
+	}
+
+	pvt->dahdi.ops = &my_ops;
+	pvt->dahdi.features = my_features;
+
+	pvt->taps = ecp->tap_length;
+	pvt->head_len = min_t(int, ecp->tap_length, MDF_B);
+	pvt->parts = parts;
+	pvt->constrain = 1;
+	/* Non-linear processor - a fancy way to say "zap small signals, to avoid
+	   accumulating noise". */
+	pvt->use_nlp = 1;
+
+	*ec = &pvt->dahdi;
+	return 0;
+}
+
+static void echo_can_free(struct dahdi_chan *chan, struct dahdi_echocan_state *ec)
+{
+	struct ec_pvt *pvt = dahdi_to_pvt(ec);
+
+	kfree(pvt->xmax);
+	kfree(pvt->xf);
+	kfree(pvt->wf);
+	kfree(pvt);
+}
+
+static void echocan_NLP_toggle(struct dahdi_echocan_state *ec, unsigned int enable)
+{
+	struct ec_pvt *pvt = dahdi_to_pvt(ec);
+
+	pvt->use_nlp = enable ? 1 : 0;
+}
+
+static int __init mod_init(void)
+{
+	mdf_init_tables();
+
+	if (dahdi_register_echocan_factory(&my_factory)) {
+		module_printk(KERN_ERR, "could not register with DAHDI core\n");
+
+		return -EPERM;
+	}
+
+	module_printk(KERN_NOTICE, "Registered echo canceler '%s'\n",
+		      my_factory.get_name(NULL));
+
+	return 0;
+}
+
+static void __exit mod_exit(void)
+{
+	dahdi_unregister_echocan_factory(&my_factory);
+}
+
+module_param(debug, int, S_IRUGO | S_IWUSR);
+
+MODULE_DESCRIPTION("DAHDI 'MDF' Frequency Domain Echo Canceler");
+MODULE_LICENSE("GPL v2");
+
+module_init(mod_init);
+module_exit(mod_exit);
@@ -48,9 +48,13 @@ static int aggressive;
 
 #define RESTORE_COEFFS {\
 				int x;\
-				memcpy(pvt->a_i, pvt->c_i, pvt->N_d*sizeof(int));\
-				for (x = 0; x < pvt->N_d; x++) {\
-					pvt->a_s[x] = pvt->a_i[x] >> 16;\
+				if (!pvt->restored) {\
+					memcpy(pvt->a_i, pvt->c_i, pvt->N_d*sizeof(int));\
+					for (x = 0; x < pvt->N_d; x++) {\
+						pvt->a_s[x] = pvt->a_i[x] >> 16;\
+					}\
+					pvt->restored = 1;\
+					pvt->coeff_gen++;\
 				}\
 				pvt->backup = BACKUP;\
 			}
@@ -175,6 +179,7 @@ static int echo_can_create(struct dahdi_chan *chan, struct dahdi_echocanparams *
 			   struct dahdi_echocanparam *p, struct dahdi_echocan_state **ec);
 static void echo_can_free(struct dahdi_chan *chan, struct dahdi_echocan_state *ec);
 static void echo_can_process(struct dahdi_echocan_state *ec, short *isig, const short *iref, u32 size);
+static void echo_can_process_batch(struct dahdi_echocan_state **ec, short *isig, const short *iref, unsigned int n);
 static int echo_can_traintap(struct dahdi_echocan_state *ec, int pos, short val);
 static void echocan_NLP_toggle(struct dahdi_echocan_state *ec, unsigned int enable);
 static const char *name = "MG2";
@@ -193,6 +198,7 @@ static const struct dahdi_echocan_features my_features = {
 static const struct dahdi_echocan_ops my_ops = {
 	.echocan_free = echo_can_free,
 	.echocan_process = echo_can_process,
+	.echocan_process_batch = echo_can_process_batch,
 	.echocan_traintap = echo_can_traintap,
 	.echocan_NLP_toggle = echocan_NLP_toggle,
 };
@@ -211,6 +217,8 @@ struct ec_pvt {
 	int N_d;
 	/* Rate of adaptation of filter */
 	int beta2_i;
+	/* Fastest CONVOLVE2_SIMD() this CPU has */
+	enum dahdi_ec_simd simd;
 
 	/* Accumulators for power computations */
 	/* ----------------------------------- */
@@ -246,6 +254,12 @@ struct ec_pvt {
 	echo_can_cb_s u_s;
 	/* Reference samples of far-end receive signal used to calculate short-time average */
 	echo_can_cb_s y_tilde_s;
+	/* Far-end window of the current block, see echo_can_process() */
+	short *blk_hist;
+	/* Bumped whenever a_s changes, invalidates precomputed block outputs */
+	unsigned int coeff_gen;
+	/* a_i still equals c_i since the last RESTORE_COEFFS */
+	int restored;
 
 	/* Peak far-end receive signal */
 	/* --------------------------- */
@@ -318,6 +332,7 @@ static inline void init_cc(struct ec_pvt *pvt, int N, int maxy, int maxu)
 	/* Reset parameters */
 	pvt->N_d = N;
 	pvt->beta2_i = DEFAULT_BETA1_I;
+	pvt->simd = dahdi_ec_simd_level();
   
 	/* Allocate coefficient memory */
 	pvt->a_i = (int *) ptr;
@@ -344,6 +359,10 @@ static inline void init_cc(struct ec_pvt *pvt, int N, int maxy, int maxu)
 
 	/* Allocate a buffer for the reference signal power computation */
 	init_cb_s(&pvt->y_tilde_s, pvt->N_d, ptr);
+	ptr += (sizeof(short) * pvt->N_d * 2);
+
+	/* Allocate the block filter window */
+	pvt->blk_hist = (short *) ptr;
 
 	/* Reset the absolute time index */
 	pvt->i_d = (int)0;
@@ -392,7 +411,8 @@ static inline short dc_removal(int *dc_estimate, short samp)
 }
 #endif
 
-static inline short sample_update(struct ec_pvt *pvt, short iref, short isig)
+static inline short sample_update(struct ec_pvt *pvt, short iref, short isig,
+				  enum dahdi_ec_simd simd, const int *rs_blk)
 {
 	/* Declare local variables that are used more than once */
 	/* ... */
@@ -432,10 +452,13 @@ static inline short sample_update(struct ec_pvt *pvt, short iref, short isig)
 	add_cc_s(&pvt->y_s, iref);
  
 
-	/* eq. (2): compute r in fixed-point */
-	rs = CONVOLVE2(pvt->a_s,
-		       pvt->y_s.buf_d + pvt->y_s.idx_d,
-		       pvt->N_d);
+	/* eq. (2): compute r in fixed-point, unless the block already did */
+	if (rs_blk)
+		rs = *rs_blk;
+	else
+		rs = CONVOLVE2_SIMD(simd, pvt->a_s,
+				    pvt->y_s.buf_d + pvt->y_s.idx_d,
+				    pvt->N_d);
 	rs >>= 15;
 
 	if (pvt->lastsig == isig) {
@@ -490,6 +513,7 @@ static inline short sample_update(struct ec_pvt *pvt, short iref, short isig)
 		pvt->backup = BACKUP;
 		memcpy(pvt->c_i, pvt->b_i, pvt->N_d*sizeof(int));
 		memcpy(pvt->b_i, pvt->a_i, pvt->N_d*sizeof(int));
+		pvt->restored = 0;
 	} else
 		pvt->backup--;
 
@@ -618,9 +642,10 @@ static inline short sample_update(struct ec_pvt *pvt, short iref, short isig)
 			for (k = 0; k < pvt->N_d; k++) {
 				/* eq. (7): compute an expectation over M_d samples */
 				int grad2;
-				grad2 = CONVOLVE2(pvt->u_s.buf_d + pvt->u_s.idx_d,
-						  pvt->y_s.buf_d + pvt->y_s.idx_d + k,
-						  DEFAULT_M);
+				grad2 = CONVOLVE2_SIMD(simd,
+						pvt->u_s.buf_d + pvt->u_s.idx_d,
+						pvt->y_s.buf_d + pvt->y_s.idx_d + k,
+						DEFAULT_M);
 				/* eq. (7): update the coefficient */
 				pvt->a_i[k] += grad2 / two_beta_i;
 				pvt->a_s[k] = pvt->a_i[k] >> 16;
@@ -649,6 +674,8 @@ static inline short sample_update(struct ec_pvt *pvt, short iref, short isig)
 					if (abs(pvt->a_i[k]) < max_coeffs[USED_COEFFS-1])
 						pvt->a_i[k] = pvt->a_s[k] = 0;
 #endif
+			pvt->coeff_gen++;
+			pvt->restored = 0;
 		} else {
 #ifdef MEC2_STATS_DETAILED
 			printk(KERN_INFO "insufficient signal to update coefficients pvt->Lu_i %5d < %5d\n", pvt->Lu_i, MIN_UPDATE_THRESH_I);
@@ -753,19 +780,76 @@ static inline short sample_update(struct ec_pvt *pvt, short iref, short isig)
 	return u;
 }
 
-static void echo_can_process(struct dahdi_echocan_state *ec, short *isig, const short *iref, u32 size)
+static void process_samples(struct ec_pvt *pvt, short *isig, const short *iref,
+			    u32 size, enum dahdi_ec_simd simd)
 {
-	struct ec_pvt *pvt = dahdi_to_pvt(ec);
+	int rs_blk[DAHDI_CHUNKSIZE];
+	unsigned int gen;
+	u32 n;
 	u32 x;
 	short result;
 
-	for (x = 0; x < size; x++) {
-		result = sample_update(pvt, *iref, *isig);
-		*isig++ = result;
-		++iref;
+	while (size) {
+		n = min_t(u32, size, DAHDI_CHUNKSIZE);
+
+		/* Run the filter over the whole block up front: the far-end
+		 * window seen by sample x is the block's first x + 1 samples
+		 * (newest first) followed by what y_s holds now.  If a_s
+		 * changes part way through (coefficient update or restore),
+		 * the rest of the block falls back to per-sample filtering.
+		 */
+		for (x = 0; x < n; x++)
+			pvt->blk_hist[n - 1 - x] = iref[x];
+		memcpy(pvt->blk_hist + n, pvt->y_s.buf_d + pvt->y_s.idx_d,
+		       (pvt->N_d - 1) * sizeof(short));
+		CONVOLVE2_BLOCK(simd, pvt->a_s, pvt->blk_hist, pvt->N_d,
+				rs_blk, n);
+		gen = pvt->coeff_gen;
+
+		for (x = 0; x < n; x++) {
+			result = sample_update(pvt, *iref, *isig, simd,
+				(gen == pvt->coeff_gen) ? &rs_blk[x] : NULL);
+			*isig++ = result;
+			++iref;
+		}
+		size -= n;
 	}
 }
 
+static void echo_can_process(struct dahdi_echocan_state *ec, short *isig, const short *iref, u32 size)
+{
+	struct ec_pvt *pvt = dahdi_to_pvt(ec);
+	enum dahdi_ec_simd simd = DAHDI_EC_SIMD_NONE;
+
+	/* One SIMD section for the whole chunk */
+	if (pvt->simd && dahdi_ec_simd_begin())
+		simd = pvt->simd;
+
+	process_samples(pvt, isig, iref, size, simd);
+
+	if (simd)
+		dahdi_ec_simd_end();
+}
+
+static void echo_can_process_batch(struct dahdi_echocan_state **ec, short *isig, const short *iref, unsigned int n)
+{
+	enum dahdi_ec_simd level = dahdi_to_pvt(ec[0])->simd;
+	enum dahdi_ec_simd simd = DAHDI_EC_SIMD_NONE;
+	unsigned int i;
+
+	/* One SIMD section for all the channels */
+	if (level && dahdi_ec_simd_begin())
+		simd = level;
+
+	for (i = 0; i < n; i++)
+		process_samples(dahdi_to_pvt(ec[i]), isig + i * DAHDI_CHUNKSIZE,
+				iref + i * DAHDI_CHUNKSIZE, DAHDI_CHUNKSIZE,
+				simd);
+
+	if (simd)
+		dahdi_ec_simd_end();
+}
+
 static int echo_can_create(struct dahdi_chan *chan, struct dahdi_echocanparams *ecp,
 			   struct dahdi_echocanparam *p, struct dahdi_echocan_state **ec)
 {
@@ -784,7 +868,7 @@ static int echo_can_create(struct dahdi_chan *chan, struct dahdi_echocanparams *
 		maxy = (1 << DEFAULT_SIGMA_LY_I);
 	if (maxu < (1 << DEFAULT_SIGMA_LU_I))
 		maxu = (1 << DEFAULT_SIGMA_LU_I);
-	size = sizeof(**ec) +
+	size = sizeof(*pvt) +
 		4 + 						/* align */
 		sizeof(int) * ecp->tap_length +			/* a_i */
 		sizeof(short) * ecp->tap_length + 		/* a_s */
@@ -793,7 +877,8 @@ static int echo_can_create(struct dahdi_chan *chan, struct dahdi_echocanparams *
 		2 * sizeof(short) * (maxy) +			/* y_s */
 		2 * sizeof(short) * (1 << DEFAULT_ALPHA_ST_I) + /* s_s */
 		2 * sizeof(short) * (maxu) +			/* u_s */
-		2 * sizeof(short) * ecp->tap_length;		/* y_tilde_s */
+		2 * sizeof(short) * ecp->tap_length +		/* y_tilde_s */
+		sizeof(short) * (DAHDI_CHUNKSIZE + ecp->tap_length); /* blk_hist */
 
 	pvt = kzalloc(size, GFP_KERNEL);
 	if (!pvt)
@@ -834,6 +919,7 @@ static int echo_can_traintap(struct dahdi_echocan_state *ec, int pos, short val)
 	 * avoid adjustments occuring immediately after initial forced training 
 	 */
 	pvt->HCNTR_d = pvt->N_d << 1;
+	pvt->restored = 0;
 
 	if (pos >= pvt->N_d) {
 		memcpy(pvt->b_i, pvt->a_i, pvt->N_d*sizeof(int));
@@ -1102,6 +1102,38 @@ static void echocan_free(struct dahdi_chan *chan, struct dahdi_echocan_state *ec
 }
 #endif
 
+#ifdef VPM_SUPPORT
+static int t4_tonedetect(struct dahdi_chan *chan, int j)
+{
+	struct t4 *wc = chan->pvt;
+	struct t4_span *ts = wc->tspans[chan->span->offset];
+	int channel;
+
+	if (!wc->vpm)
+		return -ENOSYS;
+	if (j && (vpmdtmfsupport == 0))
+		return -ENOSYS;
+	if (j & DAHDI_TONEDETECT_ON)
+		set_bit(chan->chanpos - 1, &ts->dtmfmask);
+	else
+		clear_bit(chan->chanpos - 1, &ts->dtmfmask);
+	if (j & DAHDI_TONEDETECT_MUTE)
+		set_bit(chan->chanpos - 1, &ts->dtmfmutemask);
+	else
+		clear_bit(chan->chanpos - 1, &ts->dtmfmutemask);
+
+	channel = has_e1_span(wc) ? chan->chanpos : chan->chanpos + 4;
+	if (is_octal(wc))
+		channel = channel << 3;
+	else
+		channel = channel << 2;
+	channel |= chan->span->offset;
+	vpm450m_setdtmf(wc->vpm, channel, j & DAHDI_TONEDETECT_ON,
+			j & DAHDI_TONEDETECT_MUTE);
+	return 0;
+}
+#endif
+
 static int t4_ioctl(struct dahdi_chan *chan, unsigned int cmd, unsigned long data)
 {
 	struct t4_regs regs;
@@ -1110,8 +1142,6 @@ static int t4_ioctl(struct dahdi_chan *chan, unsigned int cmd, unsigned long dat
 	struct t4 *wc = chan->pvt;
 #ifdef VPM_SUPPORT
 	int j;
-	int channel;
-	struct t4_span *ts = wc->tspans[chan->span->offset];
 #endif
 
 	switch(cmd) {
@@ -1143,28 +1173,7 @@ static int t4_ioctl(struct dahdi_chan *chan, unsigned int cmd, unsigned long dat
 	case DAHDI_TONEDETECT:
 		if (get_user(j, (__user int *) data))
 			return -EFAULT;
-		if (!wc->vpm)
-			return -ENOSYS;
-		if (j && (vpmdtmfsupport == 0))
-			return -ENOSYS;
-		if (j & DAHDI_TONEDETECT_ON)
-			set_bit(chan->chanpos - 1, &ts->dtmfmask);
-		else
-			clear_bit(chan->chanpos - 1, &ts->dtmfmask);
-		if (j & DAHDI_TONEDETECT_MUTE)
-			set_bit(chan->chanpos - 1, &ts->dtmfmutemask);
-		else
-			clear_bit(chan->chanpos - 1, &ts->dtmfmutemask);
-
-		channel = has_e1_span(wc) ? chan->chanpos : chan->chanpos + 4;
-		if (is_octal(wc))
-			channel = channel << 3;
-		else
-			channel = channel << 2;
-		channel |= chan->span->offset;
-		vpm450m_setdtmf(wc->vpm, channel, j & DAHDI_TONEDETECT_ON,
-				j & DAHDI_TONEDETECT_MUTE);
-		return 0;
+		return t4_tonedetect(chan, j);
 #endif
 	default:
 		return -ENOTTY;
@@ -2246,6 +2255,9 @@ static const struct dahdi_span_ops t4_gen1_span_ops = {
 	.hdlc_hard_xmit = t4_hdlc_hard_xmit,
 	.assigned = t4_span_assigned,
 	.set_spantype = t4_set_linemode,
+#ifdef VPM_SUPPORT
+	.tonedetect = t4_tonedetect,
+#endif
 };
 
 static const struct dahdi_span_ops t4_gen2_span_ops = {
@@ -2264,6 +2276,7 @@ static const struct dahdi_span_ops t4_gen2_span_ops = {
 #ifdef VPM_SUPPORT
 	.echocan_create = t4_echocan_create,
 	.echocan_name = t4_echocan_name,
+	.tonedetect = t4_tonedetect,
 #endif
 };
 
@@ -68,6 +68,35 @@
  */
 /* #define CONFIG_DAHDI_MMX */
 
+/*
+ * Define if you want conference mixing (ACSS / SCSS) done with SSE2 on
+ * x86_64. One kernel FPU section is opened per CPU per tick, and the C
+ * versions are used whenever the FPU is not usable from the calling context.
+ * Ignored if CONFIG_DAHDI_MMX is also defined.
+ *
+ */
+/* #define CONFIG_DAHDI_SSE2 */
+
+#if defined(CONFIG_DAHDI_SSE2) && \
+	(!defined(CONFIG_X86_64) || defined(CONFIG_DAHDI_MMX))
+#undef CONFIG_DAHDI_SSE2
+#endif
+
+/*
+ * Define if you want the MG2 and KB1 software echo cancellers to run their
+ * convolutions with SSE2 or AVX2 (picked at run time) on x86_64. The
+ * software tone detector (CONFIG_DAHDI_TONEDETECT) uses AVX2 too. The
+ * results are bit for bit the same as the C versions (tools/ec_simd_check
+ * checks this), which are still used whenever SIMD is not usable from the
+ * calling context. Ignored if CONFIG_DAHDI_MMX is also defined.
+ */
+/* #define CONFIG_DAHDI_ECHOCAN_SIMD */
+
+#if defined(CONFIG_DAHDI_ECHOCAN_SIMD) && \
+	(!defined(CONFIG_X86_64) || defined(CONFIG_DAHDI_MMX))
+#undef CONFIG_DAHDI_ECHOCAN_SIMD
+#endif
+
 /* We now use the linux kernel config to detect which options to use */
 /* You can still override them below */
 #if defined(CONFIG_HDLC) || defined(CONFIG_HDLC_MODULE)
@@ -81,6 +110,13 @@
  */
 /* #define CONFIG_DAHDI_NET */
 
+/*
+ * Uncomment CONFIG_DAHDI_NET_NAPI to have CONFIG_DAHDI_NET interfaces hand
+ * received frames to the stack in batches from a NAPI poll (with GRO)
+ * instead of one netif_rx() per frame from the card interrupt.
+ */
+/* #define CONFIG_DAHDI_NET_NAPI */
+
 /*
  * Uncomment for Generic PPP support (i.e. DAHDIRAS)
  */
@@ -112,6 +148,15 @@
  */
 #define CONFIG_DAHDI_CORE_TIMER
 
+/*
+ * Define CONFIG_DAHDI_TICK_STATS to keep per CPU log2 histograms of the time
+ * spent receiving, transmitting and echo cancelling on each span and in the
+ * master span processing. They are in the "tick_stats" attribute of each
+ * span and "masterspan_tick_stats" of the driver under /sys/bus/dahdi_spans,
+ * and cost two clock reads per span and phase each chunk.
+ */
+#define CONFIG_DAHDI_TICK_STATS
+
 /*
  * Define CONFIG_DAHDI_NO_ECHOCAN_DISABLE to prevent the 2100Hz tone detector
  * from disabling any installed software echocan.
@@ -189,6 +234,36 @@
  */
 /* #define CONFIG_DAHDI_MIRROR */
 
+/*
+ * Allows the per-tick conference processing to be split between several CPUs.
+ * The number of CPUs used is set with the masterspan_shards module parameter
+ * of dahdi.ko.
+ */
+/* #define CONFIG_DAHDI_SHARDED_MASTERSPAN */
+
+#if defined(CONFIG_DAHDI_SHARDED_MASTERSPAN) && !defined(CONFIG_SMP)
+#undef CONFIG_DAHDI_SHARDED_MASTERSPAN
+#endif
+
+/*
+ * Allows software echo cancellation to be moved out of the card interrupt
+ * and into per-CPU kernel threads, one span per thread. The number of
+ * threads is set with the ec_offload module parameter of dahdi.ko.
+ * Offloaded channels are delayed by one extra chunk.
+ */
+/* #define CONFIG_DAHDI_EC_OFFLOAD */
+
+#if defined(CONFIG_DAHDI_EC_OFFLOAD) && !defined(CONFIG_SMP)
+#undef CONFIG_DAHDI_EC_OFFLOAD
+#endif
+
+/*
+ * Detects DTMF, MF R1 or MF R2 digits in dahdi.ko for channels whose span
+ * can't do it in hardware, when asked to with DAHDI_TONEDETECT. Digits are
+ * reported as DAHDI_EVENT_DTMFDOWN and DAHDI_EVENT_DTMFUP.
+ */
+/* #define CONFIG_DAHDI_TONEDETECT */
+
 /*
  * Adds support for conference links. There are some non-Asterisk users of this
  * functionality.
@@ -48,6 +48,8 @@ struct fasthdlc_state {
 };
 
 #ifdef FAST_HDLC_NEED_TABLES
+#include <linux/bitops.h>
+
 #define RETURN_COMPLETE_FLAG	(0x1000)
 #define RETURN_DISCARD_FLAG	(0x2000)
 #define RETURN_EMPTY_FLAG	(0x4000)
@@ -128,6 +130,15 @@ static unsigned int minbits[2] = { 8, 10 };
 
 static unsigned int hdlc_encode[6][256];
 
+/*
+   And a slice-by-8 table for the FCS (the reflected CRC-CCITT that PPP
+   uses), so frames can be checked eight bytes at a time rather than one.
+   hdlc_fcs[0] is the usual byte table; hdlc_fcs[n][x] is the CRC of x
+   followed by n zero bytes.
+  */
+
+static unsigned short hdlc_fcs[8][256];
+
 static inline char hdlc_search_precalc(unsigned char c)
 {
 	int x, p=0;
@@ -348,6 +359,19 @@ static inline void fasthdlc_precalc(void)
 #endif
 		}
 	}
+	/* And the FCS slices */
+	for (y = 0; y < 256; y++) {
+		unsigned short fcs = y;
+		for (x = 0; x < 8; x++)
+			fcs = (fcs >> 1) ^ ((fcs & 1) ? 0x8408 : 0);
+		hdlc_fcs[0][y] = fcs;
+	}
+	for (x = 1; x < 8; x++) {
+		for (y = 0; y < 256; y++) {
+			unsigned short fcs = hdlc_fcs[x - 1][y];
+			hdlc_fcs[x][y] = (fcs >> 8) ^ hdlc_fcs[0][fcs & 0xff];
+		}
+	}
 }
 
 
@@ -529,5 +553,189 @@ static inline int fasthdlc_rx_run(struct fasthdlc_state *h)
 	}
 	return retval;
 }
+/*
+   Continue the FCS over len bytes of data.  Same result as running
+   PPP_FCS() over each byte in turn.
+   */
+
+static inline unsigned int fasthdlc_fcs(unsigned int fcs,
+					const unsigned char *data, int len)
+{
+	unsigned int a;
+
+	while (len >= 8) {
+		a = fcs ^ data[0] ^ (data[1] << 8);
+		fcs = hdlc_fcs[7][a & 0xff] ^ hdlc_fcs[6][a >> 8] ^
+		      hdlc_fcs[5][data[2]] ^ hdlc_fcs[4][data[3]] ^
+		      hdlc_fcs[3][data[4]] ^ hdlc_fcs[2][data[5]] ^
+		      hdlc_fcs[1][data[6]] ^ hdlc_fcs[0][data[7]];
+		data += 8;
+		len -= 8;
+	}
+	while (len--)
+		fcs = (fcs >> 8) ^ hdlc_fcs[0][(fcs ^ *data++) & 0xff];
+	return fcs;
+}
+
+/*
+   Word at a time versions of the transmit and receive loops, for
+   FASTHDLC_MODE_64 links.  Both rely on the same observation: up to the
+   point where five ones in a row turn up (counting the ones already
+   seen), there is nothing to stuff or unstuff and no flag or abort to
+   find, so whole bytes of data map straight onto bytes of line with only
+   the bit order within each byte swapped.  The next 32 bits are checked
+   at once, every byte before the first run of five ones is moved in one
+   go, and the byte with the run in it goes through the tables as
+   before.  The results are the same, byte for byte and state for state,
+   as looping over the tables alone.
+   */
+
+/* Reverse the order of the bits within each of the four bytes */
+static inline unsigned int fasthdlc_rev8x4(unsigned int x)
+{
+	x = ((x >> 1) & 0x55555555) | ((x & 0x55555555) << 1);
+	x = ((x >> 2) & 0x33333333) | ((x & 0x33333333) << 2);
+	return ((x >> 4) & 0x0f0f0f0f) | ((x & 0x0f0f0f0f) << 4);
+}
+
+/* How many of the bytes of x (MSB first) come before five ones in a row,
+   given that the last ones bits before x were ones */
+static inline int fasthdlc_clean_bytes(int ones, unsigned int x)
+{
+	unsigned long long y = ((1ULL << ones) - 1) << 32 | x;
+	int last;
+
+	y &= (y >> 1) & (y >> 2) & (y >> 3) & (y >> 4);
+	if (!y)
+		return 4;
+	/* The bit where the first run of five reaches five */
+	last = fls64(y) - 1;
+	return (last > 24) ? 0 : (31 - last) / 8;
+}
+
+/* Queue the top n bytes of x after the h->bits queued in h->data, and
+   take n bytes back off the front.  Returns the bytes taken, at the top. */
+static inline unsigned int fasthdlc_shift_bytes(struct fasthdlc_state *h,
+						unsigned int x, int n)
+{
+	unsigned long long q;
+
+	q = (unsigned long long)h->data << 32 |
+	    ((unsigned long long)x >> (32 - 8 * n) << (64 - 8 * n - h->bits));
+	h->data = (q << (8 * n)) >> 32;
+	return q >> 32;
+}
+
+/* Number of ones at the end of the top n bytes of x, which are not all
+   ones */
+static inline int fasthdlc_trailing_ones(unsigned int x, int n)
+{
+	return __ffs(~(x >> (32 - 8 * n)));
+}
+
+/*
+   Send len bytes of line from the data in src, loading a byte of data
+   each time there are fewer than 8 bits queued, exactly as a loop of
+   fasthdlc_tx_need_data(), fasthdlc_tx_load_nocheck() and
+   fasthdlc_tx_run_nocheck() does.  Returns the number of bytes of src
+   used, which is never more than len.
+   */
+
+static inline int fasthdlc_tx_run_buf(struct fasthdlc_state *h,
+				      const unsigned char *src,
+				      unsigned char *dst, int len)
+{
+	const unsigned char *const start = src;
+	unsigned int x;
+	int n;
+
+	while (len) {
+		if (h->mode == FASTHDLC_MODE_64 && h->bits < 8 && len >= 4) {
+			x = fasthdlc_rev8x4((unsigned int)src[0] << 24 |
+					    src[1] << 16 | src[2] << 8 | src[3]);
+			n = fasthdlc_clean_bytes(h->ones, x);
+			if (n) {
+				h->ones = fasthdlc_trailing_ones(x, n);
+				x = fasthdlc_shift_bytes(h, x, n);
+				src += n;
+				len -= n;
+				while (n--) {
+					*dst++ = x >> 24;
+					x <<= 8;
+				}
+				continue;
+			}
+		}
+		if (fasthdlc_tx_need_data(h))
+			fasthdlc_tx_load_nocheck(h, *src++);
+		*dst++ = fasthdlc_tx_run_nocheck(h);
+		len--;
+	}
+	return src - start;
+}
+
+/*
+   Receive len bytes of line from src, putting the data in dst.  This is
+   fasthdlc_rx_load_nocheck() and fasthdlc_rx_run() once per byte, with
+   the data bytes collected in dst (*got is how many) and the flags of an
+   empty frame skipped; framelen is how much of the current frame came
+   before src.  It stops after the byte that ends or aborts a non-empty
+   frame and sets *res to its RETURN_COMPLETE_FLAG or RETURN_DISCARD_FLAG;
+   otherwise *res is RETURN_EMPTY_FLAG.  Returns the number of bytes of
+   src used.
+   */
+
+static inline int fasthdlc_rx_run_buf(struct fasthdlc_state *h,
+				      const unsigned char *src, int len,
+				      unsigned char *dst, int framelen,
+				      int *got, int *res)
+{
+	const unsigned char *const start = src;
+	unsigned int x;
+	int n;
+	int r;
+
+	*got = 0;
+	*res = RETURN_EMPTY_FLAG;
+	while (len) {
+		/* Each byte in gives a byte of data out only while there are
+		   enough bits queued for the tables to decode one */
+		if (h->mode == FASTHDLC_MODE_64 && h->state == PROCESS_FRAME &&
+		    h->bits >= 2 && h->bits <= 24 && len >= 4) {
+			x = (unsigned int)src[0] << 24 | src[1] << 16 |
+			    src[2] << 8 | src[3];
+			/* Line bits in the order they will be decoded */
+			x = h->data | (x >> h->bits);
+			n = fasthdlc_clean_bytes(h->ones, x);
+			if (n) {
+				x = fasthdlc_shift_bytes(h,
+					(unsigned int)src[0] << 24 |
+					src[1] << 16 | src[2] << 8 | src[3], n);
+				h->ones = fasthdlc_trailing_ones(x, n);
+				x = fasthdlc_rev8x4(x);
+				src += n;
+				len -= n;
+				while (n--) {
+					dst[(*got)++] = x >> 24;
+					x <<= 8;
+				}
+				continue;
+			}
+		}
+		fasthdlc_rx_load_nocheck(h, *src++);
+		len--;
+		r = fasthdlc_rx_run(h);
+		if (r & RETURN_EMPTY_FLAG)
+			continue;
+		if (r & (RETURN_COMPLETE_FLAG | RETURN_DISCARD_FLAG)) {
+			if (!framelen && !*got)
+				continue;
+			*res = r;
+			break;
+		}
+		dst[(*got)++] = r;
+	}
+	return src - start;
+}
 #endif /* FAST_HDLC_NEED_TABLES */
 #endif
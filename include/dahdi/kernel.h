@@ -55,6 +55,7 @@
 #endif
 #include <linux/device.h>
 #include <linux/sysfs.h>
+#include <linux/llist.h>
 
 #include <linux/poll.h>
 
@@ -178,6 +179,7 @@ struct dahdi_tone_state {
 	int v2_2;
 	int v3_2;
 	int modulate;
+	int pos;	/*!< Read position in the tone's precomputed table */
 };
 
 /*! \brief Conference queue structure */
@@ -250,6 +252,11 @@ struct dahdi_echocan_ops {
 	 * \param[in] iref The transmit direction data.
 	 * \param[in] size The number of elements in the isig and iref arrays.
 	 *
+	 * The DAHDI core calls this once per chunk with a whole block of
+	 * DAHDI_CHUNKSIZE samples, never sample by sample, so an echocan is
+	 * free to run its filter over the whole block before doing per-sample
+	 * adaptation. It must still cope with any non-zero size.
+	 *
 	 * Note: This function can also return events in the events field of the
 	 * dahdi_echocan_state structure. If it can do so, then the echocan does
 	 * not need to provide the echocan_events function.
@@ -258,6 +265,26 @@ struct dahdi_echocan_ops {
 	 */
 	void (*echocan_process)(struct dahdi_echocan_state *ec, short *isig, const short *iref, u32 size);
 
+	/*! \brief Process one chunk for several instances of this echocan.
+	 * \param[in,out] ec Array of n state structures, all using these ops.
+	 * \param[in,out] isig The receive direction data (will be modified),
+	 * DAHDI_CHUNKSIZE samples per instance: the chunk of ec[i] starts at
+	 * isig[i * DAHDI_CHUNKSIZE].
+	 * \param[in] iref The transmit direction data, laid out like isig.
+	 * \param[in] n The number of instances.
+	 *
+	 * Optional. It must be equivalent to calling echocan_process on each
+	 * instance in turn, but lets the echocan set up FPU/SIMD state once
+	 * per span rather than once per channel. dahdi_ec_span() calls it
+	 * with local interrupts disabled and under rcu_read_lock(), but
+	 * without the channel locks held and outside any FPU section of its
+	 * own; the DAHDI core waits for an RCU grace period before freeing
+	 * the state of an echocan that provides this operation.
+	 *
+	 * \return Nothing.
+	 */
+	void (*echocan_process_batch)(struct dahdi_echocan_state **ec, short *isig, const short *iref, unsigned int n);
+
 	/*! \brief Retrieve events from the echocan.
 	 * \param[in,out] ec Pointer to the state structure.
 	 *
@@ -377,6 +404,12 @@ struct dahdi_echocan_state {
 
 		/*! How many samples to wait before beginning the training operation. */
 		u32 pretrain_timer;
+
+		/*! NLP change asked for by the DAHDI core, made from where the
+		 * echocan is run before it processes its next chunk. Zero when
+		 * there is none.
+		 */
+		u32 nlp_request;
 	} status;
 
 	/*! This structure contains event flags, allowing the echocan to report
@@ -498,7 +531,9 @@ struct dahdi_chan {
 	u_char		*writebuf[DAHDI_MAX_NUM_BUFS]; /*!< write buffers */
 	int		inwritebuf;
 	int		outwritebuf;
-	
+
+	short		*linreadbuf;	/*!< signed linear shadow of readbuf[] (DAHDI_FLAG_LINEAR) */
+
 	int		blocksize;	/*!< Block size */
 
 	int		eventinidx;  /*!< out index in event buf (circular) */
@@ -572,6 +607,10 @@ struct dahdi_chan {
 	const struct dahdi_echocan_factory *ec_current;
 	/*! The state data of the echo canceler instance in use */
 	struct dahdi_echocan_state *ec_state;
+#ifdef CONFIG_DAHDI_TONEDETECT
+	/*! DAHDI_TONEDETECT flags, when detection is done in software */
+	int tonedetect;
+#endif
 
 	/* RBS timings  */
 	int		prewinktime;  /*!< pre-wink time (ms) */
@@ -621,6 +660,9 @@ struct dahdi_chan {
 #ifdef	OPTIMIZE_CHANMUTE
 	int chanmute;		/*!< no need for PCM data */
 #endif
+	int txrx_drain;		/*!< idle chunks left before leaving the
+				     span's active_chans */
+	struct dahdi_ring *ring;	/*!< mmap()ed audio rings, if set up */
 #ifdef CONFIG_CALC_XLAW
 	unsigned char (*lineartoxlaw)(short a);
 #else
@@ -634,6 +676,15 @@ struct dahdi_chan {
 struct dahdi_hdlc {
 	struct net_device *netdev;
 	struct dahdi_chan *chan;
+	struct sk_buff_head txq;	/*!< Frames waiting for the transmitter */
+	struct sk_buff *txskb;		/*!< Frame being encoded, if any */
+	int txidx;			/*!< Bytes of txskb (and FCS) sent */
+	struct sk_buff *rxskb;		/*!< Frame being deframed into, if any */
+	int rxheadroom;			/*!< Headroom reserved in rxskb */
+#ifdef CONFIG_DAHDI_NET_NAPI
+	struct napi_struct napi;
+	struct sk_buff_head rxq;	/*!< Frames waiting for the NAPI poll */
+#endif
 };
 #endif
 
@@ -922,6 +973,11 @@ struct dahdi_span_ops {
 	/*! Opt: Provide the name of the echo canceller on a channel */
 	const char *(*echocan_name)(const struct dahdi_chan *chan);
 
+	/*! Opt: Set hardware DTMF detection on a channel, with the same
+	 * DAHDI_TONEDETECT_* flags as the ioctl.  Lets DAHDI itself turn it
+	 * off when software detection takes over. */
+	int (*tonedetect)(struct dahdi_chan *chan, int flags);
+
 	/*! When using "assigned spans", this function is called back when this
 	 * span has been assigned with the system. */
 	void (*assigned)(struct dahdi_span *span);
@@ -986,6 +1042,19 @@ struct dahdi_span {
 	int spanno;			/*!< Span number for DAHDI */
 	int offset;			/*!< Offset within a given card */
 	int lastalarms;			/*!< Previous alarms */
+	unsigned long *active_chans;	/*!< chans[] _dahdi_receive and
+					     _dahdi_transmit visit */
+	unsigned long *conf_chans;	/*!< chans[] the master span visits */
+	struct dahdi_span_eventfd __rcu *notify; /*!< DAHDI_SPAN_NOTIFY */
+#ifdef CONFIG_DAHDI_TICK_STATS
+	struct dahdi_tick_stats __percpu *tick_stats; /*!< per phase timing */
+#endif
+#ifdef CONFIG_DAHDI_EC_OFFLOAD
+	struct dahdi_ec_offload __rcu *ec_offload; /*!< EC worker queue */
+#endif
+#ifdef CONFIG_DAHDI_TONEDETECT
+	struct dahdi_span_tones __rcu *tones; /*!< software DAHDI_TONEDETECT */
+#endif
 
 #ifdef CONFIG_DAHDI_WATCHDOG
 	int watchcounter;
@@ -1110,6 +1179,11 @@ struct dahdi_dynamic {
 	int master;
 	unsigned char *msgbuf;
 	struct device *dev;
+	struct dahdi_dynamic_jb *jb;
+	/* CPU the span's tick is run on when steering, and ticks waiting */
+	int rxcpu;
+	atomic_t steer_ticks;
+	struct llist_node steer_node;
 
 	struct list_head list;
 };
@@ -1333,6 +1407,16 @@ struct dahdi_tone {
 	struct dahdi_tone *next;		/* Next tone in this sequence */
 
 	int modulate;
+
+	/*! Precomputed samples of this tone, wavelen bytes of mu-law
+	 * followed by wavelen bytes of A-law, or NULL if the tone is
+	 * generated on the fly.  Shared by every channel playing it. */
+	u8 *wave;
+	int wavelen;
+	int waveloop;			/*!< wave holds whole periods and repeats */
+	/*! Oscillator state at the end of a one-shot wave, to carry on
+	 * from when a tone is played for longer than the table. */
+	struct dahdi_tone_state wave_end;
 };
 
 static inline short dahdi_tone_nextsample(struct dahdi_tone_state *ts, struct dahdi_tone *zt)
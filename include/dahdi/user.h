@@ -247,6 +247,9 @@ enum {
 
 #define DAHDI_TONEDETECT_ON	(1 << 0)		/* Detect tones */
 #define DAHDI_TONEDETECT_MUTE	(1 << 1)		/* Mute audio in received channel */
+#define DAHDI_TONEDETECT_MFR1	(1 << 2)		/* Detect MF R1 instead of DTMF */
+#define DAHDI_TONEDETECT_MFR2_FWD	(1 << 3)	/* Detect MF R2 forward tones instead of DTMF */
+#define DAHDI_TONEDETECT_MFR2_BACK	(1 << 4)	/* Detect MF R2 backward tones instead of DTMF */
 
 /* Define the max # of outgoing DTMF, MFR1 or MFR2 digits to queue */
 #define DAHDI_MAX_DTMF_BUF 256
@@ -1102,6 +1105,118 @@ struct dahdi_vmwi_info {
  */
 #define DAHDI_BUFFER_EVENTS		_IOW(DAHDI_CODE, 105, int)
 
+/*
+ * Read and / or write several channels in one call.
+ *
+ * Each dahdi_iovec names a channel by a file descriptor on which it is open
+ * (a channel or a pseudo channel), and is handled as a non-blocking read()
+ * and / or write() of that channel would be. readres and writeres are set to
+ * the number of bytes moved or to a negative errno, e.g. -EAGAIN if nothing
+ * was ready or -ELAST if an event is pending. Returns the number of
+ * descriptors for which anything was read or written.
+ *
+ * May be issued on any open DAHDI file.
+ */
+#define DAHDI_IOVEC_READ	(1 << 0)
+#define DAHDI_IOVEC_WRITE	(1 << 1)
+
+#define DAHDI_MAX_IOVECS	1024
+
+struct dahdi_iovec {
+	__s32 fd;		/* Open channel to operate on */
+	__u32 flags;		/* DAHDI_IOVEC_READ and / or DAHDI_IOVEC_WRITE */
+	__u64 readbuf;		/* User pointer to read into */
+	__u64 writebuf;		/* User pointer to write from */
+	__u32 readlen;		/* Size of readbuf */
+	__u32 writelen;		/* Bytes in writebuf */
+	__s32 readres;		/* Bytes read, or -errno (returned) */
+	__s32 writeres;		/* Bytes written, or -errno (returned) */
+};
+
+struct dahdi_multi_io {
+	__u64 iov;		/* User pointer to an array of dahdi_iovec */
+	__u32 count;		/* Number of entries, up to DAHDI_MAX_IOVECS */
+	__u32 reserved;
+};
+
+#define DAHDI_MULTI_IO			_IOWR(DAHDI_CODE, 106, struct dahdi_multi_io)
+
+/*
+ * Shared memory audio rings for a channel.
+ *
+ * DAHDI_SET_RING sets up (or, with a size of 0, tears down) a receive and a
+ * transmit ring of the given size in bytes, a power of two between
+ * DAHDI_RING_MIN and DAHDI_RING_MAX. User space then maps them with mmap() on
+ * the channel file, at offset 0 and with a length of DAHDI_RING_MAPLEN(size).
+ *
+ * The mapping starts with a struct dahdi_ring_hdr. Each ring is a single
+ * producer / single consumer queue of samples in the law of the channel. The
+ * indices are free running byte counts, so a ring holds (head - tail) bytes,
+ * stored at offset (index & (size - 1)) of its data area.
+ *
+ * While the rings are set up received audio goes to the rx ring rather than
+ * to read(). Anything already written with write() is sent first, and the tx
+ * ring is only drained once the write buffers are empty. The transmit buffer
+ * policy (DAHDI_SET_BUFINFO) applies to the tx ring as well. poll() reports
+ * POLLIN once a block (DAHDI_SET_BLOCKSIZE) is waiting in the rx ring, and
+ * POLLOUT while a block would fit in the tx ring.
+ * Not available on HDLC channels: DAHDI_SET_RING fails on them, switching a
+ * channel with rings to HDLC fails with EBUSY, and a channel configured for
+ * HDLC some other way goes back to read() / write() until it is not.
+ */
+#define DAHDI_RING_MIN		1024
+#define DAHDI_RING_MAX		(1 << 20)
+#define DAHDI_RING_HDRLEN	4096
+#define DAHDI_RING_MAPLEN(size)	(DAHDI_RING_HDRLEN + 2 * (size))
+
+struct dahdi_ring_hdr {
+	__u32 rx_head;		/* Written by the kernel */
+	__u32 pad0[15];
+	__u32 rx_tail;		/* Written by user space */
+	__u32 pad1[15];
+	__u32 tx_head;		/* Written by user space */
+	__u32 pad2[15];
+	__u32 tx_tail;		/* Written by the kernel */
+	__u32 pad3[15];
+	__u32 size;		/* Size of each data area */
+	__u32 rx_offset;	/* Offset of the rx data area in the mapping */
+	__u32 tx_offset;	/* Offset of the tx data area in the mapping */
+	__u32 rx_overruns;	/* Bytes dropped because the rx ring was full */
+};
+
+#define DAHDI_SET_RING			_IOW(DAHDI_CODE, 107, int)
+
+/*
+ * Aggregated wakeups for a span.
+ *
+ * DAHDI_SPAN_NOTIFY, issued on /dev/dahdi/ctl, attaches an eventfd to a span
+ * or, with an fd of -1, detaches it. Whenever a channel of the span would wake
+ * its own poll() -- a read block is complete, a write buffer has drained, an
+ * event is queued -- the bit of that channel is set in a ready bitmap and the
+ * eventfd is signalled once for the tick, however many channels are ready.
+ * The eventfd is detached again when the ctl file that attached it is closed
+ * or the span goes away.
+ *
+ * DAHDI_SPAN_READY fetches and clears the ready bitmap. Bit (chanpos - 1) is
+ * bit ((chanpos - 1) % 32) of word ((chanpos - 1) / 32) of the __u32 array at
+ * map, which is len bytes long. On return len holds the number of bytes
+ * needed to cover the whole span. If len is less than that, nothing is
+ * fetched or cleared and the ioctl fails with ENOSPC.
+ */
+struct dahdi_span_notify {
+	__s32 spanno;
+	__s32 fd;		/* eventfd, or -1 to detach */
+};
+
+struct dahdi_span_ready {
+	__s32 spanno;
+	__u32 len;		/* Size of the array at map in bytes */
+	__u64 map;		/* Pointer to __u32 ready bitmap */
+};
+
+#define DAHDI_SPAN_NOTIFY		_IOW(DAHDI_CODE, 108, struct dahdi_span_notify)
+#define DAHDI_SPAN_READY		_IOWR(DAHDI_CODE, 109, struct dahdi_span_ready)
+
 /* Get current status IOCTL */
 /* Defines for Radio Status (dahdi_radio_stat.radstat) bits */
 
@@ -0,0 +1,131 @@
+/*
+ * Check the MMX and SSE2 ACSS()/SCSS() in drivers/dahdi/arith.h against
+ * the C versions, then time a conference mixed with each, from two members
+ * up to the given number.
+ *
+ * Usage: conf_bench [members] [ticks]
+ */
+
+#include "harness.h"
+#include "kshim.h"
+
+#define DAHDI_CHUNKSIZE 8
+#define CONFIG_DAHDI_SSE2
+#include "arith.h"
+
+DEFINE_PER_CPU(int, dahdi_sse2_active);
+
+/* conf_bench_mmx.c */
+void conf_acss_mmx(short *dst, const short *src);
+void conf_scss_mmx(short *dst, const short *src);
+void conf_mix_mmx(short (*in)[DAHDI_CHUNKSIZE],
+		  short (*out)[DAHDI_CHUNKSIZE], int members);
+
+enum conf_impl { CONF_C, CONF_MMX, CONF_SSE2 };
+
+static void check(void)
+{
+	uint32_t seed = 1;
+	short a[DAHDI_CHUNKSIZE], b[DAHDI_CHUNKSIZE];
+	short c[DAHDI_CHUNKSIZE], s[DAHDI_CHUNKSIZE], m[DAHDI_CHUNKSIZE];
+	int i, x;
+
+	for (i = 0; i < 1000000; i++) {
+		for (x = 0; x < DAHDI_CHUNKSIZE; x++) {
+			/* Plenty of values near the rails, to saturate */
+			a[x] = (i & 1) ? (short)harness_rand(&seed) :
+				(short)(harness_rand(&seed) | 0x7000);
+			b[x] = (short)harness_rand(&seed);
+		}
+		memcpy(c, a, sizeof(a));
+		memcpy(s, a, sizeof(a));
+		memcpy(m, a, sizeof(a));
+		__ACSS_C(c, b);
+		__ACSS_SSE2(s, b);
+		conf_acss_mmx(m, b);
+		HARNESS_CHECK(!memcmp(c, s, sizeof(c)), "ACSS differs, pass %d", i);
+		HARNESS_CHECK(!memcmp(c, m, sizeof(c)),
+			      "MMX ACSS differs, pass %d", i);
+		memcpy(c, a, sizeof(a));
+		memcpy(s, a, sizeof(a));
+		memcpy(m, a, sizeof(a));
+		__SCSS_C(c, b);
+		__SCSS_SSE2(s, b);
+		conf_scss_mmx(m, b);
+		HARNESS_CHECK(!memcmp(c, s, sizeof(c)), "SCSS differs, pass %d", i);
+		HARNESS_CHECK(!memcmp(c, m, sizeof(c)),
+			      "MMX SCSS differs, pass %d", i);
+	}
+}
+
+/* One tick of a conference: everyone talks, everyone hears the rest */
+static void mix(short (*in)[DAHDI_CHUNKSIZE], short (*out)[DAHDI_CHUNKSIZE],
+		int members)
+{
+	short sum[DAHDI_CHUNKSIZE] = { 0 };
+	int m;
+
+	for (m = 0; m < members; m++)
+		ACSS(sum, in[m]);
+	for (m = 0; m < members; m++) {
+		memcpy(out[m], sum, sizeof(sum));
+		SCSS(out[m], in[m]);
+	}
+}
+
+static double bench(enum conf_impl impl, int members, int ticks,
+		    short (*in)[DAHDI_CHUNKSIZE], short (*out)[DAHDI_CHUNKSIZE])
+{
+	uint64_t start;
+	int t;
+
+	dahdi_sse2_active = (impl == CONF_SSE2);
+	start = harness_ns();
+	for (t = 0; t < ticks; t++) {
+		if (impl == CONF_MMX)
+			conf_mix_mmx(in, out, members);
+		else
+			mix(in, out, members);
+		/* Keep the compiler from hoisting the ticks together */
+		__asm__ __volatile__("" : : "r" (out) : "memory");
+	}
+	return (double)(harness_ns() - start) / ticks;
+}
+
+int main(int argc, char *argv[])
+{
+	int members = (argc > 1) ? atoi(argv[1]) : 64;
+	int ticks = (argc > 2) ? atoi(argv[2]) : 200000;
+	short (*in)[DAHDI_CHUNKSIZE], (*out)[DAHDI_CHUNKSIZE];
+	uint32_t seed = 7;
+	double c, mmx, sse2;
+	int m, n, x;
+
+	check();
+
+	in = calloc(members, sizeof(*in));
+	out = calloc(members, sizeof(*out));
+	if (!in || !out)
+		return 1;
+	for (m = 0; m < members; m++)
+		for (x = 0; x < DAHDI_CHUNKSIZE; x++)
+			in[m][x] = (short)harness_rand(&seed) >> 4;
+
+	/* The sum is built over every member, so its cost grows with them */
+	printf("members  C ns/tick  MMX ns/tick  SSE2 ns/tick  "
+	       "SSE2 ns/member  C/SSE2  MMX/SSE2\n");
+	for (n = 2; ; n *= 2) {
+		if (n > members)
+			n = members;
+		c = bench(CONF_C, n, ticks, in, out);
+		mmx = bench(CONF_MMX, n, ticks, in, out);
+		sse2 = bench(CONF_SSE2, n, ticks, in, out);
+		printf("%7d %10.1f %12.1f %13.1f %15.2f %7.2f %9.2f\n", n, c,
+		       mmx, sse2, sse2 / n, c / sse2, mmx / sse2);
+		if (n == members)
+			break;
+	}
+	free(in);
+	free(out);
+	return harness_result("conf_bench");
+}
@@ -0,0 +1,46 @@
+/*
+ * The MMX ACSS()/SCSS() of drivers/dahdi/arith.h for conf_bench.  They sit
+ * on the other side of an #ifdef from the C and SSE2 versions, so they are
+ * built here on their own.
+ */
+
+#include "kshim.h"
+
+#define DAHDI_CHUNKSIZE 8
+#define CONFIG_DAHDI_MMX
+#define CLOBBERMMX
+#include "arith.h"
+
+/* The kernel leaves MMX state to kernel_fpu_end(); here it is ours */
+static void emms(void)
+{
+	__asm__ __volatile__("emms" : : : "memory");
+}
+
+void conf_acss_mmx(short *dst, const short *src)
+{
+	__ACSS(dst, src);
+	emms();
+}
+
+void conf_scss_mmx(short *dst, const short *src)
+{
+	__SCSS(dst, src);
+	emms();
+}
+
+/* As mix() in conf_bench.c */
+void conf_mix_mmx(short (*in)[DAHDI_CHUNKSIZE],
+		  short (*out)[DAHDI_CHUNKSIZE], int members)
+{
+	short sum[DAHDI_CHUNKSIZE] = { 0 };
+	int m;
+
+	for (m = 0; m < members; m++)
+		ACSS(sum, in[m]);
+	for (m = 0; m < members; m++) {
+		memcpy(out[m], sum, sizeof(sum));
+		SCSS(out[m], in[m]);
+	}
+	emms();
+}
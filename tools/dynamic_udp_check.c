@@ -0,0 +1,235 @@
+/*
+ * Bring up and check dahdi_dynamic_udp spans on a running system.  Unlike
+ * the other programs here this talks to the real drivers, through
+ * /dev/dahdi, so it needs root and the modules loaded;
+ * dynamic_udp_netns.sh runs it across two network namespaces.
+ *
+ * Usage:
+ *   dynamic_udp_check create <addr> <chans>
+ *	Create a span in the network namespace this is run in, configure
+ *	its channels as clear channels and start it.  Prints the span
+ *	number.
+ *   dynamic_udp_check destroy <addr> <chans>
+ *   dynamic_udp_check pass <span> <span> [seconds]
+ *	Wait for both spans to come out of alarm, then check that a
+ *	counting pattern written to each channel of either span comes out
+ *	of the same channel of the other.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <dahdi/user.h>
+#include "harness.h"
+
+#define CTL_DEV		"/dev/dahdi/ctl"
+#define CHAN_DEV	"/dev/dahdi/channel"
+#define SPAN_SYSFS	"/sys/bus/dahdi_spans/devices/span-%d/%s"
+
+/* Bytes of the pattern that must come through unbroken */
+#define PASS_RUN	1024
+
+static int open_ctl(void)
+{
+	int fd = open(CTL_DEV, O_RDWR);
+
+	if (fd < 0) {
+		fprintf(stderr, "%s: %s\n", CTL_DEV, strerror(errno));
+		exit(1);
+	}
+	return fd;
+}
+
+static int span_attr(int span, const char *attr)
+{
+	char path[128];
+	FILE *f;
+	int val = -1;
+
+	snprintf(path, sizeof(path), SPAN_SYSFS, span, attr);
+	f = fopen(path, "r");
+	if (!f || fscanf(f, "%d", &val) != 1) {
+		fprintf(stderr, "%s: cannot read\n", path);
+		exit(1);
+	}
+	fclose(f);
+	return val;
+}
+
+static void fill_dds(struct dahdi_dynamic_span *dds, const char *addr,
+		     const char *chans)
+{
+	memset(dds, 0, sizeof(*dds));
+	strncpy(dds->driver, "udp", sizeof(dds->driver) - 1);
+	strncpy(dds->addr, addr, sizeof(dds->addr) - 1);
+	dds->numchans = atoi(chans);
+}
+
+static int create(const char *addr, const char *chans)
+{
+	struct dahdi_dynamic_span dds;
+	const int fd = open_ctl();
+	int basechan, x;
+
+	fill_dds(&dds, addr, chans);
+	if (ioctl(fd, DAHDI_DYNAMIC_CREATE, &dds)) {
+		fprintf(stderr, "create udp,%s: %s\n", addr, strerror(errno));
+		return 1;
+	}
+	basechan = span_attr(dds.spanno, "basechan");
+	for (x = 0; x < dds.numchans; x++) {
+		struct dahdi_chanconfig cc = {
+			.chan = basechan + x,
+			.sigtype = DAHDI_SIG_CLEAR,
+		};
+
+		if (ioctl(fd, DAHDI_CHANCONFIG, &cc)) {
+			fprintf(stderr, "channel %d: %s\n", cc.chan,
+				strerror(errno));
+			return 1;
+		}
+	}
+	if (ioctl(fd, DAHDI_STARTUP, &dds.spanno)) {
+		fprintf(stderr, "span %d: %s\n", dds.spanno, strerror(errno));
+		return 1;
+	}
+	printf("%d\n", dds.spanno);
+	close(fd);
+	return 0;
+}
+
+static int destroy(const char *addr, const char *chans)
+{
+	struct dahdi_dynamic_span dds;
+	const int fd = open_ctl();
+
+	fill_dds(&dds, addr, chans);
+	if (ioctl(fd, DAHDI_DYNAMIC_DESTROY, &dds)) {
+		fprintf(stderr, "destroy udp,%s: %s\n", addr, strerror(errno));
+		return 1;
+	}
+	close(fd);
+	return 0;
+}
+
+/* Wait for a span to be out of alarm, which it is once the far end is heard */
+static bool wait_alarms(int fd, int span, int seconds)
+{
+	const uint64_t end = harness_ns() + seconds * 1000000000ULL;
+	struct dahdi_spaninfo si;
+
+	do {
+		memset(&si, 0, sizeof(si));
+		si.spanno = span;
+		if (ioctl(fd, DAHDI_SPANSTAT, &si)) {
+			fprintf(stderr, "span %d: %s\n", span, strerror(errno));
+			exit(1);
+		}
+		if (!si.alarms)
+			return true;
+		usleep(10000);
+	} while (harness_ns() < end);
+	return false;
+}
+
+static int open_chan(int channo)
+{
+	int fd = open(CHAN_DEV, O_RDWR | O_NONBLOCK);
+
+	if (fd < 0 || ioctl(fd, DAHDI_SPECIFY, &channo)) {
+		fprintf(stderr, "channel %d: %s\n", channo, strerror(errno));
+		exit(1);
+	}
+	return fd;
+}
+
+/*
+ * Write a count to one channel and read the other until PASS_RUN bytes of
+ * it have come through in order.  Jitter buffer concealment, idle and
+ * anything left from before all break the count, so only a clean run
+ * passes.
+ */
+static bool pass_chan(int from, int to, int seconds)
+{
+	const uint64_t end = harness_ns() + seconds * 1000000000ULL;
+	struct pollfd p[2];
+	unsigned char buf[256];
+	unsigned char next = 0;
+	int last = -1, run = 0;
+	int i, n;
+
+	p[0].fd = open_chan(from);
+	p[0].events = POLLOUT;
+	p[1].fd = open_chan(to);
+	p[1].events = POLLIN;
+	while (run < PASS_RUN && harness_ns() < end) {
+		if (poll(p, 2, 100) < 0)
+			break;
+		if (p[0].revents & POLLOUT) {
+			for (i = 0; i < (int)sizeof(buf); i++)
+				buf[i] = next + i;
+			n = write(p[0].fd, buf, sizeof(buf));
+			if (n > 0)
+				next += n;
+		}
+		if (p[1].revents & POLLIN) {
+			n = read(p[1].fd, buf, sizeof(buf));
+			for (i = 0; i < n; i++) {
+				run = (buf[i] == (unsigned char)(last + 1)) ?
+				      run + 1 : 0;
+				last = buf[i];
+			}
+		}
+	}
+	close(p[0].fd);
+	close(p[1].fd);
+	return run >= PASS_RUN;
+}
+
+static int pass(int a, int b, int seconds)
+{
+	const int fd = open_ctl();
+	int chans, basea, baseb, x;
+
+	HARNESS_CHECK(wait_alarms(fd, a, seconds), "span %d stays in alarm",
+		      a);
+	HARNESS_CHECK(wait_alarms(fd, b, seconds), "span %d stays in alarm",
+		      b);
+	close(fd);
+	if (harness_failures)
+		return harness_result("dynamic_udp_check");
+
+	chans = span_attr(a, "channels");
+	HARNESS_CHECK(span_attr(b, "channels") == chans,
+		      "spans %d and %d differ in size", a, b);
+	basea = span_attr(a, "basechan");
+	baseb = span_attr(b, "basechan");
+	for (x = 0; x < chans && !harness_failures; x++) {
+		HARNESS_CHECK(pass_chan(basea + x, baseb + x, seconds),
+			      "nothing from channel %d on %d", basea + x,
+			      baseb + x);
+		HARNESS_CHECK(pass_chan(baseb + x, basea + x, seconds),
+			      "nothing from channel %d on %d", baseb + x,
+			      basea + x);
+	}
+	return harness_result("dynamic_udp_check");
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc == 4 && !strcmp(argv[1], "create"))
+		return create(argv[2], argv[3]);
+	if (argc == 4 && !strcmp(argv[1], "destroy"))
+		return destroy(argv[2], argv[3]);
+	if ((argc == 4 || argc == 5) && !strcmp(argv[1], "pass"))
+		return pass(atoi(argv[2]), atoi(argv[3]),
+			    (argc == 5) ? atoi(argv[4]) : 5);
+	fprintf(stderr,
+		"usage: %s create|destroy <addr> <chans>\n"
+		"       %s pass <span> <span> [seconds]\n", argv[0], argv[0]);
+	return 1;
+}
@@ -0,0 +1,43 @@
+#!/bin/sh
+#
+# Run two dahdi_dynamic_udp spans at each other across two network
+# namespaces joined by a veth pair, and check that audio gets through both
+# ways on every channel.  Each span's socket lives in the namespace of the
+# process that created it, so both ends can use the same port.
+#
+# Needs root, iproute2, and dahdi_dynamic_udp loaded.
+#
+# Usage: dynamic_udp_netns.sh [chans] [port]
+
+set -e
+
+CHANS=${1:-4}
+PORT=${2:-4000}
+NS_A=dahdi-udp-a
+NS_B=dahdi-udp-b
+IP_A=10.254.77.1
+IP_B=10.254.77.2
+CHECK=$(cd "$(dirname "$0")" && pwd)/dynamic_udp_check
+
+cleanup() {
+	ip netns exec $NS_A "$CHECK" destroy $IP_B:$PORT/$PORT $CHANS \
+		2>/dev/null || :
+	ip netns exec $NS_B "$CHECK" destroy $IP_A:$PORT/$PORT $CHANS \
+		2>/dev/null || :
+	ip netns del $NS_A 2>/dev/null || :
+	ip netns del $NS_B 2>/dev/null || :
+}
+trap cleanup EXIT
+
+ip netns add $NS_A
+ip netns add $NS_B
+ip link add dahdi-veth-a netns $NS_A type veth peer name dahdi-veth-b \
+	netns $NS_B
+ip -n $NS_A addr add $IP_A/24 dev dahdi-veth-a
+ip -n $NS_B addr add $IP_B/24 dev dahdi-veth-b
+ip -n $NS_A link set dahdi-veth-a up
+ip -n $NS_B link set dahdi-veth-b up
+
+SPAN_A=$(ip netns exec $NS_A "$CHECK" create $IP_B:$PORT/$PORT $CHANS)
+SPAN_B=$(ip netns exec $NS_B "$CHECK" create $IP_A:$PORT/$PORT $CHANS)
+"$CHECK" pass $SPAN_A $SPAN_B
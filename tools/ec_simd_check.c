@@ -0,0 +1,112 @@
+/*
+ * Check that CONVOLVE2_SIMD() and CONVOLVE2_BLOCK() in drivers/dahdi/arith.h
+ * give bit for bit the sums of the C CONVOLVE2() at every SIMD level the CPU
+ * has, then time each level on the tap lengths the echo cancellers use.
+ *
+ * Usage: ec_simd_check [passes]
+ */
+
+#include "harness.h"
+#include "kshim.h"
+
+#define CONFIG_DAHDI_ECHOCAN_SIMD
+#include "arith.h"
+
+#define MAX_LEN		1024
+#define MAX_BLOCK	(8 * 8)
+
+static const char *const level_name[] = {
+	[DAHDI_EC_SIMD_NONE] = "C",
+	[DAHDI_EC_SIMD_SSE2] = "SSE2",
+	[DAHDI_EC_SIMD_AVX2] = "AVX2",
+};
+
+/* Random samples, with runs at the rails so that the sums wrap */
+static void fill(short *buf, int len, uint32_t *seed)
+{
+	const int rails = harness_rand(seed) & 1;
+	int x;
+
+	for (x = 0; x < len; x++) {
+		if (rails)
+			buf[x] = (harness_rand(seed) & 1) ? -32768 : 32767;
+		else
+			buf[x] = (short)harness_rand(seed);
+	}
+}
+
+static void check(enum dahdi_ec_simd level, int passes)
+{
+	static short coeffs[MAX_LEN];
+	static short hist[MAX_LEN + MAX_BLOCK];
+	int out[MAX_BLOCK];
+	uint32_t seed = 1;
+	int i, j, len, n, ref;
+
+	for (i = 0; i < passes; i++) {
+		/* Every length up to 64, to cover every tail, then any */
+		len = (i < 64) ? i : harness_rand(&seed) % (MAX_LEN + 1);
+		n = 1 + harness_rand(&seed) % MAX_BLOCK;
+		fill(coeffs, len, &seed);
+		fill(hist, len + n, &seed);
+
+		ref = CONVOLVE2(coeffs, hist, len);
+		HARNESS_CHECK(CONVOLVE2_SIMD(level, coeffs, hist, len) == ref,
+			      "%s CONVOLVE2 differs, len %d pass %d",
+			      level_name[level], len, i);
+
+		CONVOLVE2_BLOCK(level, coeffs, hist, len, out, n);
+		for (j = 0; j < n; j++) {
+			ref = CONVOLVE2(coeffs, hist + n - 1 - j, len);
+			HARNESS_CHECK(out[j] == ref,
+				      "%s CONVOLVE2_BLOCK differs, len %d "
+				      "n %d out %d pass %d",
+				      level_name[level], len, n, j, i);
+		}
+	}
+}
+
+/* ns per output sample, filtering a block of n outputs per call */
+static double bench(enum dahdi_ec_simd level, int len, int n)
+{
+	static short coeffs[MAX_LEN];
+	static short hist[MAX_LEN + MAX_BLOCK];
+	int out[MAX_BLOCK];
+	const int calls = 4000000 / len;
+	uint32_t seed = 3;
+	uint64_t start;
+	int i;
+
+	fill(coeffs, len, &seed);
+	fill(hist, len + n, &seed);
+	start = harness_ns();
+	for (i = 0; i < calls; i++) {
+		CONVOLVE2_BLOCK(level, coeffs, hist, len, out, n);
+		__asm__ __volatile__("" : : "r" (out) : "memory");
+	}
+	return (double)(harness_ns() - start) / calls / n;
+}
+
+int main(int argc, char *argv[])
+{
+	static const int lens[] = { 128, 256, 512, 1024 };
+	const int passes = (argc > 1) ? atoi(argv[1]) : 100000;
+	enum dahdi_ec_simd top = dahdi_ec_simd_level();
+	enum dahdi_ec_simd level;
+	unsigned int l;
+
+	for (level = DAHDI_EC_SIMD_NONE; level <= top; level++)
+		check(level, passes);
+
+	printf("%-6s", "taps");
+	for (level = DAHDI_EC_SIMD_NONE; level <= top; level++)
+		printf(" %10s", level_name[level]);
+	printf("   (ns per sample, blocks of 8)\n");
+	for (l = 0; l < sizeof(lens) / sizeof(lens[0]); l++) {
+		printf("%-6d", lens[l]);
+		for (level = DAHDI_EC_SIMD_NONE; level <= top; level++)
+			printf(" %10.1f", bench(level, lens[l], 8));
+		printf("\n");
+	}
+	return harness_result("ec_simd_check");
+}
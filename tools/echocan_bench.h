@@ -0,0 +1,226 @@
+/*
+ * Benchmark for the software echo cancellers, shared by the *_bench
+ * programs in tools/.  Each of them includes one echocan module and then
+ * this file, which drives the module's my_factory.
+ *
+ * A far end signal is played through a made-up echo path and the canceller
+ * is run over the echo, once feeding it whole chunks as the DAHDI core does
+ * and once a sample at a time, with plain C and, for cancellers that use
+ * SIMD, with the best level the CPU has.  All the runs must give the same
+ * output, bit for bit.
+ * Reported are the time per chunk, the echo return loss enhancement
+ * (ERLE) over the last second and how long the canceller took to first
+ * reach BENCH_CONV_DB of it.
+ *
+ * This is done with a loud far end, which keeps the canceller adapting,
+ * and again with a quiet one, below the level the cancellers adapt at,
+ * where the time goes into filtering alone.  With the loud far end every
+ * tail length must converge within BENCH_CONV_MS and end up with at least
+ * BENCH_MIN_ERLE.
+ *
+ * Usage: <echocan>_bench [seconds]
+ */
+#ifndef _DAHDI_TOOLS_ECHOCAN_BENCH_H
+#define _DAHDI_TOOLS_ECHOCAN_BENCH_H
+
+#include <math.h>
+#include <asm/cpufeature.h>
+#include "harness.h"
+
+#define BENCH_RATE	8000
+#define BENCH_ECHO_LEN	64
+#define BENCH_ECHO_DELAY 40
+/* Samples over which convergence is judged: 100 ms */
+#define BENCH_CONV_WINDOW (BENCH_RATE / 10)
+/* What the cancellers must do with the loud far end, in dB and ms */
+#define BENCH_CONV_DB	20
+#define BENCH_CONV_MS	1000
+#define BENCH_MIN_ERLE	30
+
+struct bench_audio {
+	int samples;
+	short *far;	/* iref, what is sent to the line */
+	short *echo;	/* isig, what comes back from it */
+};
+
+/*
+ * Noise at -6 dBFS less shift * 6 dB, through a decaying, delayed echo path
+ * of about -20 dB.
+ */
+static void bench_make_audio(struct bench_audio *a, int seconds, int shift)
+{
+	int h[BENCH_ECHO_LEN];
+	uint32_t seed = 11;
+	int n, k;
+
+	a->samples = seconds * BENCH_RATE;
+	a->far = calloc(a->samples, sizeof(short));
+	a->echo = calloc(a->samples, sizeof(short));
+	if (!a->far || !a->echo)
+		exit(1);
+
+	for (k = 0; k < BENCH_ECHO_LEN; k++)
+		h[k] = (int)(0.05 * 32768 * exp(-k / 12.0) *
+			     ((k & 1) ? -0.5 : 1.0));
+	for (n = 0; n < a->samples; n++)
+		a->far[n] = ((short)harness_rand(&seed) / 2) >> shift;
+	for (n = 0; n < a->samples; n++) {
+		int64_t e = 0;
+
+		for (k = 0; k < BENCH_ECHO_LEN; k++) {
+			const int i = n - BENCH_ECHO_DELAY - k;
+
+			if (i >= 0)
+				e += (int64_t)h[k] * a->far[i];
+		}
+		a->echo[n] = (short)(e >> 15);
+	}
+}
+
+/* Echo return loss enhancement over the last second, in dB */
+static double bench_erle(const struct bench_audio *a, const short *out)
+{
+	double ein = 1, eout = 1;
+	int n;
+
+	for (n = a->samples - BENCH_RATE; n < a->samples; n++) {
+		ein += (double)a->echo[n] * a->echo[n];
+		eout += (double)out[n] * out[n];
+	}
+	return 10 * log10(ein / eout);
+}
+
+/*
+ * Time for the ERLE over BENCH_CONV_WINDOW samples to first reach db, in
+ * ms, or -1 if it never does.
+ */
+static int bench_converge_ms(const struct bench_audio *a, const short *out,
+			     double db)
+{
+	int n, k;
+
+	for (n = 0; n + BENCH_CONV_WINDOW <= a->samples;
+	     n += BENCH_CONV_WINDOW / 4) {
+		double ein = 1, eout = 1;
+
+		for (k = n; k < n + BENCH_CONV_WINDOW; k++) {
+			ein += (double)a->echo[k] * a->echo[k];
+			eout += (double)out[k] * out[k];
+		}
+		if (10 * log10(ein / eout) >= db)
+			return (n + BENCH_CONV_WINDOW) * 1000LL / BENCH_RATE;
+	}
+	return -1;
+}
+
+/*
+ * Run the canceller over the audio into out, step samples per call.
+ * Returns the time per chunk in ns.
+ */
+static double bench_run(const struct bench_audio *a, int taps, int simd,
+			int step, short *out)
+{
+	struct dahdi_echocanparams ecp = { .tap_length = taps };
+	struct dahdi_echocan_state *ec;
+	uint64_t start, total = 0;
+	int n;
+
+	kshim_cpu_mask = !simd;
+	if (my_factory.echocan_create(NULL, &ecp, NULL, &ec)) {
+		fprintf(stderr, "could not create a %d tap canceller\n", taps);
+		exit(1);
+	}
+	kshim_cpu_mask = false;
+
+	memcpy(out, a->echo, a->samples * sizeof(short));
+	for (n = 0; n + DAHDI_CHUNKSIZE <= a->samples; n += DAHDI_CHUNKSIZE) {
+		int i;
+
+		start = harness_ns();
+		for (i = 0; i < DAHDI_CHUNKSIZE; i += step)
+			ec->ops->echocan_process(ec, out + n + i,
+						 a->far + n + i, step);
+		total += harness_ns() - start;
+	}
+	ec->ops->echocan_free(NULL, ec);
+	return (double)total / (a->samples / DAHDI_CHUNKSIZE);
+}
+
+/*
+ * One table of timings, for a far end at -6 dBFS less shift * 6 dB.  The
+ * SIMD runs are the last two of the four.  If converge is set, check that
+ * the canceller converged.
+ */
+static void bench_level(const char *name, int seconds, int shift, int runs,
+			bool converge)
+{
+	static const int taps[] = { 128, 256, 512, 1024 };
+	static const char *const run_name[] = {
+		"C/sample", "C/chunk", "SIMD/sample", "SIMD/chunk",
+	};
+	struct bench_audio a;
+	short *out[4];
+	double ns[4];
+	double erle;
+	unsigned int t;
+	int r, ms;
+
+	bench_make_audio(&a, seconds, shift);
+	for (r = 0; r < 4; r++) {
+		out[r] = calloc(a.samples, sizeof(short));
+		if (!out[r])
+			exit(1);
+	}
+
+	printf("%s, %d s of audio, far end at %d dBFS, ns per chunk\n%-6s",
+	       name, seconds, -6 - 6 * shift, "taps");
+	for (r = 0; r < runs; r++)
+		printf(" %12s", run_name[r]);
+	printf(" %8s %9s\n", "ERLE", "converged");
+
+	for (t = 0; t < ARRAY_SIZE(taps); t++) {
+		for (r = 0; r < runs; r++)
+			ns[r] = bench_run(&a, taps[t], r >= 2,
+					  (r & 1) ? DAHDI_CHUNKSIZE : 1,
+					  out[r]);
+		for (r = 1; r < runs; r++)
+			HARNESS_CHECK(!memcmp(out[0], out[r],
+					      a.samples * sizeof(short)),
+				      "%d taps: %s output differs from %s",
+				      taps[t], run_name[r], run_name[0]);
+		erle = bench_erle(&a, out[1]);
+		ms = bench_converge_ms(&a, out[1], BENCH_CONV_DB);
+		printf("%-6d", taps[t]);
+		for (r = 0; r < runs; r++)
+			printf(" %12.1f", ns[r]);
+		if (ms >= 0)
+			printf(" %5.1f dB %6d ms\n", erle, ms);
+		else
+			printf(" %5.1f dB %9s\n", erle, "never");
+		if (!converge)
+			continue;
+		HARNESS_CHECK(ms >= 0 && ms <= BENCH_CONV_MS,
+			      "%d taps: %d dB of ERLE took %d ms", taps[t],
+			      BENCH_CONV_DB, ms);
+		HARNESS_CHECK(erle >= BENCH_MIN_ERLE,
+			      "%d taps: only %.1f dB of ERLE", taps[t], erle);
+	}
+
+	for (r = 0; r < 4; r++)
+		free(out[r]);
+	free(a.far);
+	free(a.echo);
+}
+
+static int echocan_bench_main(int argc, char *argv[], const char *name,
+			      bool simd)
+{
+	const int seconds = (argc > 1) ? atoi(argv[1]) : 10;
+	const int runs = simd ? 4 : 2;
+
+	bench_level(name, (seconds > 1) ? seconds : 2, 0, runs, true);
+	bench_level(name, (seconds > 1) ? seconds : 2, 6, runs, false);
+	return harness_result(name);
+}
+
+#endif
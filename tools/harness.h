@@ -0,0 +1,54 @@
+/*
+ * Helpers shared by the userspace harnesses in tools/.
+ */
+#ifndef _DAHDI_TOOLS_HARNESS_H
+#define _DAHDI_TOOLS_HARNESS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+static inline uint64_t harness_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* A small, repeatable generator, so failures can be replayed by seed */
+static inline uint32_t harness_rand(uint32_t *state)
+{
+	uint32_t x = *state;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*state = x;
+	return x;
+}
+
+static int harness_failures;
+
+#define HARNESS_CHECK(cond, ...)					\
+	do {								\
+		if (!(cond)) {						\
+			harness_failures++;				\
+			fprintf(stderr, "FAIL %s:%d: ", __FILE__, __LINE__); \
+			fprintf(stderr, __VA_ARGS__);			\
+			fputc('\n', stderr);				\
+		}							\
+	} while (0)
+
+static inline int harness_result(const char *name)
+{
+	if (harness_failures) {
+		printf("%s: %d failure(s)\n", name, harness_failures);
+		return 1;
+	}
+	printf("%s: ok\n", name);
+	return 0;
+}
+
+#endif
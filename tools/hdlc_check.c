@@ -0,0 +1,376 @@
+/*
+ * Check the word at a time fasthdlc_tx_run_buf(), fasthdlc_rx_run_buf()
+ * and fasthdlc_fcs() in include/dahdi/fasthdlc.h against the byte at a
+ * time table loops they replace, then time both.
+ *
+ * Frames of data heavy in the patterns that matter (runs of ones, flags,
+ * bytes with no ones at all) are sent in chunks of random length, in each
+ * of the three modes, and the line that comes out is received again, as
+ * sent and with bits flipped and aborts thrown in.  The line or data, the
+ * return values and the whole HDLC state must match after every chunk.
+ *
+ * Usage: hdlc_check [seeds] [chunk]
+ */
+
+#include <string.h>
+#include "harness.h"
+#include "kshim.h"
+#include <linux/kernel.h>
+
+#define FAST_HDLC_NEED_TABLES
+#include <dahdi/fasthdlc.h>
+
+#define MAX_FRAME	300
+#define MAX_CHUNK	64
+#define LINE_LEN	(1 << 16)
+/* A DAHDI chunk, which is what the drivers hand over each tick */
+#define BENCH_CHUNK	8
+
+static const char *const mode_name[] = { "64k", "56k", "16k" };
+
+/* The loops as they were, one byte at a time through the tables */
+static int ref_tx_run(struct fasthdlc_state *h, const unsigned char *src,
+		      unsigned char *dst, int len)
+{
+	const unsigned char *const start = src;
+
+	while (len--) {
+		if (fasthdlc_tx_need_data(h))
+			fasthdlc_tx_load_nocheck(h, *src++);
+		*dst++ = fasthdlc_tx_run_nocheck(h);
+	}
+	return src - start;
+}
+
+static int ref_rx_run(struct fasthdlc_state *h, const unsigned char *src,
+		      int len, unsigned char *dst, int framelen, int *got,
+		      int *res)
+{
+	const unsigned char *const start = src;
+	int r;
+
+	*got = 0;
+	*res = RETURN_EMPTY_FLAG;
+	while (len--) {
+		fasthdlc_rx_load_nocheck(h, *src++);
+		r = fasthdlc_rx_run(h);
+		if (r & RETURN_EMPTY_FLAG)
+			continue;
+		if (r & (RETURN_COMPLETE_FLAG | RETURN_DISCARD_FLAG)) {
+			if (!framelen && !*got)
+				continue;
+			*res = r;
+			break;
+		}
+		dst[(*got)++] = r;
+	}
+	return src - start;
+}
+
+/* PPP_FCS() a bit at a time, straight from the polynomial */
+static unsigned int ref_fcs(unsigned int fcs, const unsigned char *data,
+			    int len)
+{
+	int b;
+
+	while (len--) {
+		fcs ^= *data++;
+		for (b = 0; b < 8; b++)
+			fcs = (fcs >> 1) ^ ((fcs & 1) ? 0x8408 : 0);
+	}
+	return fcs;
+}
+
+/* PPP_FCS() a byte at a time, as the receive path did */
+static unsigned int byte_fcs(unsigned int fcs, const unsigned char *data,
+			     int len)
+{
+	while (len--)
+		fcs = (fcs >> 8) ^ hdlc_fcs[0][(fcs ^ *data++) & 0xff];
+	return fcs;
+}
+
+static int same_state(const struct fasthdlc_state *a,
+		      const struct fasthdlc_state *b)
+{
+	return a->state == b->state && a->data == b->data &&
+	       a->bits == b->bits && a->ones == b->ones;
+}
+
+static unsigned char pattern_byte(int pattern, uint32_t *seed)
+{
+	const uint32_t r = harness_rand(seed);
+
+	switch (pattern) {
+	case 0:		/* anything */
+		return r;
+	case 1:		/* runs of ones, often long enough to stuff */
+		return (r & 0x300) ? 0xff : r;
+	case 2:		/* flags and aborts in the data */
+		return (r & 0x100) ? 0x7e : ((r & 0x200) ? 0x3f : 0xfc);
+	default:	/* nothing to stuff at all */
+		return r & 0x77;
+	}
+}
+
+struct line {
+	unsigned char buf[LINE_LEN + MAX_CHUNK];
+	int len;
+	/* The frames that went into it, with their FCS */
+	unsigned char frames[LINE_LEN];
+	int framelens[LINE_LEN / 2];
+	int nframes;
+};
+
+/*
+ * Send frames of the pattern until the line is nearly full, checking
+ * fasthdlc_tx_run_buf() against ref_tx_run() chunk by chunk.
+ */
+static void check_tx(struct line *l, enum fasthdlc_mode mode, int pattern,
+		     uint32_t *seed)
+{
+	struct fasthdlc_state ref, fast;
+	unsigned char data[MAX_FRAME + 2];
+	unsigned char out[MAX_CHUNK];
+	int framedata = 0;
+
+	fasthdlc_init(&ref, mode);
+	/* The opening flag of the first frame */
+	fasthdlc_tx_frame_nocheck(&ref);
+	fast = ref;
+	l->len = 0;
+	l->nframes = 0;
+	while (l->len < LINE_LEN - 4 * MAX_FRAME) {
+		const int len = harness_rand(seed) % MAX_FRAME;
+		int idx = 0, i, n;
+		unsigned int fcs;
+
+		for (i = 0; i < len; i++)
+			data[i] = pattern_byte(pattern, seed);
+		fcs = ref_fcs(0xffff, data, len) ^ 0xffff;
+		data[len] = fcs & 0xff;
+		data[len + 1] = fcs >> 8;
+		memcpy(l->frames + framedata, data, len + 2);
+		l->framelens[l->nframes++] = len + 2;
+		framedata += len + 2;
+
+		while (idx < len + 2) {
+			/* Never more than a byte of data per byte of line */
+			n = 1 + harness_rand(seed) % MAX_CHUNK;
+			if (n > len + 2 - idx)
+				n = len + 2 - idx;
+			i = ref_tx_run(&ref, data + idx, l->buf + l->len, n);
+			HARNESS_CHECK(fasthdlc_tx_run_buf(&fast, data + idx,
+							  out, n) == i,
+				      "%s tx: data used differs", mode_name[mode]);
+			HARNESS_CHECK(!memcmp(out, l->buf + l->len, n),
+				      "%s tx: line differs", mode_name[mode]);
+			HARNESS_CHECK(same_state(&ref, &fast),
+				      "%s tx: state differs", mode_name[mode]);
+			fast = ref;
+			idx += i;
+			l->len += n;
+		}
+
+		/* The closing flag, and a few more to idle with */
+		for (n = 2 + harness_rand(seed) % 4; n; n--) {
+			fasthdlc_tx_frame_nocheck(&ref);
+			while (!fasthdlc_tx_need_data(&ref))
+				l->buf[l->len++] = fasthdlc_tx_run_nocheck(&ref);
+		}
+		fast = ref;
+	}
+}
+
+/* Flip bits and drop in aborts, some of them inside frames */
+static void corrupt(struct line *l, uint32_t *seed)
+{
+	int i;
+
+	for (i = 0; i < l->len / 200; i++) {
+		const int pos = harness_rand(seed) % l->len;
+
+		if (harness_rand(seed) & 1)
+			l->buf[pos] ^= 1 << (harness_rand(seed) & 7);
+		else
+			l->buf[pos] = 0xff;
+	}
+}
+
+/*
+ * Receive the line in chunks, checking fasthdlc_rx_run_buf() against
+ * ref_rx_run().  Frames ending clean are checked against what was sent
+ * when the line was not corrupted.
+ */
+static void check_rx(const struct line *l, enum fasthdlc_mode mode,
+		     uint32_t *seed, bool clean)
+{
+	struct fasthdlc_state ref, fast;
+	unsigned char frame[LINE_LEN];
+	unsigned char want[MAX_CHUNK], out[MAX_CHUNK];
+	int framelen = 0, nframes = 0, framedata = 0;
+	int pos = 0;
+
+	fasthdlc_init(&ref, mode);
+	fasthdlc_init(&fast, mode);
+	while (pos < l->len) {
+		int n = 1 + harness_rand(seed) % MAX_CHUNK;
+		int used, got, res, fgot, fres;
+
+		if (n > l->len - pos)
+			n = l->len - pos;
+		used = ref_rx_run(&ref, l->buf + pos, n, want, framelen,
+				  &got, &res);
+		HARNESS_CHECK(fasthdlc_rx_run_buf(&fast, l->buf + pos, n, out,
+						  framelen, &fgot,
+						  &fres) == used,
+			      "%s rx: line used differs", mode_name[mode]);
+		HARNESS_CHECK(fgot == got && fres == res &&
+			      !memcmp(out, want, got),
+			      "%s rx: data differs", mode_name[mode]);
+		HARNESS_CHECK(same_state(&ref, &fast),
+			      "%s rx: state differs", mode_name[mode]);
+		fast = ref;
+		pos += used;
+
+		memcpy(frame + framelen, want, got);
+		framelen += got;
+		if (res & RETURN_COMPLETE_FLAG && clean) {
+			HARNESS_CHECK(nframes < l->nframes &&
+				      framelen == l->framelens[nframes] &&
+				      !memcmp(frame, l->frames + framedata,
+					      framelen),
+				      "%s rx: frame %d not as sent",
+				      mode_name[mode], nframes);
+			HARNESS_CHECK(byte_fcs(0xffff, frame, framelen) ==
+				      0xf0b8, "%s rx: bad FCS on frame %d",
+				      mode_name[mode], nframes);
+			framedata += l->framelens[nframes++];
+		}
+		if (res != RETURN_EMPTY_FLAG) {
+			framelen = 0;
+		} else if (framelen > MAX_FRAME + 2) {
+			/* Overrun, as the receive path handles it */
+			ref.state = 0;
+			ref.bits = 0;
+			fast = ref;
+			framelen = 0;
+		}
+	}
+	if (clean)
+		HARNESS_CHECK(nframes == l->nframes,
+			      "%s rx: %d of %d frames received",
+			      mode_name[mode], nframes, l->nframes);
+}
+
+static void check_fcs(uint32_t *seed)
+{
+	unsigned char data[MAX_FRAME];
+	int i, len, x;
+
+	for (i = 0; i < 100000; i++) {
+		const unsigned int fcs = harness_rand(seed) & 0xffff;
+
+		len = harness_rand(seed) % MAX_FRAME;
+		for (x = 0; x < len; x++)
+			data[x] = harness_rand(seed);
+		HARNESS_CHECK(fasthdlc_fcs(fcs, data, len) ==
+			      ref_fcs(fcs, data, len),
+			      "fcs differs, %d bytes from %04x", len, fcs);
+	}
+}
+
+/*
+ * Time sending, receiving and checking the FCS of a line of frames of the
+ * pattern in the 64k mode, chunk bytes of line at a time.
+ */
+static void bench(int pattern, int chunk)
+{
+	static const char *const pattern_name[] = {
+		"random", "ones", "flags", "clean",
+	};
+	static struct line l;
+	static unsigned char data[LINE_LEN], out[LINE_LEN];
+	struct fasthdlc_state h;
+	uint32_t seed = 7;
+	uint64_t start, t[6];
+	int i, pos, got, res, used;
+
+	for (i = 0; i < LINE_LEN; i++)
+		data[i] = pattern_byte(pattern, &seed);
+	check_tx(&l, FASTHDLC_MODE_64, pattern, &seed);
+
+	fasthdlc_init(&h, FASTHDLC_MODE_64);
+	start = harness_ns();
+	for (pos = used = 0; pos + chunk <= LINE_LEN; pos += chunk)
+		used += ref_tx_run(&h, data + used, out + pos, chunk);
+	t[0] = harness_ns() - start;
+	fasthdlc_init(&h, FASTHDLC_MODE_64);
+	start = harness_ns();
+	for (pos = used = 0; pos + chunk <= LINE_LEN; pos += chunk)
+		used += fasthdlc_tx_run_buf(&h, data + used, out + pos, chunk);
+	t[1] = harness_ns() - start;
+
+	fasthdlc_init(&h, FASTHDLC_MODE_64);
+	start = harness_ns();
+	for (pos = 0; pos < l.len; pos += used)
+		used = ref_rx_run(&h, l.buf + pos, min(chunk, l.len - pos),
+				  out, 1, &got, &res);
+	t[2] = harness_ns() - start;
+	fasthdlc_init(&h, FASTHDLC_MODE_64);
+	start = harness_ns();
+	for (pos = 0; pos < l.len; pos += used)
+		used = fasthdlc_rx_run_buf(&h, l.buf + pos,
+					   min(chunk, l.len - pos), out, 1,
+					   &got, &res);
+	t[3] = harness_ns() - start;
+
+	start = harness_ns();
+	for (pos = 0, res = 0xffff; pos + chunk <= LINE_LEN; pos += chunk)
+		res = byte_fcs(res, data + pos, chunk);
+	t[4] = harness_ns() - start;
+	start = harness_ns();
+	for (pos = 0, got = 0xffff; pos + chunk <= LINE_LEN; pos += chunk)
+		got = fasthdlc_fcs(got, data + pos, chunk);
+	t[5] = harness_ns() - start;
+	HARNESS_CHECK(res == got, "fcs differs in the benchmark");
+
+	printf("%-7s %8.2f %8.2f %8.2f %8.2f %8.2f %8.2f\n",
+	       pattern_name[pattern], (double)t[0] / LINE_LEN,
+	       (double)t[1] / LINE_LEN, (double)t[2] / l.len,
+	       (double)t[3] / l.len, (double)t[4] / LINE_LEN,
+	       (double)t[5] / LINE_LEN);
+}
+
+int main(int argc, char *argv[])
+{
+	const int seeds = (argc > 1) ? atoi(argv[1]) : 16;
+	int chunk = (argc > 2) ? atoi(argv[2]) : BENCH_CHUNK;
+	static struct line l;
+	int s, mode, pattern;
+
+	if (chunk < 1 || chunk > LINE_LEN)
+		chunk = BENCH_CHUNK;
+	fasthdlc_precalc();
+
+	for (s = 1; s <= seeds; s++) {
+		uint32_t seed = s;
+
+		check_fcs(&seed);
+		for (mode = FASTHDLC_MODE_64; mode <= FASTHDLC_MODE_16; mode++) {
+			for (pattern = 0; pattern < 4; pattern++) {
+				check_tx(&l, mode, pattern, &seed);
+				check_rx(&l, mode, &seed, true);
+				corrupt(&l, &seed);
+				check_rx(&l, mode, &seed, false);
+			}
+		}
+	}
+
+	printf("64k mode, %d bytes a chunk, ns per byte\n", chunk);
+	printf("%-7s %8s %8s %8s %8s %8s %8s\n", "data", "tx/byte", "tx/buf",
+	       "rx/byte", "rx/buf", "fcs/byte", "fcs/buf");
+	for (pattern = 0; pattern < 4; pattern++)
+		bench(pattern, chunk);
+	return harness_result("hdlc_check");
+}
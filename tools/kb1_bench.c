@@ -0,0 +1,15 @@
+/*
+ * Benchmark of the KB1 echo canceller; see echocan_bench.h.
+ *
+ * Usage: kb1_bench [seconds]
+ */
+
+#define CONFIG_X86_64
+#define CONFIG_DAHDI_ECHOCAN_SIMD
+#include "../drivers/dahdi/dahdi_echocan_kb1.c"
+#include "echocan_bench.h"
+
+int main(int argc, char *argv[])
+{
+	return echocan_bench_main(argc, argv, "kb1_bench", true);
+}
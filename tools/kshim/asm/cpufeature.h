@@ -0,0 +1,20 @@
+/*
+ * Userspace stand-in for <asm/cpufeature.h>, for the harnesses in tools/.
+ * Features are those of the CPU the harness runs on, unless switched off
+ * with kshim_cpu_mask.
+ */
+#ifndef _KSHIM_ASM_CPUFEATURE_H
+#define _KSHIM_ASM_CPUFEATURE_H
+
+#include "kshim.h"
+
+#define X86_FEATURE_AVX2	"avx2"
+#define X86_FEATURE_OSXSAVE	"avx"
+
+/* Set to make boot_cpu_has() deny everything, to force a lower level */
+static bool kshim_cpu_mask;
+
+#define boot_cpu_has(feature)	\
+	(!kshim_cpu_mask && __builtin_cpu_supports(feature))
+
+#endif
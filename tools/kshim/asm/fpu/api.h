@@ -0,0 +1,14 @@
+/*
+ * Userspace stand-in for <asm/fpu/api.h>, for the harnesses in tools/.
+ * A process owns its vector registers, so there is nothing to save.
+ */
+#ifndef _KSHIM_ASM_FPU_API_H
+#define _KSHIM_ASM_FPU_API_H
+
+#include "kshim.h"
+
+static inline bool irq_fpu_usable(void) { return true; }
+static inline void kernel_fpu_begin(void) { }
+static inline void kernel_fpu_end(void) { }
+
+#endif
@@ -0,0 +1,192 @@
+/*
+ * Userspace stand-in for <dahdi/kernel.h>, for the harnesses in tools/.
+ *
+ * Only the echo canceller interface and the tones are here, as the echocan
+ * modules and dahdi-tonegen.c see them.
+ * The definitions follow include/dahdi/kernel.h and must be kept in step
+ * with it; the comments are left over there.
+ */
+#ifndef _KSHIM_DAHDI_KERNEL_H
+#define _KSHIM_DAHDI_KERNEL_H
+
+#include "kshim.h"
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <dahdi/user.h>
+
+#define DAHDI_CHUNKSIZE		8
+#define DAHDI_MIN_CHUNKSIZE	DAHDI_CHUNKSIZE
+#define DAHDI_DEFAULT_CHUNKSIZE	DAHDI_CHUNKSIZE
+#define DAHDI_MAX_CHUNKSIZE	DAHDI_CHUNKSIZE
+
+typedef struct {
+	int32_t gain;
+	int32_t a1;
+	int32_t a2;
+	int32_t b1;
+	int32_t b2;
+	int32_t z1;
+	int32_t z2;
+} biquad2_state_t;
+
+typedef struct {
+	biquad2_state_t notch;
+	int notch_level;
+	int channel_level;
+	int tone_present;
+	int tone_cycle_duration;
+	int good_cycles;
+	int hit;
+} echo_can_disable_detector_state_t;
+
+struct dahdi_chan;
+struct dahdi_echocan_state;
+
+struct dahdi_echocan_features {
+	u32 CED_tx_detect:1;
+	u32 CED_rx_detect:1;
+	u32 CNG_tx_detect:1;
+	u32 CNG_rx_detect:1;
+	u32 NLP_toggle:1;
+	u32 NLP_automatic:1;
+};
+
+struct dahdi_echocan_ops {
+	void (*echocan_free)(struct dahdi_chan *chan,
+			     struct dahdi_echocan_state *ec);
+	void (*echocan_process)(struct dahdi_echocan_state *ec, short *isig,
+				const short *iref, u32 size);
+	void (*echocan_process_batch)(struct dahdi_echocan_state **ec,
+				      short *isig, const short *iref,
+				      unsigned int n);
+	void (*echocan_events)(struct dahdi_echocan_state *ec);
+	int (*echocan_traintap)(struct dahdi_echocan_state *ec, int pos,
+				short val);
+	void (*echocan_NLP_toggle)(struct dahdi_echocan_state *ec,
+				   unsigned int enable);
+#ifdef CONFIG_DAHDI_ECHOCAN_PROCESS_TX
+	void (*echocan_process_tx)(struct dahdi_echocan_state *ec,
+				   short *tx, u32 size);
+#endif
+};
+
+struct dahdi_echocan_factory {
+	const char *(*get_name)(const struct dahdi_chan *chan);
+	struct module *owner;
+	int (*echocan_create)(struct dahdi_chan *chan,
+			      struct dahdi_echocanparams *ecp,
+			      struct dahdi_echocanparam *p,
+			      struct dahdi_echocan_state **ec);
+};
+
+/* The harness calls the factory itself */
+static inline int
+dahdi_register_echocan_factory(const struct dahdi_echocan_factory *ec)
+{
+	return 0;
+}
+
+static inline void
+dahdi_unregister_echocan_factory(const struct dahdi_echocan_factory *ec)
+{
+}
+
+enum dahdi_echocan_mode {
+	__ECHO_MODE_MUTE = 1 << 8,
+	ECHO_MODE_IDLE = 0,
+	ECHO_MODE_PRETRAINING = 1 | __ECHO_MODE_MUTE,
+	ECHO_MODE_STARTTRAINING = 2 | __ECHO_MODE_MUTE,
+	ECHO_MODE_AWAITINGECHO = 3 | __ECHO_MODE_MUTE,
+	ECHO_MODE_TRAINING = 4 | __ECHO_MODE_MUTE,
+	ECHO_MODE_ACTIVE = 5,
+	ECHO_MODE_FAX = 6,
+};
+
+struct dahdi_echocan_state {
+	const struct dahdi_echocan_ops *ops;
+	echo_can_disable_detector_state_t txecdis;
+	echo_can_disable_detector_state_t rxecdis;
+	struct dahdi_echocan_features features;
+	struct {
+		enum dahdi_echocan_mode mode;
+		u32 last_train_tap;
+		u32 pretrain_timer;
+		u32 nlp_request;
+	} status;
+	union dahdi_echocan_events {
+		u32 all;
+		struct {
+			u32 CED_tx_detected:1;
+			u32 CED_rx_detected:1;
+			u32 CNG_tx_detected:1;
+			u32 CNG_rx_detected:1;
+			u32 NLP_auto_disabled:1;
+			u32 NLP_auto_enabled:1;
+		} bit;
+	} events;
+};
+
+#define DAHDI_MS_TO_SAMPLES(ms) ((ms) * 8)
+
+/* A harness using these fills them in, as dahdi_conv_init() does */
+extern u8 __dahdi_lin2mu[16384];
+extern u8 __dahdi_lin2a[16384];
+#define DAHDI_LIN2MU(a) (__dahdi_lin2mu[((unsigned short)(a)) >> 2])
+#define DAHDI_LIN2A(a) (__dahdi_lin2a[((unsigned short)(a)) >> 2])
+
+struct dahdi_tone_state {
+	int v1_1;
+	int v2_1;
+	int v3_1;
+	int v1_2;
+	int v2_2;
+	int v3_2;
+	int modulate;
+	int pos;
+};
+
+struct dahdi_tone {
+	int fac1;
+	int init_v2_1;
+	int init_v3_1;
+
+	int fac2;
+	int init_v2_2;
+	int init_v3_2;
+
+	int tonesamples;
+	struct dahdi_tone *next;
+
+	int modulate;
+
+	u8 *wave;
+	int wavelen;
+	int waveloop;
+	struct dahdi_tone_state wave_end;
+};
+
+void dahdi_init_tone_state(struct dahdi_tone_state *ts, struct dahdi_tone *zt);
+
+static inline short dahdi_tone_nextsample(struct dahdi_tone_state *ts, struct dahdi_tone *zt)
+{
+	int p;
+
+	ts->v1_1 = ts->v2_1;
+	ts->v2_1 = ts->v3_1;
+	ts->v3_1 = (zt->fac1 * ts->v2_1 >> 15) - ts->v1_1;
+
+	ts->v1_2 = ts->v2_2;
+	ts->v2_2 = ts->v3_2;
+	ts->v3_2 = (zt->fac2 * ts->v2_2 >> 15) - ts->v1_2;
+
+	if (!ts->modulate) return ts->v3_1 + ts->v3_2;
+	p = ts->v3_2 - 32768;
+	if (p < 0) p = -p;
+	p = ((p * 9) / 10) + 1;
+	return (ts->v3_1 * p) >> 15;
+}
+
+#define module_printk(level, fmt, args...) \
+	printk(level "%s: " fmt, THIS_MODULE->name, ## args)
+
+#endif
@@ -0,0 +1,27 @@
+/*
+ * The little of the kernel environment that the DAHDI headers exercised by
+ * the harnesses in tools/ need, for building them as userspace programs.
+ */
+#ifndef _KSHIM_H
+#define _KSHIM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef int8_t s8;
+typedef int16_t s16;
+typedef int32_t s32;
+typedef int64_t s64;
+
+#ifndef likely
+#define likely(x)	__builtin_expect(!!(x), 1)
+#define unlikely(x)	__builtin_expect(!!(x), 0)
+#endif
+
+#endif
@@ -0,0 +1,17 @@
+/*
+ * Userspace stand-in for <linux/bitops.h>, for the harnesses in tools/.
+ */
+#ifndef _KSHIM_LINUX_BITOPS_H
+#define _KSHIM_LINUX_BITOPS_H
+
+static inline int fls64(unsigned long long x)
+{
+	return x ? 64 - __builtin_clzll(x) : 0;
+}
+
+static inline unsigned long __ffs(unsigned long word)
+{
+	return __builtin_ctzl(word);
+}
+
+#endif
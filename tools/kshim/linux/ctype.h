@@ -0,0 +1,2 @@
+/* Userspace stand-in for <linux/ctype.h>, for the harnesses in tools/. */
+#include <ctype.h>
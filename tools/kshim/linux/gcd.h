@@ -0,0 +1,18 @@
+/*
+ * Userspace stand-in for <linux/gcd.h>, for the harnesses in tools/.
+ */
+#ifndef _KSHIM_LINUX_GCD_H
+#define _KSHIM_LINUX_GCD_H
+
+static inline unsigned long gcd(unsigned long a, unsigned long b)
+{
+	while (b) {
+		unsigned long r = a % b;
+
+		a = b;
+		b = r;
+	}
+	return a;
+}
+
+#endif
@@ -0,0 +1,10 @@
+/*
+ * Userspace stand-in for <linux/init.h>, for the harnesses in tools/.
+ */
+#ifndef _KSHIM_LINUX_INIT_H
+#define _KSHIM_LINUX_INIT_H
+
+#define __init
+#define __exit
+
+#endif
@@ -0,0 +1,36 @@
+/*
+ * Userspace stand-in for <linux/kernel.h>, for the harnesses in tools/.
+ */
+#ifndef _KSHIM_LINUX_KERNEL_H
+#define _KSHIM_LINUX_KERNEL_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "kshim.h"
+
+#define KERN_ERR	""
+#define KERN_WARNING	""
+#define KERN_NOTICE	""
+#define KERN_INFO	""
+#define KERN_DEBUG	""
+
+#define printk(fmt, ...)	fprintf(stderr, fmt, ##__VA_ARGS__)
+
+#define min(a, b)		((a) < (b) ? (a) : (b))
+#define max(a, b)		((a) > (b) ? (a) : (b))
+#define min_t(type, a, b)	min((type)(a), (type)(b))
+#define max_t(type, a, b)	max((type)(a), (type)(b))
+#define clamp(v, lo, hi)	min(max(v, lo), hi)
+#define clamp_t(type, v, lo, hi) clamp((type)(v), (type)(lo), (type)(hi))
+
+#define ARRAY_SIZE(a)		(sizeof(a) / sizeof((a)[0]))
+#define DIV_ROUND_UP(n, d)	(((n) + (d) - 1) / (d))
+#define ALIGN(x, a)		(((x) + (a) - 1) & ~((a) - 1))
+#define roundup(x, y)		((((x) + (y) - 1) / (y)) * (y))
+
+#define container_of(ptr, type, member) \
+	((type *)((char *)(ptr) - offsetof(type, member)))
+
+#define BUG_ON(cond)		do { if (cond) abort(); } while (0)
+
+#endif
@@ -0,0 +1,24 @@
+/*
+ * Userspace stand-in for <linux/math64.h>, for the harnesses in tools/.
+ */
+#ifndef _KSHIM_LINUX_MATH64_H
+#define _KSHIM_LINUX_MATH64_H
+
+#include "kshim.h"
+
+static inline u64 div64_u64(u64 dividend, u64 divisor)
+{
+	return dividend / divisor;
+}
+
+static inline s64 div64_s64(s64 dividend, s64 divisor)
+{
+	return dividend / divisor;
+}
+
+static inline s64 div_s64(s64 dividend, s32 divisor)
+{
+	return dividend / divisor;
+}
+
+#endif
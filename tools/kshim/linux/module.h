@@ -0,0 +1,35 @@
+/*
+ * Userspace stand-in for <linux/module.h>, for the harnesses in tools/.
+ * A driver's init function is run before main(), as if the module had
+ * just been loaded; its exit function is never run.
+ */
+#ifndef _KSHIM_LINUX_MODULE_H
+#define _KSHIM_LINUX_MODULE_H
+
+#include <stdlib.h>
+
+struct module {
+	const char *name;
+};
+
+static struct module __this_module __attribute__((unused)) = {
+	.name = "harness",
+};
+#define THIS_MODULE		(&__this_module)
+
+#define MODULE_DESCRIPTION(s)
+#define MODULE_AUTHOR(s)
+#define MODULE_LICENSE(s)
+#define MODULE_PARM_DESC(var, s)
+#define EXPORT_SYMBOL(sym)
+
+#define module_init(fn) \
+	static void __attribute__((constructor)) __kshim_init(void) \
+	{ \
+		if (fn()) \
+			abort(); \
+	}
+#define module_exit(fn) \
+	static void (*__kshim_exit)(void) __attribute__((unused)) = fn
+
+#endif
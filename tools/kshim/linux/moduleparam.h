@@ -0,0 +1,15 @@
+/*
+ * Userspace stand-in for <linux/moduleparam.h>, for the harnesses in
+ * tools/.  Parameters keep their defaults unless the harness sets them.
+ */
+#ifndef _KSHIM_LINUX_MODULEPARAM_H
+#define _KSHIM_LINUX_MODULEPARAM_H
+
+#include <sys/stat.h>
+
+#define S_IRUGO		(S_IRUSR | S_IRGRP | S_IROTH)
+
+#define module_param(name, type, perm) \
+	static void *__kshim_param_##name __attribute__((unused)) = &name
+
+#endif
@@ -0,0 +1,16 @@
+/*
+ * Userspace stand-in for <linux/percpu.h>, for the harnesses in tools/.
+ * There is only the one CPU.
+ */
+#ifndef _KSHIM_LINUX_PERCPU_H
+#define _KSHIM_LINUX_PERCPU_H
+
+#include "kshim.h"
+
+#define DECLARE_PER_CPU(type, name)	extern type name
+#define DEFINE_PER_CPU(type, name)	type name
+#define this_cpu_read(name)		(name)
+#define this_cpu_write(name, val)	((name) = (val))
+#define this_cpu_ptr(ptr)		(ptr)
+
+#endif
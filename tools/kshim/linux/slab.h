@@ -0,0 +1,17 @@
+/*
+ * Userspace stand-in for <linux/slab.h>, for the harnesses in tools/.
+ */
+#ifndef _KSHIM_LINUX_SLAB_H
+#define _KSHIM_LINUX_SLAB_H
+
+#include <stdlib.h>
+
+#define GFP_KERNEL	0
+#define GFP_ATOMIC	0
+
+#define kmalloc(size, gfp)	malloc(size)
+#define kzalloc(size, gfp)	calloc(1, size)
+#define kcalloc(n, size, gfp)	calloc(n, size)
+#define kfree(ptr)		free(ptr)
+
+#endif
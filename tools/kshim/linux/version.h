@@ -0,0 +1,11 @@
+/*
+ * Userspace stand-in for <linux/version.h>, for the harnesses in tools/.
+ * Claims a recent kernel, so the newest code paths are the ones built.
+ */
+#ifndef _KSHIM_LINUX_VERSION_H
+#define _KSHIM_LINUX_VERSION_H
+
+#define KERNEL_VERSION(a, b, c)	(((a) << 16) + ((b) << 8) + (c))
+#define LINUX_VERSION_CODE	KERNEL_VERSION(6, 1, 0)
+
+#endif
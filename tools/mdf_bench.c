@@ -0,0 +1,15 @@
+/*
+ * Benchmark of the MDF echo canceller; see echocan_bench.h.  MDF has no
+ * SIMD, so there are only the C runs.  Compare with mg2_bench and
+ * kb1_bench for the cost of long tails.
+ *
+ * Usage: mdf_bench [seconds]
+ */
+
+#include "../drivers/dahdi/dahdi_echocan_mdf.c"
+#include "echocan_bench.h"
+
+int main(int argc, char *argv[])
+{
+	return echocan_bench_main(argc, argv, "mdf_bench", false);
+}
@@ -0,0 +1,15 @@
+/*
+ * Benchmark of the MG2 echo canceller; see echocan_bench.h.
+ *
+ * Usage: mg2_bench [seconds]
+ */
+
+#define CONFIG_X86_64
+#define CONFIG_DAHDI_ECHOCAN_SIMD
+#include "../drivers/dahdi/dahdi_echocan_mg2.c"
+#include "echocan_bench.h"
+
+int main(int argc, char *argv[])
+{
+	return echocan_bench_main(argc, argv, "mg2_bench", true);
+}
@@ -0,0 +1,385 @@
+/*
+ * Check the software DTMF and MF detectors of drivers/dahdi/dahdi-tonedetect.c
+ * on generated audio, then time them.
+ *
+ * Every lane of a bank is played all the digits of the tone set, each lane
+ * in its own order, with its own start against the block boundaries and
+ * its tones as far off frequency as the specifications allow, over a
+ * little noise.  Each digit must be reported down and up once, in order.
+ * Loud noise, single tones, tones below the minimum level and DTMF with too
+ * much twist must not be reported at all.  The C and AVX2 filters must
+ * give the same events.
+ *
+ * Usage: tonedetect_check [lanes]
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <asm/cpufeature.h>
+#include "harness.h"
+
+#include <dahdi/kernel.h>
+
+/*
+ * dahdi.h needs most of dahdi.ko; this is its part for dahdi-tonedetect.c,
+ * which must be kept in step with it.
+ */
+#define _DAHDI_H
+enum dahdi_tone_mode {
+	DAHDI_TONE_DTMF,
+	DAHDI_TONE_MFR1,
+	DAHDI_TONE_MFR2_FWD,
+	DAHDI_TONE_MFR2_BACK,
+	DAHDI_TONE_MODES,
+};
+
+struct dahdi_tone_bank;
+struct dahdi_tone_bank *dahdi_tone_bank_create(enum dahdi_tone_mode mode,
+					       unsigned int lanes);
+void dahdi_tone_bank_destroy(struct dahdi_tone_bank *bank);
+
+#define CONFIG_X86_64
+#define CONFIG_DAHDI_ECHOCAN_SIMD
+#define CONFIG_DAHDI_TONEDETECT
+#include "dahdi-tonedetect.c"
+
+#define RATE		8000
+#define MAX_LANES	64
+#define MAX_DIGITS	16
+/* 70 ms of tone and of silence per digit, long enough for every set */
+#define TONE_SAMPLES	560
+#define GAP_SAMPLES	560
+#define MAX_EVENTS	(2 * MAX_DIGITS + 4)
+
+static const char *const mode_name[DAHDI_TONE_MODES] = {
+	[DAHDI_TONE_DTMF] = "DTMF",
+	[DAHDI_TONE_MFR1] = "MF R1",
+	[DAHDI_TONE_MFR2_FWD] = "MF R2 fwd",
+	[DAHDI_TONE_MFR2_BACK] = "MF R2 back",
+};
+
+/* The frequencies of tone_sets[], in the same order */
+static const double freqs[DAHDI_TONE_MODES][TONE_MAX_FREQS] = {
+	[DAHDI_TONE_DTMF] = { 697, 770, 852, 941, 1209, 1336, 1477, 1633 },
+	[DAHDI_TONE_MFR1] = { 700, 900, 1100, 1300, 1500, 1700 },
+	[DAHDI_TONE_MFR2_FWD] = { 1380, 1500, 1620, 1740, 1860, 1980 },
+	[DAHDI_TONE_MFR2_BACK] = { 1140, 1020, 900, 780, 660, 540 },
+};
+
+/*
+ * How far off frequency a tone may be: 1.5% for DTMF (Q.24) and MF R1
+ * (Q.320), 4 Hz for MF R2 (Q.441), taken here as 10 Hz.
+ */
+static double freq_tolerance(enum dahdi_tone_mode mode, double f)
+{
+	if (mode == DAHDI_TONE_DTMF || mode == DAHDI_TONE_MFR1)
+		return 0.015 * f;
+	return 10;
+}
+
+/* What one lane is played and what it reported */
+struct lane_log {
+	short *audio;
+	int samples;
+	char expect[MAX_DIGITS];
+	int nexpect;
+	int events[MAX_EVENTS];
+	int nevents;
+};
+
+static unsigned int set_digits(enum dahdi_tone_mode mode)
+{
+	return strlen(tone_sets[mode].digits);
+}
+
+/* The two frequencies of digit d of the set */
+static void digit_freqs(enum dahdi_tone_mode mode, unsigned int d,
+			unsigned int *lo, unsigned int *hi)
+{
+	unsigned int i, j;
+
+	if (mode == DAHDI_TONE_DTMF) {
+		*lo = d / 4;
+		*hi = 4 + d % 4;
+		return;
+	}
+	for (j = 1; j < tone_sets[mode].nfreqs; j++) {
+		for (i = 0; i < j; i++) {
+			if (mf_pair(i, j) == d) {
+				*lo = i;
+				*hi = j;
+				return;
+			}
+		}
+	}
+	abort();
+}
+
+/* Add a tone of amplitude amp to n samples, from a random phase */
+static void add_tone(short *out, int n, double f, double amp, uint32_t *seed)
+{
+	const double phase = (harness_rand(seed) % 1000) * 2 * M_PI / 1000;
+	int k;
+
+	for (k = 0; k < n; k++) {
+		const double v = out[k] + amp * sin(2 * M_PI * f * k / RATE +
+						    phase);
+
+		out[k] = (short)lrint(fmax(-32768, fmin(32767, v)));
+	}
+}
+
+static void add_noise(short *out, int n, int amp, uint32_t *seed)
+{
+	int k;
+
+	for (k = 0; k < n; k++)
+		out[k] += (int)(harness_rand(seed) % (2 * amp + 1)) - amp;
+}
+
+/*
+ * All the digits of the set in an order of the lane's own, each a pair of
+ * tones of amplitude 4000, the two as close to each other as they may be,
+ * as far from each other, or on frequency.
+ */
+static void make_lane(enum dahdi_tone_mode mode, unsigned int lane,
+		      struct lane_log *log, uint32_t *seed)
+{
+	static const int offset[] = { -1, 0, 1 };
+	const unsigned int digits = set_digits(mode);
+	const int lead = (lane * 37) % 400;
+	unsigned int i;
+	short *p;
+
+	log->samples = lead + digits * (TONE_SAMPLES + GAP_SAMPLES);
+	log->audio = calloc(log->samples, sizeof(short));
+	if (!log->audio)
+		exit(1);
+	log->nexpect = digits;
+	log->nevents = 0;
+
+	p = log->audio + lead;
+	for (i = 0; i < digits; i++) {
+		const unsigned int d = (i * 7 + lane) % digits;
+		const int off = offset[(i + lane) % 3];
+		unsigned int lo, hi;
+		double f;
+
+		digit_freqs(mode, d, &lo, &hi);
+		f = freqs[mode][lo];
+		add_tone(p, TONE_SAMPLES, f + off * freq_tolerance(mode, f),
+			 4000, seed);
+		f = freqs[mode][hi];
+		add_tone(p, TONE_SAMPLES, f - off * freq_tolerance(mode, f),
+			 4000, seed);
+		log->expect[i] = tone_sets[mode].digits[d];
+		p += TONE_SAMPLES + GAP_SAMPLES;
+	}
+	/* About 40 dB under the tones */
+	add_noise(log->audio, log->samples, 40, seed);
+}
+
+/*
+ * Play each lane its audio through one bank, chunk by chunk, and log what
+ * it reports.  Returns the time spent in dahdi_tone_bank_process().
+ */
+static uint64_t run_bank(enum dahdi_tone_mode mode, struct lane_log *logs,
+			 unsigned int lanes, bool simd)
+{
+	struct dahdi_tone_bank *bank;
+	int events[MAX_LANES];
+	short silence[DAHDI_CHUNKSIZE] = { 0 };
+	uint64_t total = 0;
+	int samples = 0;
+	unsigned int l;
+	int n;
+
+	kshim_cpu_mask = !simd;
+	bank = dahdi_tone_bank_create(mode, lanes);
+	kshim_cpu_mask = false;
+	if (!bank)
+		exit(1);
+	for (l = 0; l < lanes; l++) {
+		HARNESS_CHECK(dahdi_tone_bank_add(bank) == (int)l,
+			      "lane %u added out of order", l);
+		logs[l].nevents = 0;
+		if (logs[l].samples > samples)
+			samples = logs[l].samples;
+	}
+	HARNESS_CHECK(dahdi_tone_bank_add(bank) == -ENOSPC ||
+		      lanes % TONE_LANE_ALIGN,
+		      "a full bank took one more lane");
+	if (dahdi_tone_bank_lanes(bank) > lanes)
+		dahdi_tone_bank_remove(bank, lanes);
+
+	for (n = 0; n + DAHDI_CHUNKSIZE <= samples; n += DAHDI_CHUNKSIZE) {
+		uint64_t start;
+
+		for (l = 0; l < lanes; l++) {
+			const short *in = (n + DAHDI_CHUNKSIZE <=
+					   logs[l].samples) ?
+					  logs[l].audio + n : silence;
+
+			dahdi_tone_bank_put(bank, l, in);
+		}
+		start = harness_ns();
+		dahdi_tone_bank_process(bank, events);
+		total += harness_ns() - start;
+
+		for (l = 0; l < lanes; l++) {
+			struct lane_log *const log = &logs[l];
+
+			if (!events[l])
+				continue;
+			if (log->nevents < MAX_EVENTS)
+				log->events[log->nevents] = events[l];
+			log->nevents++;
+		}
+	}
+	dahdi_tone_bank_destroy(bank);
+	return total;
+}
+
+/* Every digit played must have come down and up once, in order */
+static void check_lane(enum dahdi_tone_mode mode, const struct lane_log *log,
+		       unsigned int lane, bool simd)
+{
+	int i;
+
+	HARNESS_CHECK(log->nevents == 2 * log->nexpect,
+		      "%s lane %u%s: %d events for %d digits", mode_name[mode],
+		      lane, simd ? " (SIMD)" : "", log->nevents, log->nexpect);
+	for (i = 0; i < log->nexpect && 2 * i + 1 < log->nevents; i++) {
+		const int down = DAHDI_EVENT_DTMFDOWN | log->expect[i];
+		const int up = DAHDI_EVENT_DTMFUP | log->expect[i];
+
+		HARNESS_CHECK(log->events[2 * i] == down &&
+			      log->events[2 * i + 1] == up,
+			      "%s lane %u%s: digit %d is '%c', got events "
+			      "%#x %#x", mode_name[mode], lane,
+			      simd ? " (SIMD)" : "", i, log->expect[i],
+			      log->events[2 * i], log->events[2 * i + 1]);
+	}
+}
+
+static void check_digits(enum dahdi_tone_mode mode, unsigned int lanes,
+			 double *ns_c, double *ns_simd)
+{
+	struct lane_log c[MAX_LANES], s[MAX_LANES];
+	uint32_t seed = 5 + mode;
+	uint64_t t;
+	int chunks = 0;
+	unsigned int l;
+
+	for (l = 0; l < lanes; l++) {
+		make_lane(mode, l, &c[l], &seed);
+		s[l] = c[l];
+		if (c[l].samples > chunks)
+			chunks = c[l].samples;
+	}
+	chunks /= DAHDI_CHUNKSIZE;
+
+	t = run_bank(mode, c, lanes, false);
+	*ns_c = (double)t / chunks / lanes;
+	t = run_bank(mode, s, lanes, true);
+	*ns_simd = (double)t / chunks / lanes;
+
+	for (l = 0; l < lanes; l++) {
+		check_lane(mode, &c[l], l, false);
+		HARNESS_CHECK(c[l].nevents == s[l].nevents &&
+			      !memcmp(c[l].events, s[l].events,
+				      sizeof(c[l].events)),
+			      "%s lane %u: SIMD events differ from C",
+			      mode_name[mode], l);
+		free(c[l].audio);
+	}
+}
+
+/* Audio that must not give any event */
+static void check_silent(enum dahdi_tone_mode mode, const char *what,
+			 struct lane_log *log)
+{
+	int simd;
+
+	log->nexpect = 0;
+	for (simd = 0; simd < 2; simd++) {
+		run_bank(mode, log, 1, simd);
+		HARNESS_CHECK(log->nevents == 0, "%s%s: %s gave %d events, "
+			      "the first %#x", mode_name[mode],
+			      simd ? " (SIMD)" : "", what, log->nevents,
+			      log->events[0]);
+	}
+	free(log->audio);
+}
+
+static void new_audio(struct lane_log *log, int samples)
+{
+	log->samples = samples;
+	log->audio = calloc(samples, sizeof(short));
+	if (!log->audio)
+		exit(1);
+	log->events[0] = 0;
+}
+
+static void check_rejects(enum dahdi_tone_mode mode)
+{
+	const unsigned int nfreqs = tone_sets[mode].nfreqs;
+	struct lane_log log;
+	uint32_t seed = 17 + mode;
+	unsigned int f, lo, hi;
+
+	/* Two seconds of loud noise */
+	new_audio(&log, 2 * RATE);
+	add_noise(log.audio, log.samples, 8000, &seed);
+	check_silent(mode, "loud noise", &log);
+
+	/* Each tone alone */
+	for (f = 0; f < nfreqs; f++) {
+		new_audio(&log, 2 * TONE_SAMPLES);
+		add_tone(log.audio, TONE_SAMPLES, freqs[mode][f], 4000, &seed);
+		check_silent(mode, "a single tone", &log);
+	}
+
+	/* A digit well under the minimum level */
+	digit_freqs(mode, 0, &lo, &hi);
+	new_audio(&log, 2 * TONE_SAMPLES);
+	add_tone(log.audio, TONE_SAMPLES, freqs[mode][lo], 80, &seed);
+	add_tone(log.audio, TONE_SAMPLES, freqs[mode][hi], 80, &seed);
+	check_silent(mode, "a quiet digit", &log);
+
+	/* A digit with a third tone as loud */
+	if (nfreqs > 2) {
+		new_audio(&log, 2 * TONE_SAMPLES);
+		add_tone(log.audio, TONE_SAMPLES, freqs[mode][0], 4000, &seed);
+		add_tone(log.audio, TONE_SAMPLES, freqs[mode][1], 4000, &seed);
+		add_tone(log.audio, TONE_SAMPLES, freqs[mode][nfreqs - 1],
+			 4000, &seed);
+		check_silent(mode, "three tones", &log);
+	}
+
+	if (mode != DAHDI_TONE_DTMF)
+		return;
+	/* The column 8 dB over the row, where 4 dB is allowed */
+	new_audio(&log, 2 * TONE_SAMPLES);
+	add_tone(log.audio, TONE_SAMPLES, freqs[mode][lo], 1600, &seed);
+	add_tone(log.audio, TONE_SAMPLES, freqs[mode][hi], 4000, &seed);
+	check_silent(mode, "reverse twist", &log);
+}
+
+int main(int argc, char *argv[])
+{
+	const int arg = (argc > 1) ? atoi(argv[1]) : 32;
+	const unsigned int lanes = (arg > 0 && arg <= MAX_LANES) ? arg : 32;
+	enum dahdi_tone_mode mode;
+	double ns_c, ns_simd;
+
+	printf("%-10s %12s %12s   (ns per lane and chunk, %u lanes)\n",
+	       "tones", "C", "SIMD", lanes);
+	for (mode = 0; mode < DAHDI_TONE_MODES; mode++) {
+		check_digits(mode, lanes, &ns_c, &ns_simd);
+		check_rejects(mode);
+		printf("%-10s %12.1f %12.1f\n", mode_name[mode], ns_c,
+		       ns_simd);
+	}
+	return harness_result("tonedetect_check");
+}
@@ -0,0 +1,345 @@
+/*
+ * Check the tone tables of drivers/dahdi/dahdi-tonegen.c against the
+ * oscillator of dahdi_tone_nextsample(), then time playing tones both ways
+ * on many channels at once.
+ *
+ * The tones are set up as the tonezone library loads them.  A one-shot
+ * table must hold exactly what the oscillator plays and carry on from where
+ * it ends without a break.  A looping table must be a clean tone at the
+ * whole number of Hz nearest to the oscillator, wrap without a click and
+ * stay close to an ideal tone at the frequencies asked for.
+ *
+ * Reported is the time per channel and chunk of 8 samples, the work
+ * __dahdi_getbuf_chunk() does for every channel that plays a tone.
+ *
+ * Usage: tonegen_bench [channels] [ticks]
+ */
+
+#include <math.h>
+#include "harness.h"
+
+#include <dahdi/kernel.h>
+
+/* This is the part of dahdi.h for dahdi-tonegen.c; keep it in step */
+#define _DAHDI_H
+void dahdi_tone_build_wave(struct dahdi_tone *zt);
+void dahdi_tone_free_wave(struct dahdi_tone *zt);
+
+#include "dahdi-tonegen.c"
+
+#define RATE		8000
+#define MAX_CHANNELS	4096
+
+u8 __dahdi_lin2mu[16384];
+u8 __dahdi_lin2a[16384];
+static short mulaw[256];
+
+/* G.711 mu-law, as __dahdi_lineartoulaw() */
+static u8 lin2mu(int pcm)
+{
+	const int mask = (pcm < 0) ? 0x7f : 0xff;
+	int seg;
+
+	pcm = min(abs(pcm), 32635) + 132;
+	for (seg = 0; seg < 7 && pcm >= (256 << seg); seg++)
+		;
+	return ((seg << 4) | ((pcm >> (seg + 3)) & 0x0f)) ^ mask;
+}
+
+/* G.711 A-law, as __dahdi_lineartoalaw() */
+static u8 lin2a(int pcm)
+{
+	const int mask = (pcm >= 0) ? 0xd5 : 0x55;
+	int seg;
+
+	pcm = (pcm >= 0) ? pcm : -pcm;
+	for (seg = 0; seg < 8 && pcm > (0x1ff << seg >> 1); seg++)
+		;
+	if (seg == 8)
+		return 0x7f ^ mask;
+	return ((seg << 4) | ((pcm >> (seg ? seg + 3 : 4)) & 0x0f)) ^ mask;
+}
+
+/* As dahdi_conv_init() */
+static void conv_init(void)
+{
+	static const short etab[] = {
+		0, 132, 396, 924, 1980, 4092, 8316, 16764
+	};
+	int i;
+
+	for (i = 0; i < 256; i++) {
+		const int mu = 255 - i;
+		const int e = (mu & 0x70) / 16;
+		int y = (mu & 0x0f) * (1 << (e + 3)) + etab[e];
+
+		mulaw[i] = (mu & 0x80) ? -y : y;
+	}
+	for (i = -32768; i < 32768; i += 4) {
+		__dahdi_lin2mu[((unsigned short)(short)i) >> 2] = lin2mu(i);
+		__dahdi_lin2a[((unsigned short)(short)i) >> 2] = lin2a(i);
+	}
+}
+
+/* The tones tested, as in a zone of tones.conf */
+struct tone_def {
+	const char *name;
+	int freq1;
+	int freq2;
+	int modulate;
+	int ms;		/* 0 for a tone that loops onto itself */
+};
+
+static const struct tone_def tone_defs[] = {
+	{ "dial 350+440", 350, 440, 0, 0 },
+	{ "ring 440+480", 440, 480, 0, 2000 },
+	{ "busy 480+620", 480, 620, 0, 500 },
+	{ "dial 425", 425, 0, 0, 0 },
+	{ "ring 425*25", 425, 25, 1, 1000 },
+	{ "DTMF 5", 770, 1336, 0, 100 },
+	{ "DTMF D", 941, 1633, 0, 100 },
+	{ "MF R1 KP", 1100, 1700, 0, 100 },
+};
+
+/* As build_tone() of the tonezone library, at its -10 dBm0 */
+static void make_tone(const struct tone_def *d, struct dahdi_tone *zt)
+{
+	const double gain = pow(10.0, (-10 - 3.14) / 20.0) * 65536.0 / 2.0;
+
+	memset(zt, 0, sizeof(*zt));
+	zt->fac1 = 2.0 * cos(2.0 * M_PI * (d->freq1 / 8000.0)) * 32768.0;
+	zt->init_v2_1 = sin(-4.0 * M_PI * (d->freq1 / 8000.0)) * gain;
+	zt->init_v3_1 = sin(-2.0 * M_PI * (d->freq1 / 8000.0)) * gain;
+	zt->fac2 = 2.0 * cos(2.0 * M_PI * (d->freq2 / 8000.0)) * 32768.0;
+	zt->init_v2_2 = sin(-4.0 * M_PI * (d->freq2 / 8000.0)) * gain;
+	zt->init_v3_2 = sin(-2.0 * M_PI * (d->freq2 / 8000.0)) * gain;
+	zt->modulate = d->modulate;
+	if (d->ms) {
+		zt->tonesamples = DAHDI_MS_TO_SAMPLES(d->ms);
+		zt->next = NULL;
+	} else {
+		zt->tonesamples = DAHDI_MS_TO_SAMPLES(10000);
+		zt->next = zt;
+	}
+}
+
+/*
+ * The ideal tone.  The oscillator starts from the samples at -2 and -1 of
+ * g * sin(w * n), so that is what it plays from sample 0.
+ */
+static double ideal(const struct tone_def *d, const struct dahdi_tone *zt,
+		    int n)
+{
+	const double w1 = 2 * M_PI * d->freq1 / RATE;
+	const double w2 = 2 * M_PI * d->freq2 / RATE;
+	const double v1 = zt->init_v3_1 / sin(-w1) * sin(w1 * n);
+	const double v2 = d->freq2 ? zt->init_v3_2 / sin(-w2) * sin(w2 * n) : 0;
+
+	if (!d->modulate)
+		return v1 + v2;
+	return v1 * (fabs(v2 - 32768) * 9 / 10 + 1) / 32768;
+}
+
+/* Error in dB of a second of mu-law from fill against the ideal tone */
+static double tone_error(const struct tone_def *d, struct dahdi_tone *zt,
+			 void (*fill)(struct dahdi_tone_state *,
+				      struct dahdi_tone *, u8 *, int))
+{
+	struct dahdi_tone_state ts;
+	double sig = 0, err = 0;
+	u8 mu;
+	int x;
+
+	dahdi_init_tone_state(&ts, zt);
+	for (x = 0; x < RATE; x++) {
+		const double want = ideal(d, zt, x);
+
+		fill(&ts, zt, &mu, 1);
+		sig += want * want;
+		err += (mulaw[mu] - want) * (mulaw[mu] - want);
+	}
+	return 10 * log10(err / sig);
+}
+
+/* As dahdi_tone_fill() in dahdi-base.c, for a mu-law channel */
+static void tone_fill(struct dahdi_tone_state *ts, struct dahdi_tone *zt,
+		      u8 *txb, int samples)
+{
+	const u8 *const wave = zt->wave;
+	int x;
+
+	while (wave && samples > 0 && ts->pos < zt->wavelen) {
+		x = min(samples, zt->wavelen - ts->pos);
+		memcpy(txb, wave + ts->pos, x);
+		txb += x;
+		samples -= x;
+		ts->pos += x;
+		if (ts->pos == zt->wavelen) {
+			if (zt->waveloop)
+				ts->pos = 0;
+			else
+				*ts = zt->wave_end;
+		}
+	}
+
+	for (x = 0; x < samples; x++)
+		*(txb++) = DAHDI_LIN2MU(dahdi_tone_nextsample(ts, zt));
+}
+
+/* The oscillator alone, as before the tables */
+static void osc_fill(struct dahdi_tone_state *ts, struct dahdi_tone *zt,
+		     u8 *txb, int samples)
+{
+	int x;
+
+	for (x = 0; x < samples; x++)
+		*(txb++) = DAHDI_LIN2MU(dahdi_tone_nextsample(ts, zt));
+}
+
+/*
+ * A one-shot table is what the oscillator plays, in both laws, and playing
+ * on past it gives what the oscillator would.
+ */
+static void check_oneshot(const struct tone_def *d, struct dahdi_tone *zt)
+{
+	const int len = zt->wavelen;
+	struct dahdi_tone_state osc, tab;
+	u8 a, b;
+	int x;
+
+	dahdi_init_tone_state(&osc, zt);
+	for (x = 0; x < len; x++) {
+		const short s = dahdi_tone_nextsample(&osc, zt);
+
+		if (zt->wave[x] != DAHDI_LIN2MU(s) ||
+		    zt->wave[len + x] != DAHDI_LIN2A(s)) {
+			HARNESS_CHECK(0, "%s: one-shot table differs from the "
+				      "oscillator at sample %d", d->name, x);
+			return;
+		}
+	}
+
+	dahdi_init_tone_state(&tab, zt);
+	for (x = 0; x < len; x++)
+		tone_fill(&tab, zt, &a, 1);
+	for (x = 0; x < 2 * len; x++) {
+		tone_fill(&tab, zt, &a, 1);
+		osc_fill(&osc, zt, &b, 1);
+		if (a != b) {
+			HARNESS_CHECK(0, "%s: playing past the one-shot table "
+				      "differs from the oscillator at sample "
+				      "%d", d->name, len + x);
+			return;
+		}
+	}
+}
+
+/*
+ * A looping table is no further off the ideal tone over a second than the
+ * oscillator, and at most about what mu-law allows, and the step across
+ * its wrap is no larger than any step inside it.
+ */
+static void check_loop(const struct tone_def *d, struct dahdi_tone *zt,
+		       double *tab_db, double *osc_db)
+{
+	int step, maxstep = 0, wrapstep;
+	int x;
+
+	*tab_db = tone_error(d, zt, tone_fill);
+	*osc_db = tone_error(d, zt, osc_fill);
+	HARNESS_CHECK(*tab_db < -30 && *tab_db < *osc_db + 1,
+		      "%s: looping table is %.1f dB off the ideal tone, the "
+		      "oscillator %.1f dB", d->name, *tab_db, *osc_db);
+
+	for (x = 1; x < zt->wavelen; x++) {
+		step = abs(mulaw[zt->wave[x]] - mulaw[zt->wave[x - 1]]);
+		maxstep = max(maxstep, step);
+	}
+	wrapstep = abs(mulaw[zt->wave[0]] - mulaw[zt->wave[zt->wavelen - 1]]);
+	HARNESS_CHECK(wrapstep <= maxstep, "%s: looping table clicks at the "
+		      "wrap, a step of %d against at most %d", d->name,
+		      wrapstep, maxstep);
+}
+
+/*
+ * Time channels playing the tone, each from its own point in it, through
+ * fill.  As in __dahdi_getbuf_chunk(), a tone starts over once it has
+ * played for its length, as a digit dialled again.  Returns ns per channel
+ * and chunk.
+ */
+static double bench(struct dahdi_tone *zt, int channels, int ticks,
+		    void (*fill)(struct dahdi_tone_state *,
+				 struct dahdi_tone *, u8 *, int))
+{
+	static struct dahdi_tone_state ts[MAX_CHANNELS];
+	static int tonep[MAX_CHANNELS];
+	static u8 txb[MAX_CHANNELS][DAHDI_CHUNKSIZE];
+	const int chunks = zt->tonesamples / DAHDI_CHUNKSIZE;
+	uint64_t start;
+	int c, t;
+
+	for (c = 0; c < channels; c++) {
+		dahdi_init_tone_state(&ts[c], zt);
+		tonep[c] = 0;
+		for (t = 0; t < c % chunks; t++) {
+			fill(&ts[c], zt, txb[c], DAHDI_CHUNKSIZE);
+			tonep[c] += DAHDI_CHUNKSIZE;
+		}
+	}
+
+	start = harness_ns();
+	for (t = 0; t < ticks; t++) {
+		for (c = 0; c < channels; c++) {
+			fill(&ts[c], zt, txb[c], DAHDI_CHUNKSIZE);
+			tonep[c] += DAHDI_CHUNKSIZE;
+			if (tonep[c] >= zt->tonesamples) {
+				dahdi_init_tone_state(&ts[c], zt);
+				tonep[c] = 0;
+			}
+		}
+		__asm__ __volatile__("" : : "r" (txb) : "memory");
+	}
+	return (double)(harness_ns() - start) / ticks / channels;
+}
+
+int main(int argc, char *argv[])
+{
+	const int arg = (argc > 1) ? atoi(argv[1]) : 256;
+	const int channels = (arg > 0 && arg <= MAX_CHANNELS) ? arg : 256;
+	const int ticks = (argc > 2) ? atoi(argv[2]) : 4000;
+	unsigned int i;
+
+	conv_init();
+	printf("%-14s %-8s %6s %10s %10s   (ns per channel and chunk, "
+	       "%d channels)\n", "tone", "table", "len", "oscillator",
+	       "table", channels);
+	for (i = 0; i < ARRAY_SIZE(tone_defs); i++) {
+		const struct tone_def *const d = &tone_defs[i];
+		struct dahdi_tone zt;
+		double tab_db = 0, osc_db = 0;
+		double osc_ns, tab_ns;
+
+		make_tone(d, &zt);
+		dahdi_tone_build_wave(&zt);
+		if (!zt.wave) {
+			HARNESS_CHECK(0, "%s: no table was built", d->name);
+			continue;
+		}
+		if (zt.waveloop)
+			check_loop(d, &zt, &tab_db, &osc_db);
+		else
+			check_oneshot(d, &zt);
+		osc_ns = bench(&zt, channels, ticks, osc_fill);
+		tab_ns = bench(&zt, channels, ticks, tone_fill);
+
+		printf("%-14s %-8s %6d %10.1f %10.1f", d->name,
+		       zt.waveloop ? "looping" : "one-shot", zt.wavelen,
+		       osc_ns, tab_ns);
+		if (zt.waveloop)
+			printf("   error %.1f dB, oscillator %.1f dB", tab_db,
+			       osc_db);
+		printf("\n");
+		dahdi_tone_free_wave(&zt);
+	}
+	return harness_result("tonegen_bench");
+}